@@ -2,16 +2,27 @@
 
 uniform mat4 proj;
 uniform mat4 view;
+uniform mat3 normal_matrix;
+
+// Turns packed positions back into real ones, see Mesh::SetPositionFormat()
+uniform vec3 position_offset;
+uniform vec3 position_scale;
 
 layout(location = 0) in vec3 vertex;
+layout(location = 1) in vec3 normal;
 
 out vec3 o_vert;
+out vec3 o_norm;
 
 void main()
 {
 	mat4 mvp = proj * view;
 
-	o_vert = vertex;
+	vec3 position = position_offset + vertex * position_scale;
+	o_vert = position;
+
+	// The rest normal, deformed like the body around it
+	o_norm = normal_matrix * normal;
 
-	gl_Position = mvp * vec4(vertex, 1.0);
+	gl_Position = mvp * vec4(position, 1.0);
 }
@@ -4,15 +4,34 @@
 #include "shader.hpp"
 #include "psystem.hpp"
 #include "objloader.hpp"
+#include "spatialhash.hpp"
+#include "stepcontroller.hpp"
+#include "governor.hpp"
+#include "collision.hpp"
+#include "forcefield.hpp"
+#include "spscqueue.hpp"
+#include "triplebuffer.hpp"
+#include "thread.hpp"
+#include "atomic.hpp"
+#include "taskgraph.hpp"
+#include "parallelstep.hpp"
+#include "statepublisher.hpp"
+#include "streamserver.hpp"
 #include "application.hpp"
 
 #include <GL/glfw.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <vector>
 
 using namespace dlib;
 using std::cout;
@@ -22,22 +41,66 @@ using std::endl;
 // Application title
 const char* title = "Meshless";
 
+// The simulation runs on its own thread at a fixed rate, independent of
+// the rendering frame rate.
+const double SIM_FPS = 120.0;
+const double SIM_DT  = 1.0 / SIM_FPS;
+const double SIM_MAX_DT = 10.0 * SIM_DT;
+
+// Most substeps a single simulation step may be split into
+const int SIM_MAX_SUBSTEPS = 8;
+
+// Wall clock time a simulation step may take before the governor starts
+// lowering the quality, leaves some room for publishing the snapshots.
+const double SIM_BUDGET = 0.8 * SIM_DT;
+
+// Plasticity used when it is turned on, see PSystem::SetPlasticity()
+const real PLASTIC_YIELD = 0.1;
+const real PLASTIC_CREEP = 20.0;
+const real PLASTIC_MAX = 0.5;
+
+// Bodies fall asleep after this many steps at rest, see
+// PSystem::SetAutoSleep()
+const real SLEEP_ENERGY = 1e-3;
+const real SLEEP_DEVIATION = 1e-3;
+const int SLEEP_STEPS = 60;
+
+// Bodies with more particles are split over every thread of the pool
+const size_t LARGE_BODY_PARTICLES = 200000;
+
 float width = 0;
 float height = 0;
 double dt_multiplier = 1.0; // slow motion
 
 Camera camera;
 
-Mesh g_obj_mesh; // Loaded OBJ model
+/* A simulated object. Every loaded OBJ file becomes one body with its
+ * own mesh and particle system.
+ */
+struct Body
+{
+    Mesh mesh; // Loaded OBJ model
+    PSystem* psystem; // Particle system, does all the work
+    ParallelStep* parallel; // Steps psystem on every thread, NULL if it is small
+    SpatialHash pick_grid; // Particle lookup used while picking
+    bool pick_grid_dirty; // True if the particles moved since the last build
+    real pick_drift; // How far any particle may have moved since the last build
+    bool governor_asleep; // Put to sleep by the governor to save time
+    unsigned long version; // Changes every time the particles move
+    unsigned long uploaded_version; // Version last sent to the video card
+    fmath::mat3 normal_matrix; // Turns the rest normals of the mesh with the uploaded positions
+    real max_displacement; // Largest movement in this step, relative to its size
+    real max_deviation; // Largest goal distance in this step, relative to its size
+};
+
+std::vector<Body*> g_bodies; // All simulated objects
 Mesh g_ground_mesh; // Floor plane
-PSystem* g_psystem; // Particle system, does all the work
 
-real g_t_min = 0.0; // Used for closest particle (during picking)
-bool g_object_selected = false; // Checks if the object has been picked up
+// Radius around each particle that counts as a hit when picking
+const real PICK_RADIUS = 0.2;
 
 // Tracks if the mouse pointer is currently visible
 bool g_mouse_pointer_enabled = false;
-bool g_mouse_down = false;
 
 // Small macro to check for a single keydown event
 bool __glfw_keys[GLFW_KEY_LAST + 1];
@@ -57,43 +120,266 @@ Shader object_shader;
 // Forces
 dlib::vec3 g_gravity;
 
+// Environmental effects, only touched by the simulation thread once it is
+// running. They are evaluated inside each body's integration sweep.
+const real WIND_SPEED = 3.0; // Steady wind along +x
+const real GUST_STRENGTH = 6.0;
+const real GUST_SIZE = 2.0;
+const real EXPLOSION_STRENGTH = 400.0;
+const real EXPLOSION_RADIUS = 8.0;
+const real EXPLOSION_DURATION = 0.1; // Seconds the blast fades out over
+UniformField g_wind(dlib::zeros_matrix<real>(3L, 1L));
+TurbulenceField g_gusts(GUST_STRENGTH, GUST_SIZE, dlib::zeros_matrix<real>(3L, 1L));
+RadialField g_explosion(dlib::zeros_matrix<real>(3L, 1L), 0, EXPLOSION_RADIUS);
+ForceFieldSet g_force_fields;
+bool g_wind_enabled = false;
+real g_explosion_left = 0; // Seconds until the explosion is over
+
+/* Input that has to be applied on the simulation thread. The main thread
+ * turns key presses into these and the simulation thread applies them
+ * before each step.
+ */
+enum SimEventType
+{
+    SIM_EVENT_ALPHA, // Add value[0] to alpha
+    SIM_EVENT_BETA, // Add value[0] to beta
+    SIM_EVENT_TIME_SPEED, // Set the time multiplier to value[0]
+    SIM_EVENT_PRINT_SETTINGS, // Print alpha, beta and time speed
+    SIM_EVENT_RESET, // Reset all bodies
+    SIM_EVENT_RANDOM_FORCE, // Throw every body in a random direction
+    SIM_EVENT_PAUSE, // Pause/unpause the simulation
+    SIM_EVENT_ADAPTIVE, // Turn adaptive substepping on/off
+    SIM_EVENT_GOVERNOR, // Turn the frame budget governor on/off
+    SIM_EVENT_PLASTICITY, // Turn plasticity on/off
+    SIM_EVENT_WIND, // Turn the wind on/off
+    SIM_EVENT_EXPLOSION, // Blow everything away from the origin
+    SIM_EVENT_CAMERA, // The camera moved to value[0-2]
+    SIM_EVENT_STEP, // Take one step while paused
+    SIM_EVENT_MOUSE, // Mouse ray from value[0-2] to value[3-5], value[6] != 0 if held
+    SIM_EVENT_DESELECT // Drop the picked body
+};
+
+struct SimEvent
+{
+    SimEventType type;
+    real value[7];
+};
+
+/* Particle positions of every body after a step, handed from the
+ * simulation thread to the render thread.
+ */
+struct Snapshot
+{
+    std::vector<std::vector<dlib::vec3> > positions;
+    std::vector<PSystem::SkinTransform> skins;
+    std::vector<unsigned long> versions; // Body::version of each body's data
+};
+
+/* Runs the fixed rate simulation loop until Stop() is called.
+ */
+class SimulationThread : public Thread
+{
+public:
+    SimulationThread() : m_quit(0) { }
+
+    /* Ask the loop to finish and wait for it.
+     */
+    void Stop();
+
+protected:
+    void Run();
+
+private:
+    int m_quit; // Set to 1 to end the loop
+};
+
+SimulationThread g_sim_thread;
+TaskPool g_task_pool; // Runs the jobs of the simulation thread
+SpscQueue<SimEvent, 256> g_sim_events; // Main thread -> simulation thread
+TripleBuffer<Snapshot> g_snapshots; // Simulation thread -> main thread
+StatePublisher g_state_publisher; // Simulation thread -> other processes, see --publish
+StreamServer g_stream_server; // Simulation thread -> other machines, see --stream
+
+// State only touched by the simulation thread once it is running
+bool g_run_sim = false; // False while paused
+bool g_sim_dirty = false; // True if particles moved since the last snapshot
+double g_sim_dt_multiplier = 1.0; // Copy of dt_multiplier
+bool g_adaptive_stepping = true; // Let g_step_controller pick substeps
+StepController g_step_controller(SIM_MAX_SUBSTEPS);
+Governor g_governor(SIM_BUDGET, SIM_MAX_SUBSTEPS); // Trades quality for time
+glm::vec3 g_camera_pos; // Copy of the camera position, for the governor
+glm::vec3 g_mouse_ray[2]; // Ray through the mouse pointer, near to far
+bool g_mouse_down = false; // Mouse pointer enabled and button held
+bool g_mouse_ray_new = false; // The ray hasn't been picked against yet
+real g_t_min = 0.0; // Used for closest particle (during picking)
+Body* g_selected_body = NULL; // The body that has been picked up, if any
+TaskGraph g_sim_graph; // Jobs of the current step or snapshot
+double g_substep_dt = 0.0; // Length of each substep of the current step
+dlib::vec3 g_mouse_force; // Pull on the selected body during this substep
+
 //=============================================================================
 // initialize
 //=============================================================================
 
 static void print_help();
 
+/* Move every vertex of a mesh by the given offset.
+ */
+static void translate_mesh(Mesh& mesh, real dx, real dy, real dz)
+{
+    size_t size = mesh.GetDataSize();
+    real* data = mesh.GetData();
+    for (size_t i = 0; i < size; i += 3)
+    {
+        data[i+0] += dx;
+        data[i+1] += dy;
+        data[i+2] += dz;
+    }
+    mesh.UpdateData();
+}
+
+/* Get the smallest and largest x coordinate of a mesh.
+ */
+static void mesh_x_extent(Mesh& mesh, real& min_x, real& max_x)
+{
+    size_t size = mesh.GetDataSize();
+    real* data = mesh.GetData();
+    min_x = max_x = data[0];
+    for (size_t i = 0; i < size; i += 3)
+    {
+        min_x = std::min(min_x, data[i]);
+        max_x = std::max(max_x, data[i]);
+    }
+}
+
 bool initialize(int argc, char* argv[])
 {
     glEnable(GL_DEPTH_TEST);
 
-    // Load the model
-    ObjLoader obj;
-    const char* file = "sphere.obj";
-    if (argc > 1)
+    // Load the models, every OBJ file given becomes one body. Dense
+    // models can be simulated with proxy particles, see PSystem.
+    std::vector<const char*> files;
+    real proxy_size = 0;
+    const char* publish_name = NULL;
+    const char* stream_address = NULL;
+    Mesh::PositionFormat position_format = Mesh::FLOAT_POSITIONS;
+    for (int i = 1; i < argc; ++i)
     {
-        file = argv[1];
+        if (strcmp(argv[i], "--proxy") == 0 && i + 1 < argc)
+        {
+            proxy_size = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc)
+        {
+            publish_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+        {
+            stream_address = argv[++i];
+        }
+        else if (strcmp(argv[i], "--positions") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "half") == 0)
+            {
+                position_format = Mesh::HALF_POSITIONS;
+            }
+            else if (strcmp(argv[i], "unorm16") == 0)
+            {
+                position_format = Mesh::UNORM16_POSITIONS;
+            }
+            else if (strcmp(argv[i], "float") != 0)
+            {
+                cerr << "Unknown position format " << argv[i] << endl;
+                return false;
+            }
+        }
+        else
+        {
+            files.push_back(argv[i]);
+        }
     }
 
-    if (!obj.LoadFile(file) || !obj.ToMesh(g_obj_mesh, Mesh::VERTICES))
+    if (files.empty())
     {
-        cerr << "Failed to load OBJ file" << endl;
-        return false;
+        files.push_back("sphere.obj");
     }
 
-    size_t size = g_obj_mesh.GetDataSize();
-    real* data = g_obj_mesh.GetData();
-    for (size_t i = 0; i < size; i += 3)
+    std::vector<real> min_x(files.size());
+    std::vector<real> max_x(files.size());
+    real row_width = 0;
+    for (size_t i = 0; i < files.size(); ++i)
     {
-        data[i+0] += 0;
-        data[i+1] += 5;
-        data[i+2] += 0;
+        ObjLoader obj;
+        Body* body = new Body();
+        body->psystem = NULL;
+        body->parallel = NULL;
+        body->pick_grid_dirty = true;
+        body->pick_drift = std::numeric_limits<real>::max();
+        body->governor_asleep = false;
+        body->version = 1;
+        body->uploaded_version = 0;
+        body->normal_matrix = fmath::mat3::identity();
+        body->max_displacement = 0;
+        body->max_deviation = 0;
+        g_bodies.push_back(body);
+
+        if (!obj.LoadFile(files[i]) || !obj.ToMesh(body->mesh, Mesh::VERTICES | Mesh::NORMALS))
+        {
+            cerr << "Failed to load OBJ file " << files[i] << endl;
+            return false;
+        }
+        body->mesh.SetPositionFormat(position_format);
+
+        mesh_x_extent(body->mesh, min_x[i], max_x[i]);
+        row_width += max_x[i] - min_x[i];
     }
-    g_obj_mesh.UpdateData();
 
-    g_psystem = new PSystem(g_obj_mesh);
+    // Place the bodies in a row along the x axis centered on the origin,
+    // with a small gap between each.
+    const real gap = 1.0;
+    row_width += gap * (files.size() - 1);
+    // Copies of the same file share the first one's rest shape, placed
+    // where they are in the row.
+    std::map<std::string, size_t> first_copy;
+    std::vector<real> offset_x(files.size());
+    real x = -0.5 * row_width;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        Body* body = g_bodies[i];
+        offset_x[i] = x - min_x[i];
+        translate_mesh(body->mesh, offset_x[i], 5, 0);
+        x += (max_x[i] - min_x[i]) + gap;
+
+        std::map<std::string, size_t>::const_iterator first = first_copy.find(files[i]);
+        if (first == first_copy.end())
+        {
+            first_copy[files[i]] = i;
+            body->psystem = new PSystem(body->mesh, proxy_size);
+        }
+        else
+        {
+            const size_t j = first->second;
+            body->psystem = new PSystem(body->mesh, g_bodies[j]->psystem->GetShape());
+
+            dlib::vec3 translation;
+            translation = offset_x[i] - offset_x[j], 0, 0;
+            body->psystem->SetPlacement(fmath::mat3::identity(), translation);
+        }
+
+        // Keep the stiffness the same when steps are split into substeps
+        body->psystem->SetAlphaReferenceDt(SIM_DT);
 
-	std::cout << g_psystem->GetNumParticles() << " number of particles\n";
+        // Resting bodies stop costing steps and uploads
+        body->psystem->SetAutoSleep(SLEEP_ENERGY, SLEEP_DEVIATION, SLEEP_STEPS);
+
+        std::cout << body->psystem->GetNumParticles() << " number of particles";
+        if (body->psystem->IsProxy())
+        {
+            std::cout << " (proxies for " << body->mesh.GetDataSize() / 3 << " vertices)";
+        }
+        std::cout << "\n";
+    }
 
     // Create the ground plane
     g_ground_mesh.NewMesh();
@@ -125,19 +411,78 @@ bool initialize(int argc, char* argv[])
     // Set the forces
     g_gravity = 0, -9.8, 0;
 
+    dlib::vec3 wind;
+    wind = WIND_SPEED, 0, 0;
+    g_wind.SetAcceleration(wind);
+    g_gusts = TurbulenceField(GUST_STRENGTH, GUST_SIZE, wind);
+    dlib::vec3 blast_center;
+    blast_center = 0, -1, 0;
+    g_explosion.SetCenter(blast_center);
+
     srand(time(NULL));
 
     const bool shaders_loaded = 
             ground_shader.LoadShaders("glsl/ground.vert", "glsl/ground.frag") &&
-            object_shader.LoadShaders("glsl/object.vert", "glsl/object.frag",
-                                     "glsl/object.geom");
-    if (shaders_loaded)
+            object_shader.LoadShaders("glsl/object.vert", "glsl/object.frag");
+    if (!shaders_loaded)
     {
-        print_help();
-        return true;
+        return false;
+    }
+
+    // The simulation thread runs jobs too, and the main thread is busy
+    // rendering. Large bodies keep their ranges on the node of the worker
+    // that steps them, so the workers mustn't move then.
+    bool any_large = false;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        any_large |= g_bodies[i]->psystem->GetNumParticles() >= LARGE_BODY_PARTICLES;
+    }
+    g_task_pool.Start(std::max(get_num_cpus() - 2, 0), any_large);
+
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        Body* body = g_bodies[i];
+        if (body->psystem->GetNumParticles() >= LARGE_BODY_PARTICLES)
+        {
+            body->parallel = new ParallelStep(*body->psystem, g_task_pool,
+                                              check_for_collisions);
+            if (!body->parallel->Distribute())
+            {
+                cerr << "Failed to spread body " << i << " over the NUMA nodes" << endl;
+            }
+        }
+    }
+
+    // Let other processes watch the bodies
+    if (publish_name != NULL)
+    {
+        std::vector<size_t> capacities;
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            capacities.push_back(g_bodies[i]->psystem->GetNumParticles());
+        }
+        if (!g_state_publisher.Open(publish_name, capacities))
+        {
+            return false;
+        }
     }
 
-    return false;
+    // And other machines
+    if (stream_address != NULL && !g_stream_server.Listen(stream_address))
+    {
+        return false;
+    }
+
+    // Everything the simulation needs is setup, from now on the bodies'
+    // particle systems belong to the simulation thread.
+    if (!g_sim_thread.Start())
+    {
+        cerr << "Failed to start the simulation thread" << endl;
+        return false;
+    }
+
+    print_help();
+    return true;
 }
 
 //=============================================================================
@@ -146,7 +491,18 @@ bool initialize(int argc, char* argv[])
 
 void cleanup()
 {
-    delete g_psystem;
+    g_sim_thread.Stop();
+    g_task_pool.Stop();
+    g_state_publisher.Close();
+    g_stream_server.Close();
+
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        delete g_bodies[i]->parallel;
+        delete g_bodies[i]->psystem;
+        delete g_bodies[i];
+    }
+    g_bodies.clear();
 }
 
 //=============================================================================
@@ -197,6 +553,11 @@ static void print_help()
               << "H - Print this help\n"
               << "[ - Add random force to particle system\n"
               << "P - Pause/unpause the simulation\n"
+              << "V - Turn adaptive substepping on/off\n"
+              << "U - Turn the frame budget governor on/off\n"
+              << "C - Turn plasticity on/off\n"
+              << "Z - Turn gusty wind on/off\n"
+              << "X - Set off an explosion\n"
               << "(spacebar) - When simulation is paused, take one step\n"
               << "R - Reset mesh to original location and deformation\n"
 			  << "ESC - Quit\n"
@@ -204,10 +565,54 @@ static void print_help()
 }
 
 //=============================================================================
-// update
+// push_event
 //=============================================================================
 
-static void integrate(double dt);
+/* Queue an event for the simulation thread.
+ */
+static void push_event(SimEventType type, real v0 = 0, real v1 = 0)
+{
+    SimEvent event;
+    event.type = type;
+    event.value[0] = v0;
+    event.value[1] = v1;
+    if (!g_sim_events.Push(event))
+    {
+        cerr << "Simulation event queue is full, dropping input" << endl;
+    }
+}
+
+//=============================================================================
+// push_mouse_event
+//=============================================================================
+
+/* Send the ray coming out of the camera through the mouse pointer to the
+ * simulation thread, it does the picking and mouse attraction.
+ */
+static void push_mouse_event(bool down)
+{
+    glm::vec3 window_near(g_mouse_x, height-g_mouse_y, 0.0);
+    glm::vec3 window_far(g_mouse_x, height-g_mouse_y, 1.0);
+    glm::vec4 viewport(0, 0, width, height);
+    glm::mat4 view = camera.GetView();
+    glm::mat4 proj = camera.GetProj();
+    glm::vec3 v1 = glm::unProject(window_near, view, proj, viewport);
+    glm::vec3 v2 = glm::unProject(window_far, view, proj, viewport);
+
+    SimEvent event;
+    event.type = SIM_EVENT_MOUSE;
+    event.value[0] = v1.x; event.value[1] = v1.y; event.value[2] = v1.z;
+    event.value[3] = v2.x; event.value[4] = v2.y; event.value[5] = v2.z;
+    event.value[6] = down ? 1 : 0;
+    if (!g_sim_events.Push(event))
+    {
+        cerr << "Simulation event queue is full, dropping input" << endl;
+    }
+}
+
+//=============================================================================
+// update
+//=============================================================================
 
 bool update(double dt)
 {
@@ -240,52 +645,51 @@ bool update(double dt)
         glfwGetMousePos(&g_mouse_x, &g_mouse_y);
     }
 
-    g_mouse_down = glfwGetMouseButton(GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    // Only tell the simulation about the mouse while it is being used, and
+    // once more when the button is let go.
+    static bool mouse_was_down = false;
+    const bool mouse_down = g_mouse_pointer_enabled &&
+        glfwGetMouseButton(GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    if (mouse_down || mouse_was_down)
+    {
+        push_mouse_event(mouse_down);
+    }
+    mouse_was_down = mouse_down;
 
     // Take one simulation step, useful when simulation is paused
-    static bool run_sim = false;
     if (glfwKeyPressed(' '))
     {
-        if (!run_sim)
-        {
-            integrate(dt);
-        }
+        push_event(SIM_EVENT_STEP);
     }
 
     // Increase alpha value
     if (glfwKeyPressed('O'))
     {
-        g_psystem->SetAlpha(g_psystem->GetAlpha() + 0.1);
-        std::cout << "Alpha is now " << g_psystem->GetAlpha() << "\n";
+        push_event(SIM_EVENT_ALPHA, 0.1);
     }
 
     // Decrease alpha value
     if (glfwKeyPressed('L'))
     {
-        g_psystem->SetAlpha(g_psystem->GetAlpha() - 0.1);
-        std::cout << "Alpha is now " << g_psystem->GetAlpha() << "\n";
+        push_event(SIM_EVENT_ALPHA, -0.1);
     }
 
     // Increase beta value
     if (glfwKeyPressed('I'))
     {
-        g_psystem->SetBeta(g_psystem->GetBeta() + 0.1);
-        std::cout << "Beta is now " << g_psystem->GetBeta() << "\n";
+        push_event(SIM_EVENT_BETA, 0.1);
     }
 
     // Decrease beta value
     if (glfwKeyPressed('K'))
     {
-        g_psystem->SetBeta(g_psystem->GetBeta() - 0.1);
-        std::cout << "Beta is now " << g_psystem->GetBeta() << "\n";
+        push_event(SIM_EVENT_BETA, -0.1);
     }
 
     // Dump the current settings
     if (glfwKeyPressed('Y'))
     {
-        std::cout << "Alpha: " << g_psystem->GetAlpha() << "\n"
-                << "Beta: " << g_psystem->GetBeta() << "\n"
-                << "Time Speed: " << dt_multiplier << "x\n";
+        push_event(SIM_EVENT_PRINT_SETTINGS);
     }
 
     // Print help
@@ -297,7 +701,7 @@ bool update(double dt)
     // Reset the mesh
     if (glfwKeyPressed('R'))
     {
-        g_psystem->Reset();
+        push_event(SIM_EVENT_RESET);
     }
 
     // Enable the mouse pointer for throwing
@@ -307,8 +711,7 @@ bool update(double dt)
         if (g_mouse_pointer_enabled)
         {
             glfwEnable(GLFW_MOUSE_CURSOR);
-            g_object_selected = false;
-            g_t_min = 0.0;
+            push_event(SIM_EVENT_DESELECT);
         }
         else
         {
@@ -318,6 +721,8 @@ bool update(double dt)
     }
 
 #ifdef SLOW_MO
+    const double old_multiplier = dt_multiplier;
+
     // Increase time multiplier
     if (glfwKeyPressed('T'))
     {
@@ -353,195 +758,736 @@ bool update(double dt)
         dt_multiplier = 1.0;
         std::cout << "Speed: " << dt_multiplier << "x\n";
     }
+
+    if (dt_multiplier != old_multiplier)
+    {
+        push_event(SIM_EVENT_TIME_SPEED, dt_multiplier);
+    }
 #endif
 
     // Add a random force to the mesh
     if (glfwKeyPressed('['))
     {
-        dlib::vec3 dv;
-        dv = randf(-8, 8), randf(2, 8), randf(-8, 8);
-        dlib::vec3* vel = g_psystem->GetVelocities();
-        size_t size = g_psystem->GetNumParticles();
-        for (size_t i = 0; i < size; ++i)
-        {
-            vel[i] += dv;
-        }
+        push_event(SIM_EVENT_RANDOM_FORCE);
     }
 
     // Pause the simulation
     if (glfwKeyPressed('P'))
     {
-        run_sim = !run_sim;
+        push_event(SIM_EVENT_PAUSE);
+    }
+
+    // Toggle adaptive substepping
+    if (glfwKeyPressed('V'))
+    {
+        push_event(SIM_EVENT_ADAPTIVE);
+    }
+
+    // Toggle the frame budget governor
+    if (glfwKeyPressed('U'))
+    {
+        push_event(SIM_EVENT_GOVERNOR);
     }
 
-    // Run the simulation
-    if (run_sim)
+    // Toggle plasticity
+    if (glfwKeyPressed('C'))
     {
-        integrate(dt_multiplier*dt);
+        push_event(SIM_EVENT_PLASTICITY);
+    }
+
+    // Toggle the wind
+    if (glfwKeyPressed('Z'))
+    {
+        push_event(SIM_EVENT_WIND);
+    }
+
+    // Explosion
+    if (glfwKeyPressed('X'))
+    {
+        push_event(SIM_EVENT_EXPLOSION);
+    }
+
+    // The governor puts the bodies furthest from the camera to sleep first
+    static glm::vec3 last_camera_pos(1e30f);
+    const glm::vec3 camera_pos = camera.GetPosition();
+    if (glm::distance(camera_pos, last_camera_pos) > 0.5f)
+    {
+        SimEvent event;
+        event.type = SIM_EVENT_CAMERA;
+        event.value[0] = camera_pos.x;
+        event.value[1] = camera_pos.y;
+        event.value[2] = camera_pos.z;
+        if (g_sim_events.Push(event))
+        {
+            last_camera_pos = camera_pos;
+        }
     }
 
     return true;
 }
 
 //=============================================================================
-// ray_sphere_intersect
+// SimulationThread
 //=============================================================================
 
-bool ray_sphere_intersect(const glm::vec3& v1, const glm::vec3& v2,
-                        const glm::vec3& center, const float radius,
-                        float& t)
+static void integrate(double dt);
+
+/* Print what the governor is doing.
+ */
+static void print_governor_telemetry()
 {
-    const glm::vec3 o_to_c = center - v1;
-    const glm::vec3 line_dir = glm::normalize(v2 - v1);
-    const float line_length = glm::distance(v1, v2);
-    t = glm::dot(o_to_c, line_dir);
-    glm::vec3 closest;
-    if (t <= 0.0f)
+    const Governor::Telemetry& t = g_governor.GetTelemetry();
+    std::cout << "Governor: " << (g_governor.IsEnabled() ? "on" : "off")
+              << ", level " << t.level << "/" << (t.num_levels - 1)
+              << " (" << g_governor.GetDescription() << ")\n"
+              << "  Step cost: " << t.average_cost * 1000.0 << " ms average, "
+              << t.peak_cost * 1000.0 << " ms peak, "
+              << t.budget * 1000.0 << " ms budget\n"
+              << "  Downgrades: " << t.downgrades << ", upgrades: " << t.upgrades
+              << ", dropped time: " << t.dropped_time << " s\n";
+}
+
+/* Put the bodies furthest from the camera to sleep so that only the
+ * governor's fraction of them stays awake. The picked body always stays
+ * awake.
+ */
+static void update_sleeping_bodies()
+{
+    std::vector<std::pair<real, Body*> > by_distance;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
     {
-        return false;
+        const dlib::vec3 com = g_bodies[i]->psystem->GetCOM();
+        const glm::vec3 to_camera = glm::vec3(com(0), com(1), com(2)) - g_camera_pos;
+        by_distance.push_back(std::make_pair(glm::dot(to_camera, to_camera), g_bodies[i]));
     }
-    else if (t >= line_length)
+    std::sort(by_distance.begin(), by_distance.end());
+
+    const double fraction = g_governor.GetQuality().awake_fraction;
+    const size_t awake = std::max<size_t>(1, std::ceil(fraction * by_distance.size()));
+    for (size_t i = 0; i < by_distance.size(); ++i)
     {
-        closest = v2;
+        Body* body = by_distance[i].second;
+        const bool should_sleep = i >= awake && body != g_selected_body;
+        if (should_sleep && !body->governor_asleep)
+        {
+            body->psystem->Sleep();
+            body->governor_asleep = true;
+        }
+        else if (!should_sleep && body->governor_asleep)
+        {
+            body->psystem->Wake();
+            body->governor_asleep = false;
+        }
     }
-    else
+}
+
+/* Apply the governor's current quality level.
+ */
+static void apply_quality()
+{
+    const Governor::Quality& quality = g_governor.GetQuality();
+    g_step_controller.SetMaxSubsteps(quality.max_substeps);
+    for (size_t i = 0; i < g_bodies.size(); ++i)
     {
-        closest = v1 + line_dir*t;
+        g_bodies[i]->psystem->SetQuadratic(quality.quadratic);
     }
+    update_sleeping_bodies();
+}
 
-    return glm::distance(center, closest) <= radius;
+/* Apply everything the main thread queued since the last step.
+ */
+static void process_events()
+{
+    SimEvent event;
+    while (g_sim_events.Pop(event))
+    {
+        switch (event.type)
+        {
+            case SIM_EVENT_ALPHA:
+                for (size_t i = 0; i < g_bodies.size(); ++i)
+                {
+                    PSystem* psys = g_bodies[i]->psystem;
+                    psys->SetAlpha(psys->GetAlpha() + event.value[0]);
+                }
+                std::cout << "Alpha is now " << g_bodies[0]->psystem->GetAlpha() << "\n";
+                break;
+
+            case SIM_EVENT_BETA:
+                for (size_t i = 0; i < g_bodies.size(); ++i)
+                {
+                    PSystem* psys = g_bodies[i]->psystem;
+                    psys->SetBeta(psys->GetBeta() + event.value[0]);
+                }
+                std::cout << "Beta is now " << g_bodies[0]->psystem->GetBeta() << "\n";
+                break;
+
+            case SIM_EVENT_TIME_SPEED:
+                g_sim_dt_multiplier = event.value[0];
+                break;
+
+            case SIM_EVENT_PRINT_SETTINGS:
+            {
+                size_t resting = 0;
+                for (size_t i = 0; i < g_bodies.size(); ++i)
+                {
+                    resting += g_bodies[i]->psystem->IsResting() ? 1 : 0;
+                }
+                std::cout << "Alpha: " << g_bodies[0]->psystem->GetAlpha() << "\n"
+                        << "Beta: " << g_bodies[0]->psystem->GetBeta() << "\n"
+                        << "Time Speed: " << g_sim_dt_multiplier << "x\n"
+                        << "Adaptive Stepping: " << (g_adaptive_stepping ? "on" : "off")
+                        << " (" << g_step_controller.GetSubsteps() << " substeps)\n"
+                        << "Plasticity: " << (g_bodies[0]->psystem->IsPlastic() ? "on" : "off") << "\n"
+                        << "Resting: " << resting << "/" << g_bodies.size() << "\n";
+                print_governor_telemetry();
+                break;
+            }
+
+            case SIM_EVENT_RESET:
+                for (size_t i = 0; i < g_bodies.size(); ++i)
+                {
+                    g_bodies[i]->psystem->Reset();
+                    g_bodies[i]->pick_grid_dirty = true;
+                    g_bodies[i]->pick_drift = std::numeric_limits<real>::max();
+                    ++g_bodies[i]->version;
+                }
+                g_sim_dirty = true;
+                break;
+
+            case SIM_EVENT_RANDOM_FORCE:
+                for (size_t b = 0; b < g_bodies.size(); ++b)
+                {
+                    dlib::vec3 dv;
+                    dv = randf(-8, 8), randf(2, 8), randf(-8, 8);
+                    g_bodies[b]->psystem->Wake();
+                    g_bodies[b]->governor_asleep = false;
+                    dlib::vec3* vel = g_bodies[b]->psystem->GetVelocities();
+                    size_t size = g_bodies[b]->psystem->GetNumParticles();
+                    for (size_t i = 0; i < size; ++i)
+                    {
+                        vel[i] += dv;
+                    }
+                }
+                break;
+
+            case SIM_EVENT_PAUSE:
+                g_run_sim = !g_run_sim;
+                break;
+
+            case SIM_EVENT_ADAPTIVE:
+                g_adaptive_stepping = !g_adaptive_stepping;
+                g_step_controller.Reset();
+                std::cout << "Adaptive stepping is now "
+                          << (g_adaptive_stepping ? "on" : "off") << "\n";
+                break;
+
+            case SIM_EVENT_GOVERNOR:
+                g_governor.SetEnabled(!g_governor.IsEnabled());
+                apply_quality();
+                std::cout << "Governor is now "
+                          << (g_governor.IsEnabled() ? "on" : "off") << "\n";
+                break;
+
+            case SIM_EVENT_PLASTICITY:
+            {
+                const bool plastic = !g_bodies[0]->psystem->IsPlastic();
+                for (size_t i = 0; i < g_bodies.size(); ++i)
+                {
+                    if (plastic)
+                    {
+                        g_bodies[i]->psystem->SetPlasticity(PLASTIC_YIELD, PLASTIC_CREEP, PLASTIC_MAX);
+                    }
+                    else
+                    {
+                        g_bodies[i]->psystem->SetPlasticity(0, 0, 0);
+                    }
+                }
+                std::cout << "Plasticity is now " << (plastic ? "on" : "off") << "\n";
+                break;
+            }
+
+            case SIM_EVENT_WIND:
+                g_wind_enabled = !g_wind_enabled;
+                if (g_wind_enabled)
+                {
+                    g_force_fields.Add(&g_wind);
+                    g_force_fields.Add(&g_gusts);
+                }
+                else
+                {
+                    g_force_fields.Remove(&g_wind);
+                    g_force_fields.Remove(&g_gusts);
+                }
+                std::cout << "Wind is now " << (g_wind_enabled ? "on" : "off") << "\n";
+                break;
+
+            case SIM_EVENT_EXPLOSION:
+                if (g_explosion_left <= 0)
+                {
+                    g_force_fields.Add(&g_explosion);
+                }
+                g_explosion_left = EXPLOSION_DURATION;
+                break;
+
+            case SIM_EVENT_CAMERA:
+                g_camera_pos = glm::vec3(event.value[0], event.value[1], event.value[2]);
+                break;
+
+            case SIM_EVENT_STEP:
+                if (!g_run_sim)
+                {
+                    integrate(SIM_DT);
+                }
+                break;
+
+            case SIM_EVENT_MOUSE:
+                g_mouse_ray[0] = glm::vec3(event.value[0], event.value[1], event.value[2]);
+                g_mouse_ray[1] = glm::vec3(event.value[3], event.value[4], event.value[5]);
+                g_mouse_down = event.value[6] != 0;
+                g_mouse_ray_new = true;
+                break;
+
+            case SIM_EVENT_DESELECT:
+                g_selected_body = NULL;
+                g_t_min = 0.0;
+                break;
+        }
+    }
+}
+
+/* Copy the particle positions of one body into the snapshot being written.
+ */
+static void copy_body(void* data, size_t index)
+{
+    Snapshot& snapshot = *static_cast<Snapshot*>(data);
+    PSystem* psys = g_bodies[index]->psystem;
+    const dlib::vec3* pos = psys->GetPositions();
+    snapshot.positions[index].assign(pos, pos + psys->GetNumParticles());
+    snapshot.skins[index] = psys->GetSkinTransform();
+}
+
+static void publish_body(void*, size_t index)
+{
+    PSystem* psys = g_bodies[index]->psystem;
+    g_state_publisher.WriteBody(index, psys->GetPositions(), psys->GetNumParticles(),
+                                psys->GetCOM(), psys->GetRotation());
+}
+
+static void stream_body(void*, size_t index)
+{
+    g_stream_server.WriteBody(index, *g_bodies[index]->psystem);
+}
+
+/* Copy the particle positions of every body for the render thread. Bodies
+ * that haven't moved since the buffer was last written are skipped, the
+ * others are copied in parallel. Other processes and clients of the stream
+ * get every body of the frame, see --publish and --stream.
+ */
+static void publish_snapshot()
+{
+    Snapshot& snapshot = g_snapshots.GetWriteBuffer();
+    snapshot.positions.resize(g_bodies.size());
+    snapshot.skins.resize(g_bodies.size());
+    snapshot.versions.resize(g_bodies.size(), 0);
+
+    g_sim_graph.Clear();
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        if (snapshot.versions[i] != g_bodies[i]->version)
+        {
+            snapshot.versions[i] = g_bodies[i]->version;
+            g_sim_graph.Add(copy_body, &snapshot, i);
+        }
+    }
+    if (g_state_publisher.IsOpen())
+    {
+        g_state_publisher.BeginFrame(get_time());
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            g_sim_graph.Add(publish_body, NULL, i);
+        }
+    }
+    const bool streaming = g_stream_server.IsOpen() &&
+                           g_stream_server.BeginFrame(get_time(), g_bodies.size());
+    if (streaming)
+    {
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            g_sim_graph.Add(stream_body, NULL, i);
+        }
+    }
+    g_task_pool.Run(g_sim_graph);
+
+    g_snapshots.Publish();
+    if (g_state_publisher.IsOpen())
+    {
+        g_state_publisher.EndFrame();
+    }
+    if (streaming)
+    {
+        g_stream_server.EndFrame();
+    }
+}
+
+void SimulationThread::Run()
+{
+    double previous_time = get_time();
+    double sim_time = 0.0;
+    unsigned long steps = 0;
+    while (!atomic::load(&m_quit))
+    {
+        // Take new stream clients and keep sending to slow ones
+        g_stream_server.Poll();
+
+        // Get the elapsed time since the last update
+        const double current_time = get_time();
+        sim_time += current_time - previous_time;
+        previous_time = current_time;
+
+        // Fell too far behind, the time is lost. The governor should keep
+        // this from happening.
+        if (sim_time > SIM_MAX_DT)
+        {
+            if (g_run_sim)
+            {
+                g_governor.AddDroppedTime(sim_time - SIM_MAX_DT);
+            }
+            sim_time = SIM_MAX_DT;
+        }
+
+        // Nothing to do until a full step has passed
+        if (sim_time < SIM_DT)
+        {
+            sleep_for(SIM_DT - sim_time);
+            continue;
+        }
+
+        while (sim_time >= SIM_DT)
+        {
+            sim_time -= SIM_DT;
+            process_events();
+            if (!g_run_sim)
+            {
+                continue;
+            }
+
+            const double step_start = get_time();
+            integrate(g_sim_dt_multiplier*SIM_DT);
+            const bool quality_changed = g_governor.Report(get_time() - step_start);
+
+            // Let the governor know about its decisions, and every second
+            // check if other bodies are now the furthest away.
+            if (quality_changed)
+            {
+                apply_quality();
+                const Governor::Telemetry& t = g_governor.GetTelemetry();
+                std::cout << "Governor: " << g_governor.GetDescription()
+                          << " (step cost " << t.average_cost * 1000.0
+                          << " ms, budget " << t.budget * 1000.0 << " ms)\n";
+            }
+            else if (++steps % static_cast<unsigned long>(SIM_FPS) == 0 &&
+                     g_governor.GetQuality().awake_fraction < 1.0)
+            {
+                update_sleeping_bodies();
+            }
+        }
+
+        // Only hand over a new state if something moved
+        if (g_sim_dirty)
+        {
+            publish_snapshot();
+            g_sim_dirty = false;
+        }
+    }
+}
+
+void SimulationThread::Stop()
+{
+    atomic::store(&m_quit, 1);
+    Join();
 }
 
 //=============================================================================
 // try_to_select
 //=============================================================================
 
-static bool try_to_select(PSystem& psys, const glm::vec3& v1, 
-                const glm::vec3& v2, real& t_min)
+/* Find the particle closest to v1 along the ray from v1 to v2, over all the
+ * bodies. Each body's picking grid is only rebuilt if the body has moved
+ * since the last time it was picked against, and could have moved into
+ * the ray.
+ */
+static Body* try_to_select(const glm::vec3& v1, const glm::vec3& v2, real& t_min)
 {
-    const size_t data_size = psys.GetNumParticles();
-    const dlib::vec3* data = psys.GetPositions();
-    for (size_t i = 0; i < data_size; ++i)
+    const glm::vec3 line_dir = glm::normalize(v2 - v1);
+    dlib::vec3 origin, dir;
+    origin = v1.x, v1.y, v1.z;
+    dir = line_dir.x, line_dir.y, line_dir.z;
+    const real max_t = glm::distance(v1, v2);
+
+    Body* closest = NULL;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
     {
-        const dlib::vec3& p(data[i]);
-        const glm::vec3 center(p(0), p(1), p(2));
-        if (ray_sphere_intersect(v1, v2, center, 0.2, t_min))
+        Body* body = g_bodies[i];
+        if (body->pick_grid_dirty)
         {
-            return true;
+            // None of the particles has left the old grid's box by more
+            // than pick_drift, so a ray that misses the grown box misses
+            // them too
+            if (!body->pick_grid.MayHit(origin, dir, max_t, body->pick_drift))
+            {
+                continue;
+            }
+
+            body->pick_grid.Build(body->psystem->GetPositions(),
+                                  body->psystem->GetNumParticles(), PICK_RADIUS);
+            body->pick_grid_dirty = false;
+            body->pick_drift = 0;
+        }
+
+        real t;
+        size_t index;
+        if (body->pick_grid.Raycast(origin, dir, max_t, t, index) &&
+            (closest == NULL || t < t_min))
+        {
+            closest = body;
+            t_min = t;
         }
     }
 
-    return false;
+    return closest;
 }
 
 //=============================================================================
 // get_mouse_attraction_force
 //=============================================================================
 
+/* Returns the force pulling the selected body toward the mouse, picking a
+ * body first if none is selected.
+ */
 static dlib::vec3 get_mouse_attraction_force()
 {
-    // Create a ray coming out of the camera
-    glm::vec3 window_near(g_mouse_x, height-g_mouse_y, 0.0);
-    glm::vec3 window_far(g_mouse_x, height-g_mouse_y, 1.0);
-    glm::vec4 viewport(0, 0, width, height);
-    glm::mat4 view = camera.GetView();
-    glm::mat4 proj = camera.GetProj();
-    glm::vec3 v1 = glm::unProject(window_near, view, proj, viewport);
-    glm::vec3 v2 = glm::unProject(window_far, view, proj, viewport);
+    // The ray coming out of the camera, sent by the main thread
+    const glm::vec3& v1(g_mouse_ray[0]);
+    const glm::vec3& v2(g_mouse_ray[1]);
 
-    // See if the ray intersects a particle
-    if (!g_object_selected)
+    // See if the ray intersects a particle. Only once for each ray the
+    // main thread sends, not every substep.
+    if (g_selected_body == NULL && g_mouse_ray_new)
     {
-        g_object_selected = try_to_select(*g_psystem, v1, v2, g_t_min);
+        g_selected_body = try_to_select(v1, v2, g_t_min);
     }
+    g_mouse_ray_new = false;
 
     // Return a force that points toward the mouse
-    if (g_object_selected)
+    if (g_selected_body != NULL)
     {
         const glm::vec3 _dest(v1 + glm::normalize(v2 - v1)*g_t_min);
         dlib::vec3 dest;
         dest = _dest.x, _dest.y, _dest.z;
-        return (dest - g_psystem->GetCOM()) * 5.0;
+        return (dest - g_selected_body->psystem->GetCOM()) * 5.0;
     }
 
     return dlib::zeros_matrix<real>(3L, 1L);
 }
 
 //=============================================================================
-// check_for_collisions
+// integrate
 //=============================================================================
 
-static void check_for_collisions()
+/* Get ready for the next substep: move the environment along and find
+ * the pull of the mouse. Runs while no body is being stepped.
+ */
+static void prepare_substep(void*, size_t)
 {
-    // Keep the particle system contained inside a box
-    dlib::vec3* particles = g_psystem->GetPositions();
-    dlib::vec3* velocities = g_psystem->GetVelocities();
-    size_t num_particles = g_psystem->GetNumParticles();
-    for (size_t i = 0; i < num_particles; ++i)
+    // The gusts move with the wind, and explosions fade out
+    if (g_wind_enabled)
     {
-        dlib::vec3& pos(particles[i]);
-        dlib::vec3& vel(velocities[i]);
-        static real zero[3] = { 0, 0, 0 };
-        if (pos(0) < -20) 
-        { 
-            real r[3] = { -20, pos(1), pos(2) };
-            vel = vec3(zero);
-            pos = vec3(r);
-        }
-        else if (pos(0) > 20)
+        g_gusts.Advance(g_substep_dt);
+    }
+    if (g_explosion_left > 0)
+    {
+        g_explosion.SetStrength(EXPLOSION_STRENGTH * g_explosion_left / EXPLOSION_DURATION);
+        g_explosion_left -= g_substep_dt;
+        if (g_explosion_left <= 0)
         {
-            real r[3] = { 20, pos(1), pos(2) };
-            vel = vec3(zero);
-            pos = vec3(r);
+            g_force_fields.Remove(&g_explosion);
         }
+    }
 
-        if (pos(1) < 0) 
-        { 
-            real r[3] = { pos(0), 0, pos(2) };
-            vel = vec3(zero);
-            pos = vec3(r);
-        }
-        else if (pos(1) > 20)
-        {
-            real r[3] = { pos(0), 20, pos(2) };
-            vel = vec3(zero);
-            pos = vec3(r);
-        }
+    // Add a force to pull the selected object towards the mouse
+    g_mouse_force = dlib::zeros_matrix<real>(3L, 1L);
+    if (g_mouse_down)
+    {
+        g_mouse_force = get_mouse_attraction_force();
+    }
+}
 
-        if (pos(2) < -20) 
-        { 
-            real r[3] = { pos(0), pos(1), -20 };
-            vel = vec3(zero);
-            pos = vec3(r);
-        }
-        else if (pos(2) > 20)
+/* Find the force on a body for this substep and wake it if it has to.
+ *
+ * Returns:
+ *   False if the body is asleep and shouldn't be stepped.
+ */
+static bool start_body_step(Body* body, dlib::vec3& force)
+{
+    PSystem* psys = body->psystem;
+    force = g_gravity;
+    if (body == g_selected_body)
+    {
+        force += g_mouse_force;
+
+        // Don't let the governor freeze what the user is holding
+        if (body->governor_asleep)
         {
-            real r[3] = { pos(0), pos(1), 20 };
-            vel = vec3(zero);
-            pos = vec3(r);
+            psys->Wake();
+            body->governor_asleep = false;
         }
     }
+
+    // The gusts change without the field set changing
+    if (g_wind_enabled && psys->IsResting())
+    {
+        psys->Wake();
+    }
+
+    // Skip resting bodies before the collision checks too
+    psys->WakeIfDisturbed(force, &g_force_fields);
+    return !psys->IsSleeping();
 }
 
-//=============================================================================
-// integrate
-//=============================================================================
+/* Record how far a body moved in the substep it just took.
+ */
+static void finish_body_step(Body* body)
+{
+    PSystem* psys = body->psystem;
+    const real radius = psys->GetRestRadius();
+    body->max_displacement = std::max(body->max_displacement,
+                                      psys->GetMaxDisplacement() / radius);
+    body->max_deviation = std::max(body->max_deviation,
+                                   psys->GetMaxGoalDeviation() / radius);
+
+    // Update() moves a particle by at most the displacement, and the
+    // collisions only push it back towards where it was
+    body->pick_grid_dirty = true;
+    body->pick_drift += psys->GetMaxDisplacement();
+    ++body->version;
+}
+
+/* Take one substep of a body. Bodies only collide with the box around
+ * them, so every body of a substep can be stepped at the same time.
+ */
+static void step_body(void*, size_t index)
+{
+    Body* body = g_bodies[index];
+    dlib::vec3 force;
+    if (!start_body_step(body, force))
+    {
+        return;
+    }
+
+    check_for_collisions(*body->psystem);
+
+    body->psystem->Update(g_substep_dt, force, &g_force_fields);
+
+    check_for_collisions(*body->psystem);
+
+    finish_body_step(body);
+}
+
+/* Set up the substep of a large body, for the tasks of its ParallelStep.
+ */
+static void begin_large_body(void*, size_t index)
+{
+    Body* body = g_bodies[index];
+    dlib::vec3 force;
+    if (!start_body_step(body, force))
+    {
+        body->parallel->Skip();
+        return;
+    }
+
+    body->parallel->Begin(g_substep_dt, force, &g_force_fields);
+}
+
+static void end_large_body(void*, size_t index)
+{
+    Body* body = g_bodies[index];
+    if (body->parallel->WasStepped())
+    {
+        finish_body_step(body);
+    }
+}
 
 static void integrate(double dt)
 {
-    dlib::vec3 force = g_gravity;
+    // Split the step up if the last one moved things too far
+    const int substeps = g_adaptive_stepping ? g_step_controller.GetSubsteps() : 1;
+    g_substep_dt = dt / substeps;
+
+    // Every substep is a job that moves the environment along, followed
+    // by a job for each body. The next substep waits for all of them.
+    // Large bodies get a job for each part of their step on each thread.
+    g_sim_graph.Clear();
+    size_t previous = 0;
+    for (int s = 0; s < substeps; ++s)
+    {
+        // The bodies of the last substep were added right after its job
+        const size_t prepare = g_sim_graph.Add(prepare_substep, NULL);
+        for (size_t i = previous; s > 0 && i < prepare; ++i)
+        {
+            g_sim_graph.AddDependency(i, prepare);
+        }
+
+        previous = prepare;
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            if (g_bodies[i]->parallel == NULL)
+            {
+                g_sim_graph.AddDependency(prepare, g_sim_graph.Add(step_body, NULL, i));
+                continue;
+            }
+
+            const size_t begin = g_sim_graph.Add(begin_large_body, NULL, i);
+            g_sim_graph.AddDependency(prepare, begin);
+            const size_t parts = g_bodies[i]->parallel->AddTasks(g_sim_graph, begin);
+            g_sim_graph.AddDependency(parts, g_sim_graph.Add(end_large_body, NULL, i));
+        }
+    }
 
-    // Add a force to pull the object towards the mouse
-    if (g_mouse_pointer_enabled && g_mouse_down)
+    // Versions only go up, so the sum changes if any body moved
+    unsigned long old_versions = 0;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
     {
-        force += get_mouse_attraction_force();
+        g_bodies[i]->max_displacement = 0;
+        g_bodies[i]->max_deviation = 0;
+        old_versions += g_bodies[i]->version;
     }
 
-    check_for_collisions();
+    g_task_pool.Run(g_sim_graph);
 
-    g_psystem->Update(dt, force);
+    unsigned long new_versions = 0;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        new_versions += g_bodies[i]->version;
+    }
 
-    check_for_collisions();
+    if (new_versions != old_versions)
+    {
+        g_sim_dirty = true;
+    }
+
+    // Largest movement and goal distance relative to body size, for the
+    // step controller
+    if (g_adaptive_stepping)
+    {
+        real max_displacement = 0;
+        real max_deviation = 0;
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            max_displacement = std::max(max_displacement, g_bodies[i]->max_displacement);
+            max_deviation = std::max(max_deviation, g_bodies[i]->max_deviation);
+        }
+        g_step_controller.Report(max_displacement, max_deviation);
+    }
 }
 
 //=============================================================================
@@ -550,8 +1496,26 @@ static void integrate(double dt)
 
 void render()
 {
-    g_psystem->EndUpdate();
-    
+    // Upload the latest state from the simulation thread, if there is one
+    if (g_snapshots.Acquire())
+    {
+        const Snapshot& snapshot = g_snapshots.GetReadBuffer();
+        for (size_t i = 0; i < g_bodies.size(); ++i)
+        {
+            // Sleeping bodies keep the buffers they have
+            Body* body = g_bodies[i];
+            if (snapshot.versions[i] != body->uploaded_version)
+            {
+                body->psystem->EndUpdate(&snapshot.positions[i][0], snapshot.skins[i]);
+                body->uploaded_version = snapshot.versions[i];
+
+                // The mesh keeps its rest normals, they are turned with the
+                // linear part of the goal transform instead
+                body->normal_matrix = fmath::cofactor(snapshot.skins[i].matrix.left());
+            }
+        }
+    }
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // All vertices are already in world coordinates, don't need model matrix
@@ -563,7 +1527,15 @@ void render()
     object_shader.Bind();
     glUniformMatrix4fv(object_shader["proj"], 1, GL_FALSE, glm::value_ptr(camera.GetProj()));
     glUniformMatrix4fv(object_shader["view"], 1, GL_FALSE, glm::value_ptr(camera.GetView()));
-    g_psystem->Render();
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+    {
+        const Mesh& mesh = g_bodies[i]->mesh;
+        glUniformMatrix3fv(object_shader["normal_matrix"], 1, GL_TRUE,
+                           &g_bodies[i]->normal_matrix.m[0][0]);
+        glUniform3fv(object_shader["position_offset"], 1, mesh.GetPositionOffset());
+        glUniform3fv(object_shader["position_scale"], 1, mesh.GetPositionScale());
+        g_bodies[i]->psystem->Render();
+    }
 }
 
 //=============================================================================
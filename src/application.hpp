@@ -14,12 +14,14 @@ bool initialize(int argc, char* argv[]);
  */
 void resolution_changed(int width, int height);
 
-/* Called to perform an application update. Usually every
- * 1/60 seconds.
+/* Called once per rendered frame to handle input. The simulation
+ * itself runs on a separate thread at a fixed rate, input that affects
+ * it is forwarded there.
  */
 bool update(double dt);
 
-/* Called after update, should put rendering code here.
+/* Called after update, should put rendering code here. Picks up the
+ * latest simulation state if a new one is available.
  */
 void render(void);
 
@@ -0,0 +1,210 @@
+#include "arena.hpp"
+#include "thread.hpp"
+
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Blocks smaller than a huge page are rounded up to whole pages
+static const size_t PAGE_SIZE = 4096;
+
+// A pooled block is only reused for a request at least this fraction of
+// its size, so small bodies don't hold on to huge blocks
+static const size_t POOL_MAX_WASTE = 2;
+
+// Released blocks waiting to be reused, by size
+typedef std::multimap<size_t, char*> BlockPool;
+static BlockPool g_pool;
+static size_t g_pool_bytes = 0; // Sum of the sizes in g_pool
+static size_t g_pool_limit = 256 * 1024 * 1024; // See SetPoolLimit()
+static Mutex g_pool_mutex; // Arenas are created on several threads
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+Arena::Arena() :
+    m_block(NULL),
+    m_size(0),
+    m_used(0)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+Arena::~Arena()
+{
+    Release();
+}
+
+//=============================================================================
+// Create
+//=============================================================================
+
+/* Take the smallest pooled block that fits, or NULL if there is none.
+ * Blocks for huge pages have to start on one, blocks that were allocated
+ * for small pages are skipped.
+ */
+static char* take_from_pool(size_t bytes, bool huge, size_t& size)
+{
+    ScopedLock lock(g_pool_mutex);
+
+    BlockPool::iterator iter = g_pool.lower_bound(bytes);
+    while (huge && iter != g_pool.end() && iter->first <= bytes * POOL_MAX_WASTE &&
+           reinterpret_cast<uintptr_t>(iter->second) % Arena::HUGE_PAGE_SIZE != 0)
+    {
+        ++iter;
+    }
+    if (iter == g_pool.end() || iter->first > bytes * POOL_MAX_WASTE)
+    {
+        return NULL;
+    }
+
+    char* block = iter->second;
+    size = iter->first;
+    g_pool_bytes -= size;
+    g_pool.erase(iter);
+    return block;
+}
+
+bool Arena::Create(size_t bytes, unsigned int flags)
+{
+    Release();
+
+    // Huge pages only help if the block spans at least one of them
+    const bool huge = (flags & HUGE_PAGES) != 0 && bytes >= HUGE_PAGE_SIZE;
+    const size_t granularity = huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    bytes = (bytes + granularity - 1) / granularity * granularity;
+
+    // Pooled blocks have been written to before, so they are already
+    // faulted in, and on whichever node wrote them
+    const bool first_touch = (flags & FIRST_TOUCH) != 0;
+    m_block = first_touch ? NULL : take_from_pool(bytes, huge, m_size);
+    const bool pooled = m_block != NULL;
+    if (!pooled)
+    {
+        void* block = NULL;
+        if (posix_memalign(&block, granularity, bytes) != 0)
+        {
+            return false;
+        }
+
+        m_block = static_cast<char*>(block);
+        m_size = bytes;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (huge)
+    {
+        // Only a hint, fine if transparent huge pages are turned off. A
+        // pooled block may have been allocated without it.
+        madvise(m_block, m_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (pooled)
+    {
+        return true;
+    }
+
+    if (first_touch)
+    {
+        // The allocator may hand out memory it used before, drop the pages
+        // so the next write faults in a new one
+        madvise(m_block, m_size, MADV_DONTNEED);
+    }
+    else if ((flags & PREFAULT) != 0)
+    {
+        for (size_t i = 0; i < m_size; i += PAGE_SIZE)
+        {
+            m_block[i] = 0;
+        }
+    }
+
+    return true;
+}
+
+//=============================================================================
+// Release
+//=============================================================================
+
+void Arena::Release()
+{
+    if (m_block == NULL)
+    {
+        return;
+    }
+
+    {
+        ScopedLock lock(g_pool_mutex);
+        if (g_pool_bytes + m_size <= g_pool_limit)
+        {
+            g_pool.insert(std::make_pair(m_size, m_block));
+            g_pool_bytes += m_size;
+            m_block = NULL;
+        }
+    }
+
+    // Didn't fit in the pool
+    free(m_block);
+
+    m_block = NULL;
+    m_size = 0;
+    m_used = 0;
+}
+
+//=============================================================================
+// Swap
+//=============================================================================
+
+void Arena::Swap(Arena& other)
+{
+    std::swap(m_block, other.m_block);
+    std::swap(m_size, other.m_size);
+    std::swap(m_used, other.m_used);
+}
+
+//=============================================================================
+// SetPoolLimit
+//=============================================================================
+
+void Arena::SetPoolLimit(size_t bytes)
+{
+    ScopedLock lock(g_pool_mutex);
+
+    g_pool_limit = bytes;
+
+    // Free the largest blocks first until it fits
+    while (g_pool_bytes > g_pool_limit)
+    {
+        BlockPool::iterator last = g_pool.end();
+        --last;
+        g_pool_bytes -= last->first;
+        free(last->second);
+        g_pool.erase(last);
+    }
+}
+
+//=============================================================================
+// TrimPool
+//=============================================================================
+
+void Arena::TrimPool()
+{
+    ScopedLock lock(g_pool_mutex);
+
+    for (BlockPool::iterator iter = g_pool.begin(); iter != g_pool.end(); ++iter)
+    {
+        free(iter->second);
+    }
+
+    g_pool.clear();
+    g_pool_bytes = 0;
+}
+
+//=============================================================================
+//
+//=============================================================================
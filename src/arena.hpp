@@ -0,0 +1,142 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include <new>
+#include <cstddef>
+#include <cassert>
+
+/* One large block of memory that arrays are carved out of, so all the
+ * particle streams of a body live next to each other instead of wherever
+ * the allocator puts them. Every array starts on its own cache line.
+ *
+ * The total size has to be known up front:
+ *
+ *   Arena arena;
+ *   arena.Create(Arena::Size<dlib::vec3>(n) * 2);
+ *   dlib::vec3* pos = arena.Allocate<dlib::vec3>(n);
+ *   dlib::vec3* vel = arena.Allocate<dlib::vec3>(n);
+ *
+ * Blocks of at least a huge page are backed by transparent huge pages where
+ * the system supports them, which cuts down on TLB misses for very large
+ * bodies. Released blocks go back into a pool shared by all arenas, so
+ * destroying and respawning bodies doesn't go through the allocator or
+ * fault in fresh pages again.
+ *
+ * Allocate() default constructs the elements, but nothing is destroyed
+ * when the arena is released. Only use it for types with trivial
+ * destructors, like the fixed size dlib matrices.
+ */
+class Arena
+{
+public:
+    /* Options for Create().
+     */
+    enum Flags
+    {
+        HUGE_PAGES = 1, // Ask for transparent huge pages on large blocks
+        PREFAULT = 2, // Touch every page so no faults happen later
+        FIRST_TOUCH = 4, // Fresh pages, each placed on the NUMA node of the
+                         // thread that writes it first. Overrides PREFAULT.
+        DEFAULT_FLAGS = HUGE_PAGES | PREFAULT
+    };
+
+    // Alignment of the block and of every array in it
+    static const size_t ALIGNMENT = 64;
+
+    // Size of a transparent huge page on x86-64 Linux
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    Arena();
+
+    /* Returns the block to the pool.
+     */
+    ~Arena();
+
+    /* Get a block of at least the given size, from the pool if there is a
+     * suitable one. Any previous block is released first.
+     *
+     * Returns:
+     *   False if the memory couldn't be allocated.
+     */
+    bool Create(size_t bytes, unsigned int flags = DEFAULT_FLAGS);
+
+    /* Give the block back to the pool, every array carved from it becomes
+     * invalid.
+     */
+    void Release();
+
+    /* Exchange blocks with another arena, the arrays carved from both stay
+     * valid.
+     */
+    void Swap(Arena& other);
+
+    /* Carve an array out of the block. There must be enough space left,
+     * use Size() when calculating the size passed to Create().
+     */
+    template <typename T>
+    T* Allocate(size_t count)
+    {
+        const size_t bytes = Size<T>(count);
+        assert(m_used + bytes <= m_size);
+
+        T* array = reinterpret_cast<T*>(m_block + m_used);
+        for (size_t i = 0; i < count; ++i)
+        {
+            new (array + i) T();
+        }
+
+        m_used += bytes;
+        return array;
+    }
+
+    /* The number of bytes Allocate<T>(count) takes from the block.
+     */
+    template <typename T>
+    static size_t Size(size_t count)
+    {
+        return Align(count * sizeof(T));
+    }
+
+    /* Round up to a multiple of ALIGNMENT.
+     */
+    static size_t Align(size_t bytes)
+    {
+        return (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    /* Bytes available in the block, at least what was passed to Create().
+     */
+    size_t GetSize() const
+    {
+        return m_size;
+    }
+
+    /* Bytes handed out by Allocate() so far.
+     */
+    size_t GetUsed() const
+    {
+        return m_used;
+    }
+
+    /* Limit how many bytes the shared pool keeps around for reuse, blocks
+     * released beyond it are freed. Lowering the limit frees blocks right
+     * away.
+     */
+    static void SetPoolLimit(size_t bytes);
+
+    /* Free every block in the pool.
+     */
+    static void TrimPool();
+
+private:
+    // Not copyable
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+private:
+    char* m_block; // Start of the block, NULL if none
+    size_t m_size; // Usable size of m_block
+    size_t m_used; // Bytes handed out by Allocate()
+};
+
+#endif
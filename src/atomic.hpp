@@ -0,0 +1,57 @@
+#ifndef __ATOMIC_HPP__
+#define __ATOMIC_HPP__
+
+/* Small wrappers around the GCC atomic builtins. The code base is C++03 so
+ * std::atomic is not available, these give the same acquire/release
+ * semantics for plain integral and pointer variables that are shared
+ * between threads.
+ */
+namespace atomic
+{
+    /* Read a value written by another thread. Anything the other thread
+     * wrote before its matching store() is visible after this returns.
+     */
+    template <typename T>
+    inline T load(const T* ptr)
+    {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+
+    /* Publish a value to other threads, see load().
+     */
+    template <typename T>
+    inline void store(T* ptr, T value)
+    {
+        __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+    }
+
+    /* Swap in a new value and return the old one.
+     */
+    template <typename T>
+    inline T exchange(T* ptr, T value)
+    {
+        return __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL);
+    }
+
+    /* Add to a value, returns the value before the addition.
+     */
+    template <typename T>
+    inline T fetch_add(T* ptr, T value)
+    {
+        return __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL);
+    }
+
+    /* Keep the memory accesses before the fence from being reordered with
+     * those after it, for data that is guarded by a separate counter.
+     */
+    inline void fence()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+// Size used to keep variables written by different threads on separate
+// cache lines.
+#define CACHE_LINE_SIZE 64
+
+#endif
@@ -0,0 +1,1022 @@
+#include "batch.hpp"
+#include "mesh.hpp"
+#include "psystem.hpp"
+#include "smallbody.hpp"
+#include "lattice.hpp"
+#include "objloader.hpp"
+#include "collision.hpp"
+#include "transport.hpp"
+#include "thread.hpp"
+#include "atomic.hpp"
+
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+
+// Bodies start this far above the ground, same as in the interactive mode
+static const real DROP_HEIGHT = 5;
+
+// Alpha is tuned for the interactive step size (SIM_DT in application.cpp)
+// and scaled for other step sizes
+static const real ALPHA_REFERENCE_DT = 1.0 / 120.0;
+
+// Distributed cases fall asleep like the interactive mode, see
+// PSystem::SetAutoSleep()
+static const real SLEEP_ENERGY = 1e-3;
+static const real SLEEP_DEVIATION = 1e-3;
+static const int SLEEP_STEPS = 60;
+
+/* A loaded OBJ file. The mesh is only read once loaded, PSystem::EndUpdate()
+ * must never be called on it since it is shared between threads. The rest
+ * shape is built once and shared by every case too.
+ */
+struct BatchRunner::Asset
+{
+    Asset() : shape(NULL) {}
+
+    ~Asset()
+    {
+        if (shape != NULL)
+        {
+            shape->Release();
+        }
+    }
+
+    Mesh mesh;
+    ShapeTemplate* shape;
+};
+
+/* A time varying acceleration, see the BatchRunner description.
+ */
+struct BatchRunner::ForceScript
+{
+    struct Window
+    {
+        real start; // Seconds
+        real end;
+        dlib::vec3 force;
+    };
+
+    dlib::vec3 gravity; // Always applied
+    std::vector<Window> windows; // Only applied between start and end
+
+    ForceScript()
+    {
+        gravity = 0, -9.8, 0;
+    }
+
+    /* The total acceleration at some point in time.
+     */
+    dlib::vec3 GetForce(real time) const
+    {
+        dlib::vec3 force = gravity;
+        for (size_t i = 0; i < windows.size(); ++i)
+        {
+            if (time >= windows[i].start && time < windows[i].end)
+            {
+                force += windows[i].force;
+            }
+        }
+
+        return force;
+    }
+
+    bool Load(const std::string& file);
+};
+
+//=============================================================================
+// ForceScript::Load
+//=============================================================================
+
+/* Read three numbers into a vector.
+ */
+static bool read_vec3(std::istream& in, dlib::vec3& v)
+{
+    real r[3];
+    in >> r[0] >> r[1] >> r[2];
+    v = dlib::vec3(r);
+    return !in.fail();
+}
+
+bool BatchRunner::ForceScript::Load(const std::string& file)
+{
+    std::ifstream in(file.c_str());
+    if (!in.is_open())
+    {
+        cerr << "Failed to open force script " << file << endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line))
+    {
+        ++line_no;
+
+        std::stringstream ss(line);
+        std::string type;
+        if (!(ss >> type) || type[0] == '#')
+        {
+            continue;
+        }
+
+        bool valid = false;
+        if (type == "gravity")
+        {
+            valid = read_vec3(ss, gravity);
+        }
+        else if (type == "force")
+        {
+            Window window;
+            ss >> window.start >> window.end;
+            valid = read_vec3(ss, window.force);
+            windows.push_back(window);
+        }
+
+        if (!valid)
+        {
+            cerr << file << ": bad line:" << line_no << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//=============================================================================
+// BatchWorker
+//=============================================================================
+
+/* Keeps running cases until there are none left.
+ */
+class BatchWorker : public Thread
+{
+public:
+    BatchWorker(BatchRunner& runner) :
+        m_runner(runner)
+    { }
+
+protected:
+    void Run()
+    {
+        while (m_runner.run_next())
+        { }
+    }
+
+private:
+    BatchRunner& m_runner;
+};
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+BatchRunner::BatchRunner() :
+    m_next_case(0)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+BatchRunner::~BatchRunner()
+{
+    std::map<std::string, Asset*>::iterator asset;
+    for (asset = m_assets.begin(); asset != m_assets.end(); ++asset)
+    {
+        delete asset->second;
+    }
+
+    std::map<std::string, ForceScript*>::iterator script;
+    for (script = m_scripts.begin(); script != m_scripts.end(); ++script)
+    {
+        delete script->second;
+    }
+}
+
+//=============================================================================
+// LoadSweep
+//=============================================================================
+
+/* Parse every value in a list of strings as a number.
+ */
+static bool to_reals(const std::vector<std::string>& strings, std::vector<real>& values)
+{
+    values.clear();
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        std::stringstream ss(strings[i]);
+        real value;
+        if (!(ss >> value))
+        {
+            return false;
+        }
+        values.push_back(value);
+    }
+
+    return true;
+}
+
+bool BatchRunner::LoadSweep(const std::string& file)
+{
+    std::ifstream in(file.c_str());
+    if (!in.is_open())
+    {
+        cerr << "Failed to open sweep file " << file << endl;
+        return false;
+    }
+
+    // The values for each parameter, as written in the file
+    std::map<std::string, std::vector<std::string> > params;
+    params["engine"].push_back("psystem");
+    params["copies"].push_back("1");
+    params["cell"].push_back("0.25");
+    params["region"].push_back("1");
+    params["ranks"].push_back("2");
+    params["forces"].push_back("none");
+    params["alpha"].push_back("0.4");
+    params["beta"].push_back("0.7");
+    params["dt"].push_back("0.0083333");
+    params["duration"].push_back("5");
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line))
+    {
+        ++line_no;
+
+        std::stringstream ss(line);
+        std::string key;
+        if (!(ss >> key) || key[0] == '#')
+        {
+            continue;
+        }
+
+        if (key != "mesh" && params.find(key) == params.end())
+        {
+            cerr << file << ": unknown parameter " << key << ":" << line_no << endl;
+            return false;
+        }
+
+        std::vector<std::string> values;
+        std::string value;
+        while (ss >> value)
+        {
+            values.push_back(value);
+        }
+
+        if (values.empty())
+        {
+            cerr << file << ": no values:" << line_no << endl;
+            return false;
+        }
+
+        params[key] = values;
+    }
+
+    if (params["mesh"].empty())
+    {
+        cerr << file << ": no mesh given" << endl;
+        return false;
+    }
+
+    std::vector<real> copies, cells, regions, ranks, alphas, betas, dts, durations;
+    if (!to_reals(params["copies"], copies) ||
+        !to_reals(params["cell"], cells) || !to_reals(params["region"], regions) ||
+        !to_reals(params["ranks"], ranks) ||
+        !to_reals(params["alpha"], alphas) || !to_reals(params["beta"], betas) ||
+        !to_reals(params["dt"], dts) || !to_reals(params["duration"], durations))
+    {
+        cerr << file << ": bad number" << endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < copies.size(); ++i)
+    {
+        if (copies[i] < 1 || copies[i] != std::floor(copies[i]))
+        {
+            cerr << file << ": copies must be a whole number of bodies" << endl;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        if (cells[i] <= 0)
+        {
+            cerr << file << ": cell must be larger than 0" << endl;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < regions.size(); ++i)
+    {
+        if (regions[i] < 1 || regions[i] != std::floor(regions[i]))
+        {
+            cerr << file << ": region must be a whole number of cells" << endl;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < ranks.size(); ++i)
+    {
+        if (ranks[i] < 1 || ranks[i] != std::floor(ranks[i]))
+        {
+            cerr << file << ": ranks must be a whole number of parts" << endl;
+            return false;
+        }
+    }
+
+    const std::vector<std::string>& engines = params["engine"];
+    for (size_t i = 0; i < engines.size(); ++i)
+    {
+        if (engines[i] != "psystem" && engines[i] != "debris" && engines[i] != "lattice" &&
+            engines[i] != "distributed")
+        {
+            cerr << file << ": unknown engine " << engines[i] << endl;
+            return false;
+        }
+    }
+
+    // Every combination, cases for the same mesh end up next to each other.
+    // The lattice parameters are only swept for lattice cases, the ranks
+    // for distributed cases, which have a single copy.
+    const std::vector<std::string>& meshes = params["mesh"];
+    const std::vector<std::string>& forces = params["forces"];
+    for (size_t m = 0; m < meshes.size(); ++m)
+    for (size_t e = 0; e < engines.size(); ++e)
+    for (size_t l = 0; l < (engines[e] == "lattice" ? cells.size() : 1); ++l)
+    for (size_t r = 0; r < (engines[e] == "lattice" ? regions.size() : 1); ++r)
+    for (size_t p = 0; p < (engines[e] == "distributed" ? ranks.size() : 1); ++p)
+    for (size_t c = 0; c < (engines[e] == "distributed" ? 1 : copies.size()); ++c)
+    for (size_t f = 0; f < forces.size(); ++f)
+    for (size_t a = 0; a < alphas.size(); ++a)
+    for (size_t b = 0; b < betas.size(); ++b)
+    for (size_t t = 0; t < dts.size(); ++t)
+    for (size_t d = 0; d < durations.size(); ++d)
+    {
+        BatchCase batch_case;
+        batch_case.mesh = meshes[m];
+        batch_case.engine = engines[e];
+        batch_case.copies = engines[e] == "distributed" ? 1 : static_cast<int>(copies[c]);
+        batch_case.cell_size = cells[l];
+        batch_case.region_width = static_cast<int>(regions[r]);
+        batch_case.ranks = static_cast<int>(ranks[p]);
+        batch_case.forces = forces[f] == "none" ? "" : forces[f];
+        batch_case.alpha = alphas[a];
+        batch_case.beta = betas[b];
+        batch_case.dt = dts[t];
+        batch_case.duration = durations[d];
+        AddCase(batch_case);
+    }
+
+    return true;
+}
+
+//=============================================================================
+// AddCase
+//=============================================================================
+
+void BatchRunner::AddCase(const BatchCase& batch_case)
+{
+    assert(batch_case.dt > 0);
+    assert(batch_case.copies >= 1);
+    assert(batch_case.ranks >= 1);
+
+    m_cases.push_back(batch_case);
+}
+
+//=============================================================================
+// load_assets
+//=============================================================================
+
+bool BatchRunner::load_assets()
+{
+    for (size_t i = 0; i < m_cases.size(); ++i)
+    {
+        const BatchCase& batch_case = m_cases[i];
+        if (m_assets.find(batch_case.mesh) == m_assets.end())
+        {
+            Asset* asset = new Asset();
+            m_assets[batch_case.mesh] = asset;
+
+            // No OpenGL context, so the mesh is never finished
+            ObjLoader obj;
+            if (!obj.LoadFile(batch_case.mesh) ||
+                !obj.ToMesh(asset->mesh, Mesh::VERTICES, false))
+            {
+                cerr << "Failed to load OBJ file " << batch_case.mesh << endl;
+                return false;
+            }
+
+            real* data = asset->mesh.GetData();
+            for (size_t j = 1; j < asset->mesh.GetDataSize(); j += 3)
+            {
+                data[j] += DROP_HEIGHT;
+            }
+            asset->shape = new ShapeTemplate(asset->mesh);
+        }
+
+        if (!batch_case.forces.empty() &&
+            m_scripts.find(batch_case.forces) == m_scripts.end())
+        {
+            ForceScript* script = new ForceScript();
+            m_scripts[batch_case.forces] = script;
+
+            if (!script->Load(batch_case.forces))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+//=============================================================================
+// Run
+//=============================================================================
+
+bool BatchRunner::Run(int num_threads)
+{
+    assert(num_threads >= 1);
+
+    if (!load_assets())
+    {
+        return false;
+    }
+
+    // Cases from an earlier Run() are kept
+    m_next_case = m_results.size();
+    if (m_next_case == m_cases.size())
+    {
+        return true;
+    }
+
+    BatchResult empty;
+    empty.finished = false;
+    m_results.resize(m_cases.size(), empty);
+
+    // The calling thread runs cases too, and there is no point in having
+    // more threads than cases
+    const size_t remaining = m_cases.size() - m_next_case;
+    const size_t num_workers = std::min<size_t>(num_threads, remaining) - 1;
+
+    std::vector<BatchWorker*> workers;
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        BatchWorker* worker = new BatchWorker(*this);
+        if (!worker->Start())
+        {
+            cerr << "Failed to start a batch worker" << endl;
+            delete worker;
+            break;
+        }
+        workers.push_back(worker);
+    }
+
+    // Also makes sure everything runs if no worker could be started
+    while (run_next())
+    { }
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->Join();
+        delete workers[i];
+    }
+
+    return true;
+}
+
+//=============================================================================
+// run_next
+//=============================================================================
+
+bool BatchRunner::run_next()
+{
+    const size_t index = atomic::fetch_add(&m_next_case, 1u);
+    if (index >= m_cases.size())
+    {
+        return false;
+    }
+
+    run_case(index);
+    return true;
+}
+
+//=============================================================================
+// run_case
+//=============================================================================
+
+/* Volume enclosed by a triangle mesh, using the divergence theorem.
+ *
+ * Params:
+ *   positions - Particle positions
+ *   triangles - Three particle indices per triangle
+ */
+static real enclosed_volume(const dlib::vec3* positions,
+                            const std::vector<int>& triangles)
+{
+    real volume = 0;
+    for (size_t i = 0; i < triangles.size(); i += 3)
+    {
+        const dlib::vec3& p1 = positions[triangles[i+0]];
+        const dlib::vec3& p2 = positions[triangles[i+1]];
+        const dlib::vec3& p3 = positions[triangles[i+2]];
+        volume += dlib::dot(p1, dlib::cross(p2, p3));
+    }
+
+    return volume / 6;
+}
+
+/* False for NaN and infinity.
+ */
+static bool is_finite(real x)
+{
+    return x == x && std::fabs(x) <= std::numeric_limits<real>::max();
+}
+
+void BatchRunner::run_case(size_t index)
+{
+    const BatchCase& batch_case = m_cases[index];
+    BatchResult& result = m_results[index];
+    Asset& asset = *m_assets[batch_case.mesh];
+    const ForceScript default_script;
+    const ForceScript& script = batch_case.forces.empty() ?
+        default_script : *m_scripts[batch_case.forces];
+
+    result.steps = 0;
+    result.exploded = false;
+    result.final_volume_drift = 0;
+    result.max_volume_drift = 0;
+    result.max_deformation = 0;
+    result.inversions = 0;
+    result.part_error = 0;
+    result.steps_per_second = 0;
+
+    if (batch_case.engine == "debris")
+    {
+        run_debris(batch_case, asset, script, result);
+    }
+    else if (batch_case.engine == "lattice")
+    {
+        run_lattice(batch_case, asset, script, result);
+    }
+    else if (batch_case.engine == "distributed")
+    {
+        run_distributed(batch_case, asset, script, result);
+    }
+    else
+    {
+        run_psystem(batch_case, asset, script, result);
+    }
+
+    result.body_step_us = result.steps_per_second > 0 ?
+        1e6 / (result.steps_per_second * batch_case.copies) : 0;
+    result.finished = true;
+}
+
+//=============================================================================
+// run_psystem
+//=============================================================================
+
+void BatchRunner::run_psystem(const BatchCase& batch_case, Asset& asset,
+                              const ForceScript& script, BatchResult& result)
+{
+    std::vector<PSystem*> bodies(batch_case.copies);
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        bodies[i] = new PSystem(asset.mesh, asset.shape);
+        bodies[i]->SetAlpha(batch_case.alpha);
+        bodies[i]->SetBeta(batch_case.beta);
+        bodies[i]->SetAlphaReferenceDt(ALPHA_REFERENCE_DT);
+    }
+    PSystem& psys = *bodies[0];
+
+    // Turn the mesh triangles into particle triangles for the volume
+    std::vector<int> triangles(asset.mesh.GetDataSize() / 3);
+    const std::vector<std::vector<int> >& mesh_indices = psys.GetMeshIndices();
+    for (size_t i = 0; i < mesh_indices.size(); ++i)
+    {
+        for (size_t j = 0; j < mesh_indices[i].size(); ++j)
+        {
+            triangles[mesh_indices[i][j]] = i;
+        }
+    }
+
+    const real rest_volume = enclosed_volume(psys.GetPositions(), triangles);
+    const real rest_radius = psys.GetRestRadius();
+    const unsigned long steps =
+        static_cast<unsigned long>(std::ceil(batch_case.duration / batch_case.dt));
+
+    result.particles = psys.GetNumParticles();
+
+    // Only the simulation itself is timed, not the measurements
+    double sim_time = 0;
+    bool was_inverted = false;
+    for (unsigned long step = 0; step < steps; ++step)
+    {
+        const dlib::vec3 force = script.GetForce(step * batch_case.dt);
+
+        const double start = get_time();
+        for (size_t i = 0; i < bodies.size(); ++i)
+        {
+            check_for_collisions(*bodies[i]);
+            bodies[i]->Update(batch_case.dt, force);
+            check_for_collisions(*bodies[i]);
+        }
+        sim_time += get_time() - start;
+
+        ++result.steps;
+
+        const dlib::vec3 com = psys.GetCOM();
+        if (!is_finite(com(0)) || !is_finite(com(1)) || !is_finite(com(2)))
+        {
+            result.exploded = true;
+            break;
+        }
+
+        if (psys.IsInverted() && !was_inverted)
+        {
+            ++result.inversions;
+        }
+        was_inverted = psys.IsInverted();
+
+        result.max_deformation = std::max(result.max_deformation,
+                                          psys.GetMaxGoalDeviation() / rest_radius);
+
+        const real volume = enclosed_volume(psys.GetPositions(), triangles);
+        result.final_volume_drift = (volume - rest_volume) / rest_volume;
+        result.max_volume_drift = std::max(result.max_volume_drift,
+                                           std::fabs(result.final_volume_drift));
+    }
+
+    result.steps_per_second = sim_time > 0 ? result.steps / sim_time : 0;
+
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        delete bodies[i];
+    }
+}
+
+//=============================================================================
+// run_debris
+//=============================================================================
+
+void BatchRunner::run_debris(const BatchCase& batch_case, Asset& asset,
+                             const ForceScript& script, BatchResult& result)
+{
+    // The particles of a PSystem of the mesh, in its rest shape
+    PSystem rest(asset.mesh, asset.shape);
+    const dlib::vec3* positions = rest.GetPositions();
+
+    SmallBodyBatch debris;
+    debris.SetAlpha(batch_case.alpha);
+    debris.SetBeta(batch_case.beta);
+    debris.SetAlphaReferenceDt(ALPHA_REFERENCE_DT);
+    for (int i = 0; i < batch_case.copies; ++i)
+    {
+        debris.AddBody(positions, rest.GetNumParticles());
+    }
+
+    const unsigned long steps =
+        static_cast<unsigned long>(std::ceil(batch_case.duration / batch_case.dt));
+
+    result.particles = rest.GetNumParticles();
+
+    double sim_time = 0;
+    for (unsigned long step = 0; step < steps; ++step)
+    {
+        const dlib::vec3 force = script.GetForce(step * batch_case.dt);
+
+        const double start = get_time();
+        debris.Update(batch_case.dt, force);
+        check_for_collisions(debris);
+        sim_time += get_time() - start;
+
+        ++result.steps;
+
+        const dlib::vec3 com = debris.GetCOM(0);
+        if (!is_finite(com(0)) || !is_finite(com(1)) || !is_finite(com(2)))
+        {
+            result.exploded = true;
+            break;
+        }
+    }
+
+    result.steps_per_second = sim_time > 0 ? result.steps / sim_time : 0;
+}
+
+//=============================================================================
+// run_lattice
+//=============================================================================
+
+void BatchRunner::run_lattice(const BatchCase& batch_case, Asset& asset,
+                              const ForceScript& script, BatchResult& result)
+{
+    // The vertices are embedded but never moved, EndUpdate() isn't called
+    // on the shared mesh
+    std::vector<LatticeSystem*> bodies(batch_case.copies);
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        bodies[i] = new LatticeSystem(asset.mesh, batch_case.cell_size,
+                                      batch_case.region_width);
+        bodies[i]->SetAlpha(batch_case.alpha);
+        bodies[i]->SetBeta(batch_case.beta);
+        bodies[i]->SetAlphaReferenceDt(ALPHA_REFERENCE_DT);
+    }
+    LatticeSystem& lattice = *bodies[0];
+
+    // Deformations are relative to the size of the whole body, the same
+    // as for a PSystem
+    const real rest_radius = PSystem(asset.mesh, asset.shape).GetRestRadius();
+    const unsigned long steps =
+        static_cast<unsigned long>(std::ceil(batch_case.duration / batch_case.dt));
+
+    result.particles = lattice.GetNumParticles();
+
+    double sim_time = 0;
+    for (unsigned long step = 0; step < steps; ++step)
+    {
+        const dlib::vec3 force = script.GetForce(step * batch_case.dt);
+
+        const double start = get_time();
+        for (size_t i = 0; i < bodies.size(); ++i)
+        {
+            check_for_collisions(*bodies[i]);
+            bodies[i]->Update(batch_case.dt, force);
+            check_for_collisions(*bodies[i]);
+        }
+        sim_time += get_time() - start;
+
+        ++result.steps;
+
+        const dlib::vec3& pos = lattice.GetPositions()[0];
+        if (!is_finite(pos(0)) || !is_finite(pos(1)) || !is_finite(pos(2)))
+        {
+            result.exploded = true;
+            break;
+        }
+
+        result.max_deformation = std::max(result.max_deformation,
+                                          lattice.GetMaxGoalDeviation() / rest_radius);
+    }
+
+    result.steps_per_second = sim_time > 0 ? result.steps / sim_time : 0;
+
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        delete bodies[i];
+    }
+}
+
+//=============================================================================
+// run_distributed
+//=============================================================================
+
+/* Runs one rank of a distributed case other than rank 0, see
+ * BatchRunner::run_part().
+ */
+class PartWorker : public Thread
+{
+public:
+    PartWorker(BatchRunner& runner, const BatchCase& batch_case,
+               const BatchRunner::ForceScript& script, const std::vector<dlib::vec3>& rest,
+               PSystem& reference, int rank, const std::string& path, BatchResult& result) :
+        m_runner(runner),
+        m_case(batch_case),
+        m_script(script),
+        m_rest(rest),
+        m_reference(reference),
+        m_rank(rank),
+        m_path(path),
+        m_result(result)
+    { }
+
+protected:
+    void Run()
+    {
+        // Rank 0 notices a failure too, the transport breaks
+        m_runner.run_part(m_case, m_script, m_rest, m_reference, m_rank, m_path, m_result);
+    }
+
+private:
+    BatchRunner& m_runner;
+    const BatchCase& m_case;
+    const BatchRunner::ForceScript& m_script;
+    const std::vector<dlib::vec3>& m_rest;
+    PSystem& m_reference;
+    int m_rank;
+    std::string m_path;
+    BatchResult& m_result;
+};
+
+void BatchRunner::run_distributed(const BatchCase& batch_case, Asset& asset,
+                                  const ForceScript& script, BatchResult& result)
+{
+    // The whole body in one piece, stepped by rank 0 for the others to
+    // compare with
+    PSystem reference(asset.mesh, asset.shape);
+    reference.SetAlpha(batch_case.alpha);
+    reference.SetBeta(batch_case.beta);
+    reference.SetAlphaReferenceDt(ALPHA_REFERENCE_DT);
+    reference.SetAutoSleep(SLEEP_ENERGY, SLEEP_DEVIATION, SLEEP_STEPS);
+
+    const std::vector<dlib::vec3> rest(reference.GetPositions(),
+                                       reference.GetPositions() + reference.GetNumParticles());
+    result.particles = rest.size();
+
+    const int num_ranks = batch_case.ranks;
+    if (rest.size() / num_ranks < ShapeTemplate::MIN_PARTICLES)
+    {
+        cerr << batch_case.mesh << ": too few particles for " << num_ranks << " ranks" << endl;
+        return;
+    }
+
+    // Cases run at the same time, each needs its own socket
+    std::stringstream path;
+    path << "/tmp/batch-" << getpid() << "-" << (&result - &m_results[0]) << ".sock";
+
+    std::vector<BatchResult> parts(num_ranks, result);
+    std::vector<PartWorker*> workers;
+    for (int rank = 1; rank < num_ranks; ++rank)
+    {
+        PartWorker* worker = new PartWorker(*this, batch_case, script, rest, reference,
+                                            rank, path.str(), parts[rank]);
+        if (!worker->Start())
+        {
+            cerr << "Failed to start a rank" << endl;
+            delete worker;
+            break;
+        }
+        workers.push_back(worker);
+    }
+
+    // The ranks that did start give up connecting if one is missing
+    const bool finished = static_cast<int>(workers.size()) == num_ranks - 1 &&
+        run_part(batch_case, script, rest, reference, 0, path.str(), parts[0]);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->Join();
+        delete workers[i];
+    }
+
+    if (!finished)
+    {
+        cerr << batch_case.mesh << ": the ranks of a distributed case lost their connection"
+             << endl;
+    }
+
+    result.steps = parts[0].steps;
+    result.steps_per_second = parts[0].steps_per_second;
+    for (int rank = 0; rank < num_ranks; ++rank)
+    {
+        result.exploded = result.exploded || parts[rank].exploded;
+        result.part_error = std::max(result.part_error, parts[rank].part_error);
+    }
+}
+
+//=============================================================================
+// run_part
+//=============================================================================
+
+bool BatchRunner::run_part(const BatchCase& batch_case, const ForceScript& script,
+                           const std::vector<dlib::vec3>& rest, PSystem& reference,
+                           int rank, const std::string& path, BatchResult& result)
+{
+    const int num_ranks = batch_case.ranks;
+
+    // Every num_ranks-th particle of the body, starting at the rank
+    std::vector<dlib::vec3> positions;
+    for (size_t i = rank; i < rest.size(); i += num_ranks)
+    {
+        positions.push_back(rest[i]);
+    }
+    std::vector<dlib::vec3> velocities(positions.size());
+
+    ShapeTemplate* shape = new ShapeTemplate(&positions[0](0), positions.size());
+    PSystem part(shape, ParticleArray(&positions[0]), ParticleArray(&velocities[0]));
+    shape->Release();
+    part.SetAlpha(batch_case.alpha);
+    part.SetBeta(batch_case.beta);
+    part.SetAlphaReferenceDt(ALPHA_REFERENCE_DT);
+    part.SetAutoSleep(SLEEP_ENERGY, SLEEP_DEVIATION, SLEEP_STEPS);
+
+    // Read before rank 0 can start stepping the reference
+    const real rest_radius = reference.GetRestRadius();
+
+    SocketTransport transport;
+    if (!transport.Connect(path.c_str(), rank, num_ranks) || !part.JoinParts(transport))
+    {
+        return false;
+    }
+
+    const unsigned long steps =
+        static_cast<unsigned long>(std::ceil(batch_case.duration / batch_case.dt));
+
+    double sim_time = 0;
+    for (unsigned long step = 0; step < steps; ++step)
+    {
+        const dlib::vec3 force = script.GetForce(step * batch_case.dt);
+
+        // The other ranks only read the reference once the step below
+        // connected them with rank 0, and until the comparison is done
+        if (rank == 0)
+        {
+            check_for_collisions(reference);
+            reference.Update(batch_case.dt, force);
+            check_for_collisions(reference);
+        }
+
+        const double start = get_time();
+        check_for_collisions(part);
+        if (!part.UpdatePart(batch_case.dt, force))
+        {
+            return false;
+        }
+        check_for_collisions(part);
+        sim_time += get_time() - start;
+
+        ++result.steps;
+
+        const dlib::vec3* reference_pos = reference.GetPositions();
+        double error = 0;
+        for (size_t i = 0; i < positions.size(); ++i)
+        {
+            const real distance = dlib::length(positions[i] - reference_pos[rank + i*num_ranks]);
+            error = is_finite(distance) ? std::max<double>(error, distance) :
+                std::numeric_limits<double>::infinity();
+        }
+
+        // Every rank gets the largest, so they all stop together
+        if (!transport.Max(&error, 1))
+        {
+            return false;
+        }
+        if (error == std::numeric_limits<double>::infinity())
+        {
+            result.exploded = true;
+            break;
+        }
+        result.part_error = std::max<real>(result.part_error, error / rest_radius);
+    }
+
+    result.steps_per_second = sim_time > 0 ? result.steps / sim_time : 0;
+    return true;
+}
+
+//=============================================================================
+// WriteResults
+//=============================================================================
+
+void BatchRunner::WriteResults(std::ostream& out) const
+{
+    out << "mesh,engine,copies,cell,region,ranks,forces,alpha,beta,dt,duration,particles,steps,"
+        << "exploded,final_volume_drift,max_volume_drift,max_deformation,inversions,part_error,"
+        << "steps_per_second,body_step_us\n";
+
+    for (size_t i = 0; i < m_results.size(); ++i)
+    {
+        const BatchCase& c = m_cases[i];
+        const BatchResult& r = m_results[i];
+        if (!r.finished)
+        {
+            continue;
+        }
+
+        out << c.mesh << ","
+            << c.engine << ","
+            << c.copies << ","
+            << c.cell_size << ","
+            << c.region_width << ","
+            << c.ranks << ","
+            << (c.forces.empty() ? "none" : c.forces) << ","
+            << c.alpha << ","
+            << c.beta << ","
+            << c.dt << ","
+            << c.duration << ","
+            << r.particles << ","
+            << r.steps << ","
+            << (r.exploded ? 1 : 0) << ","
+            << r.final_volume_drift << ","
+            << r.max_volume_drift << ","
+            << r.max_deformation << ","
+            << r.inversions << ","
+            << r.part_error << ","
+            << r.steps_per_second << ","
+            << r.body_step_us << "\n";
+    }
+}
+
+//=============================================================================
+//
+//=============================================================================
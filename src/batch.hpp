@@ -0,0 +1,222 @@
+#ifndef __BATCH_HPP__
+#define __BATCH_HPP__
+
+#include "defs.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+class PSystem;
+
+/* One simulation run of a parameter sweep, a body is dropped onto the
+ * ground and simulated without a window.
+ */
+struct BatchCase
+{
+    std::string mesh; // OBJ file of the body
+    std::string engine; // "psystem", "debris", "lattice" or "distributed", see BatchRunner
+    int copies; // Number of bodies dropped at once, all the same
+    real cell_size; // See LatticeSystem::LatticeSystem(), lattice only
+    int region_width; // See LatticeSystem::SetRegionWidth(), lattice only
+    int ranks; // Parts the body is split into, distributed only
+    std::string forces; // Force script (see BatchRunner), empty for gravity
+    real alpha; // See PSystem::SetAlpha()
+    real beta; // See PSystem::SetBeta()
+    real dt; // Time step in seconds
+    real duration; // Simulated seconds
+};
+
+/* What was measured during a BatchCase.
+ */
+struct BatchResult
+{
+    bool finished; // False if the case never ran
+    bool exploded; // The positions became NaN or infinite, run was stopped
+    size_t particles; // Number of particles in the body
+    unsigned long steps; // Steps taken
+    real final_volume_drift; // (V - V_rest) / V_rest at the end of the run
+    real max_volume_drift; // Largest |V - V_rest| / V_rest during the run
+    real max_deformation; // Largest goal distance divided by rest radius
+    unsigned long inversions; // Times the body turned inside out
+    real part_error; // Largest distance from the unsplit body over rest radius
+    double steps_per_second; // Wall clock speed of the simulation steps
+    double body_step_us; // Microseconds per step of a single body
+};
+
+/* Runs many headless simulations in parallel, for tuning materials without
+ * pressing keys one run at a time.
+ *
+ * A sweep file lists the values to try for each parameter, every
+ * combination of them becomes one case:
+ *
+ *   # Lines starting with # are comments
+ *   mesh sphere.obj cube.obj
+ *   forces none push.forces
+ *   alpha 0.2 0.4 0.6
+ *   beta 0.5 0.7
+ *   dt 0.008333
+ *   duration 5
+ *
+ * Only mesh is required. Each OBJ file is loaded once and its mesh and rest
+ * shape are shared read-only by all the cases using it.
+ *
+ * The engine steps the bodies with a PSystem each by default, "debris"
+ * steps all the copies together in a SmallBodyBatch instead. Comparing
+ * the two with many copies measures what batching saves per body:
+ *
+ *   mesh cube.obj
+ *   engine psystem debris
+ *   copies 256
+ *
+ * "lattice" steps each body with a LatticeSystem, for the voxel sizes in
+ * cell (0.25 by default) and region widths in region (1 by default).
+ * Those two are only swept for lattice cases:
+ *
+ *   engine psystem lattice
+ *   cell 0.25 0.5
+ *   region 1 2 3
+ *
+ * "distributed" splits the body into parts, each every ranks-th particle
+ * (2 by default, only swept for distributed cases). The parts are stepped
+ * together with PSystem::UpdatePart() over a SocketTransport, one thread
+ * per rank, next to a single PSystem of the whole body. part_error is the
+ * largest distance between the same particle in the two, relative to the
+ * rest radius. It stays around 1e-10 when real is double, with float the
+ * sums are added up in a different order and the two drift apart slowly:
+ *
+ *   engine distributed
+ *   ranks 2 3 4
+ *
+ * The bodies of distributed cases fall asleep at rest like in the
+ * interactive mode, so the parts have to agree on that too. The timing is
+ * of rank 0 and only one copy is run.
+ *
+ * The volume, deformation and inversions are measured on the first copy.
+ * Only psystem cases measure all of them, lattice cases only the
+ * deformation and the others none.
+ *
+ * A force script sets the acceleration on every particle over time, "none"
+ * means only gravity:
+ *
+ *   # Replaces the default of 0 -9.8 0
+ *   gravity 0 -9.8 0
+ *   # Add 20 0 0 from 1.0 to 1.5 seconds
+ *   force 1.0 1.5 20 0 0
+ *
+ *   BatchRunner runner;
+ *   runner.LoadSweep("sweep.txt");
+ *   runner.Run(get_num_cpus());
+ *   runner.WriteResults(std::cout);
+ */
+class BatchRunner
+{
+public:
+    BatchRunner();
+
+    ~BatchRunner();
+
+    /* Add every combination of the values in a sweep file.
+     *
+     * Returns:
+     *   True if the file could be read and is well formed.
+     */
+    bool LoadSweep(const std::string& file);
+
+    /* Add a single case.
+     */
+    void AddCase(const BatchCase& batch_case);
+
+    /* Run all cases that haven't been run yet, blocks until they are done.
+     *
+     * Params:
+     *   num_threads - Number of cases simulated at the same time
+     *
+     * Returns:
+     *   False if a mesh or force script couldn't be loaded, nothing is run
+     *   in that case.
+     */
+    bool Run(int num_threads);
+
+    /* Write one CSV line per case, with a header.
+     */
+    void WriteResults(std::ostream& out) const;
+
+    size_t GetNumCases() const
+    {
+        return m_cases.size();
+    }
+
+    const BatchCase& GetCase(size_t i) const
+    {
+        return m_cases[i];
+    }
+
+    const BatchResult& GetResult(size_t i) const
+    {
+        return m_results[i];
+    }
+
+private:
+    friend class BatchWorker;
+    friend class PartWorker;
+
+    struct Asset;
+    struct ForceScript;
+
+    /* Simulate the next case that hasn't been claimed yet, called by the
+     * worker threads.
+     *
+     * Returns:
+     *   False when there are no cases left.
+     */
+    bool run_next();
+
+    /* Load every mesh and force script used by the cases, once each.
+     */
+    bool load_assets();
+
+    /* Simulate a single case.
+     */
+    void run_case(size_t index);
+
+    /* The stepping and measuring of run_case() for each engine.
+     */
+    void run_psystem(const BatchCase& batch_case, Asset& asset,
+                     const ForceScript& script, BatchResult& result);
+    void run_debris(const BatchCase& batch_case, Asset& asset,
+                    const ForceScript& script, BatchResult& result);
+    void run_lattice(const BatchCase& batch_case, Asset& asset,
+                     const ForceScript& script, BatchResult& result);
+    void run_distributed(const BatchCase& batch_case, Asset& asset,
+                         const ForceScript& script, BatchResult& result);
+
+    /* Step one rank of a distributed case, called by every rank at once.
+     * Rank 0 also steps the reference body, the others only read it.
+     *
+     * Params:
+     *   rest - The particles of the reference body at rest
+     *   path - Socket of the SocketTransport connecting the ranks
+     *   result - Gets the steps, timing and part_error of this rank
+     *
+     * Returns:
+     *   False if the transport failed, the case is unfinished then.
+     */
+    bool run_part(const BatchCase& batch_case, const ForceScript& script,
+                  const std::vector<dlib::vec3>& rest, PSystem& reference,
+                  int rank, const std::string& path, BatchResult& result);
+
+    // Not copyable
+    BatchRunner(const BatchRunner&);
+    BatchRunner& operator=(const BatchRunner&);
+
+private:
+    std::vector<BatchCase> m_cases; // Everything to run
+    std::vector<BatchResult> m_results; // One per case, filled in by Run()
+    std::map<std::string, Asset*> m_assets; // Loaded meshes by file name
+    std::map<std::string, ForceScript*> m_scripts; // Loaded scripts by file
+    unsigned int m_next_case; // Next case for a worker to claim
+};
+
+#endif
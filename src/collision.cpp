@@ -0,0 +1,88 @@
+#include "collision.hpp"
+
+//=============================================================================
+// contain
+//=============================================================================
+
+/* Keep particles contained inside the box, see check_for_collisions().
+ */
+static void contain(const ParticleArray& particles, const ParticleArray& velocities,
+                    size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        dlib::vec3& pos(particles[i]);
+        dlib::vec3& vel(velocities[i]);
+        static real zero[3] = { 0, 0, 0 };
+        if (pos(0) < -20) 
+        { 
+            real r[3] = { -20, pos(1), pos(2) };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+        else if (pos(0) > 20)
+        {
+            real r[3] = { 20, pos(1), pos(2) };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+
+        if (pos(1) < 0) 
+        { 
+            real r[3] = { pos(0), 0, pos(2) };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+        else if (pos(1) > 20)
+        {
+            real r[3] = { pos(0), 20, pos(2) };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+
+        if (pos(2) < -20) 
+        { 
+            real r[3] = { pos(0), pos(1), -20 };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+        else if (pos(2) > 20)
+        {
+            real r[3] = { pos(0), pos(1), 20 };
+            vel = dlib::vec3(zero);
+            pos = dlib::vec3(r);
+        }
+    }
+}
+
+//=============================================================================
+// check_for_collisions
+//=============================================================================
+
+void check_for_collisions(PSystem& psys)
+{
+    check_for_collisions(psys, 0, psys.GetNumParticles());
+}
+
+void check_for_collisions(PSystem& psys, size_t begin, size_t end)
+{
+    contain(psys.GetPositionArray(), psys.GetVelocityArray(), begin, end);
+}
+
+void check_for_collisions(LatticeSystem& lattice)
+{
+    contain(ParticleArray(lattice.GetPositions()), ParticleArray(lattice.GetVelocities()),
+            0, lattice.GetNumParticles());
+}
+
+void check_for_collisions(SmallBodyBatch& batch)
+{
+    dlib::vec3 lower, upper;
+    lower = -20, 0, -20;
+    upper = 20, 20, 20;
+    batch.Contain(lower, upper);
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,27 @@
+#ifndef __COLLISION_HPP__
+#define __COLLISION_HPP__
+
+#include "psystem.hpp"
+#include "smallbody.hpp"
+#include "lattice.hpp"
+
+/* Keep the particle system contained inside the 40x20x40 box standing on
+ * the ground plane. Particles outside of it are moved back to the closest
+ * wall and stopped.
+ */
+void check_for_collisions(PSystem& psys);
+
+/* The same for the particles from begin up to end only, for bodies whose
+ * steps are split into ranges, see ParallelStep.
+ */
+void check_for_collisions(PSystem& psys, size_t begin, size_t end);
+
+/* The same box for every body of a batch.
+ */
+void check_for_collisions(SmallBodyBatch& batch);
+
+/* The same box for the particles of a lattice.
+ */
+void check_for_collisions(LatticeSystem& lattice);
+
+#endif
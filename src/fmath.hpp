@@ -0,0 +1,513 @@
+#ifndef __FMATH_HPP__
+#define __FMATH_HPP__
+
+#include "defs.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+/* Small fixed size vectors and matrices for the per step math in PSystem.
+ * dlib's matrices are general expression templates, which is great for
+ * one time setup but every det(), inv() and temporary in the step goes
+ * through a lot of generic machinery. These are plain arrays of reals
+ * with the loops written out for the few sizes the paper needs, so the
+ * compiler can keep everything in registers.
+ *
+ * Element access uses operator() like dlib. Default constructors leave the
+ * elements uninitialized, use zero() or identity() where needed.
+ */
+namespace fmath
+{
+    /* 3 element column vector.
+     */
+    struct vec3
+    {
+        real v[3];
+
+        vec3() { }
+
+        vec3(real x, real y, real z)
+        {
+            v[0] = x; v[1] = y; v[2] = z;
+        }
+
+        real& operator()(int i) { return v[i]; }
+        real operator()(int i) const { return v[i]; }
+
+        vec3& operator+=(const vec3& o)
+        {
+            v[0] += o.v[0]; v[1] += o.v[1]; v[2] += o.v[2];
+            return *this;
+        }
+
+        vec3& operator-=(const vec3& o)
+        {
+            v[0] -= o.v[0]; v[1] -= o.v[1]; v[2] -= o.v[2];
+            return *this;
+        }
+
+        vec3& operator*=(real s)
+        {
+            v[0] *= s; v[1] *= s; v[2] *= s;
+            return *this;
+        }
+    };
+
+    inline vec3 operator+(const vec3& a, const vec3& b)
+    {
+        return vec3(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2]);
+    }
+
+    inline vec3 operator-(const vec3& a, const vec3& b)
+    {
+        return vec3(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2]);
+    }
+
+    inline vec3 operator*(const vec3& a, real s)
+    {
+        return vec3(a.v[0] * s, a.v[1] * s, a.v[2] * s);
+    }
+
+    inline vec3 operator*(real s, const vec3& a)
+    {
+        return a * s;
+    }
+
+    inline real dot(const vec3& a, const vec3& b)
+    {
+        return a.v[0]*b.v[0] + a.v[1]*b.v[1] + a.v[2]*b.v[2];
+    }
+
+    inline real length_squared(const vec3& a)
+    {
+        return dot(a, a);
+    }
+
+    inline vec3 cross(const vec3& a, const vec3& b)
+    {
+        return vec3(a.v[1]*b.v[2] - a.v[2]*b.v[1],
+                    a.v[2]*b.v[0] - a.v[0]*b.v[2],
+                    a.v[0]*b.v[1] - a.v[1]*b.v[0]);
+    }
+
+    /* The q~ vector of the paper, [x y z xx yy zz xy yz zx].
+     */
+    struct vec9
+    {
+        real v[9];
+
+        vec9() { }
+
+        /* Build q~ from q.
+         */
+        explicit vec9(const vec3& q)
+        {
+            const real x = q.v[0], y = q.v[1], z = q.v[2];
+            v[0] = x;   v[1] = y;   v[2] = z;
+            v[3] = x*x; v[4] = y*y; v[5] = z*z;
+            v[6] = x*y; v[7] = y*z; v[8] = z*x;
+        }
+
+        real& operator()(int i) { return v[i]; }
+        real operator()(int i) const { return v[i]; }
+    };
+
+    /* Row major 3x3 matrix.
+     */
+    struct mat3
+    {
+        real m[3][3];
+
+        real& operator()(int r, int c) { return m[r][c]; }
+        real operator()(int r, int c) const { return m[r][c]; }
+
+        static mat3 zero()
+        {
+            mat3 z;
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    z.m[r][c] = 0;
+            return z;
+        }
+
+        static mat3 identity()
+        {
+            mat3 i = zero();
+            i.m[0][0] = i.m[1][1] = i.m[2][2] = 1;
+            return i;
+        }
+
+        /* this += a * b^T
+         */
+        void add_outer(const vec3& a, const vec3& b)
+        {
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    m[r][c] += a.v[r] * b.v[c];
+        }
+    };
+
+    inline mat3 operator*(const mat3& a, const mat3& b)
+    {
+        mat3 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                p.m[r][c] = a.m[r][0]*b.m[0][c] + a.m[r][1]*b.m[1][c] + a.m[r][2]*b.m[2][c];
+        return p;
+    }
+
+    inline vec3 operator*(const mat3& a, const vec3& v)
+    {
+        return vec3(a.m[0][0]*v.v[0] + a.m[0][1]*v.v[1] + a.m[0][2]*v.v[2],
+                    a.m[1][0]*v.v[0] + a.m[1][1]*v.v[1] + a.m[1][2]*v.v[2],
+                    a.m[2][0]*v.v[0] + a.m[2][1]*v.v[1] + a.m[2][2]*v.v[2]);
+    }
+
+    inline mat3 operator*(const mat3& a, real s)
+    {
+        mat3 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                p.m[r][c] = a.m[r][c] * s;
+        return p;
+    }
+
+    inline mat3 operator+(const mat3& a, const mat3& b)
+    {
+        mat3 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                p.m[r][c] = a.m[r][c] + b.m[r][c];
+        return p;
+    }
+
+    inline mat3 operator-(const mat3& a, const mat3& b)
+    {
+        mat3 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                p.m[r][c] = a.m[r][c] - b.m[r][c];
+        return p;
+    }
+
+    /* Frobenius norm.
+     */
+    inline real norm(const mat3& a)
+    {
+        real sum = 0;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                sum += a.m[r][c] * a.m[r][c];
+        return std::sqrt(sum);
+    }
+
+    inline mat3 trans(const mat3& a)
+    {
+        mat3 t;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                t.m[r][c] = a.m[c][r];
+        return t;
+    }
+
+    inline real det(const mat3& a)
+    {
+        return a.m[0][0] * (a.m[1][1]*a.m[2][2] - a.m[1][2]*a.m[2][1])
+             - a.m[0][1] * (a.m[1][0]*a.m[2][2] - a.m[1][2]*a.m[2][0])
+             + a.m[0][2] * (a.m[1][0]*a.m[2][1] - a.m[1][1]*a.m[2][0]);
+    }
+
+    /* Closed form inverse using the adjugate. The matrix must not be
+     * singular.
+     */
+    inline mat3 inv(const mat3& a)
+    {
+        mat3 i;
+        i.m[0][0] = a.m[1][1]*a.m[2][2] - a.m[1][2]*a.m[2][1];
+        i.m[0][1] = a.m[0][2]*a.m[2][1] - a.m[0][1]*a.m[2][2];
+        i.m[0][2] = a.m[0][1]*a.m[1][2] - a.m[0][2]*a.m[1][1];
+        i.m[1][0] = a.m[1][2]*a.m[2][0] - a.m[1][0]*a.m[2][2];
+        i.m[1][1] = a.m[0][0]*a.m[2][2] - a.m[0][2]*a.m[2][0];
+        i.m[1][2] = a.m[0][2]*a.m[1][0] - a.m[0][0]*a.m[1][2];
+        i.m[2][0] = a.m[1][0]*a.m[2][1] - a.m[1][1]*a.m[2][0];
+        i.m[2][1] = a.m[0][1]*a.m[2][0] - a.m[0][0]*a.m[2][1];
+        i.m[2][2] = a.m[0][0]*a.m[1][1] - a.m[0][1]*a.m[1][0];
+
+        const real d = a.m[0][0]*i.m[0][0] + a.m[0][1]*i.m[1][0] + a.m[0][2]*i.m[2][0];
+        return i * (1 / d);
+    }
+
+    /* The cofactor matrix, det(a) * inv(a)^T. It takes the normals of a
+     * surface to the normals of the surface deformed by a, and unlike the
+     * inverse transpose it exists for singular matrices too.
+     */
+    inline mat3 cofactor(const mat3& a)
+    {
+        mat3 c;
+        c.m[0][0] = a.m[1][1]*a.m[2][2] - a.m[1][2]*a.m[2][1];
+        c.m[0][1] = a.m[1][2]*a.m[2][0] - a.m[1][0]*a.m[2][2];
+        c.m[0][2] = a.m[1][0]*a.m[2][1] - a.m[1][1]*a.m[2][0];
+        c.m[1][0] = a.m[0][2]*a.m[2][1] - a.m[0][1]*a.m[2][2];
+        c.m[1][1] = a.m[0][0]*a.m[2][2] - a.m[0][2]*a.m[2][0];
+        c.m[1][2] = a.m[0][1]*a.m[2][0] - a.m[0][0]*a.m[2][1];
+        c.m[2][0] = a.m[0][1]*a.m[1][2] - a.m[0][2]*a.m[1][1];
+        c.m[2][1] = a.m[0][2]*a.m[1][0] - a.m[0][0]*a.m[1][2];
+        c.m[2][2] = a.m[0][0]*a.m[1][1] - a.m[0][1]*a.m[1][0];
+        return c;
+    }
+
+    /* Row major 9x9 matrix, for the constant Aqq~ inverse and for mapping
+     * between q~ bases.
+     */
+    struct mat9
+    {
+        real m[9][9];
+
+        real& operator()(int r, int c) { return m[r][c]; }
+        real operator()(int r, int c) const { return m[r][c]; }
+
+        static mat9 zero()
+        {
+            mat9 z;
+            for (int r = 0; r < 9; ++r)
+                for (int c = 0; c < 9; ++c)
+                    z.m[r][c] = 0;
+            return z;
+        }
+
+        static mat9 identity()
+        {
+            mat9 i = zero();
+            for (int r = 0; r < 9; ++r)
+                i.m[r][r] = 1;
+            return i;
+        }
+
+        /* The top left 3x3 block.
+         */
+        mat3 top_left() const
+        {
+            mat3 l;
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    l.m[r][c] = m[r][c];
+            return l;
+        }
+    };
+
+    inline mat9 operator*(const mat9& a, const mat9& b)
+    {
+        mat9 p;
+        for (int r = 0; r < 9; ++r)
+        {
+            for (int c = 0; c < 9; ++c)
+            {
+                real sum = 0;
+                for (int k = 0; k < 9; ++k)
+                    sum += a.m[r][k] * b.m[k][c];
+                p.m[r][c] = sum;
+            }
+        }
+        return p;
+    }
+
+    inline vec9 operator*(const mat9& a, const vec9& v)
+    {
+        vec9 p;
+        for (int r = 0; r < 9; ++r)
+        {
+            real sum = 0;
+            for (int c = 0; c < 9; ++c)
+                sum += a.m[r][c] * v.v[c];
+            p.v[r] = sum;
+        }
+        return p;
+    }
+
+    inline mat9 trans(const mat9& a)
+    {
+        mat9 t;
+        for (int r = 0; r < 9; ++r)
+            for (int c = 0; c < 9; ++c)
+                t.m[r][c] = a.m[c][r];
+        return t;
+    }
+
+    /* Row major 3x9 matrix.
+     */
+    struct mat3x9
+    {
+        real m[3][9];
+
+        real& operator()(int r, int c) { return m[r][c]; }
+        real operator()(int r, int c) const { return m[r][c]; }
+
+        static mat3x9 zero()
+        {
+            mat3x9 z;
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 9; ++c)
+                    z.m[r][c] = 0;
+            return z;
+        }
+
+        /* this += a * b^T
+         */
+        void add_outer(const vec3& a, const vec9& b)
+        {
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 9; ++c)
+                    m[r][c] += a.v[r] * b.v[c];
+        }
+
+        /* [l 0 0], a linear transform working on q~.
+         */
+        static mat3x9 padded(const mat3& l)
+        {
+            mat3x9 p = zero();
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    p.m[r][c] = l.m[r][c];
+            return p;
+        }
+
+        /* The first three columns.
+         */
+        mat3 left() const
+        {
+            mat3 l;
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    l.m[r][c] = m[r][c];
+            return l;
+        }
+    };
+
+    inline mat3x9 operator*(const mat3x9& a, real s)
+    {
+        mat3x9 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 9; ++c)
+                p.m[r][c] = a.m[r][c] * s;
+        return p;
+    }
+
+    inline mat3x9 operator+(const mat3x9& a, const mat3x9& b)
+    {
+        mat3x9 p;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 9; ++c)
+                p.m[r][c] = a.m[r][c] + b.m[r][c];
+        return p;
+    }
+
+    inline vec3 operator*(const mat3x9& a, const vec9& v)
+    {
+        vec3 p;
+        for (int r = 0; r < 3; ++r)
+        {
+            real sum = 0;
+            for (int c = 0; c < 9; ++c)
+                sum += a.m[r][c] * v.v[c];
+            p.v[r] = sum;
+        }
+        return p;
+    }
+
+    inline mat3x9 operator*(const mat3x9& a, const mat9& b)
+    {
+        mat3x9 p;
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 9; ++c)
+            {
+                real sum = 0;
+                for (int k = 0; k < 9; ++k)
+                    sum += a.m[r][k] * b.m[k][c];
+                p.m[r][c] = sum;
+            }
+        }
+        return p;
+    }
+
+    /* The determinant of the 9x9 matrix made by padding A~ with the 6x9
+     * block [0 I] below it. That matrix is block upper triangular, so its
+     * determinant is the determinant of A~'s first three columns.
+     */
+    inline real det_padded(const mat3x9& a)
+    {
+        return det(a.left());
+    }
+
+    /* s*a + t*b with b = [R 0 0], the goal matrix of the paper for
+     * quadratic deformations.
+     */
+    inline mat3x9 blend(const mat3x9& a, real s, const mat3& b, real t)
+    {
+        mat3x9 p;
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+                p.m[r][c] = s*a.m[r][c] + t*b.m[r][c];
+            for (int c = 3; c < 9; ++c)
+                p.m[r][c] = s*a.m[r][c];
+        }
+        return p;
+    }
+
+    /* Denman-Beavers iteration for the square root of a matrix. It
+     * converges quadratically, so it stops as soon as an iteration changes
+     * the result by less than the precision of a real.
+     */
+    inline mat3 sqrt_db(const mat3& a)
+    {
+        const int MAX_ITERATIONS = 100;
+
+        mat3 y = a;
+        mat3 z = mat3::identity();
+        for (int i = 0; i < MAX_ITERATIONS; ++i)
+        {
+            const mat3 next_y = (y + inv(z)) * 0.5;
+            const mat3 next_z = (z + inv(y)) * 0.5;
+
+            real change = 0;
+            real size = 0;
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    change = std::max(change, std::fabs(next_y.m[r][c] - y.m[r][c]));
+                    size = std::max(size, std::fabs(next_y.m[r][c]));
+                }
+            }
+
+            y = next_y;
+            z = next_z;
+
+            if (change <= size * 4 * std::numeric_limits<real>::epsilon())
+            {
+                break;
+            }
+        }
+
+        return y;
+    }
+
+    /* Copy between the dlib vectors of the public interfaces and the fmath
+     * vectors used internally.
+     */
+    inline vec3 load(const dlib::vec3& v)
+    {
+        return vec3(v(0), v(1), v(2));
+    }
+
+    inline void store(dlib::vec3& d, const vec3& v)
+    {
+        d(0) = v(0);
+        d(1) = v(1);
+        d(2) = v(2);
+    }
+}
+
+#endif
@@ -0,0 +1,271 @@
+#include "forcefield.hpp"
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+//=============================================================================
+// UniformField
+//=============================================================================
+
+UniformField::UniformField(const dlib::vec3& acceleration)
+{
+    SetAcceleration(acceleration);
+}
+
+void UniformField::SetAcceleration(const dlib::vec3& acceleration)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        m_acceleration[k] = acceleration(k);
+    }
+}
+
+void UniformField::Evaluate(ForceBlock& block) const
+{
+    const real ax = m_acceleration[0];
+    const real ay = m_acceleration[1];
+    const real az = m_acceleration[2];
+    for (size_t i = 0; i < block.count; ++i)
+    {
+        block.fx[i] += ax;
+        block.fy[i] += ay;
+        block.fz[i] += az;
+    }
+}
+
+//=============================================================================
+// RadialField
+//=============================================================================
+
+RadialField::RadialField(const dlib::vec3& center, real strength, real radius) :
+    m_strength(strength),
+    m_radius(radius)
+{
+    assert(radius > 0);
+    SetCenter(center);
+}
+
+void RadialField::SetCenter(const dlib::vec3& center)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        m_center[k] = center(k);
+    }
+}
+
+void RadialField::SetStrength(real strength)
+{
+    m_strength = strength;
+}
+
+void RadialField::Evaluate(ForceBlock& block) const
+{
+    const real inv_radius = 1 / m_radius;
+    for (size_t i = 0; i < block.count; ++i)
+    {
+        const real dx = block.x[i] - m_center[0];
+        const real dy = block.y[i] - m_center[1];
+        const real dz = block.z[i] - m_center[2];
+        const real distance = std::sqrt(dx*dx + dy*dy + dz*dz);
+
+        // strength * (1 - d/r) along the unit direction, nothing at the
+        // center itself
+        const real falloff = std::max<real>(1 - distance * inv_radius, 0);
+        const real scale = distance > 0 ? m_strength * falloff / distance : 0;
+        block.fx[i] += dx * scale;
+        block.fy[i] += dy * scale;
+        block.fz[i] += dz * scale;
+    }
+}
+
+//=============================================================================
+// TurbulenceField
+//=============================================================================
+
+TurbulenceField::TurbulenceField(real amplitude, real scale, const dlib::vec3& drift) :
+    m_amplitude(amplitude),
+    m_inv_scale(1 / scale)
+{
+    assert(scale > 0);
+    for (int k = 0; k < 3; ++k)
+    {
+        m_drift[k] = drift(k);
+        m_offset[k] = 0;
+    }
+}
+
+void TurbulenceField::Advance(real dt)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        m_offset[k] -= m_drift[k] * dt * m_inv_scale;
+    }
+}
+
+/* A random value in [-1, 1] for each lattice point and channel.
+ */
+static inline real lattice_value(int x, int y, int z, unsigned int channel)
+{
+    unsigned int h = static_cast<unsigned int>(x) * 73856093u ^
+                     static_cast<unsigned int>(y) * 19349663u ^
+                     static_cast<unsigned int>(z) * 83492791u ^
+                     channel * 2654435761u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffff) * (2.0 / 0xffff) - 1;
+}
+
+void TurbulenceField::Evaluate(ForceBlock& block) const
+{
+    real* const out[3] = { block.fx, block.fy, block.fz };
+    for (size_t i = 0; i < block.count; ++i)
+    {
+        const real p[3] = {
+            block.x[i] * m_inv_scale + m_offset[0],
+            block.y[i] * m_inv_scale + m_offset[1],
+            block.z[i] * m_inv_scale + m_offset[2],
+        };
+
+        // Lattice cell and smoothed position in it
+        int cell[3];
+        real t[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            const real floor = std::floor(p[k]);
+            cell[k] = static_cast<int>(floor);
+            const real f = p[k] - floor;
+            t[k] = f * f * (3 - 2*f);
+        }
+
+        for (unsigned int channel = 0; channel < 3; ++channel)
+        {
+            real value = 0;
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                const int dx = corner & 1;
+                const int dy = (corner >> 1) & 1;
+                const int dz = (corner >> 2) & 1;
+                const real weight = (dx ? t[0] : 1 - t[0]) *
+                                    (dy ? t[1] : 1 - t[1]) *
+                                    (dz ? t[2] : 1 - t[2]);
+                value += weight * lattice_value(cell[0] + dx, cell[1] + dy,
+                                                cell[2] + dz, channel);
+            }
+            out[channel][i] += m_amplitude * value;
+        }
+    }
+}
+
+//=============================================================================
+// GridField
+//=============================================================================
+
+GridField::GridField(const dlib::vec3& origin, real spacing, int nx, int ny, int nz) :
+    m_inv_spacing(1 / spacing),
+    m_samples(3 * nx * ny * nz, 0)
+{
+    assert(spacing > 0);
+    assert(nx >= 2 && ny >= 2 && nz >= 2);
+
+    for (int k = 0; k < 3; ++k)
+    {
+        m_origin[k] = origin(k);
+    }
+    m_dims[0] = nx;
+    m_dims[1] = ny;
+    m_dims[2] = nz;
+}
+
+void GridField::SetSample(int x, int y, int z, const dlib::vec3& acceleration)
+{
+    assert(x >= 0 && x < m_dims[0]);
+    assert(y >= 0 && y < m_dims[1]);
+    assert(z >= 0 && z < m_dims[2]);
+
+    real* sample = &m_samples[3 * ((z*m_dims[1] + y)*m_dims[0] + x)];
+    for (int k = 0; k < 3; ++k)
+    {
+        sample[k] = acceleration(k);
+    }
+}
+
+void GridField::Evaluate(ForceBlock& block) const
+{
+    const int sx = 3;
+    const int sy = 3 * m_dims[0];
+    const int sz = 3 * m_dims[0] * m_dims[1];
+    for (size_t i = 0; i < block.count; ++i)
+    {
+        const real g[3] = {
+            (block.x[i] - m_origin[0]) * m_inv_spacing,
+            (block.y[i] - m_origin[1]) * m_inv_spacing,
+            (block.z[i] - m_origin[2]) * m_inv_spacing,
+        };
+
+        bool inside = true;
+        int cell[3];
+        real t[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            inside = inside && g[k] >= 0 && g[k] <= m_dims[k] - 1;
+            cell[k] = std::min(static_cast<int>(g[k]), m_dims[k] - 2);
+            t[k] = g[k] - cell[k];
+        }
+
+        if (!inside)
+        {
+            continue;
+        }
+
+        const real* base = &m_samples[cell[2]*sz + cell[1]*sy + cell[0]*sx];
+        real sum[3] = { 0, 0, 0 };
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const int dx = corner & 1;
+            const int dy = (corner >> 1) & 1;
+            const int dz = (corner >> 2) & 1;
+            const real weight = (dx ? t[0] : 1 - t[0]) *
+                                (dy ? t[1] : 1 - t[1]) *
+                                (dz ? t[2] : 1 - t[2]);
+            const real* sample = base + dz*sz + dy*sy + dx*sx;
+            sum[0] += weight * sample[0];
+            sum[1] += weight * sample[1];
+            sum[2] += weight * sample[2];
+        }
+
+        block.fx[i] += sum[0];
+        block.fy[i] += sum[1];
+        block.fz[i] += sum[2];
+    }
+}
+
+//=============================================================================
+// ForceFieldSet
+//=============================================================================
+
+void ForceFieldSet::Add(const ForceField* field)
+{
+    assert(field != NULL);
+    m_fields.push_back(field);
+    ++m_version;
+}
+
+void ForceFieldSet::Remove(const ForceField* field)
+{
+    m_fields.erase(std::remove(m_fields.begin(), m_fields.end(), field), m_fields.end());
+    ++m_version;
+}
+
+void ForceFieldSet::Evaluate(ForceBlock& block) const
+{
+    for (size_t i = 0; i < m_fields.size(); ++i)
+    {
+        m_fields[i]->Evaluate(block);
+    }
+}
+
+//=============================================================================
+//
+//=============================================================================
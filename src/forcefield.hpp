@@ -0,0 +1,167 @@
+#ifndef __FORCE_FIELD_HPP__
+#define __FORCE_FIELD_HPP__
+
+#include "defs.hpp"
+
+#include <vector>
+
+/* A block of particles handed to the force fields, in separate x, y and z
+ * arrays so the fields' loops can be vectorized. The integration sweep
+ * fills in the positions and the uniform force, every field then adds its
+ * acceleration.
+ */
+struct ForceBlock
+{
+    enum { SIZE = 64 };
+
+    real x[SIZE], y[SIZE], z[SIZE]; // Particle positions
+    real fx[SIZE], fy[SIZE], fz[SIZE]; // Accelerations, added to by the fields
+    size_t count; // Particles in the block, at most SIZE
+};
+
+/* A spatially varying acceleration, like wind or an explosion. Fields are
+ * evaluated for a whole block of particles at a time inside
+ * PSystem::Update(), instead of every effect being its own pass over the
+ * velocities.
+ */
+class ForceField
+{
+public:
+    virtual ~ForceField() { }
+
+    /* Add the acceleration at each of the block's positions to its
+     * accelerations.
+     */
+    virtual void Evaluate(ForceBlock& block) const = 0;
+};
+
+/* The same acceleration everywhere, like a steady wind.
+ */
+class UniformField : public ForceField
+{
+public:
+    UniformField(const dlib::vec3& acceleration);
+
+    void SetAcceleration(const dlib::vec3& acceleration);
+
+    void Evaluate(ForceBlock& block) const;
+
+private:
+    real m_acceleration[3];
+};
+
+/* Pushes away from (or pulls toward, with a negative strength) a point,
+ * fading out linearly to nothing at the radius. Good for explosions and
+ * attractors.
+ */
+class RadialField : public ForceField
+{
+public:
+    RadialField(const dlib::vec3& center, real strength, real radius);
+
+    void SetCenter(const dlib::vec3& center);
+
+    /* Acceleration at the center, negative pulls toward it.
+     */
+    void SetStrength(real strength);
+
+    void Evaluate(ForceBlock& block) const;
+
+private:
+    real m_center[3];
+    real m_strength;
+    real m_radius;
+};
+
+/* Smooth random gusts, value noise over a lattice that drifts over time.
+ */
+class TurbulenceField : public ForceField
+{
+public:
+    /* Params:
+     *   amplitude - Largest acceleration in each direction
+     *   scale - Size of a gust, the noise lattice spacing
+     *   drift - How fast the gusts move, in distance per second
+     */
+    TurbulenceField(real amplitude, real scale, const dlib::vec3& drift);
+
+    /* Move the gusts forward, call once per step.
+     */
+    void Advance(real dt);
+
+    void Evaluate(ForceBlock& block) const;
+
+private:
+    real m_amplitude;
+    real m_inv_scale; // 1 / lattice spacing
+    real m_drift[3];
+    real m_offset[3]; // Drift so far, in lattice units
+};
+
+/* Accelerations sampled on a regular grid, from a fluid solver or an
+ * artist painted flow. Trilinearly interpolated, zero outside the grid.
+ */
+class GridField : public ForceField
+{
+public:
+    /* All samples start at zero.
+     *
+     * Params:
+     *   origin - Position of sample (0, 0, 0)
+     *   spacing - Distance between samples
+     *   nx, ny, nz - Number of samples along each axis, at least 2
+     */
+    GridField(const dlib::vec3& origin, real spacing, int nx, int ny, int nz);
+
+    void SetSample(int x, int y, int z, const dlib::vec3& acceleration);
+
+    void Evaluate(ForceBlock& block) const;
+
+private:
+    real m_origin[3];
+    real m_inv_spacing;
+    int m_dims[3];
+    std::vector<real> m_samples; // 3 per sample, x fastest
+};
+
+/* The fields acting on a body. The fields aren't owned and must stay
+ * allocated while they are in the set.
+ */
+class ForceFieldSet
+{
+public:
+    ForceFieldSet() : m_version(0) { }
+
+    void Add(const ForceField* field);
+
+    void Remove(const ForceField* field);
+
+    void Clear()
+    {
+        m_fields.clear();
+        ++m_version;
+    }
+
+    bool IsEmpty() const
+    {
+        return m_fields.empty();
+    }
+
+    /* Changes every time a field is added or removed, so resting bodies
+     * can tell the forces on them changed.
+     */
+    unsigned int GetVersion() const
+    {
+        return m_version;
+    }
+
+    /* Add the acceleration of every field to the block.
+     */
+    void Evaluate(ForceBlock& block) const;
+
+private:
+    std::vector<const ForceField*> m_fields;
+    unsigned int m_version; // See GetVersion()
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "governor.hpp"
+
+#include <sstream>
+#include <cassert>
+#include <algorithm>
+
+// Weight of the newest step in the smoothed cost
+static const double SMOOTHING = 0.1;
+
+// Steps to wait after a change before lowering the quality again, gives
+// the smoothed cost time to reflect the new level
+static const unsigned long SETTLE_STEPS = 30;
+
+// The smoothed cost has to be below this fraction of the budget before the
+// quality is raised again
+static const double RESTORE_FRACTION = 0.6;
+
+// Range of the number of steps to wait under budget before raising the
+// quality, the wait doubles every time a raised level fails
+static const unsigned long MIN_RESTORE_DELAY = 120;
+static const unsigned long MAX_RESTORE_DELAY = 120 * 32;
+
+// A raised level that stays under budget this many steps counts as stable
+static const unsigned long PROVE_STEPS = 240;
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+Governor::Governor(double budget, int max_substeps) :
+    m_enabled(true),
+    m_level(0),
+    m_levels(),
+    m_descriptions(),
+    m_budget(budget),
+    m_average(0),
+    m_steps_at_level(0),
+    m_restore_delay(MIN_RESTORE_DELAY),
+    m_just_restored(false)
+{
+    assert(budget > 0);
+    assert(max_substeps >= 1);
+
+    // First give up substeps
+    for (int n = max_substeps; ; n /= 2)
+    {
+        std::stringstream ss;
+        ss << "quadratic, " << n << (n == 1 ? " substep" : " substeps");
+        add_level(n, true, 1.0, ss.str());
+
+        if (n == 1)
+        {
+            break;
+        }
+    }
+
+    // Then the quadratic deformations
+    add_level(1, false, 1.0, "linear, 1 substep");
+
+    // Finally put the bodies that are furthest away to sleep
+    add_level(1, false, 0.5, "linear, half of the bodies asleep");
+    add_level(1, false, 0.25, "linear, three quarters of the bodies asleep");
+    add_level(1, false, 0.0, "linear, only the closest body awake");
+
+    m_telemetry.budget = budget;
+    m_telemetry.average_cost = 0;
+    m_telemetry.peak_cost = 0;
+    m_telemetry.level = 0;
+    m_telemetry.num_levels = m_levels.size();
+    m_telemetry.steps = 0;
+    m_telemetry.downgrades = 0;
+    m_telemetry.upgrades = 0;
+    m_telemetry.dropped_time = 0;
+}
+
+//=============================================================================
+// add_level
+//=============================================================================
+
+void Governor::add_level(int max_substeps, bool quadratic, double awake_fraction,
+                         const std::string& description)
+{
+    Quality quality;
+    quality.max_substeps = max_substeps;
+    quality.quadratic = quadratic;
+    quality.awake_fraction = awake_fraction;
+    m_levels.push_back(quality);
+    m_descriptions.push_back(description);
+}
+
+//=============================================================================
+// set_level
+//=============================================================================
+
+void Governor::set_level(int level)
+{
+    assert(level >= 0 && level < static_cast<int>(m_levels.size()));
+
+    m_level = level;
+    m_steps_at_level = 0;
+    m_telemetry.level = level;
+    m_telemetry.peak_cost = 0;
+}
+
+//=============================================================================
+// SetEnabled
+//=============================================================================
+
+void Governor::SetEnabled(bool enabled)
+{
+    m_enabled = enabled;
+    if (!enabled)
+    {
+        set_level(0);
+        m_just_restored = false;
+        m_restore_delay = MIN_RESTORE_DELAY;
+    }
+}
+
+//=============================================================================
+// Report
+//=============================================================================
+
+bool Governor::Report(double seconds)
+{
+    if (!m_enabled)
+    {
+        return false;
+    }
+
+    if (m_telemetry.steps == 0)
+    {
+        m_average = seconds;
+    }
+    m_average += SMOOTHING * (seconds - m_average);
+
+    ++m_telemetry.steps;
+    ++m_steps_at_level;
+    m_telemetry.average_cost = m_average;
+    m_telemetry.peak_cost = std::max(m_telemetry.peak_cost, seconds);
+
+    // A raised level that held up for a while, be quicker to try the next
+    if (m_just_restored && m_steps_at_level >= PROVE_STEPS)
+    {
+        m_just_restored = false;
+        m_restore_delay = std::max(MIN_RESTORE_DELAY, m_restore_delay / 2);
+    }
+
+    const int last_level = m_levels.size() - 1;
+    if (m_average > m_budget && m_steps_at_level >= SETTLE_STEPS && m_level < last_level)
+    {
+        // Raising the quality was a mistake, wait longer next time
+        if (m_just_restored)
+        {
+            m_restore_delay = std::min(MAX_RESTORE_DELAY, m_restore_delay * 2);
+            m_just_restored = false;
+        }
+
+        set_level(m_level + 1);
+        ++m_telemetry.downgrades;
+        return true;
+    }
+
+    if (m_average < RESTORE_FRACTION * m_budget &&
+        m_steps_at_level >= m_restore_delay && m_level > 0)
+    {
+        set_level(m_level - 1);
+        m_just_restored = true;
+        ++m_telemetry.upgrades;
+        return true;
+    }
+
+    return false;
+}
+
+//=============================================================================
+//
+//=============================================================================
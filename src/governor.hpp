@@ -0,0 +1,137 @@
+#ifndef __GOVERNOR_HPP__
+#define __GOVERNOR_HPP__
+
+#include <string>
+#include <vector>
+
+/* Keeps the cost of a simulation step within its real-time budget by
+ * trading away quality. Without it a step that takes longer than the time
+ * it simulates makes the simulation fall further behind every frame (the
+ * "spiral of death") and simulated time has to be dropped.
+ *
+ * The caller reports how long each step took. When the smoothed cost goes
+ * over the budget the governor moves one quality level down, always in the
+ * same order:
+ *
+ *   1. Halve the allowed substeps until only one is left
+ *   2. Switch from quadratic to linear deformations
+ *   3. Put the bodies furthest from the camera to sleep, halving the
+ *      number of awake bodies each level (at least one stays awake)
+ *
+ * When the cost has been well under budget for a while it moves back up one
+ * level. If a restored level immediately goes over budget again, the wait
+ * before the next restore is doubled so the levels don't oscillate.
+ *
+ *   Governor governor(SIM_DT * 0.8, SIM_MAX_SUBSTEPS);
+ *   ...
+ *   const double start = get_time();
+ *   ... step ...
+ *   if (governor.Report(get_time() - start))
+ *   {
+ *       ... apply governor.GetQuality() ...
+ *   }
+ */
+class Governor
+{
+public:
+    /* One step of the quality ladder.
+     */
+    struct Quality
+    {
+        int max_substeps; // Upper limit for the step controller
+        bool quadratic; // Quadratic (true) or linear deformations
+        double awake_fraction; // Fraction of bodies kept awake, closest first
+    };
+
+    /* What the governor is doing, for printing or logging.
+     */
+    struct Telemetry
+    {
+        double budget; // Seconds a step may take
+        double average_cost; // Smoothed seconds per step
+        double peak_cost; // Most expensive step since the last level change
+        int level; // Current level, 0 is full quality
+        int num_levels; // Number of levels
+        unsigned long steps; // Steps reported so far
+        unsigned long downgrades; // Times the quality was lowered
+        unsigned long upgrades; // Times the quality was raised
+        double dropped_time; // Simulated seconds skipped, see AddDroppedTime()
+    };
+
+    /* Params:
+     *   budget - The number of seconds a single step may take
+     *   max_substeps - The substep limit at full quality
+     */
+    Governor(double budget, int max_substeps);
+
+    /* Report the cost of the last step.
+     *
+     * Params:
+     *   seconds - Wall clock time the step took
+     *
+     * Returns:
+     *   True if the quality level changed and GetQuality() should be
+     *   applied again.
+     */
+    bool Report(double seconds);
+
+    /* Record simulated time that had to be skipped because the simulation
+     * fell too far behind.
+     */
+    void AddDroppedTime(double seconds)
+    {
+        m_telemetry.dropped_time += seconds;
+    }
+
+    /* The settings for the current level.
+     */
+    const Quality& GetQuality() const
+    {
+        return m_levels[m_level];
+    }
+
+    /* A short description of the current level.
+     */
+    const std::string& GetDescription() const
+    {
+        return m_descriptions[m_level];
+    }
+
+    const Telemetry& GetTelemetry() const
+    {
+        return m_telemetry;
+    }
+
+    /* Turning the governor off goes back to full quality.
+     */
+    void SetEnabled(bool enabled);
+
+    bool IsEnabled() const
+    {
+        return m_enabled;
+    }
+
+private:
+    /* Add a level to the bottom of the ladder.
+     */
+    void add_level(int max_substeps, bool quadratic, double awake_fraction,
+                   const std::string& description);
+
+    /* Change the level and reset the per level counters.
+     */
+    void set_level(int level);
+
+private:
+    bool m_enabled; // Report() does nothing while false
+    int m_level; // Index into m_levels
+    std::vector<Quality> m_levels; // Quality ladder, best first
+    std::vector<std::string> m_descriptions; // Description of each level
+    double m_budget; // Seconds a step may take
+    double m_average; // Smoothed step cost
+    unsigned long m_steps_at_level; // Steps since the last level change
+    unsigned long m_restore_delay; // Steps under budget before restoring
+    bool m_just_restored; // Level was raised and hasn't proven itself yet
+    Telemetry m_telemetry;
+};
+
+#endif
@@ -0,0 +1,522 @@
+#include "lattice.hpp"
+#include "shapematch.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <new>
+
+// Most components per cell of m_field, the rest state needs the mass, the
+// sum of positions and the sum of their outer products
+static const int FIELD_COMPONENTS = 13;
+
+// Components of the fields summed during Update(), the outer products
+// x p^T and positions x, then the goal transforms
+static const int STEP_COMPONENTS = 12;
+
+// Regions whose Aqq determinant is below this fraction of the cube of its
+// average eigenvalue are treated as flat
+static const real FLAT_REGION_RATIO = 1e-3;
+
+// Iterations per step when updating the region rotations
+static const int ROTATION_ITERATIONS = 4;
+
+// Regions squashed below this fraction of their rest volume only rotate
+static const real MIN_LINEAR_VOLUME = 0.1;
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+LatticeSystem::LatticeSystem(Mesh& mesh, real cell_size, int region_width) :
+    m_mesh(mesh),
+    m_alpha(0.4),
+    m_beta(0),
+    m_alpha_reference_dt(0),
+    m_max_displacement(0),
+    m_max_goal_deviation(0),
+    m_region_width(region_width)
+{
+    // Only the positions are simulated, the rest of the mesh is left as is
+    assert(mesh.IsFlagEnabled(Mesh::VERTICES));
+    assert(cell_size > 0);
+    assert(region_width >= 1);
+
+    voxelize(cell_size);
+    init_rest_state();
+    Reset();
+}
+
+//=============================================================================
+// voxelize
+//=============================================================================
+
+void LatticeSystem::voxelize(real cell_size)
+{
+    const dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh.GetData());
+    const size_t num_vertices = m_mesh.GetDataSize() / 3;
+    assert(num_vertices >= 3);
+
+    fmath::vec3 lower = fmath::load(data[0]);
+    fmath::vec3 upper = lower;
+    for (size_t i = 1; i < num_vertices; ++i)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            lower(k) = std::min<real>(lower(k), data[i](k));
+            upper(k) = std::max<real>(upper(k), data[i](k));
+        }
+    }
+
+    // Pad by a cell on each side so the outside is connected
+    m_origin = lower - fmath::vec3(cell_size, cell_size, cell_size);
+    for (int k = 0; k < 3; ++k)
+    {
+        m_dims[k] = static_cast<int>((upper(k) - m_origin(k)) / cell_size) + 2;
+    }
+    m_num_cells = static_cast<size_t>(m_dims[0]) * m_dims[1] * m_dims[2];
+
+    // Mark every cell a triangle passes through, by sampling the triangles
+    // finer than the cells
+    enum { CELL_EMPTY, CELL_SURFACE, CELL_OUTSIDE };
+    std::vector<char> cells(m_num_cells, CELL_EMPTY);
+    const real inv_size = 1 / cell_size;
+    for (size_t t = 0; t + 2 < num_vertices; t += 3)
+    {
+        const fmath::vec3 a = fmath::load(data[t]);
+        const fmath::vec3 b = fmath::load(data[t + 1]);
+        const fmath::vec3 c = fmath::load(data[t + 2]);
+        const real longest = std::sqrt(std::max(fmath::length_squared(b - a),
+                                       std::max(fmath::length_squared(c - b),
+                                                fmath::length_squared(a - c))));
+        const int steps = static_cast<int>(std::ceil(2 * longest * inv_size)) + 1;
+        for (int i = 0; i <= steps; ++i)
+        {
+            for (int j = 0; i + j <= steps; ++j)
+            {
+                const real u = i / static_cast<real>(steps);
+                const real v = j / static_cast<real>(steps);
+                const fmath::vec3 point = a + (b - a) * u + (c - a) * v;
+
+                size_t index = 0;
+                for (int k = 3; k-- > 0; )
+                {
+                    int cell = static_cast<int>((point(k) - m_origin(k)) * inv_size);
+                    cell = std::min(std::max(cell, 0), m_dims[k] - 1);
+                    index = index * m_dims[k] + cell;
+                }
+                cells[index] = CELL_SURFACE;
+            }
+        }
+    }
+
+    // Flood the outside from the corner, whatever isn't reached is solid
+    const int strides[3] = { 1, m_dims[0], m_dims[0] * m_dims[1] };
+    std::vector<size_t> stack;
+    stack.push_back(0);
+    cells[0] = CELL_OUTSIDE;
+    while (!stack.empty())
+    {
+        const size_t index = stack.back();
+        stack.pop_back();
+
+        size_t rest = index;
+        for (int k = 0; k < 3; ++k)
+        {
+            const int coord = rest % m_dims[k];
+            rest /= m_dims[k];
+
+            if (coord > 0 && cells[index - strides[k]] == CELL_EMPTY)
+            {
+                cells[index - strides[k]] = CELL_OUTSIDE;
+                stack.push_back(index - strides[k]);
+            }
+            if (coord + 1 < m_dims[k] && cells[index + strides[k]] == CELL_EMPTY)
+            {
+                cells[index + strides[k]] = CELL_OUTSIDE;
+                stack.push_back(index + strides[k]);
+            }
+        }
+    }
+
+    m_cell_particle.assign(m_num_cells, -1);
+    m_num_particles = 0;
+    for (size_t i = 0; i < m_num_cells; ++i)
+    {
+        if (cells[i] != CELL_OUTSIDE)
+        {
+            m_cell_particle[i] = m_num_particles++;
+        }
+    }
+
+    // All the particle arrays are carved out of one block
+    const size_t n = m_num_particles;
+    const size_t bytes = 3*Arena::Size<dlib::vec3>(n) + 2*Arena::Size<fmath::vec3>(n) +
+                         Arena::Size<size_t>(n) + Arena::Size<Region>(n) +
+                         Arena::Size<fmath::mat3>(n) + Arena::Size<Transform>(n);
+    if (!m_arena.Create(bytes))
+    {
+        throw std::bad_alloc();
+    }
+
+    m_initial_pos = m_arena.Allocate<dlib::vec3>(n);
+    m_current_pos = m_arena.Allocate<dlib::vec3>(n);
+    m_current_vel = m_arena.Allocate<dlib::vec3>(n);
+    m_old_pos = m_arena.Allocate<fmath::vec3>(n);
+    m_rest = m_arena.Allocate<fmath::vec3>(n);
+    m_particle_cell = m_arena.Allocate<size_t>(n);
+    m_regions = m_arena.Allocate<Region>(n);
+    m_rotations = m_arena.Allocate<fmath::mat3>(n);
+    m_transforms = m_arena.Allocate<Transform>(n);
+
+    // Particles sit in the center of their cells
+    fmath::vec3 com_sum(0, 0, 0);
+    for (size_t i = 0; i < m_num_cells; ++i)
+    {
+        const int particle = m_cell_particle[i];
+        if (particle < 0)
+        {
+            continue;
+        }
+
+        const int x = i % m_dims[0];
+        const int y = (i / m_dims[0]) % m_dims[1];
+        const int z = i / (static_cast<size_t>(m_dims[0]) * m_dims[1]);
+        const fmath::vec3 center = m_origin + fmath::vec3(x + 0.5, y + 0.5, z + 0.5) * cell_size;
+        fmath::store(m_initial_pos[particle], center);
+        m_particle_cell[particle] = i;
+        com_sum += center;
+    }
+    m_initial_com = com_sum * (1 / static_cast<real>(m_num_particles));
+
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        m_rest[i] = fmath::load(m_initial_pos[i]) - m_initial_com;
+    }
+
+    // Every vertex is in a surface cell, it follows that cell's particle
+    m_vertex_particle.resize(num_vertices);
+    m_vertex_rest.resize(num_vertices);
+    for (size_t i = 0; i < num_vertices; ++i)
+    {
+        size_t index = 0;
+        for (int k = 3; k-- > 0; )
+        {
+            int cell = static_cast<int>((data[i](k) - m_origin(k)) * inv_size);
+            cell = std::min(std::max(cell, 0), m_dims[k] - 1);
+            index = index * m_dims[k] + cell;
+        }
+
+        assert(m_cell_particle[index] >= 0);
+        m_vertex_particle[i] = m_cell_particle[index];
+        m_vertex_rest[i] = fmath::load(data[i]) - m_initial_com;
+    }
+
+    m_field.resize(m_num_cells * FIELD_COMPONENTS);
+    m_line.resize((*std::max_element(m_dims, m_dims + 3) + 1) * FIELD_COMPONENTS);
+}
+
+//=============================================================================
+// init_rest_state
+//=============================================================================
+
+void LatticeSystem::init_rest_state()
+{
+    // Sum the mass, positions and outer products of each region
+    std::fill(m_field.begin(), m_field.end(), 0.0);
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        double* cell = &m_field[m_particle_cell[i] * FIELD_COMPONENTS];
+        const fmath::vec3& p(m_rest[i]);
+        cell[0] = 1;
+        for (int r = 0; r < 3; ++r)
+        {
+            cell[1 + r] = p(r);
+            for (int c = 0; c < 3; ++c)
+            {
+                cell[4 + 3*r + c] = p(r) * p(c);
+            }
+        }
+    }
+
+    box_sum(&m_field[0], FIELD_COMPONENTS);
+
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        const double* cell = &m_field[m_particle_cell[i] * FIELD_COMPONENTS];
+        Region& region(m_regions[i]);
+
+        region.mass = cell[0];
+        region.rest_com = fmath::vec3(cell[1], cell[2], cell[3]) * (1 / region.mass);
+
+        // Aqq = sum p p^T - M c c^T
+        fmath::mat3 Aqq;
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                Aqq(r, c) = cell[4 + 3*r + c] - region.mass * region.rest_com(r) * region.rest_com(c);
+            }
+        }
+
+        // Flat regions have no linear fit, only a rotation
+        const real average = (Aqq(0,0) + Aqq(1,1) + Aqq(2,2)) / 3;
+        region.solid = average > 0 &&
+            fmath::det(Aqq) > FLAT_REGION_RATIO * average * average * average;
+        if (region.solid)
+        {
+            region.Aqq = fmath::inv(Aqq);
+        }
+    }
+}
+
+//=============================================================================
+// box_sum
+//=============================================================================
+
+void LatticeSystem::box_sum(double* field, int components)
+{
+    const int w = m_region_width;
+    const size_t k = components;
+
+    // One pass per axis, each sums the cells within w along that axis.
+    // Together they sum the whole cube.
+    size_t stride = 1;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const int n = m_dims[axis];
+        double* prefix = &m_line[0];
+
+        for (size_t start = 0; start < m_num_cells; ++start)
+        {
+            // Only visit each line once, from its first cell
+            if ((start / stride) % n != 0)
+            {
+                continue;
+            }
+
+            for (size_t c = 0; c < k; ++c)
+            {
+                prefix[c] = 0;
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                const double* cell = field + (start + i*stride) * k;
+                for (size_t c = 0; c < k; ++c)
+                {
+                    prefix[(i + 1)*k + c] = prefix[i*k + c] + cell[c];
+                }
+            }
+
+            for (int i = 0; i < n; ++i)
+            {
+                double* cell = field + (start + i*stride) * k;
+                const double* upper = prefix + (std::min(i + w, n - 1) + 1) * k;
+                const double* lower = prefix + std::max(i - w, 0) * k;
+                for (size_t c = 0; c < k; ++c)
+                {
+                    cell[c] = upper[c] - lower[c];
+                }
+            }
+        }
+
+        stride *= n;
+    }
+}
+
+//=============================================================================
+// SetRegionWidth
+//=============================================================================
+
+void LatticeSystem::SetRegionWidth(int width)
+{
+    assert(width >= 1);
+    if (width != m_region_width)
+    {
+        m_region_width = width;
+        init_rest_state();
+    }
+}
+
+//=============================================================================
+// Reset
+//=============================================================================
+
+void LatticeSystem::Reset()
+{
+    memset(m_current_vel, 0, m_num_particles*sizeof(dlib::vec3));
+    memcpy(m_current_pos, m_initial_pos, m_num_particles*sizeof(dlib::vec3));
+
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        m_rotations[i] = fmath::mat3::identity();
+        m_transforms[i].matrix = fmath::mat3::identity();
+        m_transforms[i].offset = m_initial_com;
+    }
+
+    m_max_displacement = 0;
+    m_max_goal_deviation = 0;
+}
+
+//=============================================================================
+// Update
+//=============================================================================
+
+void LatticeSystem::Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    // Do a partial integration
+    shapematch::predict(m_current_pos, m_current_vel, m_old_pos, m_num_particles,
+                        fmath::load(force), fields, dt);
+
+    // Sum x p^T and x over every region. With both sums
+    //
+    //   Apq = sum (x - c)(p - c0)^T = sum x p^T - (sum x) c0^T
+    //
+    // since the positions are summed over the same particles as c0.
+    double* field = &m_field[0];
+    memset(field, 0, m_num_cells * STEP_COMPONENTS * sizeof(double));
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        double* cell = field + m_particle_cell[i] * STEP_COMPONENTS;
+        const fmath::vec3 x = fmath::load(m_current_pos[i]);
+        const fmath::vec3& p(m_rest[i]);
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                cell[3*r + c] = x(r) * p(c);
+            }
+            cell[9 + r] = x(r);
+        }
+    }
+
+    box_sum(field, STEP_COMPONENTS);
+
+    // Shape match every region
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        const double* cell = field + m_particle_cell[i] * STEP_COMPONENTS;
+        const Region& region(m_regions[i]);
+
+        const fmath::vec3 sum_x(cell[9], cell[10], cell[11]);
+        const fmath::vec3 com = sum_x * (1 / region.mass);
+
+        fmath::mat3 Apq;
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                Apq(r, c) = cell[3*r + c] - sum_x(r) * region.rest_com(c);
+            }
+        }
+
+        // Regions can be small enough to be flattened or turned inside
+        // out, so the rotation is found iteratively from the last one
+        shapematch::extract_rotation(Apq, m_rotations[i], ROTATION_ITERATIONS);
+
+        // A region crushed flat or inside out, like against the ground,
+        // has a linear fit that scaling to its volume would blow up. It
+        // can only rotate until it has recovered.
+        fmath::mat3 goal = m_rotations[i];
+        if (m_beta > 0 && region.solid)
+        {
+            fmath::mat3 A = Apq * region.Aqq;
+            const real det_A = fmath::det(A);
+            if (det_A > MIN_LINEAR_VOLUME)
+            {
+                A = A * (1.0 / shapematch::root(det_A, 3.0));
+                goal = (A * m_beta) + (goal * (1.0 - m_beta));
+            }
+        }
+
+        Transform& transform(m_transforms[i]);
+        transform.matrix = goal;
+        transform.offset = com - goal * region.rest_com;
+    }
+
+    // Sum the transforms of the regions each particle is in. The regions
+    // are cubes, so those are the regions centered in the particle's own
+    // cube.
+    memset(field, 0, m_num_cells * STEP_COMPONENTS * sizeof(double));
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        double* cell = field + m_particle_cell[i] * STEP_COMPONENTS;
+        const Transform& transform(m_transforms[i]);
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                cell[3*r + c] = transform.matrix(r, c);
+            }
+            cell[9 + r] = transform.offset(r);
+        }
+    }
+
+    box_sum(field, STEP_COMPONENTS);
+
+    // Finish the integration
+    const real dt_inv = 1.0 / dt;
+    const real alpha_term = shapematch::scaled_alpha(m_alpha, dt, m_alpha_reference_dt);
+
+    real max_deviation_sq = 0;
+    real max_vel_sq = 0;
+    for (size_t i = 0; i < m_num_particles; ++i)
+    {
+        const double* cell = field + m_particle_cell[i] * STEP_COMPONENTS;
+        const real inv_count = 1 / m_regions[i].mass;
+
+        Transform& transform(m_transforms[i]);
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                transform.matrix(r, c) = cell[3*r + c] * inv_count;
+            }
+            transform.offset(r) = cell[9 + r] * inv_count;
+        }
+
+        const fmath::vec3 goal = (transform.matrix * m_rest[i]) + transform.offset;
+        const fmath::vec3 deviation = goal - fmath::load(m_current_pos[i]);
+
+        fmath::vec3 vel = fmath::load(m_current_vel[i]);
+        vel += deviation * (alpha_term * dt_inv);
+        fmath::store(m_current_vel[i], vel);
+        fmath::store(m_current_pos[i], m_old_pos[i] + vel * dt);
+
+        max_deviation_sq = std::max(max_deviation_sq, fmath::length_squared(deviation));
+        max_vel_sq = std::max(max_vel_sq, fmath::length_squared(vel));
+    }
+
+    m_max_goal_deviation = std::sqrt(max_deviation_sq);
+    m_max_displacement = dt * std::sqrt(max_vel_sq);
+}
+
+//=============================================================================
+// EndUpdate
+//=============================================================================
+
+void LatticeSystem::EndUpdate()
+{
+    dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh.GetData());
+    for (size_t i = 0; i < m_vertex_particle.size(); ++i)
+    {
+        const Transform& transform(m_transforms[m_vertex_particle[i]]);
+        fmath::store(data[i], (transform.matrix * m_vertex_rest[i]) + transform.offset);
+    }
+
+    // Upload the new positions to the video card.
+    m_mesh.UpdateData();
+}
+
+//=============================================================================
+// Render
+//=============================================================================
+
+void LatticeSystem::Render()
+{
+    m_mesh.Render();
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,224 @@
+#ifndef __LATTICE_HPP__
+#define __LATTICE_HPP__
+
+#include "defs.hpp"
+#include "mesh.hpp"
+#include "arena.hpp"
+#include "fmath.hpp"
+#include "forcefield.hpp"
+
+#include <vector>
+#include <algorithm>
+
+/* Shape matching on a voxel lattice, from the paper
+ *     'FastLSM: Fast Lattice Shape Matching for Robust Real-Time
+ *      Deformation'
+ * http://dl.acm.org/citation.cfm?id=1276480
+ *
+ * PSystem matches one shape to the whole body, so it can only bend as a
+ * whole. Here the body is voxelized and every particle gets its own region,
+ * the cube of particles up to the region width away in each direction.
+ * Each region is shape matched on its own, and a particle's goal is the
+ * average of the goals of all the regions it is in. Small regions make a
+ * soft body that bends locally, large regions a stiff one.
+ *
+ * The region sums are box sums over the lattice, done with three
+ * separable prefix sum passes. A step costs the same for any region
+ * width.
+ *
+ * The mesh is embedded in the lattice, each vertex follows the transform
+ * of the voxel it is in:
+ *
+ *   LatticeSystem lattice(mesh, 0.25);
+ *   lattice.Update(dt, gravity);
+ *   lattice.EndUpdate();
+ */
+class LatticeSystem
+{
+public:
+    /* Mesh must stay allocated for at least as long as this object.
+     *
+     * Params:
+     *   mesh - Closed meshes are voxelized solid, others only where their
+     *          triangles are
+     *   cell_size - The size of a voxel, one particle per voxel
+     *   region_width - See SetRegionWidth()
+     */
+    LatticeSystem(Mesh& mesh, real cell_size, int region_width = 1);
+
+    /* Performs the integration step. Does not upload the data to the
+     * video card, must call EndUpdate() before rendering.
+     *
+     * Params:
+     *   dt - timestep in seconds
+     *   force - Any forces accumulated, like gravity
+     *   fields - Spatially varying forces added to force, optional
+     */
+    void Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
+
+    /* Move the mesh vertices with their voxels and update the OpenGL
+     * buffer object.
+     */
+    void EndUpdate();
+
+    /* Calls the internal mesh's render method.
+     */
+    void Render();
+
+    /* Reset the particles to their initial state.
+     */
+    void Reset();
+
+    /* Get the positions array for modifying, usually for collision
+     * detection. Use GetNumParticles() to get the length.
+     */
+    dlib::vec3* GetPositions()
+    {
+        return m_current_pos;
+    }
+
+    /* Get the velocities array for modifying. Use GetNumParticles() to get
+     * the length.
+     */
+    dlib::vec3* GetVelocities()
+    {
+        return m_current_vel;
+    }
+
+    /* Return the number of particles, the number of solid voxels.
+     */
+    size_t GetNumParticles() const
+    {
+        return m_num_particles;
+    }
+
+    real GetAlpha() const
+    {
+        return m_alpha;
+    }
+
+    /* Same as PSystem::SetAlpha().
+     */
+    void SetAlpha(real alpha)
+    {
+        m_alpha = std::min<real>(std::max<real>(alpha, 0), 1);
+    }
+
+    real GetBeta() const
+    {
+        return m_beta;
+    }
+
+    /* Same as PSystem::SetBeta(), blends each region's linear fit with its
+     * rotation. 0 is the rotation only matching of the paper.
+     */
+    void SetBeta(real beta)
+    {
+        m_beta = std::min<real>(std::max<real>(beta, 0), 1);
+    }
+
+    /* Same as PSystem::SetAlphaReferenceDt().
+     */
+    void SetAlphaReferenceDt(real reference_dt)
+    {
+        m_alpha_reference_dt = reference_dt;
+    }
+
+    int GetRegionWidth() const
+    {
+        return m_region_width;
+    }
+
+    /* How many voxels the region of a particle reaches in each direction,
+     * at least 1. Wider regions make the body stiffer, without making
+     * Update() slower.
+     */
+    void SetRegionWidth(int width);
+
+    /* Same as PSystem::GetMaxDisplacement().
+     */
+    real GetMaxDisplacement() const
+    {
+        return m_max_displacement;
+    }
+
+    /* Same as PSystem::GetMaxGoalDeviation().
+     */
+    real GetMaxGoalDeviation() const
+    {
+        return m_max_goal_deviation;
+    }
+
+private:
+    // Not copyable
+    LatticeSystem(const LatticeSystem&);
+    LatticeSystem& operator=(const LatticeSystem&);
+
+    /* The rest state of one region, from sums over the particles in it.
+     */
+    struct Region
+    {
+        real mass; // Number of particles in the region
+        fmath::vec3 rest_com; // Center of mass at rest
+        fmath::mat3 Aqq; // Inverse of the Aqq matrix, if solid
+        bool solid; // False if the region is flat, it can only rotate
+    };
+
+    /* A per particle affine transform, goal = matrix * rest + offset.
+     */
+    struct Transform
+    {
+        fmath::mat3 matrix;
+        fmath::vec3 offset;
+    };
+
+    /* Build the lattice from the mesh triangles, and embed the vertices.
+     */
+    void voxelize(real cell_size);
+
+    /* Compute the rest state of every region for m_region_width.
+     */
+    void init_rest_state();
+
+    /* Replace every cell of a field with the sum over the cube of cells
+     * m_region_width away from it. The field has the given number of
+     * components per cell.
+     */
+    void box_sum(double* field, int components);
+
+private:
+    Mesh& m_mesh; // Underlying mesh, embedded in the lattice
+    real m_alpha; // See SetAlpha()
+    real m_beta; // See SetBeta()
+    real m_alpha_reference_dt; // Time step alpha is tuned for, 0 if unused
+    real m_max_displacement; // Largest particle movement in the last Update()
+    real m_max_goal_deviation; // Largest goal distance in the last Update()
+    int m_region_width; // See SetRegionWidth()
+
+    // The lattice covers the mesh with one empty cell of padding on each
+    // side, cell (x, y, z) has index (z*m_dims[1] + y)*m_dims[0] + x
+    int m_dims[3];
+    size_t m_num_cells;
+    fmath::vec3 m_origin; // Corner of cell (0, 0, 0)
+    std::vector<int> m_cell_particle; // Particle of each cell, -1 if empty
+    std::vector<double> m_field; // Per cell sums, up to FIELD_COMPONENTS each
+    std::vector<double> m_line; // Prefix sums of one lattice line
+
+    size_t m_num_particles; // Number of solid cells
+    fmath::vec3 m_initial_com; // Center of mass of the lattice at rest
+    Arena m_arena; // Holds all of the per particle arrays below
+    dlib::vec3* m_initial_pos; // Center of each particle's cell
+    dlib::vec3* m_current_pos;
+    dlib::vec3* m_current_vel;
+    fmath::vec3* m_old_pos; // Temporary array used during Update()
+    fmath::vec3* m_rest; // m_initial_pos - m_initial_com
+    size_t* m_particle_cell; // Cell of each particle
+    Region* m_regions; // The region centered on each particle
+    fmath::mat3* m_rotations; // Rotation of each region in the last Update()
+    Transform* m_transforms; // Averaged goal transform of each particle
+
+    std::vector<int> m_vertex_particle; // Particle each mesh vertex is in
+    std::vector<fmath::vec3> m_vertex_rest; // Rest position relative to m_initial_com
+};
+
+#endif
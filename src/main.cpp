@@ -5,8 +5,13 @@
 #include <iostream> // For cout/cerr
 
 #include <sstream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
 
 #include "application.hpp"
+#include "batch.hpp"
+#include "thread.hpp"
 
 using std::cerr;
 using std::cout;
@@ -15,10 +20,9 @@ using std::cout;
 const int window_width  = 500;
 const int window_height = 500;
 
-// Simulation variables
-const double SIM_FPS = 60.0;
-const double SIM_DT  = 1.0 / SIM_FPS;
-const double SIM_MAX_DT = 10.0 * SIM_DT;
+// Longest frame time passed to update(), keeps the camera from jumping
+// after a stall
+const double MAX_FRAME_DT = 1.0 / 6.0;
 
 // Change these to change what version of OpenGL to use
 const int desired_major_version = 3;
@@ -33,6 +37,78 @@ void GLFWCALL window_resize(int width, int height)
     resolution_changed(width, height);
 }
 
+/* Run a parameter sweep without opening a window, see BatchRunner.
+ *
+ *   meshless --batch sweep.txt [--threads N] [--out results.csv]
+ *
+ * Without --out the results are written to stdout.
+ */
+int batch_main(int argc, char* argv[])
+{
+    const char* sweep_file = NULL;
+    const char* out_file = NULL;
+    int num_threads = get_num_cpus();
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            num_threads = std::max(atoi(argv[++i]), 1);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            out_file = argv[++i];
+        }
+        else if (sweep_file == NULL)
+        {
+            sweep_file = argv[i];
+        }
+        else
+        {
+            cerr << "Unexpected argument " << argv[i] << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sweep_file == NULL)
+    {
+        cerr << "Usage: meshless --batch sweep.txt [--threads N] [--out results.csv]\n";
+        return EXIT_FAILURE;
+    }
+
+    BatchRunner runner;
+    if (!runner.LoadSweep(sweep_file))
+    {
+        return EXIT_FAILURE;
+    }
+
+    cerr << "Running " << runner.GetNumCases() << " cases on "
+         << num_threads << " threads\n";
+
+    const double start = get_time();
+    if (!runner.Run(num_threads))
+    {
+        return EXIT_FAILURE;
+    }
+    cerr << "Finished in " << get_time() - start << " seconds\n";
+
+    if (out_file != NULL)
+    {
+        std::ofstream out(out_file);
+        if (!out.is_open())
+        {
+            cerr << "Failed to open " << out_file << "\n";
+            return EXIT_FAILURE;
+        }
+        runner.WriteResults(out);
+    }
+    else
+    {
+        runner.WriteResults(cout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
 /* Setup the OpenGL context and window using GLFW. GLFW
  * is a very useful cross-platform library that will do
  * all the dirty work of setting up a window and context
@@ -41,6 +117,12 @@ void GLFWCALL window_resize(int width, int height)
  */
 int main(int argc, char* argv[])
 {
+    // Batch mode doesn't need a window
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        exit(batch_main(argc - 1, argv + 1));
+    }
+
     if (!glfwInit()) 
     {
         cerr << "Failed to initialize GLFW\n";
@@ -152,30 +234,21 @@ int main(int argc, char* argv[])
     double time_passed = 0;
 
     bool quit = false;
-    double sim_time = 0.0;
 
+    // The simulation runs on its own thread (see application.cpp), this
+    // loop only handles input and rendering.
     double previous_time = glfwGetTime();
     while (!quit && glfwGetWindowParam(GLFW_OPENED) && !glfwGetKey(GLFW_KEY_ESC))
     {
         // Get the elapsed time since the last update
         double current_time = glfwGetTime();
-        const double delta_time = std::min(current_time - previous_time, SIM_MAX_DT);
+        const double delta_time = std::min(current_time - previous_time, MAX_FRAME_DT);
         previous_time = current_time;
 
-        sim_time += delta_time;
-        if (sim_time > SIM_MAX_DT)
-        {
-            sim_time = SIM_MAX_DT;
-        }
-
-        while (sim_time >= SIM_DT)
+        glfwPollEvents();
+        if (!update(delta_time))
         {
-            glfwPollEvents();
-            sim_time -= SIM_DT;
-            if (!update(SIM_DT))
-            {
-                quit = true;
-            }
+            quit = true;
         }
 
         // Render the application's state
@@ -1,6 +1,12 @@
 #include "mesh.hpp"
 
 #include <cassert>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //=============================================================================
 // Static data
@@ -16,10 +22,17 @@ unsigned char Mesh::TEXCOORDS = 0x4;
 Mesh::Mesh() : 
     m_vao(0), 
     m_vbo(0),
-    m_mesh(),
+    m_attribute_vbo(0),
+    m_positions(),
+    m_attributes(),
+    m_packed(),
+    m_position_format(FLOAT_POSITIONS),
     m_primitiveType(GL_TRIANGLES),
     m_data_types(VERTICES | NORMALS | TEXCOORDS)
-{ }
+{
+    const real zero[3] = { 0, 0, 0 };
+    SetPositionBounds(zero, zero);
+}
 
 //=============================================================================
 // Destructor
@@ -50,7 +63,19 @@ void Mesh::cleanup()
         m_vbo = 0;
     }
 
-    m_mesh.clear();
+    if (m_attribute_vbo != 0)
+    {
+        glDeleteBuffers(1, &m_attribute_vbo);
+        m_attribute_vbo = 0;
+    }
+
+    m_positions.clear();
+    m_attributes.clear();
+    m_packed.clear();
+
+    m_position_format = FLOAT_POSITIONS;
+    const real zero[3] = { 0, 0, 0 };
+    SetPositionBounds(zero, zero);
 }
 
 //=============================================================================
@@ -107,17 +132,17 @@ void Mesh::AddTriangle(const dlib::vec3& p1, const dlib::vec2& t1, const dlib::v
     assert(m_vbo == 0);
     assert(m_data_types == (VERTICES | NORMALS | TEXCOORDS));
 
-    addToVector(m_mesh, p1);
-    addToVector(m_mesh, n1);
-    addToVector(m_mesh, t1);
+    addToVector(m_positions, p1);
+    addToVector(m_attributes, n1);
+    addToVector(m_attributes, t1);
 
-    addToVector(m_mesh, p2);
-    addToVector(m_mesh, n2);
-    addToVector(m_mesh, t2);
+    addToVector(m_positions, p2);
+    addToVector(m_attributes, n2);
+    addToVector(m_attributes, t2);
 
-    addToVector(m_mesh, p3);
-    addToVector(m_mesh, n3);
-    addToVector(m_mesh, t3);
+    addToVector(m_positions, p3);
+    addToVector(m_attributes, n3);
+    addToVector(m_attributes, t3);
 }
 
 //=============================================================================
@@ -132,14 +157,14 @@ void Mesh::AddTriangle(const dlib::vec3& p1, const dlib::vec2& t1,
     assert(m_vbo == 0);
     assert(m_data_types == (VERTICES | TEXCOORDS));
 
-    addToVector(m_mesh, p1);
-    addToVector(m_mesh, t1);
+    addToVector(m_positions, p1);
+    addToVector(m_attributes, t1);
 
-    addToVector(m_mesh, p2);
-    addToVector(m_mesh, t2);
+    addToVector(m_positions, p2);
+    addToVector(m_attributes, t2);
 
-    addToVector(m_mesh, p3);
-    addToVector(m_mesh, t3);
+    addToVector(m_positions, p3);
+    addToVector(m_attributes, t3);
 }
 
 //=============================================================================
@@ -154,14 +179,14 @@ void Mesh::AddTriangle(const dlib::vec3& p1, const dlib::vec3& n1,
     assert(m_vbo == 0);
     assert(m_data_types == (VERTICES | NORMALS));
 
-    addToVector(m_mesh, p1);
-    addToVector(m_mesh, n1);
+    addToVector(m_positions, p1);
+    addToVector(m_attributes, n1);
 
-    addToVector(m_mesh, p2);
-    addToVector(m_mesh, n2);
+    addToVector(m_positions, p2);
+    addToVector(m_attributes, n2);
 
-    addToVector(m_mesh, p3);
-    addToVector(m_mesh, n3);
+    addToVector(m_positions, p3);
+    addToVector(m_attributes, n3);
 }
 
 //=============================================================================
@@ -174,9 +199,9 @@ void Mesh::AddTriangle(const dlib::vec3& p1, const dlib::vec3& p2, const dlib::v
     assert(m_vbo == 0);
     assert(m_data_types == VERTICES);
 
-    addToVector(m_mesh, p1);
-    addToVector(m_mesh, p2);
-    addToVector(m_mesh, p3);
+    addToVector(m_positions, p1);
+    addToVector(m_positions, p2);
+    addToVector(m_positions, p3);
 }
 
 //=============================================================================
@@ -237,52 +262,41 @@ void Mesh::Finish()
 {
     assert(m_vao == 0);
     assert(m_vbo == 0);
-    assert(m_mesh.size() != 0);
+    assert(m_positions.size() != 0);
+    assert((m_data_types & VERTICES) > 0);
+    assert(m_attributes.size() == m_positions.size() / 3 * attribute_size());
 
     glGenVertexArrays(1, &m_vao);
     glGenBuffers(1, &m_vbo);
 
     assert(m_vao != 0);
     assert(m_vbo != 0);
-    assert(m_data_types > 0);
 
     glBindVertexArray(m_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-
-    size_t size = m_mesh.size() * sizeof(real);
-    glBufferData(GL_ARRAY_BUFFER, size, &m_mesh[0], GL_STATIC_DRAW);
-
-    // Setup the vertex buffers
-    int ptr_index = 0;
-    int stride = 0;
-
-    // Figure out how many flags are enabled
-    if ((m_data_types & VERTICES) > 0) 
-    {
-        stride += 3;
-    }
 
-    if ((m_data_types & NORMALS) > 0)
-    {
-        stride += 3;
-    }
+    // The positions are in a buffer of their own, so UpdateData() only
+    // sends them again
+    setup_positions();
+    int ptr_index = 1;
 
-    if ((m_data_types & TEXCOORDS) > 0)
+    // The normals and texture coordinates never change
+    if (m_attributes.empty())
     {
-        stride += 2;
+        glEnableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        return;
     }
 
-    stride *= sizeof(real);
+    glGenBuffers(1, &m_attribute_vbo);
+    assert(m_attribute_vbo != 0);
+    glBindBuffer(GL_ARRAY_BUFFER, m_attribute_vbo);
+    glBufferData(GL_ARRAY_BUFFER, m_attributes.size() * sizeof(real), &m_attributes[0],
+                 GL_STATIC_DRAW);
 
+    const int stride = attribute_size() * sizeof(real);
     long offset = 0;
 
-    if ((m_data_types & VERTICES) > 0)
-    {
-        glVertexAttribPointer(ptr_index, 3, GL_REAL, GL_FALSE, stride, (void*)offset);
-        ++ptr_index;
-        offset += 3*sizeof(real);
-    }
-
     if ((m_data_types & NORMALS) > 0)
     {
         glVertexAttribPointer(ptr_index, 3, GL_REAL, GL_FALSE, stride, (void*)offset);
@@ -307,6 +321,42 @@ void Mesh::Finish()
     glBindVertexArray(0);
 }
 
+//=============================================================================
+// setup_positions
+//=============================================================================
+
+void Mesh::setup_positions()
+{
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    if (m_position_format == FLOAT_POSITIONS)
+    {
+        glBufferData(GL_ARRAY_BUFFER, m_positions.size() * sizeof(real), &m_positions[0],
+                     GL_DYNAMIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_REAL, GL_FALSE, 3*sizeof(real), (void*)0);
+        return;
+    }
+
+    // Packed vertices are padded to 8 bytes so each one starts on a 4
+    // byte boundary, which the video card wants
+    real min[3];
+    real max[3];
+    FindBounds(&m_positions[0], m_positions.size() / 3, min, max);
+    SetPositionBounds(min, max);
+    m_packed.resize(m_positions.size() / 3 * 4);
+    PackPositions(&m_positions[0], m_positions.size() / 3, &m_packed[0]);
+
+    glBufferData(GL_ARRAY_BUFFER, m_packed.size() * sizeof(uint16_t), &m_packed[0],
+                 GL_DYNAMIC_DRAW);
+    if (m_position_format == HALF_POSITIONS)
+    {
+        glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, 4*sizeof(uint16_t), (void*)0);
+    }
+    else
+    {
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 4*sizeof(uint16_t), (void*)0);
+    }
+}
+
 //=============================================================================
 // UpdateData
 //=============================================================================
@@ -315,10 +365,299 @@ void Mesh::UpdateData()
 {
     assert(m_vao != 0);
     assert(m_vbo != 0);
-    assert(m_mesh.size() > 0);
+    assert(m_positions.size() > 0);
+
+    if (m_position_format == FLOAT_POSITIONS)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, m_positions.size()*sizeof(real), &m_positions[0]);
+        return;
+    }
+
+    real min[3];
+    real max[3];
+    FindBounds(&m_positions[0], m_positions.size() / 3, min, max);
+    SetPositionBounds(min, max);
+    m_packed.resize(m_positions.size() / 3 * 4);
+    PackPositions(&m_positions[0], m_positions.size() / 3, &m_packed[0]);
+    UpdatePackedData();
+}
+
+//=============================================================================
+// UpdatePackedData
+//=============================================================================
+
+void Mesh::UpdatePackedData()
+{
+    assert(m_vao != 0);
+    assert(m_vbo != 0);
+    assert(m_position_format != FLOAT_POSITIONS);
+    assert(m_packed.size() == m_positions.size() / 3 * 4);
 
     glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, m_mesh.size()*sizeof(real), &m_mesh[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, m_packed.size()*sizeof(uint16_t), &m_packed[0]);
+}
+
+//=============================================================================
+// SetPositionFormat
+//=============================================================================
+
+void Mesh::SetPositionFormat(PositionFormat format)
+{
+    m_position_format = format;
+    if (format == FLOAT_POSITIONS)
+    {
+        m_packed.clear();
+        const real zero[3] = { 0, 0, 0 };
+        SetPositionBounds(zero, zero);
+    }
+    else
+    {
+        m_packed.resize(m_positions.size() / 3 * 4);
+    }
+
+    // A finished mesh gets a new position buffer in the new format
+    if (m_vao != 0)
+    {
+        glBindVertexArray(m_vao);
+        setup_positions();
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+}
+
+//=============================================================================
+// SetPositionBounds
+//=============================================================================
+
+void Mesh::SetPositionBounds(const real* min, const real* max)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        const real extent = max[i] - min[i];
+        if (m_position_format == FLOAT_POSITIONS)
+        {
+            m_position_offset[i] = 0;
+            m_position_scale[i] = 1;
+            m_pack_factor[i] = 1;
+        }
+        else if (m_position_format == HALF_POSITIONS)
+        {
+            // Half floats are most precise close to 0
+            m_position_offset[i] = min[i] + 0.5 * extent;
+            m_position_scale[i] = 1;
+            m_pack_factor[i] = 1;
+        }
+        else
+        {
+            // A flat side packs to 0, which is unpacked to min
+            m_position_offset[i] = min[i];
+            m_position_scale[i] = extent;
+            m_pack_factor[i] = extent > 0 ? 65535 / extent : 0;
+        }
+    }
+}
+
+//=============================================================================
+// to_half
+//=============================================================================
+
+/* Round a float to the nearest half float. Anything too small for a normal
+ * half becomes 0 and anything too large the largest one. Does the same as
+ * the SSE2 version in PackPositions(), for processors without it.
+ */
+static inline uint16_t to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+
+    // Round the mantissa to 10 bits, a carry goes into the exponent, and
+    // move the exponent bias from 127 to 15
+    int32_t magnitude = static_cast<int32_t>(((bits & 0x7fffffff) + 0x1000) >> 13) -
+                        ((127 - 15) << 10);
+    magnitude = magnitude < 0 ? 0 : magnitude;
+    magnitude = magnitude > 0x7bff ? 0x7bff : magnitude;
+    return static_cast<uint16_t>(sign | magnitude);
+}
+
+#ifdef __SSE2__
+
+/* x, y, z of a vertex in the first three lanes. Reading four reals would
+ * go past the end of the array for the last vertex, so it is copied.
+ */
+static inline __m128 load_vertex(const float* positions, size_t i, size_t count)
+{
+    if (i + 1 < count)
+    {
+        return _mm_loadu_ps(positions + 3*i);
+    }
+    const float last[4] = { positions[3*i+0], positions[3*i+1], positions[3*i+2], 0 };
+    return _mm_loadu_ps(last);
+}
+
+/* The same when real is double, rounded to float. Packing keeps 16 bits at
+ * most, and the bounds only have to cover the rounded positions.
+ */
+static inline __m128 load_vertex(const double* positions, size_t i, size_t)
+{
+    return _mm_setr_ps(static_cast<float>(positions[3*i+0]),
+                       static_cast<float>(positions[3*i+1]),
+                       static_cast<float>(positions[3*i+2]), 0);
+}
+
+/* Store the low 16 bits of each lane, the fourth lane as 0. The values
+ * must be 0 to 65535, they are moved into the signed range for the
+ * saturating pack and back.
+ */
+static inline void store_packed(__m128i values, uint16_t* packed)
+{
+    const __m128i xyz = _mm_set_epi32(0, -1, -1, -1);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    values = _mm_sub_epi32(_mm_and_si128(values, xyz), bias);
+    const __m128i shorts = _mm_xor_si128(_mm_packs_epi32(values, values),
+                                         _mm_set1_epi16(-0x8000));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(packed), shorts);
+}
+
+#endif
+
+//=============================================================================
+// PackPositions
+//=============================================================================
+
+void Mesh::PackPositions(const real* positions, size_t count, uint16_t* packed) const
+{
+    assert(m_position_format != FLOAT_POSITIONS);
+
+#ifdef __SSE2__
+    const __m128 offset = _mm_setr_ps(m_position_offset[0], m_position_offset[1],
+                                      m_position_offset[2], 0);
+    const __m128 factor = _mm_setr_ps(m_pack_factor[0], m_pack_factor[1],
+                                      m_pack_factor[2], 0);
+
+    if (m_position_format == HALF_POSITIONS)
+    {
+        const __m128i sign_mask = _mm_set1_epi32(0x8000);
+        const __m128i magnitude_mask = _mm_set1_epi32(0x7fffffff);
+        const __m128i round = _mm_set1_epi32(0x1000);
+        const __m128i rebias = _mm_set1_epi32((127 - 15) << 10);
+        const __m128i largest = _mm_set1_epi32(0x7bff);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const __m128 value = _mm_mul_ps(_mm_sub_ps(load_vertex(positions, i, count), offset),
+                                            factor);
+
+            // See to_half()
+            const __m128i bits = _mm_castps_si128(value);
+            const __m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), sign_mask);
+            __m128i magnitude = _mm_add_epi32(_mm_and_si128(bits, magnitude_mask), round);
+            magnitude = _mm_sub_epi32(_mm_srli_epi32(magnitude, 13), rebias);
+            magnitude = _mm_andnot_si128(_mm_cmplt_epi32(magnitude, _mm_setzero_si128()),
+                                         magnitude);
+            const __m128i too_large = _mm_cmpgt_epi32(magnitude, largest);
+            magnitude = _mm_or_si128(_mm_andnot_si128(too_large, magnitude),
+                                     _mm_and_si128(too_large, largest));
+            store_packed(_mm_or_si128(sign, magnitude), packed + 4*i);
+        }
+        return;
+    }
+
+    const __m128 half = _mm_set1_ps(0.5);
+    const __m128 largest = _mm_set1_ps(65535);
+    for (size_t i = 0; i < count; ++i)
+    {
+        __m128 value = _mm_sub_ps(load_vertex(positions, i, count), offset);
+        value = _mm_add_ps(_mm_mul_ps(value, factor), half);
+        value = _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), largest);
+        store_packed(_mm_cvttps_epi32(value), packed + 4*i);
+    }
+#else
+    const real ox = m_position_offset[0];
+    const real oy = m_position_offset[1];
+    const real oz = m_position_offset[2];
+    const real fx = m_pack_factor[0];
+    const real fy = m_pack_factor[1];
+    const real fz = m_pack_factor[2];
+
+    if (m_position_format == HALF_POSITIONS)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            packed[4*i+0] = to_half((positions[3*i+0] - ox) * fx);
+            packed[4*i+1] = to_half((positions[3*i+1] - oy) * fy);
+            packed[4*i+2] = to_half((positions[3*i+2] - oz) * fz);
+            packed[4*i+3] = 0;
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        real x = (positions[3*i+0] - ox) * fx + 0.5;
+        real y = (positions[3*i+1] - oy) * fy + 0.5;
+        real z = (positions[3*i+2] - oz) * fz + 0.5;
+        x = x < 0 ? 0 : (x > 65535 ? 65535 : x);
+        y = y < 0 ? 0 : (y > 65535 ? 65535 : y);
+        z = z < 0 ? 0 : (z > 65535 ? 65535 : z);
+        packed[4*i+0] = static_cast<uint16_t>(x);
+        packed[4*i+1] = static_cast<uint16_t>(y);
+        packed[4*i+2] = static_cast<uint16_t>(z);
+        packed[4*i+3] = 0;
+    }
+#endif
+}
+
+//=============================================================================
+// FindBounds
+//=============================================================================
+
+void Mesh::FindBounds(const real* positions, size_t count, real* min, real* max)
+{
+    assert(count > 0);
+
+#ifdef __SSE2__
+    __m128 low = load_vertex(positions, 0, count);
+    __m128 high = low;
+    for (size_t i = 1; i < count; ++i)
+    {
+        const __m128 vertex = load_vertex(positions, i, count);
+        low = _mm_min_ps(low, vertex);
+        high = _mm_max_ps(high, vertex);
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, low);
+    min[0] = lanes[0];
+    min[1] = lanes[1];
+    min[2] = lanes[2];
+    _mm_storeu_ps(lanes, high);
+    max[0] = lanes[0];
+    max[1] = lanes[1];
+    max[2] = lanes[2];
+#else
+    real min_x = positions[0], min_y = positions[1], min_z = positions[2];
+    real max_x = min_x, max_y = min_y, max_z = min_z;
+    for (size_t i = 1; i < count; ++i)
+    {
+        const real x = positions[3*i+0];
+        const real y = positions[3*i+1];
+        const real z = positions[3*i+2];
+        min_x = x < min_x ? x : min_x;
+        min_y = y < min_y ? y : min_y;
+        min_z = z < min_z ? z : min_z;
+        max_x = x > max_x ? x : max_x;
+        max_y = y > max_y ? y : max_y;
+        max_z = z > max_z ? z : max_z;
+    }
+
+    min[0] = min_x;
+    min[1] = min_y;
+    min[2] = min_z;
+    max[0] = max_x;
+    max[1] = max_y;
+    max[2] = max_z;
+#endif
 }
 
 //=============================================================================
@@ -361,7 +700,7 @@ void Mesh::AddPoint(const dlib::vec3& point)
     assert(m_vbo == 0);
     assert(m_data_types == VERTICES);
 
-    addToVector(m_mesh, point);
+    addToVector(m_positions, point);
 }
 
 //=============================================================================
@@ -374,8 +713,8 @@ void Mesh::AddPoint(const dlib::vec3& point, const dlib::vec3& norm)
     assert(m_vbo == 0);
     assert(m_data_types == (VERTICES | NORMALS));
 
-    addToVector(m_mesh, point);
-    addToVector(m_mesh, norm);
+    addToVector(m_positions, point);
+    addToVector(m_attributes, norm);
 }
 
 //=============================================================================
@@ -389,9 +728,123 @@ void Mesh::AddPoint(const dlib::vec3& point, const dlib::vec3& norm,
     assert(m_vbo == 0);
     assert(m_data_types == (VERTICES | TEXCOORDS | NORMALS));
 
-    addToVector(m_mesh, point);
-    addToVector(m_mesh, norm);
-    addToVector(m_mesh, texCoord);
+    addToVector(m_positions, point);
+    addToVector(m_attributes, norm);
+    addToVector(m_attributes, texCoord);
+}
+
+//=============================================================================
+// SetGeometry
+//=============================================================================
+
+bool Mesh::SetGeometry(const real* vertices, const real* normals, const real* texcoords,
+                       size_t num_vertices, const unsigned int* indices, size_t num_indices)
+{
+    assert(m_vao == 0);
+    assert(m_vbo == 0);
+    assert(IsFlagEnabled(VERTICES) && vertices != NULL);
+    assert(IsFlagEnabled(NORMALS) == (normals != NULL));
+    assert(IsFlagEnabled(TEXCOORDS) == (texcoords != NULL));
+
+    const size_t count = indices != NULL ? num_indices : num_vertices;
+    if (!whole_primitives(count))
+    {
+        std::cerr << "Mesh geometry doesn't make whole primitives" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; indices != NULL && i < num_indices; ++i)
+    {
+        if (indices[i] >= num_vertices)
+        {
+            std::cerr << "Mesh index out of range: " << indices[i] << std::endl;
+            return false;
+        }
+    }
+
+    // Without indices the vertices are the position buffer
+    m_attributes.resize(count * attribute_size());
+    if (indices == NULL)
+    {
+        m_positions.assign(vertices, vertices + 3*num_vertices);
+    }
+    else
+    {
+        m_positions.resize(3*count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            memcpy(&m_positions[3*i], vertices + 3*indices[i], 3*sizeof(real));
+        }
+    }
+
+    real* out = m_attributes.empty() ? NULL : &m_attributes[0];
+    for (size_t i = 0; out != NULL && i < count; ++i)
+    {
+        const size_t vertex = indices != NULL ? indices[i] : i;
+        if (normals != NULL)
+        {
+            memcpy(out, normals + 3*vertex, 3*sizeof(real));
+            out += 3;
+        }
+        if (texcoords != NULL)
+        {
+            memcpy(out, texcoords + 2*vertex, 2*sizeof(real));
+            out += 2;
+        }
+    }
+    return true;
+}
+
+//=============================================================================
+// SwapData
+//=============================================================================
+
+bool Mesh::SwapData(std::vector<real>& positions, std::vector<real>* attributes)
+{
+    assert(m_vao == 0);
+    assert(m_vbo == 0);
+    assert((attributes != NULL) == (attribute_size() > 0));
+
+    const size_t count = positions.size() / 3;
+    if (positions.size() % 3 != 0 || !whole_primitives(count) ||
+        (attributes != NULL && attributes->size() != count * attribute_size()))
+    {
+        std::cerr << "Mesh data doesn't make whole primitives" << std::endl;
+        return false;
+    }
+
+    m_positions.swap(positions);
+    if (attributes != NULL)
+    {
+        m_attributes.swap(*attributes);
+    }
+    return true;
+}
+
+//=============================================================================
+// attribute_size
+//=============================================================================
+
+size_t Mesh::attribute_size() const
+{
+    size_t size = 0;
+    if ((m_data_types & NORMALS) > 0)
+    {
+        size += 3;
+    }
+    if ((m_data_types & TEXCOORDS) > 0)
+    {
+        size += 2;
+    }
+    return size;
+}
+
+//=============================================================================
+// whole_primitives
+//=============================================================================
+
+bool Mesh::whole_primitives(size_t count) const
+{
+    return m_primitiveType != GL_TRIANGLES || count % 3 == 0;
 }
 
 //=============================================================================
@@ -406,7 +859,7 @@ void Mesh::Render()
 
     glBindVertexArray(m_vao);
 
-    glDrawArrays(m_primitiveType, 0, m_mesh.size());
+    glDrawArrays(m_primitiveType, 0, m_positions.size() / 3);
 }
 
 //=============================================================================
@@ -4,6 +4,7 @@
 #include "defs.hpp"
 
 #include <vector>
+#include <stdint.h>
 #include <GL/gl.h>
 
 /* Represents a simple 3D mesh. This class provides a simple wrapper around the
@@ -15,6 +16,11 @@
  *   1 - dlib::vec3 - Normal for the vertex
  *   2 - dlib::vec2 - Texture coordinate of the vertex
  *
+ * The positions are kept in a buffer of their own and the other values
+ * interleaved in a second one, so a simulated mesh only uploads its
+ * positions again (see UpdateData()). They can be sent in 16 bits per
+ * coordinate instead of 32, see SetPositionFormat().
+ *
  * In the vertex shader the 'layout(location = x)' format should be used to make
  * sure the variable match up with the above buffer locations.
  *
@@ -134,6 +140,43 @@ public:
 
     void AddPoint(const dlib::vec3& p, const dlib::vec3& norm, const dlib::vec2& texCoord);
 
+    /* Build the whole mesh from separate arrays instead of one primitive at
+     * a time, for large meshes. Everything is checked first, then the
+     * buffer is sized once and filled in one pass. Replaces anything added
+     * since NewMesh().
+     *
+     * Params:
+     *   vertices - x, y, z of each vertex
+     *   normals - x, y, z of each vertex, only if NORMALS is included
+     *   texcoords - u, v of each vertex, only if TEXCOORDS is included
+     *   num_vertices - Length of the arrays, in vertices
+     *   indices - Vertices of each primitive, three per triangle. NULL to
+     *             take the vertices in order.
+     *   num_indices - Length of indices
+     *
+     * Returns:
+     *   False if an index is out of range or they don't make whole
+     *   primitives, nothing is changed then.
+     */
+    bool SetGeometry(const real* vertices, const real* normals, const real* texcoords,
+                     size_t num_vertices, const unsigned int* indices = NULL,
+                     size_t num_indices = 0);
+
+    /* Take over buffers that are already laid out like the mesh stores
+     * them, without copying them. The buffers are swapped, the arguments
+     * get whatever the mesh held before.
+     *
+     * Params:
+     *   positions - x, y, z of each vertex, like GetData()
+     *   attributes - The normal and then the texture coordinates of each
+     *                vertex, whichever are included. NULL if neither is.
+     *
+     * Returns:
+     *   False if they don't hold whole primitives, nothing is changed
+     *   then.
+     */
+    bool SwapData(std::vector<real>& positions, std::vector<real>* attributes = NULL);
+
     /* Finishes creation of the mesh. Any changes after this method will not be saved.
      * In fact none of the Add* methods should be called after this method. To start
      * creation of a new mesh the 'NewMesh()' method should be called, and then the Add*
@@ -186,34 +229,143 @@ public:
         return (m_data_types & flag) > 0;
     }
 
-    /* Access the data directly.
+    /* Access the vertex positions directly, x, y, z of each vertex.
      */
     real* GetData()
     {
-        return &m_mesh[0];
+        return &m_positions[0];
     }
 
-    /* Get the number of elements in the buffer, these are of
+    /* Get the number of elements in the position buffer, these are of
      * real type. NOT the bytes.
      */
     size_t GetDataSize()
     {
-        return m_mesh.size();
+        return m_positions.size();
     }
 
-    /* Upload the current data to the video card.
+    /* Upload the current positions to the video card. The normals and
+     * texture coordinates were uploaded once by Finish(). Positions sent
+     * in 16 bits are packed first, with bounds that fit all of them.
      */
     void UpdateData();
 
+    /* How the positions are sent to the video card. GetData() always
+     * holds them as reals, only the copy on the video card is smaller.
+     *
+     *   FLOAT_POSITIONS - As they are
+     *   HALF_POSITIONS - Half floats, relative to the center of the bounds
+     *   UNORM16_POSITIONS - 0 to 65535 from one side of the bounds to the
+     *                       other
+     *
+     * The vertex shader gets the packed value and has to turn it back into
+     * a position with GetPositionOffset() and GetPositionScale():
+     *
+     *   position = position_offset + vertex * position_scale
+     */
+    enum PositionFormat
+    {
+        FLOAT_POSITIONS,
+        HALF_POSITIONS,
+        UNORM16_POSITIONS
+    };
+
+    /* Change how the positions are sent, may be called before or after
+     * Finish(). NewMesh() goes back to FLOAT_POSITIONS.
+     */
+    void SetPositionFormat(PositionFormat format);
+
+    PositionFormat GetPositionFormat() const
+    {
+        return m_position_format;
+    }
+
+    /* Set the box the packed positions are relative to, for
+     * PackPositions(). Positions outside of it are clamped.
+     *
+     * Params:
+     *   min - x, y, z of the lowest corner
+     *   max - x, y, z of the highest corner
+     */
+    void SetPositionBounds(const real* min, const real* max);
+
+    /* Offset and scale that turn the uploaded positions back into real
+     * ones, see PositionFormat. 0 and 1 for FLOAT_POSITIONS.
+     */
+    const real* GetPositionOffset() const
+    {
+        return m_position_offset;
+    }
+
+    const real* GetPositionScale() const
+    {
+        return m_position_scale;
+    }
+
+    /* Pack positions for the video card in the current format, relative to
+     * the current bounds. Each vertex is packed with SSE2 instructions
+     * where the processor has them.
+     *
+     * Params:
+     *   positions - x, y, z of each vertex
+     *   count - Number of vertices
+     *   packed - Filled with 4 values per vertex, the last is padding
+     */
+    void PackPositions(const real* positions, size_t count, uint16_t* packed) const;
+
+    /* The packed positions, 4 values per vertex like PackPositions()
+     * writes them. Empty for FLOAT_POSITIONS.
+     */
+    uint16_t* GetPackedData()
+    {
+        return &m_packed[0];
+    }
+
+    /* Upload GetPackedData() as it is, for callers that packed the
+     * positions themselves while moving them. Nothing is packed here.
+     */
+    void UpdatePackedData();
+
+    /* Get the smallest and largest coordinates of some positions.
+     *
+     * Params:
+     *   positions - x, y, z of each vertex
+     *   count - Number of vertices, at least 1
+     *   min - Filled with the smallest x, y and z
+     *   max - Filled with the largest x, y and z
+     */
+    static void FindBounds(const real* positions, size_t count, real* min, real* max);
+
 private:
     /* Resets the mesh to a clean state.
      */
     void cleanup();
+
+    /* Number of reals each vertex takes in m_attributes, for the included
+     * data.
+     */
+    size_t attribute_size() const;
+
+    /* True if count vertices make whole primitives.
+     */
+    bool whole_primitives(size_t count) const;
+
+    /* Create the position buffer in the current format and point
+     * attribute 0 at it. The vertex array must be bound.
+     */
+    void setup_positions();
     
 protected:
     GLuint m_vao; // Vertex array object
-    GLuint m_vbo; // Vertex buffer object
-    std::vector<real> m_mesh; // The vertices/normals/texture coords
+    GLuint m_vbo; // Vertex buffer object of the positions
+    GLuint m_attribute_vbo; // Vertex buffer object of the rest, 0 if there is none
+    std::vector<real> m_positions; // The vertices
+    std::vector<real> m_attributes; // The normals/texture coords
+    std::vector<uint16_t> m_packed; // The positions as uploaded, unless they're reals
+    PositionFormat m_position_format;
+    real m_position_offset[3]; // See GetPositionOffset()
+    real m_position_scale[3];
+    real m_pack_factor[3]; // Multiplies positions relative to m_position_offset when packing
     GLenum m_primitiveType; // The type passed to glDrawArrays()
     unsigned char m_data_types; // Stores the current flags
 };
@@ -1,10 +1,17 @@
 #include "objloader.hpp"
+#include "fmath.hpp"
 
 #include <iostream>
 #include <sstream>
+#include <cassert>
+#include <cmath>
 #include <fstream>
 #include <vector>
 
+// Faces meeting at a vertex at a larger angle than this (cos of 60
+// degrees) don't share a normal there, see make_normals()
+static const real CREASE_COS = 0.5;
+
 //=============================================================================
 // Constructor
 //=============================================================================
@@ -210,11 +217,11 @@ bool ObjLoader::Load(std::istream& stream)
 // check_indices 
 //=============================================================================
 
-static bool check_indices(int arr[3])
+static bool check_indices(int arr[3], size_t size)
 {
     for (int i = 0; i < 3; ++i)
     {
-        if (arr[i] < 0) 
+        if (arr[i] < 0 || static_cast<size_t>(arr[i]) >= size) 
         {
             return false;
         }
@@ -227,7 +234,7 @@ static bool check_indices(int arr[3])
 // ToMesh
 //=============================================================================
 
-bool ObjLoader::ToMesh(Mesh& mesh, unsigned char flags)
+bool ObjLoader::ToMesh(Mesh& mesh, unsigned char flags, bool finish)
 {
     if (!m_is_loaded)
     {
@@ -240,9 +247,14 @@ bool ObjLoader::ToMesh(Mesh& mesh, unsigned char flags)
     using namespace std;
     cout << "Loaded: " << m_faces.size() << "\n";
 
+    // The whole mesh is built at once
+    assert((flags & Mesh::VERTICES) > 0);
+    const bool normals = (flags & Mesh::NORMALS) > 0;
+    const bool texcoords = (flags & Mesh::TEXCOORDS) > 0;
+    std::vector<unsigned int> indices(3*m_faces.size());
     for (size_t i = 0; i < m_faces.size(); ++i)
     {
-        if (!check_indices(m_faces[i].val.vert))
+        if (!check_indices(m_faces[i].val.vert, m_verts.size()))
         {
             std::cerr << "Bad vertex index" << std::endl;
             cout << m_faces[i].val.vert[0] << " "; 
@@ -250,19 +262,137 @@ bool ObjLoader::ToMesh(Mesh& mesh, unsigned char flags)
             cout << m_faces[i].val.vert[2] << "\n"; 
             return false;
         }
+        if ((normals && !m_norms.empty() &&
+             !check_indices(m_faces[i].val.norm, m_norms.size())) ||
+            (texcoords && !check_indices(m_faces[i].val.tex, m_texs.size())))
+        {
+            std::cerr << "Bad normal or texture index" << std::endl;
+            return false;
+        }
 
-        const dlib::vec3& v1(m_verts[m_faces[i].val.vert[0]]);
-        const dlib::vec3& v2(m_verts[m_faces[i].val.vert[1]]);
-        const dlib::vec3& v3(m_verts[m_faces[i].val.vert[2]]);
+        for (int j = 0; j < 3; ++j)
+        {
+            indices[3*i + j] = m_faces[i].val.vert[j];
+        }
+    }
 
-        mesh.AddTriangle(v1, v2, v3);
+    if (indices.empty())
+    {
+        return false;
+    }
+
+    // Positions only, they can be indexed directly. Otherwise the fields of
+    // a face corner have their own indices, and every corner becomes a
+    // vertex.
+    bool built;
+    if (!normals && !texcoords)
+    {
+        built = mesh.SetGeometry(reinterpret_cast<const real*>(&m_verts[0]), NULL, NULL,
+                                 m_verts.size(), &indices[0], indices.size());
+    }
+    else
+    {
+        std::vector<dlib::vec3> corner_verts(indices.size());
+        std::vector<dlib::vec3> corner_norms(normals ? indices.size() : 0);
+        std::vector<dlib::vec2> corner_texs(texcoords ? indices.size() : 0);
+        const bool file_normals = normals && !m_norms.empty();
+        if (normals && !file_normals)
+        {
+            make_normals(corner_norms);
+        }
+
+        for (size_t i = 0; i < m_faces.size(); ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                corner_verts[3*i + j] = m_verts[m_faces[i].val.vert[j]];
+                if (file_normals)
+                {
+                    corner_norms[3*i + j] = m_norms[m_faces[i].val.norm[j]];
+                }
+                if (texcoords)
+                {
+                    corner_texs[3*i + j] = m_texs[m_faces[i].val.tex[j]];
+                }
+            }
+        }
+
+        built = mesh.SetGeometry(
+            reinterpret_cast<const real*>(&corner_verts[0]),
+            normals ? reinterpret_cast<const real*>(&corner_norms[0]) : NULL,
+            texcoords ? reinterpret_cast<const real*>(&corner_texs[0]) : NULL,
+            corner_verts.size());
+    }
+
+    if (!built)
+    {
+        return false;
     }
 
-    mesh.Finish();
+    if (finish)
+    {
+        mesh.Finish();
+    }
 
     return true;
 }
 
+//=============================================================================
+// make_normals
+//=============================================================================
+
+void ObjLoader::make_normals(std::vector<dlib::vec3>& corner_norms) const
+{
+    // The faces around each vertex, and the normal of each face scaled by
+    // twice its area
+    std::vector<std::vector<size_t> > vertex_faces(m_verts.size());
+    std::vector<fmath::vec3> face_norms(m_faces.size());
+    for (size_t i = 0; i < m_faces.size(); ++i)
+    {
+        fmath::vec3 p[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            const dlib::vec3& v(m_verts[m_faces[i].val.vert[j]]);
+            p[j] = fmath::vec3(v(0), v(1), v(2));
+            vertex_faces[m_faces[i].val.vert[j]].push_back(i);
+        }
+        face_norms[i] = fmath::cross(p[1] - p[0], p[2] - p[0]);
+    }
+
+    corner_norms.resize(3*m_faces.size());
+    for (size_t i = 0; i < m_faces.size(); ++i)
+    {
+        const real length = std::sqrt(fmath::length_squared(face_norms[i]));
+        for (int j = 0; j < 3; ++j)
+        {
+            fmath::vec3 sum(0, 0, 0);
+            const std::vector<size_t>& faces(vertex_faces[m_faces[i].val.vert[j]]);
+            for (size_t k = 0; k < faces.size(); ++k)
+            {
+                const fmath::vec3& other(face_norms[faces[k]]);
+                const real other_length = std::sqrt(fmath::length_squared(other));
+                if (faces[k] == i ||
+                    fmath::dot(face_norms[i], other) >= CREASE_COS * length * other_length)
+                {
+                    sum += other;
+                }
+            }
+
+            // Degenerate faces get some normal rather than none
+            const real sum_length = std::sqrt(fmath::length_squared(sum));
+            dlib::vec3& n(corner_norms[3*i + j]);
+            if (sum_length > 0)
+            {
+                n = sum(0) / sum_length, sum(1) / sum_length, sum(2) / sum_length;
+            }
+            else
+            {
+                n = 0, 1, 0;
+            }
+        }
+    }
+}
+
 //=============================================================================
 // 
 //=============================================================================
@@ -7,19 +7,20 @@
 #include <string>
 #include <vector>
 
-/* Stores 0-based indexes in each of the arrays.
+/* Stores 0-based indexes in each of the arrays, in the order of the
+ * fields of an OBJ face.
  *
  * vert -> m_verts
- * norm -> m_norms
  * tex  -> m_texs
+ * norm -> m_norms
  */
 struct Face
 {
     union {
         struct {
             int vert[3];
-            int norm[3];
             int tex[3];
+            int norm[3];
         } val;
         int all[3][3];
     };
@@ -56,13 +57,18 @@ public:
 
     /* Fill in a mesh object with the current data.
      *
-     * This will erase the current mesh and build a new one.
+     * This will erase the current mesh and build a new one. flags picks
+     * what it holds, every face needs texture coordinates if they are
+     * included. Normals are made from the faces if the file has none.
+     * With finish
+     * set to false Mesh::Finish() isn't called, so the mesh can be built
+     * without an OpenGL context but can't be rendered.
      *
      * Returns:
      *   True if successfully created the mesh, false if
      *   no data to fill or other issue.
      */
-    bool ToMesh(Mesh& mesh, unsigned char flags);
+    bool ToMesh(Mesh& mesh, unsigned char flags, bool finish = true);
 
     /* Load data from an obj stream.
      *
@@ -78,6 +84,13 @@ protected:
      */
     void cleanup(void);
 
+    /* A normal for every face corner, for files without them. Each corner
+     * gets the area weighted average of the faces around its vertex that
+     * are within the crease angle of its own face, so curved surfaces are
+     * smooth and sharp edges stay sharp.
+     */
+    void make_normals(std::vector<dlib::vec3>& corner_norms) const;
+
 private:
     // True if the data in the vectors is valid.
     bool m_is_loaded;
@@ -0,0 +1,251 @@
+#include "parallelstep.hpp"
+
+#include <cassert>
+#include <algorithm>
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+ParallelStep::ParallelStep(PSystem& psys, TaskPool& pool, Constraint constraint) :
+    m_psys(psys),
+    m_pool(pool),
+    m_constraint(constraint),
+    m_active(false)
+{
+    // One range per worker, sorted by node. The thread calling Run() isn't
+    // pinned, it only gets a range if there are no workers.
+    const int num_workers = pool.GetNumThreads() - 1;
+    std::vector<std::pair<int, int> > by_node;
+    for (int i = 0; i < num_workers; ++i)
+    {
+        by_node.push_back(std::make_pair(pool.GetThreadNode(i), i));
+    }
+    if (by_node.empty())
+    {
+        by_node.push_back(std::make_pair(0, 0));
+    }
+    std::sort(by_node.begin(), by_node.end());
+
+    for (size_t r = 0; r < by_node.size(); ++r)
+    {
+        m_threads.push_back(by_node[r].second);
+        if (r == 0 || by_node[r].first != by_node[r - 1].first)
+        {
+            m_node_ranges.push_back(r);
+        }
+    }
+    m_node_ranges.push_back(by_node.size());
+}
+
+//=============================================================================
+// Distribute
+//=============================================================================
+
+bool ParallelStep::Distribute()
+{
+    if (!m_psys.BeginRelocate(m_threads.size()))
+    {
+        return false;
+    }
+
+    m_graph.Clear();
+    for (size_t r = 0; r < m_threads.size(); ++r)
+    {
+        m_graph.Add(relocate, this, r, m_threads[r]);
+    }
+    m_pool.Run(m_graph);
+
+    m_psys.EndRelocate();
+    return true;
+}
+
+//=============================================================================
+// Begin
+//=============================================================================
+
+bool ParallelStep::Begin(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    m_active = m_psys.BeginUpdate(dt, force, fields, m_threads.size());
+    return m_active;
+}
+
+//=============================================================================
+// Skip
+//=============================================================================
+
+void ParallelStep::Skip()
+{
+    m_active = false;
+}
+
+//=============================================================================
+// AddTasks
+//=============================================================================
+
+size_t ParallelStep::AddTasks(TaskGraph& graph, size_t after)
+{
+    const size_t num_ranges = m_threads.size();
+    const size_t num_nodes = m_node_ranges.size() - 1;
+
+    // Each part waits for the one before, on every range
+    const size_t first_predict = graph.GetNumTasks();
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        graph.AddDependency(after, graph.Add(predict, this, r, m_threads[r]));
+    }
+
+    const size_t center_task = graph.Add(center, this);
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        graph.AddDependency(first_predict + r, center_task);
+    }
+
+    const size_t first_accumulate = graph.GetNumTasks();
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        graph.AddDependency(center_task, graph.Add(accumulate, this, r, m_threads[r]));
+    }
+
+    // The ranges of a node are added up on the node
+    std::vector<size_t> merges;
+    for (size_t n = 0; n < num_nodes; ++n)
+    {
+        const size_t first = m_node_ranges[n];
+        const size_t merge_task = graph.Add(merge, this, n, m_threads[first]);
+        for (size_t r = first; r < m_node_ranges[n + 1]; ++r)
+        {
+            graph.AddDependency(first_accumulate + r, merge_task);
+        }
+        merges.push_back(merge_task);
+    }
+
+    const size_t solve_task = graph.Add(solve, this);
+    for (size_t n = 0; n < merges.size(); ++n)
+    {
+        graph.AddDependency(merges[n], solve_task);
+    }
+
+    const size_t first_apply = graph.GetNumTasks();
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        graph.AddDependency(solve_task, graph.Add(apply, this, r, m_threads[r]));
+    }
+
+    const size_t finish_task = graph.Add(finish, this);
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        graph.AddDependency(first_apply + r, finish_task);
+    }
+
+    return finish_task;
+}
+
+//=============================================================================
+// Update
+//=============================================================================
+
+void ParallelStep::Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    if (!Begin(dt, force, fields))
+    {
+        return;
+    }
+
+    m_graph.Clear();
+    AddTasks(m_graph, m_graph.Add(nothing, NULL));
+    m_pool.Run(m_graph);
+}
+
+//=============================================================================
+// Tasks
+//=============================================================================
+
+void ParallelStep::predict(void* data, size_t range)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (!step.m_active)
+    {
+        return;
+    }
+
+    if (step.m_constraint != NULL)
+    {
+        size_t begin, end;
+        step.m_psys.GetRange(range, step.m_threads.size(), begin, end);
+        step.m_constraint(step.m_psys, begin, end);
+    }
+    step.m_psys.PredictRange(range);
+}
+
+void ParallelStep::center(void* data, size_t)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (step.m_active)
+    {
+        step.m_psys.FindCenter();
+    }
+}
+
+void ParallelStep::accumulate(void* data, size_t range)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (step.m_active)
+    {
+        step.m_psys.AccumulateRange(range);
+    }
+}
+
+void ParallelStep::merge(void* data, size_t node)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (step.m_active)
+    {
+        const size_t first = step.m_node_ranges[node];
+        step.m_psys.MergeRanges(first, step.m_node_ranges[node + 1] - first);
+    }
+}
+
+void ParallelStep::solve(void* data, size_t)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (step.m_active)
+    {
+        step.m_psys.Solve();
+    }
+}
+
+void ParallelStep::apply(void* data, size_t range)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (!step.m_active)
+    {
+        return;
+    }
+
+    step.m_psys.ApplyRange(range);
+    if (step.m_constraint != NULL)
+    {
+        size_t begin, end;
+        step.m_psys.GetRange(range, step.m_threads.size(), begin, end);
+        step.m_constraint(step.m_psys, begin, end);
+    }
+}
+
+void ParallelStep::finish(void* data, size_t)
+{
+    ParallelStep& step = *static_cast<ParallelStep*>(data);
+    if (step.m_active)
+    {
+        step.m_psys.FinishUpdate();
+    }
+}
+
+void ParallelStep::relocate(void* data, size_t range)
+{
+    static_cast<ParallelStep*>(data)->m_psys.RelocateRange(range);
+}
+
+//=============================================================================
+//
+//=============================================================================
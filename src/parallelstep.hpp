@@ -0,0 +1,115 @@
+#ifndef __PARALLEL_STEP_HPP__
+#define __PARALLEL_STEP_HPP__
+
+#include "defs.hpp"
+#include "psystem.hpp"
+#include "taskgraph.hpp"
+
+#include <vector>
+
+/* Steps one very large body with every thread of a TaskPool, using the
+ * parts of PSystem::BeginUpdate(). Each worker owns one range of the
+ * particles, and every part of a range runs on its owner. The ranges are
+ * handed out in the order of the workers' NUMA nodes, so each node owns
+ * one stretch of the body. Distribute() moves every range into memory on
+ * its owner's node, and Apq is added up on each node before the node
+ * sums are added together.
+ *
+ * The pool has to be started before, pinned so the workers stay on their
+ * nodes:
+ *
+ *   pool.Start(get_num_cpus() - 1, true);
+ *   ParallelStep step(psys, pool, check_for_collisions);
+ *   step.Distribute();
+ *   ...
+ *   step.Update(dt, gravity);
+ *
+ * Or as part of a larger graph, with a task that calls Begin() first:
+ *
+ *   const size_t begin = graph.Add(begin_body, ...);
+ *   const size_t end = step.AddTasks(graph, begin);
+ */
+class ParallelStep
+{
+public:
+    /* Keeps the particles from begin up to end in bounds, called on each
+     * range before and after the step, like check_for_collisions().
+     */
+    typedef void (*Constraint)(PSystem& psys, size_t begin, size_t end);
+
+    ParallelStep(PSystem& psys, TaskPool& pool, Constraint constraint = NULL);
+
+    /* Move each range into memory on the node of its owner, see
+     * PSystem::BeginRelocate(). Runs the pool.
+     *
+     * Returns:
+     *   False if the memory couldn't be allocated, the body stays where it
+     *   is.
+     */
+    bool Distribute();
+
+    /* Set up the next step for the tasks of AddTasks().
+     *
+     * Returns:
+     *   False if the body is asleep, the tasks do nothing then.
+     */
+    bool Begin(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
+
+    /* Make the tasks of AddTasks() do nothing this time, instead of
+     * calling Begin().
+     */
+    void Skip();
+
+    /* Add the tasks of one step to graph, after the task after, which
+     * must call Begin() or Skip().
+     *
+     * Returns:
+     *   The id of the last task, tasks that need the finished step depend
+     *   on it.
+     */
+    size_t AddTasks(TaskGraph& graph, size_t after);
+
+    /* Take a step on its own, Begin() and running AddTasks() on the pool.
+     */
+    void Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
+
+    /* True if the last step ran, false if the body was asleep.
+     */
+    bool WasStepped() const
+    {
+        return m_active;
+    }
+
+    size_t GetNumRanges() const
+    {
+        return m_threads.size();
+    }
+
+private:
+    // Not copyable
+    ParallelStep(const ParallelStep&);
+    ParallelStep& operator=(const ParallelStep&);
+
+    // The tasks, data is the ParallelStep and index the range, or the node
+    // for merge()
+    static void predict(void* data, size_t range);
+    static void center(void* data, size_t);
+    static void accumulate(void* data, size_t range);
+    static void merge(void* data, size_t node);
+    static void solve(void* data, size_t);
+    static void apply(void* data, size_t range);
+    static void finish(void* data, size_t);
+    static void relocate(void* data, size_t range);
+    static void nothing(void*, size_t) { }
+
+private:
+    PSystem& m_psys;
+    TaskPool& m_pool;
+    Constraint m_constraint;
+    std::vector<int> m_threads; // Thread that owns each range, by node
+    std::vector<size_t> m_node_ranges; // First range of each node, and the end
+    bool m_active; // Begin() succeeded for the current step
+    TaskGraph m_graph; // For Update() and Distribute()
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __PARTICLE_ARRAY_HPP__
+#define __PARTICLE_ARRAY_HPP__
+
+#include "defs.hpp"
+
+#include <cassert>
+#include <cstddef>
+
+/* A view of one vector per particle that don't have to be next to each
+ * other, like the position member of an array of engine components:
+ *
+ *   struct Component { real pos[3]; real vel[3]; int flags; };
+ *   ParticleArray positions(components[0].pos, sizeof(Component));
+ *
+ * Each vector is three reals, laid out like a dlib::vec3, and the stride
+ * is the number of bytes from one to the next. The memory isn't owned.
+ */
+class ParticleArray
+{
+public:
+    ParticleArray() :
+        m_data(NULL),
+        m_stride(sizeof(dlib::vec3))
+    { }
+
+    ParticleArray(dlib::vec3* data, size_t stride = sizeof(dlib::vec3)) :
+        m_data(reinterpret_cast<char*>(data)),
+        m_stride(stride)
+    {
+        assert(stride >= sizeof(dlib::vec3) && stride % sizeof(real) == 0);
+    }
+
+    /* Params:
+     *   data - x, y, z of the first particle
+     *   stride - Bytes from one particle's x to the next one's
+     */
+    ParticleArray(real* data, size_t stride) :
+        m_data(reinterpret_cast<char*>(data)),
+        m_stride(stride)
+    {
+        assert(stride >= sizeof(dlib::vec3) && stride % sizeof(real) == 0);
+    }
+
+    dlib::vec3& operator[](size_t i) const
+    {
+        return *reinterpret_cast<dlib::vec3*>(m_data + i*m_stride);
+    }
+
+    /* The view starting offset particles later.
+     */
+    ParticleArray operator+(size_t offset) const
+    {
+        ParticleArray rest(*this);
+        rest.m_data += offset*m_stride;
+        return rest;
+    }
+
+    /* True if the vectors are next to each other, so GetData() is a plain
+     * array.
+     */
+    bool IsPacked() const
+    {
+        return m_stride == sizeof(dlib::vec3);
+    }
+
+    dlib::vec3* GetData() const
+    {
+        return reinterpret_cast<dlib::vec3*>(m_data);
+    }
+
+    size_t GetStride() const
+    {
+        return m_stride;
+    }
+
+private:
+    char* m_data;
+    size_t m_stride; // Bytes from one vector to the next
+};
+
+#endif
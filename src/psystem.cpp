@@ -1,40 +1,210 @@
 #include "psystem.hpp"
+#include "shapematch.hpp"
 
+#include <cmath>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <new>
+#include <map>
+#include <set>
 
-// Get rid of some boiler plate when freeing arrays
-#define FREE_ARRAY(X) if ((X) != NULL) { delete [] (X); (X) = NULL; }
+// The rest state is only rebuilt for plasticity when the permanent
+// deformation has changed by at least this much (Frobenius norm), and at
+// most once every PLASTIC_REBUILD_INTERVAL steps.
+static const real PLASTIC_REBUILD_THRESHOLD = 0.01;
+static const int PLASTIC_REBUILD_INTERVAL = 4;
 
 //=============================================================================
 // Constructor
 //=============================================================================
 
-PSystem::PSystem(Mesh& mesh) :
-    m_mesh(mesh),
+PSystem::PSystem(Mesh& mesh, real proxy_size) :
+    m_mesh(&mesh),
+    m_external(false),
     m_alpha(0.4),
-    m_beta(0.7)
+    m_beta(0.7),
+    m_alpha_reference_dt(0),
+    m_max_displacement(0),
+    m_max_goal_deviation(0),
+    m_quadratic(true),
+    m_sleeping(false),
+    m_resting(false),
+    m_rest_steps(0),
+    m_sleep_steps(0),
+    m_sleep_energy(0),
+    m_sleep_deviation(0),
+    m_last_goal_deviation(0),
+    m_rest_force(0, 0, 0),
+    m_rest_fields(0),
+    m_inverted(false),
+    m_body_length(0),
+    m_transport(NULL),
+    m_shape(new ShapeTemplate(mesh, proxy_size)),
+    m_placement_rotation(fmath::mat3::identity()),
+    m_placement_offset(0, 0, 0),
+    m_placed(false),
+    m_plastic(fmath::mat3::identity()),
+    m_plastic_applied(fmath::mat3::identity()),
+    m_plastic_steps(0),
+    m_plastic_yield(0),
+    m_plastic_creep(0),
+    m_plastic_max(0),
+    m_relocation(NULL)
 {
-    // We only want to deal with vertex meshes
-    assert(mesh.GetIncludedData() == Mesh::VERTICES);
+    // Only the positions are simulated, the rest of the mesh is left as is
+    assert(mesh.IsFlagEnabled(Mesh::VERTICES));
 
     initialize();
 }
 
+PSystem::PSystem(Mesh& mesh, ShapeTemplate* shape) :
+    m_mesh(&mesh),
+    m_external(false),
+    m_alpha(0.4),
+    m_beta(0.7),
+    m_alpha_reference_dt(0),
+    m_max_displacement(0),
+    m_max_goal_deviation(0),
+    m_quadratic(true),
+    m_sleeping(false),
+    m_resting(false),
+    m_rest_steps(0),
+    m_sleep_steps(0),
+    m_sleep_energy(0),
+    m_sleep_deviation(0),
+    m_last_goal_deviation(0),
+    m_rest_force(0, 0, 0),
+    m_rest_fields(0),
+    m_inverted(false),
+    m_body_length(0),
+    m_transport(NULL),
+    m_shape(shape),
+    m_placement_rotation(fmath::mat3::identity()),
+    m_placement_offset(0, 0, 0),
+    m_placed(false),
+    m_plastic(fmath::mat3::identity()),
+    m_plastic_applied(fmath::mat3::identity()),
+    m_plastic_steps(0),
+    m_plastic_yield(0),
+    m_plastic_creep(0),
+    m_plastic_max(0),
+    m_relocation(NULL)
+{
+    assert(mesh.IsFlagEnabled(Mesh::VERTICES));
+    assert(mesh.GetDataSize() / 3 == shape->m_vertex_particle.size());
+
+    m_shape->AddRef();
+    initialize();
+}
+
+PSystem::PSystem(ShapeTemplate* shape, const ParticleArray& positions,
+                 const ParticleArray& velocities) :
+    m_mesh(NULL),
+    m_external(true),
+    m_alpha(0.4),
+    m_beta(0.7),
+    m_alpha_reference_dt(0),
+    m_max_displacement(0),
+    m_max_goal_deviation(0),
+    m_quadratic(true),
+    m_sleeping(false),
+    m_resting(false),
+    m_rest_steps(0),
+    m_sleep_steps(0),
+    m_sleep_energy(0),
+    m_sleep_deviation(0),
+    m_last_goal_deviation(0),
+    m_rest_force(0, 0, 0),
+    m_rest_fields(0),
+    m_inverted(false),
+    m_body_length(0),
+    m_transport(NULL),
+    m_shape(shape),
+    m_placement_rotation(fmath::mat3::identity()),
+    m_placement_offset(0, 0, 0),
+    m_placed(false),
+    m_current_vel(velocities),
+    m_current_pos(positions),
+    m_plastic(fmath::mat3::identity()),
+    m_plastic_applied(fmath::mat3::identity()),
+    m_plastic_steps(0),
+    m_plastic_yield(0),
+    m_plastic_creep(0),
+    m_plastic_max(0),
+    m_relocation(NULL)
+{
+    assert(positions.GetData() != NULL && velocities.GetData() != NULL);
+
+    m_shape->AddRef();
+    initialize();
+}
+
+PSystem::PSystem(Mesh& mesh, ShapeTemplate* shape, const PSystem& parent,
+                 const std::vector<size_t>& particles) :
+    m_mesh(&mesh),
+    m_external(false),
+    m_alpha(parent.m_alpha),
+    m_beta(parent.m_beta),
+    m_alpha_reference_dt(parent.m_alpha_reference_dt),
+    m_max_displacement(0),
+    m_max_goal_deviation(0),
+    m_quadratic(parent.m_quadratic),
+    m_sleeping(false),
+    m_resting(false),
+    m_rest_steps(0),
+    m_sleep_steps(parent.m_sleep_steps),
+    m_sleep_energy(parent.m_sleep_energy),
+    m_sleep_deviation(parent.m_sleep_deviation),
+    m_last_goal_deviation(0),
+    m_rest_force(0, 0, 0),
+    m_rest_fields(0),
+    m_inverted(false),
+    m_body_length(0),
+    m_transport(NULL),
+    m_shape(shape),
+    m_placement_rotation(parent.m_placement_rotation),
+    m_placement_offset(parent.m_placement_offset),
+    m_placed(parent.m_placed),
+    m_plastic(fmath::mat3::identity()),
+    m_plastic_applied(fmath::mat3::identity()),
+    m_plastic_steps(0),
+    m_plastic_yield(parent.m_plastic_yield),
+    m_plastic_creep(parent.m_plastic_creep),
+    m_plastic_max(parent.m_plastic_max),
+    m_relocation(NULL)
+{
+    assert(mesh.IsFlagEnabled(Mesh::VERTICES));
+    assert(shape->GetNumParticles() == particles.size());
+
+    // The placement rotates around the parent's center of mass
+    m_placement_offset += (m_placement_rotation - fmath::mat3::identity()) *
+                          (shape->m_initial_com - parent.m_shape->m_initial_com);
+    initialize();
+
+    // Carry on where the parent left off. The permanent deformation is
+    // applied around a different center of mass here, which only moves
+    // the rest shape.
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        m_current_pos[i] = parent.m_current_pos[particles[i]];
+        m_current_vel[i] = parent.m_current_vel[particles[i]];
+    }
+    m_current_com = calc_com(m_current_pos);
+    m_plastic = parent.m_plastic;
+    m_plastic_applied = parent.m_plastic_applied;
+    update_rest_state();
+}
+
 //=============================================================================
 // Destructor
 //=============================================================================
 
 PSystem::~PSystem()
 {
-    // Defined above
-    FREE_ARRAY(m_initial_pos);
-    FREE_ARRAY(m_initial_rel);
-    FREE_ARRAY(m_current_pos);
-    FREE_ARRAY(m_current_rel);
-    FREE_ARRAY(m_current_vel);
-    FREE_ARRAY(m_q_tilde);
-    FREE_ARRAY(m_old_pos);
+    // The particle arrays are freed with m_arena
+    delete m_relocation;
+    m_shape->Release();
 }
 
 //=============================================================================
@@ -43,131 +213,146 @@ PSystem::~PSystem()
 
 void PSystem::initialize()
 {
-    // Calculate how much space we need, we won't use the number
-    // of vertices in the mesh because there are many duplicate
-    // values. We need to figure out how many unique vertices
-    // there are, and the mapping to each duplicated vertex in
-    // the original mesh.
-    
-    // This map stores all the unique vectors and their corresponding
-    // index in the m_mesh data array, so they can be copied over after
-    // calculating the new positions.
-    std::map<dlib::vec3, std::vector<int>, Vec3Less> vec_to_index_map;
-    const dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh.GetData());
-    const size_t data_size = (m_mesh.GetDataSize()*sizeof(real)) / sizeof(dlib::vec3);
-    for (size_t i = 0; i < data_size; ++i)
-    {
-        const dlib::vec3& val(data[i]);
-        if (vec_to_index_map.find(val) == vec_to_index_map.end())
-        {
-            std::vector<int> duplicates;
-            duplicates.push_back(i);
-            vec_to_index_map[val] = duplicates;
-        }
-        else
-        {
-            vec_to_index_map[val].push_back(i);
-        }
+    m_data_length = m_shape->GetNumParticles();
+    m_body_length = m_data_length;
+    if (!allocate())
+    {
+        throw std::bad_alloc();
     }
-    m_data_length = vec_to_index_map.size();
+    update_rest_state();
 
-    // We need to make our own buffer because we have fewer
-    // particles than vertices. They are the keys in the
-    // m_vec_to_index map.
-    int i = 0;
-    dlib::vec3* temp = new dlib::vec3[m_data_length];
-    std::map<dlib::vec3, std::vector<int>, Vec3Less>::const_iterator iter;
-    for (iter = vec_to_index_map.begin(); iter != vec_to_index_map.end(); ++iter)
+    // Perform the rest of the initialization
+    Reset();
+}
+
+//=============================================================================
+// allocate
+//=============================================================================
+
+bool PSystem::allocate(unsigned int flags)
+{
+    // All the particle arrays are carved out of one block, two of vectors
+    // shared with dlib and two used only internally. The rest state is in
+    // the shape template, and the caller's arrays are used as they are.
+    const size_t vec_bytes = m_external ? 0 : Arena::Size<dlib::vec3>(m_data_length);
+    const size_t fvec_bytes = Arena::Size<fmath::vec3>(m_data_length);
+    if (!m_arena.Create(2*vec_bytes + 2*fvec_bytes, flags))
     {
-        temp[i] = iter->first;
-        m_vec_to_index.push_back(iter->second);
-        ++i;
+        return false;
     }
-    m_initial_pos = temp;
 
-    // Temporary space for use during the Update() method.
-    m_old_pos = new dlib::vec3[m_data_length];
+    if (!m_external)
+    {
+        m_current_vel = ParticleArray(m_arena.Allocate<dlib::vec3>(m_data_length));
+        m_current_pos = ParticleArray(m_arena.Allocate<dlib::vec3>(m_data_length));
+    }
+    m_current_rel = m_arena.Allocate<fmath::vec3>(m_data_length);
+    m_old_pos = m_arena.Allocate<fmath::vec3>(m_data_length);
+    return true;
+}
 
-    // Velocity space
-    m_current_vel = new dlib::vec3[m_data_length];
+//=============================================================================
+// update_rest_state
+//=============================================================================
 
-    // Current position space
-    m_current_pos = new dlib::vec3[m_data_length];
+void PSystem::update_rest_state()
+{
+    m_shape->GetRest(m_plastic_applied, m_rest);
+}
 
-    // Calculate the initial center of mass
-    m_initial_com = calc_com(m_initial_pos);
+//=============================================================================
+// own_shape
+//=============================================================================
 
-    // Calculate the relative positions
-    temp = new dlib::vec3[m_data_length];   
-    calc_rel_pos(m_initial_pos, temp, m_initial_com);
-    m_initial_rel = temp;
+void PSystem::own_shape()
+{
+    if (m_shape->IsShared())
+    {
+        ShapeTemplate* copy = new ShapeTemplate(*m_shape);
+        m_shape->Release();
+        m_shape = copy;
+    }
+}
 
-    // Space the the q_i values
-    m_current_rel = new dlib::vec3[m_data_length];
+//=============================================================================
+// Reset
+//=============================================================================
 
-    // Make the q~ matrix for quadratic deformation, we only
-    // have to do this once
-    dlib::mat9x1* mat_temp = new dlib::mat9x1[m_data_length];
+void PSystem::Reset()
+{
+    wake_from_rest();
     for (size_t i = 0; i < m_data_length; ++i)
     {
-        const dlib::vec3& q(m_initial_rel[i]);
-        const real q_x = q(0);
-        const real q_y = q(1);
-        const real q_z = q(2);
-        mat_temp[i] = q_x, q_y, q_z,
-                q_x*q_x, q_y*q_y, q_z*q_z,
-                q_x*q_y, q_y*q_z, q_z*q_x;
+        fmath::store(m_current_vel[i], fmath::vec3(0, 0, 0));
     }
-    m_q_tilde = mat_temp;
 
-    // Calculate the A_qq matrix, this only has to be done once
-    mat_Aqq = dlib::zeros_matrix<real>(3L, 3L);
-    for (size_t i = 0; i < m_data_length; ++i)
+    // The rest shape, rotated around its center of mass and moved
+    const fmath::vec3 com = m_shape->m_initial_com + m_placement_offset;
+    if (m_placed)
     {
-        // A_qq += q_i * q_i^T
-        mat_Aqq += m_initial_rel[i] * dlib::trans(m_initial_rel[i]);
+        for (size_t i = 0; i < m_data_length; ++i)
+        {
+            fmath::store(m_current_pos[i], m_placement_rotation * m_shape->m_initial_rel[i] + com);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < m_data_length; ++i)
+        {
+            m_current_pos[i] = m_shape->m_initial_pos[i];
+        }
     }
-    mat_Aqq = dlib::inv(mat_Aqq);
 
-    // Also calculate A_qq~
-    mat_Aqq_tilde = dlib::zeros_matrix<real>(9L, 9L);
-    for (size_t i = 0; i < m_data_length; ++i)
+    // Back to the original rest shape
+    if (fmath::norm(m_plastic_applied - fmath::mat3::identity()) > 0)
     {
-        mat_Aqq_tilde += m_q_tilde[i] * dlib::trans(m_q_tilde[i]);
+        m_plastic_applied = fmath::mat3::identity();
+        update_rest_state();
     }
-    mat_Aqq_tilde = dlib::inv(mat_Aqq_tilde);
+    m_plastic = fmath::mat3::identity();
+    m_plastic_steps = 0;
 
-    // Perform the rest of the initialization
-    Reset();
+    m_current_com = com + m_placement_rotation * m_rest.com;
+    calc_rel_pos(m_current_pos, m_current_rel, m_current_com);
+    mat_R = m_placement_rotation;
+
+    // The rest shape, [R 0 0] lifted
+    m_skin.matrix = fmath::mat3x9::padded(m_placement_rotation) * m_rest.lift;
+    m_skin.offset = m_placement_rotation * fmath::vec3(m_rest.lift_offset(0),
+                                                       m_rest.lift_offset(1),
+                                                       m_rest.lift_offset(2)) +
+                    m_current_com;
+    m_max_displacement = 0;
+    m_max_goal_deviation = 0;
+    m_inverted = false;
 }
 
 //=============================================================================
-// Reset
+// SetPlacement
 //=============================================================================
 
-void PSystem::Reset()
+void PSystem::SetPlacement(const fmath::mat3& rotation, const dlib::vec3& translation)
 {
-    memset(m_current_vel, 0, m_data_length*sizeof(dlib::vec3));
-    memcpy(m_current_pos, m_initial_pos, m_data_length*sizeof(dlib::vec3)); 
-    memcpy(m_current_rel, m_initial_rel, m_data_length*sizeof(dlib::vec3));
-    m_current_com = m_initial_com;
+    m_placement_rotation = rotation;
+    m_placement_offset = fmath::load(translation);
+    m_placed = true;
+    Reset();
 }
 
 //=============================================================================
 // calc_com
 //=============================================================================
 
-dlib::vec3 PSystem::calc_com(const dlib::vec3* data)
+fmath::vec3 PSystem::calc_com(const ParticleArray& data)
 {
-    dlib::vec3 pos_sum;
-    pos_sum = 0, 0, 0;
+    fmath::vec3 pos_sum(0, 0, 0);
 
     for (size_t i = 0; i < m_data_length; ++i)
     {
-        pos_sum += data[i];
+        pos_sum += fmath::load(data[i]);
     }
 
-    pos_sum /= static_cast<real>(m_data_length);
+    pos_sum *= 1 / static_cast<real>(m_data_length);
 
     return pos_sum;
 }
@@ -176,11 +361,12 @@ dlib::vec3 PSystem::calc_com(const dlib::vec3* data)
 // calc_rel_pos
 //=============================================================================
 
-void PSystem::calc_rel_pos(const dlib::vec3* pos, dlib::vec3* rel_pos, dlib::vec3 com)
+void PSystem::calc_rel_pos(const ParticleArray& pos, fmath::vec3* rel_pos,
+                           const fmath::vec3& com)
 {
     for (size_t i = 0; i < m_data_length; ++i)
     {
-        rel_pos[i] = pos[i] - com;
+        rel_pos[i] = fmath::load(pos[i]) - com;
     }
 }
 
@@ -188,132 +374,774 @@ void PSystem::calc_rel_pos(const dlib::vec3* pos, dlib::vec3* rel_pos, dlib::vec
 // Update
 //=============================================================================
 
-/* Helper method for Update(), calculates num^(1.0/exp).
- */
-static real root(real num, real exp)
+void PSystem::Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
 {
-    if (num < 0)
+    if (BeginUpdate(dt, force, fields, 1))
     {
-        return -std::pow(-num, 1.0/exp);
+        PredictRange(0);
+        FindCenter();
+        AccumulateRange(0);
+        Solve();
+        ApplyRange(0);
+        FinishUpdate();
     }
-    else if (num == 0)
+}
+
+//=============================================================================
+// BeginUpdate
+//=============================================================================
+
+bool PSystem::BeginUpdate(real dt, const dlib::vec3& force, const ForceFieldSet* fields,
+                          size_t num_ranges)
+{
+    assert(num_ranges >= 1);
+    assert(m_relocation == NULL);
+
+    // Frozen in place until woken up
+    if (m_sleeping && !WakeIfDisturbed(force, fields))
     {
-        return 1.0;
+        return false;
     }
-    else
+
+    m_range_sums.resize(num_ranges);
+    m_step_dt = dt;
+    m_step_force = fmath::load(force);
+    m_step_fields = fields;
+
+    // Flat bodies can only deform linearly
+    m_step_quadratic = m_quadratic && m_rest.quadratic_valid;
+    return true;
+}
+
+//=============================================================================
+// GetRange
+//=============================================================================
+
+void PSystem::GetRange(size_t range, size_t num_ranges, size_t& begin, size_t& end) const
+{
+    assert(range < num_ranges);
+
+    const size_t per_range = (m_data_length + num_ranges - 1) / num_ranges;
+    const size_t size = (per_range + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT * RANGE_ALIGNMENT;
+    begin = std::min(range * size, m_data_length);
+    end = std::min(begin + size, m_data_length);
+}
+
+//=============================================================================
+// PredictRange
+//=============================================================================
+
+void PSystem::PredictRange(size_t range)
+{
+    size_t begin, end;
+    GetRange(range, m_range_sums.size(), begin, end);
+    RangeSums& sums = m_range_sums[range];
+
+    // Do a partial integration
+    sums.vel_sq = shapematch::predict(m_current_pos + begin, m_current_vel + begin,
+                                      m_old_pos + begin, end - begin, m_step_force,
+                                      m_step_fields, m_step_dt);
+
+    sums.pos = fmath::vec3(0, 0, 0);
+    for (size_t i = begin; i < end; ++i)
     {
-        return std::pow(num, 1.0/exp);
+        sums.pos += fmath::load(m_current_pos[i]);
     }
 }
 
-// Probably not necessary
-static void verlet(dlib::vec3& pos, dlib::vec3& vel, 
-		const dlib::vec3 force, const real dt)
+//=============================================================================
+// FindCenter
+//=============================================================================
+
+void PSystem::FindCenter()
 {
-	const dlib::vec3 old_vel = vel;
-	vel = vel + force * dt;
-	pos = pos + (old_vel + vel) * 0.5 * dt;
+    fmath::vec3 pos_sum = m_range_sums[0].pos;
+    for (size_t r = 1; r < m_range_sums.size(); ++r)
+    {
+        pos_sum += m_range_sums[r].pos;
+    }
+
+    pos_sum *= 1 / static_cast<real>(m_body_length);
+    m_current_com = pos_sum;
 }
 
-void PSystem::Update(real dt, const dlib::vec3& force)
+//=============================================================================
+// AccumulateRange
+//=============================================================================
+
+void PSystem::AccumulateRange(size_t range)
 {
-    // Do a partial integration
-    const dlib::vec3 force_dt = force * dt;
-    for (size_t i = 0; i < m_data_length; ++i)
+    size_t begin, end;
+    GetRange(range, m_range_sums.size(), begin, end);
+    RangeSums& sums = m_range_sums[range];
+
+    // Update the relative positions and add up their part of A_pq, or of
+    // A_pq~ for quadratic deformations. The sums are over the stored rest
+    // values and lifted to the paper's q and q~ in Solve().
+    if (!m_step_quadratic)
     {
-        m_old_pos[i] = m_current_pos[i];
-        //m_current_vel[i] += force_dt;
-        //m_current_pos[i] += dt * m_current_vel[i];
-		verlet(m_current_pos[i], m_current_vel[i], force, dt);
+        fmath::mat3 sum = fmath::mat3::zero();
+        for (size_t i = begin; i < end; ++i)
+        {
+            m_current_rel[i] = fmath::load(m_current_pos[i]) - m_current_com;
+            sum.add_outer(m_current_rel[i], m_shape->m_initial_rel[i]);
+        }
+        sums.apq = sum;
+    }
+    else
+    {
+        fmath::mat3x9 sum = fmath::mat3x9::zero();
+        for (size_t i = begin; i < end; ++i)
+        {
+            m_current_rel[i] = fmath::load(m_current_pos[i]) - m_current_com;
+            sum.add_outer(m_current_rel[i], m_shape->m_q_tilde[i]);
+        }
+        sums.apq_tilde = sum;
     }
+}
 
-    // Update the center of mass and relative positions
-    m_current_com = calc_com(m_current_pos);
-    calc_rel_pos(m_current_pos, m_current_rel, m_current_com);
+//=============================================================================
+// MergeRanges
+//=============================================================================
 
-    // Calculate the A_pq matrix
-    mat_Apq = dlib::zeros_matrix<real>(3L, 3L);
-    for (size_t i = 0; i < m_data_length; ++i)
+void PSystem::MergeRanges(size_t first, size_t count)
+{
+    assert(first + count <= m_range_sums.size());
+
+    RangeSums& into = m_range_sums[first];
+    for (size_t r = first + 1; r < first + count; ++r)
     {
-        mat_Apq += m_current_rel[i] * dlib::trans(m_initial_rel[i]);
+        RangeSums& from = m_range_sums[r];
+        if (!m_step_quadratic)
+        {
+            into.apq = into.apq + from.apq;
+            from.apq = fmath::mat3::zero();
+        }
+        else
+        {
+            into.apq_tilde = into.apq_tilde + from.apq_tilde;
+            from.apq_tilde = fmath::mat3x9::zero();
+        }
     }
+}
+
+//=============================================================================
+// Solve
+//=============================================================================
 
-    mat_A = mat_Apq * mat_Aqq;
-    mat_A *= (1.0 / root(dlib::det(mat_A), 3.0));
+void PSystem::Solve()
+{
+    // The constant part of the lift drops out of A_pq because the relative
+    // positions sum to zero
+    if (!m_step_quadratic)
+    {
+        fmath::mat3 sum = m_range_sums[0].apq;
+        for (size_t r = 1; r < m_range_sums.size(); ++r)
+        {
+            sum = sum + m_range_sums[r].apq;
+        }
+        mat_Apq = sum * fmath::trans(m_rest.lift.top_left());
+    }
+    else
+    {
+        fmath::mat3x9 sum = m_range_sums[0].apq_tilde;
+        for (size_t r = 1; r < m_range_sums.size(); ++r)
+        {
+            sum = sum + m_range_sums[r].apq_tilde;
+        }
+        mat_Apq_tilde = sum * fmath::trans(m_rest.lift);
+
+        // q is the start of q~
+        mat_Apq = mat_Apq_tilde.left();
+    }
+
+    mat_A = mat_Apq * m_rest.Aqq;
+    const real det_A = fmath::det(mat_A);
+    m_inverted = det_A < 0;
+    mat_A = mat_A * (1.0 / shapematch::root(det_A, 3.0));
 
     // Calculate the R matrix
-    dlib::mat3 mat_S = dlib::sqrt_db(dlib::trans(mat_Apq) * mat_Apq);
-    mat_R = mat_Apq * dlib::inv(mat_S);
+    mat_R = shapematch::rotation(mat_Apq);
+
+    // The goal positions are goal * q~ + com. That is folded into one
+    // matrix and offset working on the stored rest values. Linear
+    // deformations only need A and R, they skip all of the q~ work.
+    if (!m_step_quadratic)
+    {
+        const fmath::mat3 goal = (mat_A * m_beta) + (mat_R * (1.0 - m_beta));
+        m_goal_linear = goal * m_rest.lift.top_left();
+        m_goal_offset = goal * fmath::vec3(m_rest.lift_offset(0), m_rest.lift_offset(1),
+                                           m_rest.lift_offset(2));
+    }
+    else
+    {
+        // Calculate A~
+        mat_A_tilde = mat_Apq_tilde * m_rest.Aqq_tilde;
+
+        // Fix the A~ matrix by doing some volume preservation, the 9x9
+        // matrix [A~; 0 I] has the same determinant as A~'s 3x3 block
+        mat_A_tilde = mat_A_tilde * (1.0 / shapematch::root(fmath::det_padded(mat_A_tilde), 9.0));
+
+        // beta*A~ + (1 - beta)*R~, with R~ = [R 0 0]
+        const fmath::mat3x9 goal = fmath::blend(mat_A_tilde, m_beta, mat_R, 1.0 - m_beta);
+        m_goal = goal * m_rest.lift;
+        m_goal_offset = goal * m_rest.lift_offset;
+    }
+    m_goal_offset += m_current_com;
+
+    // Proxy bodies place their mesh with the same transform
+    m_skin.matrix = m_step_quadratic ? m_goal : fmath::mat3x9::padded(m_goal_linear);
+    m_skin.offset = m_goal_offset;
+
+    m_step_alpha = shapematch::scaled_alpha(m_alpha, m_step_dt, m_alpha_reference_dt);
+}
+
+//=============================================================================
+// ApplyRange
+//=============================================================================
+
+void PSystem::ApplyRange(size_t range)
+{
+    size_t begin, end;
+    GetRange(range, m_range_sums.size(), begin, end);
+    RangeSums& sums = m_range_sums[range];
+
+    // Finish the integration
+    const real dt = m_step_dt;
+    const real dt_inv = 1.0 / dt;
+    const real alpha_term = m_step_alpha;
+
+    // Track how far the particles are from their goals and how far they
+    // move, used by callers to pick the time step.
+    real max_deviation_sq = 0;
+    real max_vel_sq = 0;
+    for (size_t i = begin; i < end; ++i)
+    {
+        const fmath::vec3 goal = m_step_quadratic ?
+            (m_goal*m_shape->m_q_tilde[i]) + m_goal_offset :
+            (m_goal_linear*m_shape->m_initial_rel[i]) + m_goal_offset;
+        const fmath::vec3 deviation = goal - fmath::load(m_current_pos[i]);
+
+        fmath::vec3 vel = fmath::load(m_current_vel[i]);
+        vel += deviation * (alpha_term * dt_inv);
+        fmath::store(m_current_vel[i], vel);
+        fmath::store(m_current_pos[i], m_old_pos[i] + vel * dt);
+
+        max_deviation_sq = std::max(max_deviation_sq, fmath::length_squared(deviation));
+        max_vel_sq = std::max(max_vel_sq, fmath::length_squared(vel));
+    }
+
+    sums.max_deviation_sq = max_deviation_sq;
+    sums.max_vel_sq = max_vel_sq;
+}
+
+//=============================================================================
+// FinishUpdate
+//=============================================================================
+
+void PSystem::FinishUpdate()
+{
+    real start_vel_sq = 0;
+    real max_deviation_sq = 0;
+    real max_vel_sq = 0;
+    for (size_t r = 0; r < m_range_sums.size(); ++r)
+    {
+        const RangeSums& sums = m_range_sums[r];
+        start_vel_sq += sums.vel_sq;
+        max_deviation_sq = std::max(max_deviation_sq, sums.max_deviation_sq);
+        max_vel_sq = std::max(max_vel_sq, sums.max_vel_sq);
+    }
+
+    m_last_goal_deviation = m_max_goal_deviation;
+    m_max_goal_deviation = std::sqrt(max_deviation_sq);
+    m_max_displacement = m_step_dt * std::sqrt(max_vel_sq);
+
+    if (m_plastic_creep > 0)
+    {
+        update_plasticity(m_step_dt);
+    }
+
+    if (m_sleep_steps > 0)
+    {
+        // Velocities at the start of the step, after collisions. The ones
+        // at the end include a step of gravity that the ground takes away
+        // again.
+        check_rest(0.5 * start_vel_sq / m_body_length, m_step_force, m_step_fields);
+    }
+}
+
+//=============================================================================
+// BeginRelocate
+//=============================================================================
+
+bool PSystem::BeginRelocate(size_t num_ranges)
+{
+    assert(num_ranges >= 1);
+    assert(m_relocation == NULL);
+
+    // The new blocks are left untouched, see RelocateRange()
+    Relocation* relocation = new Relocation();
+    relocation->num_ranges = num_ranges;
+    relocation->arena.Swap(m_arena);
+    relocation->vel = m_current_vel;
+    relocation->pos = m_current_pos;
+    relocation->rel = m_current_rel;
+    relocation->old_pos = m_old_pos;
+    if (!allocate(Arena::HUGE_PAGES | Arena::FIRST_TOUCH))
+    {
+        m_arena.Swap(relocation->arena);
+        m_current_vel = relocation->vel;
+        m_current_pos = relocation->pos;
+        m_current_rel = relocation->rel;
+        m_old_pos = relocation->old_pos;
+        delete relocation;
+        return false;
+    }
+
+    // Other bodies would read the rest shape from wherever it ends up
+    relocation->shape = !m_shape->IsShared();
+    if (relocation->shape)
+    {
+        relocation->shape_arena.Swap(m_shape->m_arena);
+        relocation->initial_pos = m_shape->m_initial_pos;
+        relocation->initial_rel = m_shape->m_initial_rel;
+        relocation->q_tilde = m_shape->m_q_tilde;
+        if (!m_shape->allocate(Arena::HUGE_PAGES | Arena::FIRST_TOUCH))
+        {
+            // Only move the particles
+            m_shape->m_arena.Swap(relocation->shape_arena);
+            m_shape->m_initial_pos = relocation->initial_pos;
+            m_shape->m_initial_rel = relocation->initial_rel;
+            m_shape->m_q_tilde = relocation->q_tilde;
+            relocation->shape = false;
+        }
+    }
+
+    m_relocation = relocation;
+    return true;
+}
+
+//=============================================================================
+// RelocateRange
+//=============================================================================
+
+void PSystem::RelocateRange(size_t range)
+{
+    assert(m_relocation != NULL);
 
-    // Calculate R~, a 3x9 matrix with [R 0 0]
-    dlib::mat3x9 mat_R_tilde;
-    mat_R_tilde = mat_R(0,0), mat_R(0,1), mat_R(0,2), 0, 0, 0, 0, 0, 0,
-                  mat_R(1,0), mat_R(1,1), mat_R(1,2), 0, 0, 0, 0, 0, 0,
-                  mat_R(2,0), mat_R(2,1), mat_R(2,2), 0, 0, 0, 0, 0, 0;
+    size_t begin, end;
+    GetRange(range, m_relocation->num_ranges, begin, end);
+    const size_t count = end - begin;
 
-    // Calculate Apq~
-    mat_Apq_tilde = dlib::zeros_matrix<real>(3L, 9L);
+    // The caller's arrays stay where they are
+    if (!m_external)
+    {
+        memcpy((m_current_vel + begin).GetData(), (m_relocation->vel + begin).GetData(),
+               count*sizeof(dlib::vec3));
+        memcpy((m_current_pos + begin).GetData(), (m_relocation->pos + begin).GetData(),
+               count*sizeof(dlib::vec3));
+    }
+    memcpy(m_current_rel + begin, m_relocation->rel + begin, count*sizeof(fmath::vec3));
+    memcpy(m_old_pos + begin, m_relocation->old_pos + begin, count*sizeof(fmath::vec3));
+
+    if (m_relocation->shape)
+    {
+        memcpy(m_shape->m_initial_pos + begin, m_relocation->initial_pos + begin,
+               count*sizeof(dlib::vec3));
+        memcpy(m_shape->m_initial_rel + begin, m_relocation->initial_rel + begin,
+               count*sizeof(fmath::vec3));
+        memcpy(m_shape->m_q_tilde + begin, m_relocation->q_tilde + begin,
+               count*sizeof(fmath::vec9));
+    }
+}
+
+//=============================================================================
+// EndRelocate
+//=============================================================================
+
+void PSystem::EndRelocate()
+{
+    assert(m_relocation != NULL);
+
+    // The old blocks go back to the pool
+    delete m_relocation;
+    m_relocation = NULL;
+}
+
+//=============================================================================
+// JoinParts
+//=============================================================================
+
+bool PSystem::JoinParts(Transport& transport)
+{
+    assert(m_relocation == NULL);
+
+    // The stored rest values of every part have to be relative to the same
+    // point, the initial center of mass of the whole body
+    double origin[4] = { 0, 0, 0, static_cast<double>(m_data_length) };
     for (size_t i = 0; i < m_data_length; ++i)
     {
-        mat_Apq_tilde += m_current_rel[i] * dlib::trans(m_q_tilde[i]);
+        for (int j = 0; j < 3; ++j)
+        {
+            origin[j] += m_shape->m_initial_pos[i](j);
+        }
+    }
+    if (!transport.Sum(origin, 4))
+    {
+        return false;
     }
 
-    // Calculate A~
-    mat_A_tilde = mat_Apq_tilde * mat_Aqq_tilde;
+    own_shape();
+    m_shape->set_origin(fmath::vec3(origin[0] / origin[3], origin[1] / origin[3],
+                                    origin[2] / origin[3]));
+
+    // The rest moments are sums over the particles too
+    double moments[10][10];
+    memcpy(moments, m_shape->m_rest_moments, sizeof(moments));
+    if (!transport.Sum(&moments[0][0], 100))
+    {
+        update_rest_state();
+        return false;
+    }
+    memcpy(m_shape->m_rest_moments, moments, sizeof(moments));
+    m_shape->update_rest();
 
-    // Fix the A~ matrix by doing some volume preservation
-    dlib::mat9x9 mat_A_tilde_sq = dlib::identity_matrix<real>(9L);
+    m_body_length = static_cast<size_t>(origin[3]);
+    m_transport = &transport;
+    update_rest_state();
+    Reset();
+    return true;
+}
+
+//=============================================================================
+// UpdatePart
+//=============================================================================
+
+bool PSystem::UpdatePart(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    assert(m_transport != NULL);
+
+    // Every part saw the same sums, so they all fall asleep together. A
+    // part woken on its own, by a pick or a collision, wakes the others,
+    // otherwise it would wait for sums the sleeping parts never send.
+    if (m_sleeping)
+    {
+        WakeIfDisturbed(force, fields);
+    }
+    double awake = m_sleeping ? 0 : 1;
+    if (!m_transport->Max(&awake, 1))
+    {
+        return false;
+    }
+    if (awake == 0)
+    {
+        return true;
+    }
+    if (m_sleeping)
+    {
+        Wake();
+    }
+
+    BeginUpdate(dt, force, fields, 1);
+    RangeSums& sums = m_range_sums[0];
+
+    PredictRange(0);
+    double center[4] = { sums.pos(0), sums.pos(1), sums.pos(2), sums.vel_sq };
+    if (!m_transport->Sum(center, 4))
+    {
+        return false;
+    }
+    sums.pos = fmath::vec3(center[0], center[1], center[2]);
+    sums.vel_sq = center[3];
+    FindCenter();
+
+    // A_pq or A_pq~, whichever this step uses
+    AccumulateRange(0);
+    const int columns = m_step_quadratic ? 9 : 3;
+    double shape[27];
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int c = 0; c < columns; ++c)
+        {
+            shape[r*columns + c] = m_step_quadratic ? sums.apq_tilde(r, c) : sums.apq(r, c);
+        }
+    }
+    if (!m_transport->Sum(shape, 3*columns))
+    {
+        return false;
+    }
     for (int r = 0; r < 3; ++r)
     {
-        for (int c = 0; c < 9; ++c)
+        for (int c = 0; c < columns; ++c)
         {
-            mat_A_tilde_sq(r, c) = mat_A_tilde(r, c);
+            if (m_step_quadratic)
+            {
+                sums.apq_tilde(r, c) = shape[r*columns + c];
+            }
+            else
+            {
+                sums.apq(r, c) = shape[r*columns + c];
+            }
         }
     }
-    mat_A_tilde *= (1.0 / root(dlib::det(mat_A_tilde_sq), 9.0));
+    Solve();
 
-    // Finish the integration
-    const dlib::mat3x9 mat_goal = (m_beta*mat_A_tilde) + ((1.0 - m_beta)*mat_R_tilde);
-	const real dt_inv = 1.0 / dt;
+    ApplyRange(0);
+    double motion[2] = { sums.max_deviation_sq, sums.max_vel_sq };
+    if (!m_transport->Max(motion, 2))
+    {
+        return false;
+    }
+    sums.max_deviation_sq = motion[0];
+    sums.max_vel_sq = motion[1];
+    FinishUpdate();
+    return true;
+}
 
-#ifdef SLOW_MO
-	// Slow motion doesn't work all that great, but this is what the paper
-	// suggested for varying time steps, it doesn't work all that well.
-	const real alpha_term = m_alpha * (dt / 0.01);
-#else
-	const real alpha_term = m_alpha;
-#endif
+//=============================================================================
+// check_rest
+//=============================================================================
 
-    for (size_t i = 0; i < m_data_length; ++i)
+/* Identifies the force fields a body came to rest under, so it can tell
+ * when they change.
+ */
+static unsigned int fields_version(const ForceFieldSet* fields)
+{
+    return (fields != NULL && !fields->IsEmpty()) ? fields->GetVersion() : 0;
+}
+
+void PSystem::check_rest(real mean_energy, const fmath::vec3& force, const ForceFieldSet* fields)
+{
+    const real deviation_change = std::fabs(m_max_goal_deviation - m_last_goal_deviation);
+    if (mean_energy > m_sleep_energy || deviation_change > m_sleep_deviation * m_rest.radius)
+    {
+        m_rest_steps = 0;
+        return;
+    }
+
+    ++m_rest_steps;
+    if (m_rest_steps >= m_sleep_steps)
+    {
+        m_sleeping = true;
+        m_resting = true;
+        m_rest_force = force;
+        m_rest_fields = fields_version(fields);
+    }
+}
+
+//=============================================================================
+// WakeIfDisturbed
+//=============================================================================
+
+bool PSystem::WakeIfDisturbed(const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    if (!m_resting)
     {
-        const dlib::vec3 goal = (mat_goal*m_q_tilde[i]) + m_current_com;
-        const dlib::vec3 alpha = alpha_term * (goal - m_current_pos[i]) * dt_inv;
+        return false;
+    }
+
+    // Any noticeable change in the forces could get the body moving
+    const real FORCE_TOLERANCE = 1e-3;
+    const bool disturbed =
+        fmath::length_squared(fmath::load(force) - m_rest_force) >
+            FORCE_TOLERANCE * FORCE_TOLERANCE ||
+        fields_version(fields) != m_rest_fields;
+    if (disturbed)
+    {
+        Wake();
+    }
+
+    return disturbed;
+}
+
+//=============================================================================
+// SetAutoSleep
+//=============================================================================
+
+void PSystem::SetAutoSleep(real energy, real deviation, int steps)
+{
+    assert(steps >= 0);
+
+    m_sleep_energy = energy;
+    m_sleep_deviation = deviation;
+    m_sleep_steps = steps;
+    m_rest_steps = 0;
+    if (steps == 0)
+    {
+        wake_from_rest();
+    }
+}
+
+//=============================================================================
+// update_plasticity
+//=============================================================================
+
+void PSystem::update_plasticity(real dt)
+{
+    const fmath::mat3 identity = fmath::mat3::identity();
+
+    // The fitted transform without its rotation, identity if the body has
+    // its rest shape. The fit is against the rest shape built from
+    // m_plastic_applied, measure it against m_plastic instead so the
+    // deformation still waiting for a rebuild isn't absorbed again.
+    const fmath::mat3 strain =
+        fmath::trans(mat_R) * mat_A * m_plastic_applied * fmath::inv(m_plastic) - identity;
+    if (fmath::norm(strain) > m_plastic_yield)
+    {
+        const real amount = std::min<real>(dt * m_plastic_creep, 1.0);
+        const fmath::mat3 plastic = (identity + strain * amount) * m_plastic;
+
+        // Permanent deformations keep the volume, and never turn the rest
+        // shape inside out so it stays invertible for the strain above
+        const real det = fmath::det(plastic);
+        if (det > 0)
+        {
+            m_plastic = plastic * (1.0 / std::pow(det, 1.0 / 3.0));
+        }
 
-        m_current_vel[i] += alpha;
-        m_current_pos[i] = m_old_pos[i] + dt*m_current_vel[i];
+        const fmath::mat3 deformation = m_plastic - identity;
+        const real size = fmath::norm(deformation);
+        if (size > m_plastic_max)
+        {
+            m_plastic = identity + deformation * (m_plastic_max / size);
+        }
+    }
+
+    // Rebuilding the rest state is constant cost but not free, only do it
+    // when the shape changed noticeably and not every step
+    ++m_plastic_steps;
+    if (m_plastic_steps >= PLASTIC_REBUILD_INTERVAL &&
+        fmath::norm(m_plastic - m_plastic_applied) > PLASTIC_REBUILD_THRESHOLD)
+    {
+        m_plastic_applied = m_plastic;
+        m_plastic_steps = 0;
+        update_rest_state();
     }
 }
 
+//=============================================================================
+// SetPlasticity
+//=============================================================================
+
+void PSystem::SetPlasticity(real yield, real creep, real max_deformation)
+{
+    assert(yield >= 0);
+    assert(creep >= 0);
+    assert(max_deformation >= 0);
+
+    m_plastic_yield = yield;
+    m_plastic_creep = creep;
+    m_plastic_max = max_deformation;
+    wake_from_rest();
+}
+
 //=============================================================================
 // EndUpdate
 //=============================================================================
 
 void PSystem::EndUpdate()
 {
+    EndUpdate(m_current_pos.GetData(), m_skin);
+}
+
+void PSystem::EndUpdate(const dlib::vec3* positions, const SkinTransform& skin)
+{
+    assert(m_mesh != NULL);
+    if (m_mesh->GetPositionFormat() != Mesh::FLOAT_POSITIONS)
+    {
+        end_update_packed(positions, skin);
+        return;
+    }
+
+    dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh->GetData()); 
+
+    // Proxy bodies move every vertex to its goal position
+    for (size_t i = 0; i < m_shape->m_skin_to_index.size(); ++i)
+    {
+        dlib::vec3 pos;
+        fmath::store(pos, (skin.matrix * m_shape->m_skin_q_tilde[i]) + skin.offset);
+
+        const std::vector<int>& duplicates(m_shape->m_skin_to_index[i]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            data[duplicates[j]] = pos;
+        }
+    }
+
     // Update the mesh by copying over the new positions using the
-    // duplicate mappings in m_vec_to_index.
-    dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh.GetData()); 
-    for (size_t i = 0; i < m_vec_to_index.size(); ++i)
+    // duplicate mappings of the rest shape.
+    const std::vector<std::vector<int> >& vec_to_index(m_shape->m_vec_to_index);
+    for (size_t i = 0; i < vec_to_index.size(); ++i)
     {
-        const std::vector<int>& duplicates(m_vec_to_index[i]);
+        const std::vector<int>& duplicates(vec_to_index[i]);
         for (size_t j = 0; j < duplicates.size(); ++j)
         {
-            data[duplicates[j]] = m_current_pos[i];
+            data[duplicates[j]] = positions[i];
         }
     }
 
     // Upload the new positions to the video card.
-    m_mesh.UpdateData();
+    m_mesh->UpdateData();
+}
+
+//=============================================================================
+// end_update_packed
+//=============================================================================
+
+void PSystem::end_update_packed(const dlib::vec3* positions, const SkinTransform& skin)
+{
+    // Proxy bodies move every vertex through the skin and none with the
+    // particles, the others only with the particles
+    const bool skinned = !m_shape->m_skin_to_index.empty();
+    const std::vector<std::vector<int> >& to_index(skinned ? m_shape->m_skin_to_index :
+                                                             m_shape->m_vec_to_index);
+    const size_t count = to_index.size();
+    if (skinned)
+    {
+        m_upload_skin.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            fmath::store(m_upload_skin[i],
+                         (skin.matrix * m_shape->m_skin_q_tilde[i]) + skin.offset);
+        }
+        positions = &m_upload_skin[0];
+    }
+
+    // Each one is packed once, with bounds around all of them, before it
+    // is copied to its duplicates
+    const real* unique_data = reinterpret_cast<const real*>(positions);
+    real min[3];
+    real max[3];
+    Mesh::FindBounds(unique_data, count, min, max);
+    m_mesh->SetPositionBounds(min, max);
+    m_upload_packed.resize(4*count);
+    m_mesh->PackPositions(unique_data, count, &m_upload_packed[0]);
+
+    // Copy both forms to the duplicates, a packed vertex is one 8 byte move
+    const size_t packed_size = 4*sizeof(uint16_t);
+    dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh->GetData());
+    uint16_t* packed = m_mesh->GetPackedData();
+    const uint16_t* unique = &m_upload_packed[0];
+    size_t copied = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const std::vector<int>& duplicates(to_index[i]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            data[duplicates[j]] = positions[i];
+            memcpy(packed + 4*duplicates[j], unique + 4*i, packed_size);
+        }
+        copied += duplicates.size();
+    }
+
+    // Triangles left behind by RemoveParticles() don't follow a particle,
+    // so they are only packed right when everything is packed again
+    if (copied != m_mesh->GetDataSize() / 3)
+    {
+        m_mesh->UpdateData();
+        return;
+    }
+    m_mesh->UpdatePackedData();
 }
 
 //=============================================================================
@@ -322,7 +1150,179 @@ void PSystem::EndUpdate()
 
 void PSystem::Render()
 {
-    m_mesh.Render();
+    assert(m_mesh != NULL);
+    m_mesh->Render();
+}
+
+//=============================================================================
+// RemoveParticles
+//=============================================================================
+
+bool PSystem::RemoveParticles(const std::vector<size_t>& particles)
+{
+    assert(m_transport == NULL);
+    assert(m_mesh != NULL);
+
+    if (particles.empty())
+    {
+        return true;
+    }
+
+    if (m_data_length < particles.size() + MIN_PARTICLES)
+    {
+        return false;
+    }
+
+    std::vector<size_t> removed(particles);
+    std::sort(removed.begin(), removed.end());
+    assert(std::adjacent_find(removed.begin(), removed.end()) == removed.end());
+    assert(removed.back() < m_data_length);
+
+    // Bodies sharing the rest shape keep the old one
+    own_shape();
+
+    // Take the removed particles out of the sums, and collapse their mesh
+    // triangles. A triangle that still has a remaining particle is folded
+    // onto it so it follows the body, the others are folded onto one of
+    // their corners and left behind.
+    dlib::vec3* data = reinterpret_cast<dlib::vec3*>(m_mesh->GetData());
+    fmath::vec3 com_sum = m_current_com * static_cast<real>(m_data_length);
+    for (size_t r = 0; r < removed.size(); ++r)
+    {
+        const size_t index = removed[r];
+        m_shape->add_rest_moments(m_shape->m_q_tilde[index], -1);
+        com_sum -= fmath::load(m_current_pos[index]);
+
+        const std::vector<int>& duplicates(m_shape->m_vec_to_index[index]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            const int vertex = duplicates[j];
+            const int triangle = vertex - vertex % 3;
+
+            int survivor = -1;
+            for (int k = 0; k < 3 && survivor < 0; ++k)
+            {
+                const int other = m_shape->m_vertex_particle[triangle + k];
+                if (other >= 0 && !std::binary_search(removed.begin(), removed.end(),
+                                                      static_cast<size_t>(other)))
+                {
+                    survivor = other;
+                }
+            }
+
+            m_shape->m_vertex_particle[vertex] = survivor;
+            if (survivor >= 0)
+            {
+                m_shape->m_vec_to_index[survivor].push_back(vertex);
+            }
+            else
+            {
+                data[vertex] = data[triangle];
+            }
+        }
+    }
+
+    // Fill the holes with the particles at the end, going backwards so
+    // the one moved is never one that still has to be removed
+    for (size_t r = removed.size(); r-- > 0; )
+    {
+        const size_t index = removed[r];
+        const size_t last = m_data_length - 1;
+        if (index != last)
+        {
+            m_current_pos[index] = m_current_pos[last];
+            m_current_vel[index] = m_current_vel[last];
+        }
+
+        m_shape->remove_particle(index);
+        --m_data_length;
+    }
+    m_body_length = m_data_length;
+
+    m_current_com = com_sum * (1 / static_cast<real>(m_data_length));
+    m_shape->update_rest();
+    update_rest_state();
+    wake_from_rest();
+
+    return true;
+}
+
+//=============================================================================
+// DetachParticles
+//=============================================================================
+
+PSystem* PSystem::DetachParticles(const std::vector<size_t>& particles, Mesh& mesh)
+{
+    assert(m_transport == NULL);
+    assert(m_mesh != NULL);
+
+    // The mesh of a proxy body isn't split between its particles
+    if (IsProxy() || particles.size() < MIN_PARTICLES ||
+        m_data_length < particles.size() + MIN_PARTICLES)
+    {
+        return NULL;
+    }
+
+    // Where each detached particle ends up in the new body
+    std::map<size_t, size_t> new_index;
+    for (size_t i = 0; i < particles.size(); ++i)
+    {
+        assert(particles[i] < m_data_length);
+        new_index[particles[i]] = i;
+    }
+    assert(new_index.size() == particles.size());
+
+    // Copy every triangle that only uses detached particles
+    mesh.NewMesh();
+    mesh.SetIncludedData(Mesh::VERTICES);
+
+    std::vector<std::vector<int> > vec_to_index(particles.size());
+    std::set<int> visited;
+    int num_vertices = 0;
+    for (size_t i = 0; i < particles.size(); ++i)
+    {
+        const std::vector<int>& duplicates(m_shape->m_vec_to_index[particles[i]]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            const int triangle = duplicates[j] - duplicates[j] % 3;
+            if (!visited.insert(triangle).second)
+            {
+                continue;
+            }
+
+            size_t corners[3];
+            bool inside = true;
+            for (int k = 0; k < 3 && inside; ++k)
+            {
+                const int other = m_shape->m_vertex_particle[triangle + k];
+                std::map<size_t, size_t>::const_iterator iter = new_index.find(other);
+                inside = other >= 0 && iter != new_index.end();
+                corners[k] = inside ? iter->second : 0;
+            }
+
+            if (!inside)
+            {
+                continue;
+            }
+
+            mesh.AddTriangle(m_current_pos[particles[corners[0]]],
+                             m_current_pos[particles[corners[1]]],
+                             m_current_pos[particles[corners[2]]]);
+            for (int k = 0; k < 3; ++k)
+            {
+                vec_to_index[corners[k]].push_back(num_vertices++);
+            }
+        }
+    }
+
+    ShapeTemplate* shape = new ShapeTemplate(*m_shape, particles, vec_to_index, num_vertices);
+    PSystem* body = new PSystem(mesh, shape, *this, particles);
+
+    const bool removed = RemoveParticles(particles);
+    assert(removed);
+    (void)removed;
+
+    return body;
 }
 
 //=============================================================================
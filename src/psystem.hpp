@@ -3,30 +3,16 @@
 
 #include "defs.hpp"
 #include "mesh.hpp"
+#include "particlearray.hpp"
+#include "arena.hpp"
+#include "fmath.hpp"
+#include "forcefield.hpp"
+#include "shapetemplate.hpp"
+#include "transport.hpp"
+#include "atomic.hpp"
 
-#include <map>
 #include <vector>
-
-/* Used by the std::map in PSystem::initialize() for finding duplicate
- * vertices.
- */
-class Vec3Less
-{
-public:
-    bool operator()(const dlib::vec3& v1, const dlib::vec3& v2) const
-    {
-        // Need to satisfy strict weak ordering for C++ containers.
-        // Start by comparing the first elements, then second, then third...
-        for (int i = 0; i < 3; ++i)
-        {
-            if (v1(i) < v2(i)) return true;
-            if (v2(i) < v1(i)) return false;
-        }
-
-        // They're equal
-        return false;
-    }
-};
+#include <cassert>
 
 /* Straight forward implementation of the paper
  *     'Meshless Deformations Based on Shape Matching' 
@@ -35,11 +21,66 @@ public:
 class PSystem
 {
 public:
+    /* The goal transform of the last Update(). The goal position of a
+     * point is matrix * q~ + offset, with q~ made from its rest position
+     * relative to the initial center of mass. Proxy bodies place their
+     * render vertices with it.
+     */
+    struct SkinTransform
+    {
+        fmath::mat3x9 matrix;
+        fmath::vec3 offset;
+    };
+
     /* Mesh must stay allocated for at least as long as this object.
+     *
+     * Params:
+     *   mesh - Every unique vertex becomes a particle, unless proxy_size
+     *          is given
+     *   proxy_size - If larger than 0 the body is simulated with one proxy
+     *                particle per cube of this size instead, at the center
+     *                of the vertices in it. The vertices follow the goal
+     *                transform of the proxies, so the mesh can be far
+     *                denser than the simulation. Falls back to a particle
+     *                per vertex if there would be fewer than MIN_PARTICLES
+     *                proxies.
      */
-    PSystem(Mesh& mesh);
+    PSystem(Mesh& mesh, real proxy_size = 0);
 
-    /* Cleans up all allocations.
+    /* Another body with the rest shape of a template, without copying or
+     * recomputing it. Only the particle positions and velocities are per
+     * body. The body starts in the rest shape, see SetPlacement().
+     *
+     * Params:
+     *   mesh - Has the same vertices as the mesh the template was made
+     *          from, they are placed with the body
+     *   shape - Shared with any other bodies using it, the body takes a
+     *           reference
+     */
+    PSystem(Mesh& mesh, ShapeTemplate* shape);
+
+    /* A body that steps particle arrays owned by the caller in place, like
+     * the component arrays of an engine or mapped staging memory, instead
+     * of copying them to and from a Mesh. The arrays are set to the rest
+     * shape here. There is no mesh, so EndUpdate(), Render(),
+     * RemoveParticles() and DetachParticles() can't be used.
+     *
+     *   ShapeTemplate* shape = new ShapeTemplate(vertices, num_vertices);
+     *   PSystem body(shape, ParticleArray(&components[0].pos[0], sizeof(Component)),
+     *                ParticleArray(&components[0].vel[0], sizeof(Component)));
+     *
+     * Params:
+     *   shape - Usually made from the caller's vertices, one particle per
+     *           vertex. The body takes a reference.
+     *   positions - GetNumParticles() positions of the shape's particles,
+     *               must stay allocated for as long as this object
+     *   velocities - The same for the velocities
+     */
+    PSystem(ShapeTemplate* shape, const ParticleArray& positions,
+            const ParticleArray& velocities);
+
+    /* Cleans up all allocations, the particle arrays go back to the arena
+     * pool for the next body. The shape template is released.
      */
     ~PSystem();
 
@@ -49,29 +90,182 @@ public:
      * Params:
      *   dt - timestep in seconds (usually 0.016)
      *   force - Any forces accumulated, like gravity
+     *   fields - Spatially varying forces added to force, optional
+     */
+    void Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
+
+    /* Update() split into parts that each work on one range of the
+     * particles, so a large body can be stepped by several threads.
+     * Update() is the same as
+     *
+     *   if (BeginUpdate(dt, force, fields, 1))
+     *   {
+     *       PredictRange(0);
+     *       FindCenter();
+     *       AccumulateRange(0);
+     *       Solve();
+     *       ApplyRange(0);
+     *       FinishUpdate();
+     *   }
+     *
+     * With more ranges, the calls of one part for different ranges can
+     * run at the same time, but all of them must finish before the next
+     * part starts. MergeRanges() can add up the ranges of one NUMA node
+     * between AccumulateRange() and Solve(), so Solve() only reads one
+     * partial sum per node. The sums are always added in the same order,
+     * the result only depends on the number of ranges and not on the
+     * threads that ran them.
+     *
+     * Returns:
+     *   False if the body is asleep, the other parts must not be called.
+     */
+    bool BeginUpdate(real dt, const dlib::vec3& force, const ForceFieldSet* fields,
+                     size_t num_ranges);
+
+    /* Partial integration of the particles in a range.
+     */
+    void PredictRange(size_t range);
+
+    /* The center of mass, from the sums of every range.
+     */
+    void FindCenter();
+
+    /* The range's part of Apq, or Apq~ for quadratic deformations.
+     */
+    void AccumulateRange(size_t range);
+
+    /* Add the sums of count ranges starting at first into the first one.
+     */
+    void MergeRanges(size_t first, size_t count);
+
+    /* The goal transform, from the sums of every range.
+     */
+    void Solve();
+
+    /* Move the particles in a range toward their goals.
+     */
+    void ApplyRange(size_t range);
+
+    /* Plasticity and going to sleep, after every range has been applied.
+     */
+    void FinishUpdate();
+
+    /* The particles of a range, from begin up to end. Ranges are a
+     * multiple of RANGE_ALIGNMENT particles long, so neighbouring ranges
+     * share few pages. Trailing ranges of small bodies are empty.
+     */
+    void GetRange(size_t range, size_t num_ranges, size_t& begin, size_t& end) const;
+
+    /* Move the particle arrays into new memory, one range at a time.
+     * Memory is placed on the NUMA node of the thread that writes it
+     * first, so calling RelocateRange() for each range on the thread that
+     * will step it keeps most of a large body's memory accesses local.
+     * The rest shape is moved too, unless it is shared with other bodies.
+     *
+     *   if (psys.BeginRelocate(ranges))
+     *   {
+     *       RelocateRange(r) for every range, on its own thread
+     *       EndRelocate();
+     *   }
+     *
+     * The body must not be used in between.
+     *
+     * Returns:
+     *   False if the memory couldn't be allocated, nothing is changed.
+     */
+    bool BeginRelocate(size_t num_ranges);
+
+    /* Copy a range of particles into the new memory.
      */
-    void Update(real dt, const dlib::vec3& force);
+    void RelocateRange(size_t range);
+
+    /* Free the old memory.
+     */
+    void EndRelocate();
+
+    // Particles per range are a multiple of this, see GetRange()
+    static const size_t RANGE_ALIGNMENT = 1024;
+
+    /* Make this body one part of a body whose particles are split over
+     * several processes, so it can outgrow one machine. Each process makes
+     * a PSystem from its own piece of the mesh, without particles in
+     * common with the other pieces, and every part calls this with a
+     * transport connecting them. The parts then share one rest shape, and
+     * UpdatePart() steps them together by adding up the few sums shape
+     * matching needs over the transport, 34 values per step.
+     *
+     * Anything that changes the state of the body, like Reset(),
+     * SetAlpha() or Sleep(), must be done to every part. Wake() is the
+     * exception, waking one part wakes the others in the next step.
+     * RemoveParticles() and DetachParticles() aren't supported. The
+     * transport must outlive the body.
+     *
+     * Returns:
+     *   False if the transport failed, the body is only a piece then.
+     */
+    bool JoinParts(Transport& transport);
+
+    /* Update() for one part of a body, see JoinParts(). Every part must
+     * call it with the same arguments, sleeping or not. A sleeping body
+     * still sends one value per step, to find out if any part was woken.
+     *
+     * Returns:
+     *   False if the transport failed, the step is left unfinished.
+     */
+    bool UpdatePart(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
 
     /* Update mesh data and update the OpenGL buffer object.
      */
     void EndUpdate();
 
+    /* Same as EndUpdate() but takes the particle positions and skin
+     * transform from a copy instead of the live state, used when the
+     * simulation runs on another thread.
+     *
+     * If the mesh sends its positions in 16 bits (see
+     * Mesh::SetPositionFormat()) they are packed here, once per particle
+     * rather than once per vertex.
+     *
+     * Params:
+     *   positions - GetNumParticles() positions, in the same order as
+     *               GetPositions()
+     *   skin - GetSkinTransform() from the same step, only used by proxy
+     *          bodies
+     */
+    void EndUpdate(const dlib::vec3* positions, const SkinTransform& skin);
+
     /* Calls the internal mesh's render method.
      */
     void Render();
 
     /* Get the positions array for modifying, usually for collision
-     * detection. Use GetNumParticles() to get the length.
+     * detection. Use GetNumParticles() to get the length. Bodies stepping
+     * the caller's arrays only have one if they are packed, see
+     * GetPositionArray().
      */
     dlib::vec3* GetPositions()
     {
-        return m_current_pos;
+        assert(m_current_pos.IsPacked());
+        return m_current_pos.GetData();
     }
 
     /* Get the velocities array for modifying. Use GetNumParticles()
      * to get the length.
      */
     dlib::vec3* GetVelocities()
+    {
+        assert(m_current_vel.IsPacked());
+        return m_current_vel.GetData();
+    }
+
+    /* The positions of any body, also when they are strided.
+     */
+    const ParticleArray& GetPositionArray() const
+    {
+        return m_current_pos;
+    }
+
+    const ParticleArray& GetVelocityArray() const
     {
         return m_current_vel;
     }
@@ -80,7 +274,17 @@ public:
      */
     dlib::vec3 GetCOM() const
     {
-        return m_current_com;
+        dlib::vec3 com;
+        com = m_current_com(0), m_current_com(1), m_current_com(2);
+        return com;
+    }
+
+    /* The rotation from the rest shape to the current one, found in the
+     * last Update(), or the placement rotation after Reset().
+     */
+    const fmath::mat3& GetRotation() const
+    {
+        return mat_R;
     }
 
     /* Return the number of particles in the system.
@@ -105,6 +309,7 @@ public:
         if (alpha > 1.0) m_alpha = 1.0;
         else if (alpha < 0.0) m_alpha = 0.0;
         else m_alpha = alpha;
+        wake_from_rest();
     }
 
     real GetBeta()
@@ -123,54 +328,407 @@ public:
         if (beta > 1.0) m_beta = 1.0;
         else if (beta < 0.0) m_beta = 0.0;
         else m_beta = beta;
+        wake_from_rest();
+    }
+
+    /* The alpha value is tuned for one time step size. When dt differs
+     * from it (slow motion, substepping) the paper suggests scaling alpha
+     * by dt / reference_dt so the system keeps the same stiffness. A value
+     * of 0 disables the correction and uses alpha as is for every step.
+     */
+    void SetAlphaReferenceDt(real reference_dt)
+    {
+        m_alpha_reference_dt = reference_dt;
+        wake_from_rest();
+    }
+
+    real GetAlphaReferenceDt() const
+    {
+        return m_alpha_reference_dt;
+    }
+
+    /* The largest distance any particle moved during the last Update().
+     * Together with GetMaxGoalDeviation() this is used to estimate if the
+     * time step was small enough.
+     */
+    real GetMaxDisplacement() const
+    {
+        return m_max_displacement;
+    }
+
+    /* The largest distance between a particle and its goal position during
+     * the last Update(), before being pulled toward the goal.
+     */
+    real GetMaxGoalDeviation() const
+    {
+        return m_max_goal_deviation;
+    }
+
+    /* The root mean square distance of the particles from the center of
+     * mass in the rest shape. A measure of the size of the body.
+     */
+    real GetRestRadius() const
+    {
+        return m_rest.radius;
+    }
+
+    /* True if the body was turned inside out during the last Update(),
+     * meaning the best fit linear transform A has a negative determinant.
+     */
+    bool IsInverted() const
+    {
+        return m_inverted;
     }
 
+    /* The mesh vertices each particle was made from. Entry i lists the
+     * indices of all mesh vertices that are duplicates of particle i.
+     * Proxy particles aren't mesh vertices, their lists are empty.
+     */
+    const std::vector<std::vector<int> >& GetMeshIndices() const
+    {
+        return m_shape->m_vec_to_index;
+    }
+
+    /* The rest shape of the body, for making more bodies like it. Changes
+     * when particles are removed from a body whose shape is shared.
+     */
+    ShapeTemplate* GetShape()
+    {
+        return m_shape;
+    }
+
+    /* Where Reset() puts the body: the rest shape as it is in the mesh,
+     * rotated around its center of mass and then moved by translation.
+     * Also resets the body.
+     */
+    void SetPlacement(const fmath::mat3& rotation, const dlib::vec3& translation);
+
+    /* The goal transform from the last Update(), or the rest shape after
+     * Reset().
+     */
+    const SkinTransform& GetSkinTransform() const
+    {
+        return m_skin;
+    }
+
+    /* The rest position of each particle relative to the initial center
+     * of mass, what the matrix of GetSkinTransform() is applied to.
+     */
+    const fmath::vec3* GetRestPositions() const
+    {
+        return m_shape->m_initial_rel;
+    }
+
+    /* True if the body is simulated with proxy particles, see the
+     * constructor.
+     */
+    bool IsProxy() const
+    {
+        return m_shape->IsProxy();
+    }
+
+    /* Switch between quadratic deformations (the default) and linear
+     * deformations. Linear deformations look stiffer but skip all of the
+     * 9x9 quadratic terms, making each Update() considerably cheaper.
+     */
+    void SetQuadratic(bool quadratic)
+    {
+        if (quadratic != m_quadratic)
+        {
+            m_quadratic = quadratic;
+            wake_from_rest();
+        }
+    }
+
+    bool IsQuadratic() const
+    {
+        return m_quadratic;
+    }
+
+    /* Plastic deformation from the paper. When the strain of the body
+     * (how far the fitted transform is from a rotation) is larger than
+     * yield, part of it becomes permanent and the rest shape changes. The
+     * body stays dented or crushed instead of springing back. Reset()
+     * restores the original shape.
+     *
+     * Params:
+     *   yield - Strain above which the deformation becomes permanent
+     *   creep - How fast the strain is absorbed, per second. 0 turns
+     *           plasticity off.
+     *   max_deformation - Limit on the permanent deformation
+     */
+    void SetPlasticity(real yield, real creep, real max_deformation);
+
+    bool IsPlastic() const
+    {
+        return m_plastic_creep > 0;
+    }
+
+    /* Freeze the particle system, Update() does nothing until Wake() is
+     * called. The velocities are kept so the motion continues when woken.
+     */
+    void Sleep()
+    {
+        m_sleeping = true;
+        m_resting = false;
+    }
+
+    /* Wake the body, whether it was put to sleep with Sleep() or came to
+     * rest on its own.
+     */
+    void Wake()
+    {
+        m_sleeping = false;
+        m_resting = false;
+        m_rest_steps = 0;
+    }
+
+    bool IsSleeping() const
+    {
+        return m_sleeping;
+    }
+
+    /* Let the body fall asleep on its own once it is at rest: the mean
+     * kinetic energy of its particles stays below energy, and the largest
+     * goal deviation changes by less than deviation times the rest radius
+     * per step, for the given number of steps in a row. Resting on the
+     * ground keeps the deviation large, but it stops changing.
+     *
+     * A resting body wakes up when the force or force fields passed to
+     * Update() change, when its parameters change, and on Reset(). It
+     * doesn't notice changes made through GetPositions() or
+     * GetVelocities(), or fields that change over time while staying in the
+     * set, call Wake() after those.
+     *
+     * Params:
+     *   steps - Steps at rest before sleeping, 0 turns it off (the default)
+     */
+    void SetAutoSleep(real energy, real deviation, int steps);
+
+    /* True if the body fell asleep on its own, see SetAutoSleep().
+     */
+    bool IsResting() const
+    {
+        return m_resting;
+    }
+
+    /* Wake a resting body if Update() would be called with a different
+     * force or force fields than the ones it came to rest under. Update()
+     * does this itself, it is for callers that skip work for sleeping
+     * bodies.
+     *
+     * Returns:
+     *   True if the body was woken.
+     */
+    bool WakeIfDisturbed(const dlib::vec3& force, const ForceFieldSet* fields);
+
     /* Reset the particle system to its initial state.
      */
     void Reset();
 
+    /* Remove particles from the body, for tearing off or destroying parts
+     * of it. Only the removed particles are visited, the rest state is
+     * updated from them instead of being rebuilt. Mesh triangles that used
+     * a removed particle are collapsed so they don't render, call
+     * EndUpdate() afterwards.
+     *
+     * The remaining particles are reordered, indices from before the call
+     * are not valid anymore. Proxy bodies keep all of their mesh, it
+     * follows the remaining particles.
+     *
+     * Params:
+     *   particles - Indices of the particles to remove, no duplicates
+     *
+     * Returns:
+     *   False if fewer than MIN_PARTICLES would remain, nothing is
+     *   removed in that case.
+     */
+    bool RemoveParticles(const std::vector<size_t>& particles);
+
+    /* Move particles into a new body, for fracture. The new body keeps
+     * their rest shape, positions, velocities and settings. They are
+     * removed from this body like RemoveParticles() does.
+     *
+     * Params:
+     *   particles - Indices of the particles to detach, no duplicates
+     *   mesh - Filled with the triangles that only use detached particles.
+     *          It isn't finished, call Mesh::Finish() on the thread with
+     *          the OpenGL context. Must stay allocated for as long as the
+     *          new body.
+     *
+     * Returns:
+     *   The new body, owned by the caller. NULL if either body would have
+     *   fewer than MIN_PARTICLES or this is a proxy body, nothing is
+     *   changed in that case.
+     */
+    PSystem* DetachParticles(const std::vector<size_t>& particles, Mesh& mesh);
+
+    // The fewest particles a body can have and still have a rest shape
+    static const size_t MIN_PARTICLES = ShapeTemplate::MIN_PARTICLES;
+
 private:
-    /* Perform all one time setup and allocations.
+    /* Used by DetachParticles(), takes over some of the particles of
+     * another body. The shape is made from the same particles, the body
+     * takes over the caller's reference to it.
+     */
+    PSystem(Mesh& mesh, ShapeTemplate* shape, const PSystem& parent,
+            const std::vector<size_t>& particles);
+
+    /* Perform all one time setup and allocations, once m_shape is set.
      */
     void initialize();
 
+    /* Carve the particle arrays for m_data_length particles out of the
+     * arena.
+     *
+     * Returns:
+     *   False if the memory couldn't be allocated.
+     */
+    bool allocate(unsigned int flags = Arena::DEFAULT_FLAGS);
+
+    /* Get the rest state for the current permanent deformation from the
+     * shape template.
+     */
+    void update_rest_state();
+
+    /* Make a private copy of the shape template before changing it, if it
+     * is shared with other bodies.
+     */
+    void own_shape();
+
+    /* Wake the body if it fell asleep on its own.
+     */
+    void wake_from_rest()
+    {
+        if (m_resting)
+        {
+            Wake();
+        }
+    }
+
+    /* Count the steps the body has been at rest, and put it to sleep when
+     * it has been for long enough.
+     */
+    void check_rest(real mean_energy, const fmath::vec3& force, const ForceFieldSet* fields);
+
+    /* Absorb some of the current strain into the plastic deformation, and
+     * apply it to the rest state when it has changed enough.
+     */
+    void update_plasticity(real dt);
+
+    /* EndUpdate() for meshes that send packed positions. Packs the
+     * particles, or the skinned vertices of a proxy body, and copies them
+     * to the mesh together with the reals.
+     */
+    void end_update_packed(const dlib::vec3* positions, const SkinTransform& skin);
+
     /* Helper for calculating the center of mass.
      */
-    dlib::vec3 calc_com(const dlib::vec3* data);
+    fmath::vec3 calc_com(const ParticleArray& data);
 
     /* Helper for calculating the relative positions of the particles from
      * their original positions.
      */
-    void calc_rel_pos(const dlib::vec3* pos, dlib::vec3* rel_pos, dlib::vec3 com);
+    void calc_rel_pos(const ParticleArray& pos, fmath::vec3* rel_pos, const fmath::vec3& com);
 
 private:
-    Mesh& m_mesh; // Underlying mesh that this particles system is based on
+    Mesh* m_mesh; // Underlying mesh that this particles system is based on, NULL if none
+    bool m_external; // m_current_pos and m_current_vel belong to the caller
     real m_alpha; // Alpha parameter (explained above in SetAlpha())
     real m_beta; // Beta parameter (explained above in SetBeta())
+    real m_alpha_reference_dt; // Time step alpha is tuned for, 0 if unused
+    real m_max_displacement; // Largest particle movement in the last Update()
+    real m_max_goal_deviation; // Largest goal distance in the last Update()
+    bool m_quadratic; // Use quadratic deformations (see SetQuadratic())
+    bool m_sleeping; // Update() does nothing while true
+    bool m_resting; // m_sleeping was set by check_rest()
+    int m_rest_steps; // Steps in a row the body has been at rest
+    int m_sleep_steps; // See SetAutoSleep(), 0 if off
+    real m_sleep_energy;
+    real m_sleep_deviation;
+    real m_last_goal_deviation; // m_max_goal_deviation of the step before
+    fmath::vec3 m_rest_force; // The force the body came to rest under
+    unsigned int m_rest_fields; // Version of the fields it came to rest under, 0 if none
+    bool m_inverted; // det(A) was negative in the last Update()
     size_t m_data_length; // The number of particles
-    std::vector<std::vector<int> > m_vec_to_index; // Mapping of particles to mesh indices
-    dlib::vec3 m_current_com; // Current particle system center of mass
-    dlib::vec3 m_initial_com; // Initial particle system center of mass
+    size_t m_body_length; // Particles of the whole body, over every part
+    Transport* m_transport; // Connects the parts, NULL unless JoinParts() was called
+    ShapeTemplate* m_shape; // The rest shape, possibly shared with other bodies
+    ShapeTemplate::Rest m_rest; // m_shape's rest state with m_plastic_applied
+    fmath::mat3 m_placement_rotation; // See SetPlacement()
+    fmath::vec3 m_placement_offset; // Translation of the placement
+    bool m_placed; // False until SetPlacement(), the rest pose is used as is
+    Arena m_arena; // Holds all of the per particle arrays below
+    fmath::vec3 m_current_com; // Current particle system center of mass
 
-    dlib::vec3* m_current_vel; // Array of each particles current velocity
-    dlib::vec3* m_current_pos; // Array of each particles position
-    dlib::vec3* m_current_rel; // Array of cur_pos - cur_COM
-    dlib::vec3* m_old_pos; // Temporary array used during Update()
+    ParticleArray m_current_vel; // Array of each particles current velocity
+    ParticleArray m_current_pos; // Array of each particles position
+    fmath::vec3* m_current_rel; // Array of cur_pos - cur_COM
+    fmath::vec3* m_old_pos; // Temporary array used during Update()
+    std::vector<dlib::vec3> m_upload_skin; // Skinned vertices during end_update_packed()
+    std::vector<uint16_t> m_upload_packed; // Particles or skinned vertices, packed
 
-    dlib::vec3 const* m_initial_pos; // Array of initial particle positions
-    dlib::vec3 const* m_initial_rel; // Array of init_pos - init_COM
+    fmath::mat3 m_plastic; // Permanent deformation Sp of the rest shape
+    fmath::mat3 m_plastic_applied; // The Sp the lift was last built with
+    int m_plastic_steps; // Steps since m_plastic_applied was updated
+    real m_plastic_yield; // See SetPlasticity()
+    real m_plastic_creep;
+    real m_plastic_max;
 
-    // These matrices follow the paper
-    dlib::mat3x9 mat_Apq_tilde; // Stores the Apq~ matrix
-    dlib::mat3x9 mat_A_tilde; // Stores the A matrix
-    dlib::mat9x1 const* m_q_tilde; // Stores q~ array, calculated once
-    dlib::mat9x9 mat_Aqq_tilde; // Stores the Aqq~ matrix, calculated once
+    // These matrices follow the paper, the step only uses the fixed size
+    // fmath types
+    fmath::mat3x9 mat_Apq_tilde; // Stores the Apq~ matrix
+    fmath::mat3x9 mat_A_tilde; // Stores the A matrix
 
     // Matrices from the paper
-    dlib::mat3 mat_Apq; // Apq matrix
-    dlib::mat3 mat_Aqq; // Aqq matrix, calculated once
-    dlib::mat3 mat_A; // A matrix
-    dlib::mat3 mat_R; // R matrix, rotation matrix
+    fmath::mat3 mat_Apq; // Apq matrix
+    fmath::mat3 mat_A; // A matrix
+    fmath::mat3 mat_R; // R matrix, rotation matrix
+
+    SkinTransform m_skin; // See GetSkinTransform()
+
+    /* What one range adds up during a step, see BeginUpdate(). Each is on
+     * its own cache lines, they are written by different threads.
+     */
+    struct RangeSums
+    {
+        real vel_sq; // Sum of the squared velocities before the step
+        fmath::vec3 pos; // Sum of the predicted positions
+        fmath::mat3 apq; // Sum of rel * q^T for linear deformations
+        fmath::mat3x9 apq_tilde; // Sum of rel * q~^T for quadratic ones
+        real max_deviation_sq;
+        real max_vel_sq;
+        char padding[CACHE_LINE_SIZE];
+    };
+
+    // The step between BeginUpdate() and FinishUpdate()
+    std::vector<RangeSums> m_range_sums;
+    real m_step_dt;
+    fmath::vec3 m_step_force;
+    const ForceFieldSet* m_step_fields;
+    bool m_step_quadratic; // Quadratic deformations this step
+    real m_step_alpha; // Alpha scaled for m_step_dt
+    fmath::mat3 m_goal_linear; // Goal transform of the stored rest values
+    fmath::mat3x9 m_goal; // The same for quadratic deformations
+    fmath::vec3 m_goal_offset;
+
+    /* The old arrays while the body is being moved, see BeginRelocate().
+     */
+    struct Relocation
+    {
+        Arena arena; // The old block of the particle arrays
+        ParticleArray vel;
+        ParticleArray pos;
+        fmath::vec3* rel;
+        fmath::vec3* old_pos;
+        bool shape; // True if the rest shape is moved too
+        Arena shape_arena; // The old block of the rest shape
+        dlib::vec3* initial_pos;
+        fmath::vec3* initial_rel;
+        fmath::vec9* q_tilde;
+        size_t num_ranges;
+    };
+    Relocation* m_relocation; // NULL unless between BeginRelocate() and EndRelocate()
 };
 
 #endif
@@ -0,0 +1,211 @@
+#ifndef __SHAPE_MATCH_HPP__
+#define __SHAPE_MATCH_HPP__
+
+#include "defs.hpp"
+#include "fmath.hpp"
+#include "forcefield.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+/* The parts of a shape matching step that don't depend on how the
+ * particles are grouped, shared by PSystem and LatticeSystem.
+ */
+namespace shapematch
+{
+    /* Calculates num^(1.0/exp), keeping the sign of num. Returns 1 for 0
+     * so it can be used to normalize a determinant.
+     */
+    inline real root(real num, real exp)
+    {
+        if (num < 0)
+        {
+            return -std::pow(-num, 1.0/exp);
+        }
+        else if (num == 0)
+        {
+            return 1.0;
+        }
+        else
+        {
+            return std::pow(num, 1.0/exp);
+        }
+    }
+
+    // Probably not necessary
+    inline void verlet(fmath::vec3& pos, fmath::vec3& vel,
+                       const fmath::vec3& force, const real dt)
+    {
+        const fmath::vec3 old_vel = vel;
+        vel += force * dt;
+        pos += (old_vel + vel) * (0.5 * dt);
+    }
+
+    /* The first half of a step, integrate every particle with the uniform
+     * force and any force fields. The positions before the step are kept
+     * in old_pos.
+     *
+     * The fields are evaluated a block of particles at a time inside the
+     * same sweep, so they don't cost extra passes over the particles.
+     *
+     * pos and vel are dlib::vec3 pointers or ParticleArrays.
+     *
+     * Returns:
+     *   The sum of the squared velocities before the step, after whatever
+     *   the caller did to them since the last one (like collisions).
+     */
+    template <typename Array>
+    inline real predict(Array pos, Array vel, fmath::vec3* old_pos,
+                        size_t count, const fmath::vec3& force,
+                        const ForceFieldSet* fields, real dt)
+    {
+        real sum_vel_sq = 0;
+        if (fields == NULL || fields->IsEmpty())
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                fmath::vec3 p(pos[i](0), pos[i](1), pos[i](2));
+                fmath::vec3 v(vel[i](0), vel[i](1), vel[i](2));
+                sum_vel_sq += fmath::length_squared(v);
+                old_pos[i] = p;
+                verlet(p, v, force, dt);
+                for (int k = 0; k < 3; ++k)
+                {
+                    pos[i](k) = p(k);
+                    vel[i](k) = v(k);
+                }
+            }
+            return sum_vel_sq;
+        }
+
+        ForceBlock block;
+        for (size_t start = 0; start < count; start += ForceBlock::SIZE)
+        {
+            block.count = std::min<size_t>(count - start, ForceBlock::SIZE);
+            for (size_t j = 0; j < block.count; ++j)
+            {
+                const dlib::vec3& p(pos[start + j]);
+                block.x[j] = p(0);
+                block.y[j] = p(1);
+                block.z[j] = p(2);
+                block.fx[j] = force(0);
+                block.fy[j] = force(1);
+                block.fz[j] = force(2);
+            }
+
+            fields->Evaluate(block);
+
+            for (size_t j = 0; j < block.count; ++j)
+            {
+                const size_t i = start + j;
+                fmath::vec3 p(block.x[j], block.y[j], block.z[j]);
+                fmath::vec3 v(vel[i](0), vel[i](1), vel[i](2));
+                sum_vel_sq += fmath::length_squared(v);
+                old_pos[i] = p;
+                verlet(p, v, fmath::vec3(block.fx[j], block.fy[j], block.fz[j]), dt);
+                for (int k = 0; k < 3; ++k)
+                {
+                    pos[i](k) = p(k);
+                    vel[i](k) = v(k);
+                }
+            }
+        }
+
+        return sum_vel_sq;
+    }
+
+    /* The rotational part R of Apq, from its polar decomposition.
+     */
+    inline fmath::mat3 rotation(const fmath::mat3& Apq)
+    {
+        const fmath::mat3 S = fmath::sqrt_db(fmath::trans(Apq) * Apq);
+        return Apq * fmath::inv(S);
+    }
+
+    /* Update R towards the rotational part of A, from the paper
+     *     'A Robust Method to Extract the Rotational Part of Deformations'
+     * http://dl.acm.org/citation.cfm?id=2994269
+     *
+     * Unlike rotation() it works for singular and inverted A, which is
+     * common for small groups of particles. Where A has no information,
+     * like the normal of a flat group, R keeps its previous value. Starting
+     * from the last step's R a few iterations are enough.
+     */
+    inline void extract_rotation(const fmath::mat3& A, fmath::mat3& R, int iterations)
+    {
+        for (int iteration = 0; iteration < iterations; ++iteration)
+        {
+            // omega = sum r_i x a_i / |sum r_i . a_i| over the columns
+            fmath::vec3 omega(0, 0, 0);
+            real dot = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                const fmath::vec3 r(R(0, c), R(1, c), R(2, c));
+                const fmath::vec3 a(A(0, c), A(1, c), A(2, c));
+                omega += fmath::vec3(r(1)*a(2) - r(2)*a(1),
+                                     r(2)*a(0) - r(0)*a(2),
+                                     r(0)*a(1) - r(1)*a(0));
+                dot += fmath::dot(r, a);
+            }
+            omega *= 1 / (std::fabs(dot) + 1e-9);
+
+            const real angle = std::sqrt(fmath::length_squared(omega));
+            if (angle < 1e-9)
+            {
+                break;
+            }
+
+            // Rodrigues' formula for the rotation by angle around omega
+            const fmath::vec3 axis = omega * (1 / angle);
+            const real s = std::sin(angle);
+            const real c = std::cos(angle);
+            const real t = 1 - c;
+            fmath::mat3 step;
+            step(0, 0) = c + t*axis(0)*axis(0);
+            step(0, 1) = t*axis(0)*axis(1) - s*axis(2);
+            step(0, 2) = t*axis(0)*axis(2) + s*axis(1);
+            step(1, 0) = t*axis(1)*axis(0) + s*axis(2);
+            step(1, 1) = c + t*axis(1)*axis(1);
+            step(1, 2) = t*axis(1)*axis(2) - s*axis(0);
+            step(2, 0) = t*axis(2)*axis(0) - s*axis(1);
+            step(2, 1) = t*axis(2)*axis(1) + s*axis(0);
+            step(2, 2) = c + t*axis(2)*axis(2);
+            R = step * R;
+        }
+
+        // Keep R orthonormal as the steps accumulate
+        fmath::vec3 x(R(0, 0), R(1, 0), R(2, 0));
+        fmath::vec3 y(R(0, 1), R(1, 1), R(2, 1));
+        x *= 1 / std::sqrt(fmath::length_squared(x));
+        y -= x * fmath::dot(x, y);
+        y *= 1 / std::sqrt(fmath::length_squared(y));
+        const fmath::vec3 z(x(1)*y(2) - x(2)*y(1),
+                            x(2)*y(0) - x(0)*y(2),
+                            x(0)*y(1) - x(1)*y(0));
+        for (int r = 0; r < 3; ++r)
+        {
+            R(r, 0) = x(r);
+            R(r, 1) = y(r);
+            R(r, 2) = z(r);
+        }
+    }
+
+    /* The alpha used for a step of dt. This is what the paper suggested
+     * for varying time steps, it can make the simulation more unstable
+     * with high beta and low alpha values.
+     *
+     * Params:
+     *   reference_dt - The time step alpha is tuned for, 0 to use alpha
+     *                  as is
+     */
+    inline real scaled_alpha(real alpha, real dt, real reference_dt)
+    {
+        if (reference_dt > 0)
+        {
+            return std::min<real>(alpha * (dt / reference_dt), 1.0);
+        }
+        return alpha;
+    }
+}
+
+#endif
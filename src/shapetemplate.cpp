@@ -0,0 +1,637 @@
+#include "shapetemplate.hpp"
+#include "atomic.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <new>
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+ShapeTemplate::ShapeTemplate(Mesh& mesh, real proxy_size) :
+    m_references(1),
+    m_proxy_size(proxy_size)
+{
+    // Only the positions are simulated, the rest of the mesh is left as is
+    assert(mesh.IsFlagEnabled(Mesh::VERTICES));
+
+    // Calculate how much space we need, we won't use the number
+    // of vertices in the mesh because there are many duplicate
+    // values. We need to figure out how many unique vertices
+    // there are, and the mapping to each duplicated vertex in
+    // the original mesh.
+
+    // This map stores all the unique vectors and their corresponding
+    // index in the mesh data array, so they can be copied over after
+    // calculating the new positions.
+    std::map<dlib::vec3, std::vector<int>, Vec3Less> vec_to_index_map;
+    const dlib::vec3* data = reinterpret_cast<dlib::vec3*>(mesh.GetData());
+    const size_t data_size = (mesh.GetDataSize()*sizeof(real)) / sizeof(dlib::vec3);
+    for (size_t i = 0; i < data_size; ++i)
+    {
+        const dlib::vec3& val(data[i]);
+        if (vec_to_index_map.find(val) == vec_to_index_map.end())
+        {
+            std::vector<int> duplicates;
+            duplicates.push_back(i);
+            vec_to_index_map[val] = duplicates;
+        }
+        else
+        {
+            vec_to_index_map[val].push_back(i);
+        }
+    }
+
+    if (m_proxy_size <= 0 || !make_proxies(vec_to_index_map))
+    {
+        m_proxy_size = 0;
+        m_data_length = vec_to_index_map.size();
+
+        if (!allocate())
+        {
+            throw std::bad_alloc();
+        }
+
+        // We need to make our own buffer because we have fewer
+        // particles than vertices. They are the keys in the
+        // m_vec_to_index map.
+        int i = 0;
+        std::map<dlib::vec3, std::vector<int>, Vec3Less>::const_iterator iter;
+        for (iter = vec_to_index_map.begin(); iter != vec_to_index_map.end(); ++iter)
+        {
+            m_initial_pos[i] = iter->first;
+            m_vec_to_index.push_back(iter->second);
+            ++i;
+        }
+    }
+
+    init_rest_state(data_size);
+
+    // The skinned vertices are stored like the particles' rest state, so
+    // the goal transform of the proxies places them
+    for (size_t i = 0; i < m_skin_to_index.size(); ++i)
+    {
+        const dlib::vec3& vertex(data[m_skin_to_index[i][0]]);
+        m_skin_q_tilde[i] = fmath::vec9(fmath::load(vertex) - m_initial_com);
+    }
+}
+
+ShapeTemplate::ShapeTemplate(const real* vertices, size_t num_vertices, size_t stride) :
+    m_references(1),
+    m_proxy_size(0),
+    m_data_length(num_vertices),
+    m_vec_to_index(num_vertices)
+{
+    assert(num_vertices >= MIN_PARTICLES);
+    assert(stride >= sizeof(dlib::vec3) && stride % sizeof(real) == 0);
+
+    if (!allocate())
+    {
+        throw std::bad_alloc();
+    }
+
+    const char* vertex = reinterpret_cast<const char*>(vertices);
+    for (size_t i = 0; i < m_data_length; ++i, vertex += stride)
+    {
+        m_initial_pos[i] = *reinterpret_cast<const dlib::vec3*>(vertex);
+        m_vec_to_index[i].push_back(i);
+    }
+
+    init_rest_state(num_vertices);
+}
+
+ShapeTemplate::ShapeTemplate(const ShapeTemplate& parent, const std::vector<size_t>& particles,
+                             const std::vector<std::vector<int> >& vec_to_index,
+                             size_t num_vertices) :
+    m_references(1),
+    m_proxy_size(0),
+    m_data_length(particles.size()),
+    m_vec_to_index(vec_to_index)
+{
+    assert(vec_to_index.size() == particles.size());
+
+    if (!allocate())
+    {
+        throw std::bad_alloc();
+    }
+
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        m_initial_pos[i] = parent.m_initial_pos[particles[i]];
+    }
+
+    init_rest_state(num_vertices);
+}
+
+ShapeTemplate::ShapeTemplate(const ShapeTemplate& other) :
+    m_references(1),
+    m_proxy_size(other.m_proxy_size),
+    m_data_length(other.m_data_length),
+    m_vec_to_index(other.m_vec_to_index),
+    m_vertex_particle(other.m_vertex_particle),
+    m_initial_com(other.m_initial_com),
+    m_rest(other.m_rest),
+    m_skin_to_index(other.m_skin_to_index),
+    m_skin_q_tilde(other.m_skin_q_tilde)
+{
+    if (!allocate())
+    {
+        throw std::bad_alloc();
+    }
+    memcpy(m_initial_pos, other.m_initial_pos, m_data_length*sizeof(dlib::vec3));
+    memcpy(m_initial_rel, other.m_initial_rel, m_data_length*sizeof(fmath::vec3));
+    memcpy(m_q_tilde, other.m_q_tilde, m_data_length*sizeof(fmath::vec9));
+    memcpy(m_rest_moments, other.m_rest_moments, sizeof(m_rest_moments));
+}
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+ShapeTemplate::~ShapeTemplate()
+{
+    // The particle arrays are freed with m_arena
+}
+
+//=============================================================================
+// AddRef / Release
+//=============================================================================
+
+void ShapeTemplate::AddRef()
+{
+    atomic::fetch_add(&m_references, 1);
+}
+
+void ShapeTemplate::Release()
+{
+    if (atomic::fetch_add(&m_references, -1) == 1)
+    {
+        delete this;
+    }
+}
+
+bool ShapeTemplate::IsShared() const
+{
+    return atomic::load(&m_references) > 1;
+}
+
+//=============================================================================
+// make_proxies
+//=============================================================================
+
+bool ShapeTemplate::make_proxies(std::map<dlib::vec3, std::vector<int>, Vec3Less>& vertices)
+{
+    // Sum up the vertices in each cube, keyed by the cube's integer
+    // coordinates
+    typedef std::map<dlib::vec3, std::pair<fmath::vec3, int>, Vec3Less> CellMap;
+    CellMap cells;
+    std::map<dlib::vec3, std::vector<int>, Vec3Less>::const_iterator iter;
+    for (iter = vertices.begin(); iter != vertices.end(); ++iter)
+    {
+        dlib::vec3 cell;
+        for (int k = 0; k < 3; ++k)
+        {
+            cell(k) = std::floor(iter->first(k) / m_proxy_size);
+        }
+
+        std::pair<fmath::vec3, int>& sum(cells[cell]);
+        if (sum.second == 0)
+        {
+            sum.first = fmath::vec3(0, 0, 0);
+        }
+        sum.first += fmath::load(iter->first);
+        ++sum.second;
+    }
+
+    if (cells.size() < MIN_PARTICLES)
+    {
+        return false;
+    }
+
+    m_data_length = cells.size();
+    if (!allocate())
+    {
+        throw std::bad_alloc();
+    }
+
+    int i = 0;
+    for (CellMap::const_iterator cell = cells.begin(); cell != cells.end(); ++cell)
+    {
+        fmath::store(m_initial_pos[i],
+                     cell->second.first * (1 / static_cast<real>(cell->second.second)));
+        ++i;
+    }
+
+    // The proxies have no vertices of their own, every vertex is skinned
+    m_vec_to_index.assign(m_data_length, std::vector<int>());
+    m_skin_to_index.reserve(vertices.size());
+    for (iter = vertices.begin(); iter != vertices.end(); ++iter)
+    {
+        m_skin_to_index.push_back(iter->second);
+    }
+    m_skin_q_tilde.resize(m_skin_to_index.size());
+
+    return true;
+}
+
+//=============================================================================
+// allocate
+//=============================================================================
+
+bool ShapeTemplate::allocate(unsigned int flags)
+{
+    // All the rest arrays are carved out of one block
+    const size_t vec_bytes = Arena::Size<dlib::vec3>(m_data_length);
+    const size_t fvec_bytes = Arena::Size<fmath::vec3>(m_data_length);
+    const size_t q_tilde_bytes = Arena::Size<fmath::vec9>(m_data_length);
+    if (!m_arena.Create(vec_bytes + fvec_bytes + q_tilde_bytes, flags))
+    {
+        return false;
+    }
+
+    m_initial_pos = m_arena.Allocate<dlib::vec3>(m_data_length);
+    m_initial_rel = m_arena.Allocate<fmath::vec3>(m_data_length);
+    m_q_tilde = m_arena.Allocate<fmath::vec9>(m_data_length);
+    return true;
+}
+
+//=============================================================================
+// init_rest_state
+//=============================================================================
+
+void ShapeTemplate::init_rest_state(size_t num_vertices)
+{
+    // Calculate the initial center of mass, the rest state is kept
+    // relative to it from now on
+    fmath::vec3 pos_sum(0, 0, 0);
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        pos_sum += fmath::load(m_initial_pos[i]);
+    }
+    m_initial_com = pos_sum * (1 / static_cast<real>(m_data_length));
+
+    // Make the q~ vectors for quadratic deformation and sum up the
+    // moments Aqq and Aqq~ are made from
+    memset(m_rest_moments, 0, sizeof(m_rest_moments));
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        m_initial_rel[i] = fmath::load(m_initial_pos[i]) - m_initial_com;
+        m_q_tilde[i] = fmath::vec9(m_initial_rel[i]);
+        add_rest_moments(m_q_tilde[i], 1);
+    }
+
+    update_rest();
+
+    // The inverse of m_vec_to_index, for finding the triangles of a
+    // particle
+    m_vertex_particle.assign(num_vertices, -1);
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        const std::vector<int>& duplicates(m_vec_to_index[i]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            m_vertex_particle[duplicates[j]] = i;
+        }
+    }
+}
+
+//=============================================================================
+// set_origin
+//=============================================================================
+
+void ShapeTemplate::set_origin(const fmath::vec3& origin)
+{
+    const fmath::vec3 shift = m_initial_com - origin;
+    m_initial_com = origin;
+
+    memset(m_rest_moments, 0, sizeof(m_rest_moments));
+    for (size_t i = 0; i < m_data_length; ++i)
+    {
+        m_initial_rel[i] = fmath::load(m_initial_pos[i]) - m_initial_com;
+        m_q_tilde[i] = fmath::vec9(m_initial_rel[i]);
+        add_rest_moments(m_q_tilde[i], 1);
+    }
+
+    // The skinned vertices only keep their q~, which starts with the
+    // offset from the old origin
+    for (size_t i = 0; i < m_skin_q_tilde.size(); ++i)
+    {
+        const fmath::vec9& q_tilde = m_skin_q_tilde[i];
+        m_skin_q_tilde[i] = fmath::vec9(fmath::vec3(q_tilde(0), q_tilde(1), q_tilde(2)) + shift);
+    }
+
+    update_rest();
+}
+
+//=============================================================================
+// add_rest_moments
+//=============================================================================
+
+void ShapeTemplate::add_rest_moments(const fmath::vec9& p_tilde, double sign)
+{
+    double a[10];
+    for (int i = 0; i < 9; ++i)
+    {
+        a[i] = p_tilde(i);
+    }
+    a[9] = 1;
+
+    for (int r = 0; r < 10; ++r)
+    {
+        for (int c = 0; c < 10; ++c)
+        {
+            m_rest_moments[r][c] += sign * a[r] * a[c];
+        }
+    }
+}
+
+//=============================================================================
+// remove_particle
+//=============================================================================
+
+void ShapeTemplate::remove_particle(size_t index)
+{
+    const size_t last = m_data_length - 1;
+    if (index != last)
+    {
+        m_initial_pos[index] = m_initial_pos[last];
+        m_initial_rel[index] = m_initial_rel[last];
+        m_q_tilde[index] = m_q_tilde[last];
+
+        m_vec_to_index[index].swap(m_vec_to_index[last]);
+        const std::vector<int>& duplicates(m_vec_to_index[index]);
+        for (size_t j = 0; j < duplicates.size(); ++j)
+        {
+            m_vertex_particle[duplicates[j]] = index;
+        }
+    }
+
+    m_vec_to_index.pop_back();
+    --m_data_length;
+}
+
+//=============================================================================
+// GetRest
+//=============================================================================
+
+/* The affine map from the q~ of a point p to the q~ of p - c, as a 9x10
+ * matrix working on [q~ 1].
+ */
+static void shift_lift(const double c[3], double lift[9][10])
+{
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 10; ++k)
+        {
+            lift[r][k] = (r == k) ? 1 : 0;
+        }
+    }
+
+    const double x = c[0], y = c[1], z = c[2];
+
+    // p - c
+    lift[0][9] = -x;
+    lift[1][9] = -y;
+    lift[2][9] = -z;
+
+    // (p_x - x)^2 = p_x^2 - 2x p_x + x^2
+    lift[3][0] = -2*x; lift[3][9] = x*x;
+    lift[4][1] = -2*y; lift[4][9] = y*y;
+    lift[5][2] = -2*z; lift[5][9] = z*z;
+
+    // (p_x - x)(p_y - y) = p_x p_y - y p_x - x p_y + x y
+    lift[6][0] = -y; lift[6][1] = -x; lift[6][9] = x*y;
+    lift[7][1] = -z; lift[7][2] = -y; lift[7][9] = y*z;
+    lift[8][2] = -x; lift[8][0] = -z; lift[8][9] = z*x;
+}
+
+/* The linear map from the q~ of a point q to the q~ of S * q, as a 9x9
+ * matrix.
+ */
+static void plastic_lift(const fmath::mat3& S, double lift[9][9])
+{
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 9; ++k)
+        {
+            lift[r][k] = 0;
+        }
+    }
+
+    // Linear part
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            lift[r][k] = S(r, k);
+        }
+    }
+
+    // Index into q~ of the product q_a * q_b
+    static const int QUADRATIC[3][3] = {
+        { 3, 6, 8 },
+        { 6, 4, 7 },
+        { 8, 7, 5 },
+    };
+
+    // The quadratic rows in the order of q~: xx yy zz xy yz zx
+    static const int ROW_PAIRS[6][2] = {
+        { 0, 0 }, { 1, 1 }, { 2, 2 }, { 0, 1 }, { 1, 2 }, { 2, 0 },
+    };
+
+    // (Sq)_a (Sq)_b = sum over c, d of S_ac S_bd q_c q_d
+    for (int i = 0; i < 6; ++i)
+    {
+        const int a = ROW_PAIRS[i][0];
+        const int b = ROW_PAIRS[i][1];
+        for (int c = 0; c < 3; ++c)
+        {
+            for (int d = 0; d < 3; ++d)
+            {
+                lift[3 + i][QUADRATIC[c][d]] += S(a, c) * S(b, d);
+            }
+        }
+    }
+}
+
+/* Gauss-Jordan inversion with partial pivoting.
+ *
+ * Returns:
+ *   False if the matrix is (close to) singular.
+ */
+static bool invert9(const double m[9][9], fmath::mat9& result)
+{
+    double a[9][18];
+    double scale = 0;
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int c = 0; c < 9; ++c)
+        {
+            a[r][c] = m[r][c];
+            a[r][c + 9] = (r == c) ? 1 : 0;
+            scale = std::max(scale, std::fabs(m[r][c]));
+        }
+    }
+
+    for (int c = 0; c < 9; ++c)
+    {
+        int pivot = c;
+        for (int r = c + 1; r < 9; ++r)
+        {
+            if (std::fabs(a[r][c]) > std::fabs(a[pivot][c]))
+            {
+                pivot = r;
+            }
+        }
+
+        if (std::fabs(a[pivot][c]) <= scale * 1e-12)
+        {
+            return false;
+        }
+
+        for (int k = 0; k < 18; ++k)
+        {
+            std::swap(a[c][k], a[pivot][k]);
+        }
+
+        const double inv_pivot = 1 / a[c][c];
+        for (int k = 0; k < 18; ++k)
+        {
+            a[c][k] *= inv_pivot;
+        }
+
+        for (int r = 0; r < 9; ++r)
+        {
+            if (r != c && a[r][c] != 0)
+            {
+                const double factor = a[r][c];
+                for (int k = 0; k < 18; ++k)
+                {
+                    a[r][k] -= factor * a[c][k];
+                }
+            }
+        }
+    }
+
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int c = 0; c < 9; ++c)
+        {
+            result(r, c) = a[r][c + 9];
+        }
+    }
+
+    return true;
+}
+
+void ShapeTemplate::GetRest(const fmath::mat3& plastic, Rest& rest) const
+{
+    if (fmath::norm(plastic - fmath::mat3::identity()) > 0)
+    {
+        compute_rest(plastic, rest);
+    }
+    else
+    {
+        rest = m_rest;
+    }
+}
+
+void ShapeTemplate::update_rest()
+{
+    compute_rest(fmath::mat3::identity(), m_rest);
+}
+
+void ShapeTemplate::compute_rest(const fmath::mat3& plastic, Rest& rest) const
+{
+    const double n = m_rest_moments[9][9];
+    const double c[3] = {
+        m_rest_moments[0][9] / n,
+        m_rest_moments[1][9] / n,
+        m_rest_moments[2][9] / n,
+    };
+    rest.com = fmath::vec3(c[0], c[1], c[2]);
+
+    // Move to the rest center of mass, then apply the permanent
+    // deformation
+    double shift[9][10];
+    shift_lift(c, shift);
+
+    double deformation[9][9];
+    plastic_lift(plastic, deformation);
+
+    double lift[9][10];
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 10; ++k)
+        {
+            double sum = 0;
+            for (int j = 0; j < 9; ++j)
+            {
+                sum += deformation[r][j] * shift[j][k];
+            }
+            lift[r][k] = sum;
+        }
+    }
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 9; ++k)
+        {
+            rest.lift(r, k) = lift[r][k];
+        }
+        rest.lift_offset(r) = lift[r][9];
+    }
+
+    // Aqq~ = sum q~ q~^T = lift * moments * lift^T, its top left block is
+    // Aqq since q is the start of q~
+    double temp[9][10];
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 10; ++k)
+        {
+            double sum = 0;
+            for (int j = 0; j < 10; ++j)
+            {
+                sum += lift[r][j] * m_rest_moments[j][k];
+            }
+            temp[r][k] = sum;
+        }
+    }
+
+    double Aqq_tilde[9][9];
+    for (int r = 0; r < 9; ++r)
+    {
+        for (int k = 0; k < 9; ++k)
+        {
+            double sum = 0;
+            for (int j = 0; j < 10; ++j)
+            {
+                sum += temp[r][j] * lift[k][j];
+            }
+            Aqq_tilde[r][k] = sum;
+        }
+    }
+
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            rest.Aqq(r, k) = Aqq_tilde[r][k];
+        }
+    }
+
+    // The trace of A_qq is the sum of the squared distances from the COM
+    rest.radius = std::sqrt((rest.Aqq(0,0) + rest.Aqq(1,1) + rest.Aqq(2,2)) / n);
+
+    rest.Aqq = fmath::inv(rest.Aqq);
+
+    // Flat or tiny bodies don't have enough information for quadratic
+    // deformations, they fall back to linear ones
+    rest.quadratic_valid = invert9(Aqq_tilde, rest.Aqq_tilde);
+}
+
+//=============================================================================
+//
+//=============================================================================
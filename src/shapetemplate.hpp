@@ -0,0 +1,219 @@
+#ifndef __SHAPE_TEMPLATE_HPP__
+#define __SHAPE_TEMPLATE_HPP__
+
+#include "defs.hpp"
+#include "mesh.hpp"
+#include "arena.hpp"
+#include "fmath.hpp"
+
+#include <map>
+#include <vector>
+
+/* Used by the std::map in ShapeTemplate for finding duplicate vertices.
+ */
+class Vec3Less
+{
+public:
+    bool operator()(const dlib::vec3& v1, const dlib::vec3& v2) const
+    {
+        // Need to satisfy strict weak ordering for C++ containers.
+        // Start by comparing the first elements, then second, then third...
+        for (int i = 0; i < 3; ++i)
+        {
+            if (v1(i) < v2(i)) return true;
+            if (v2(i) < v1(i)) return false;
+        }
+
+        // They're equal
+        return false;
+    }
+};
+
+/* The rest shape of a body, everything about it that doesn't change while
+ * it is simulated: the rest positions and their q~ vectors, the moments
+ * Aqq and Aqq~ are made from, the mapping between particles and mesh
+ * vertices, and the skinned vertices of proxy bodies.
+ *
+ * Templates are reference counted and shared by every PSystem made from
+ * them, so spawning many copies of the same mesh doesn't store or invert
+ * the same rest state again for each:
+ *
+ *   ShapeTemplate* rock = new ShapeTemplate(rock_mesh);
+ *   for (...)
+ *       bodies.push_back(new PSystem(meshes[i], rock));
+ *   rock->Release();
+ *
+ * A body that changes its rest shape (RemoveParticles(), DetachParticles())
+ * first makes its own copy if the template is shared. Plastic deformation
+ * only changes the per body Rest, not the template.
+ */
+class ShapeTemplate
+{
+public:
+    /* The matrices that depend on the rest moments and the permanent
+     * deformation. A constant amount of data, each body keeps one.
+     */
+    struct Rest
+    {
+        fmath::vec3 com; // Rest center of mass relative to the initial one
+        fmath::mat9 lift; // Maps the stored q~ to the paper's q~, see below
+        fmath::vec9 lift_offset;
+        fmath::mat3 Aqq; // Inverse of the Aqq matrix
+        fmath::mat9 Aqq_tilde; // Inverse of the Aqq~ matrix
+        bool quadratic_valid; // False if the rest shape is too flat for Aqq~
+        real radius; // RMS distance of the rest shape from its COM
+    };
+
+    /* Build the rest shape of a mesh, the same way PSystem(mesh,
+     * proxy_size) does. The mesh is only read here. The caller holds the
+     * first reference.
+     *
+     * Params:
+     *   mesh - Every unique vertex becomes a particle, unless proxy_size
+     *          is given
+     *   proxy_size - See PSystem::PSystem()
+     */
+    ShapeTemplate(Mesh& mesh, real proxy_size = 0);
+
+    /* Build the rest shape of vertices that aren't in a Mesh, for bodies
+     * that step the caller's particle arrays. Every vertex becomes a
+     * particle in the same order, duplicates are kept. For an indexed
+     * mesh that is its vertex buffer, shape matching doesn't need the
+     * triangles.
+     *
+     * Params:
+     *   vertices - x, y, z of the first vertex
+     *   stride - Bytes from one vertex to the next, see ParticleArray
+     */
+    ShapeTemplate(const real* vertices, size_t num_vertices,
+                  size_t stride = sizeof(dlib::vec3));
+
+    /* A template of some of the particles of another one, in the order
+     * given, with its own vertex mapping. Used when bodies split.
+     */
+    ShapeTemplate(const ShapeTemplate& parent, const std::vector<size_t>& particles,
+                  const std::vector<std::vector<int> >& vec_to_index, size_t num_vertices);
+
+    /* A private copy, for changing a shared template.
+     */
+    ShapeTemplate(const ShapeTemplate& other);
+
+    /* Take another reference, safe to call from any thread.
+     */
+    void AddRef();
+
+    /* Drop a reference, the template deletes itself when the last one is
+     * gone.
+     */
+    void Release();
+
+    /* True if more than one reference is held.
+     */
+    bool IsShared() const;
+
+    size_t GetNumParticles() const
+    {
+        return m_data_length;
+    }
+
+    /* See PSystem::IsProxy().
+     */
+    bool IsProxy() const
+    {
+        return m_proxy_size > 0;
+    }
+
+    /* The rest state with the permanent deformation plastic applied. The
+     * undeformed one is computed once and copied.
+     */
+    void GetRest(const fmath::mat3& plastic, Rest& rest) const;
+
+    // The fewest particles a body can have and still have a rest shape
+    static const size_t MIN_PARTICLES = 4;
+
+private:
+    friend class PSystem;
+
+    // Deleted by Release()
+    ~ShapeTemplate();
+
+    // Not assignable
+    ShapeTemplate& operator=(const ShapeTemplate&);
+
+    /* Replace the unique vertices with one proxy particle per cube of
+     * m_proxy_size, and keep the vertices for skinning.
+     *
+     * Returns:
+     *   False if there would be too few proxies, nothing is changed then.
+     */
+    bool make_proxies(std::map<dlib::vec3, std::vector<int>, Vec3Less>& vertices);
+
+    /* Carve the particle arrays for m_data_length particles out of the
+     * arena.
+     *
+     * Returns:
+     *   False if the memory couldn't be allocated.
+     */
+    bool allocate(unsigned int flags = Arena::DEFAULT_FLAGS);
+
+    /* Compute the rest state from m_initial_pos. Also builds the mapping
+     * from mesh vertices to particles.
+     */
+    void init_rest_state(size_t num_vertices);
+
+    /* Recompute m_rest from the rest moments, after they changed.
+     */
+    void update_rest();
+
+    /* Keep the rest state relative to origin instead of the initial
+     * center of mass, and recompute the rest moments. The parts of a body
+     * split over several processes all use the same origin, see
+     * PSystem::JoinParts().
+     */
+    void set_origin(const fmath::vec3& origin);
+
+    /* Compute a Rest from the rest moments and a permanent deformation.
+     * This is a constant amount of work, independent of the number of
+     * particles.
+     */
+    void compute_rest(const fmath::mat3& plastic, Rest& rest) const;
+
+    /* Add (sign 1) or remove (sign -1) a particle's contribution to the
+     * rest moments.
+     */
+    void add_rest_moments(const fmath::vec9& p_tilde, double sign);
+
+    /* Move the last particle into the place of another one, and drop it.
+     */
+    void remove_particle(size_t index);
+
+private:
+    int m_references; // Number of holders, see AddRef()
+    real m_proxy_size; // Size of the proxy cubes, 0 if not a proxy body
+    size_t m_data_length; // The number of particles
+    std::vector<std::vector<int> > m_vec_to_index; // Mapping of particles to mesh indices
+    std::vector<int> m_vertex_particle; // Particle of each mesh vertex, -1 if removed
+    Arena m_arena; // Holds all of the per particle arrays below
+    fmath::vec3 m_initial_com; // Center of mass the rest state is relative to
+    dlib::vec3* m_initial_pos; // Array of initial particle positions
+    fmath::vec3* m_initial_rel; // Array of init_pos - m_initial_com
+
+    // The rest state is kept relative to m_initial_com, which never changes,
+    // so removing particles or deforming the rest shape doesn't touch the
+    // particles. The paper's q and q~ are Sp times the offset from the
+    // current rest center of mass, they are found by lifting the stored
+    // values:
+    //
+    //   q~_i = lift * m_q_tilde[i] + lift_offset
+    //
+    // and q_i is the first three rows of that.
+    fmath::vec9* m_q_tilde; // Stores q~ of each m_initial_rel
+    double m_rest_moments[10][10]; // Sum of [q~ 1] * [q~ 1]^T over m_q_tilde
+    Rest m_rest; // Without permanent deformation
+
+    // Proxy bodies, see PSystem::PSystem()
+    std::vector<std::vector<int> > m_skin_to_index; // Mesh indices of each skinned vertex
+    std::vector<fmath::vec9> m_skin_q_tilde; // q~ of each skinned vertex, like m_q_tilde
+};
+
+#endif
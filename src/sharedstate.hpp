@@ -0,0 +1,55 @@
+#ifndef __SHARED_STATE_HPP__
+#define __SHARED_STATE_HPP__
+
+#include <stdint.h>
+
+/* Layout of the shared memory the simulation publishes its state in, see
+ * StatePublisher and StateReader. Everything is plain data with fixed
+ * sizes, so other programs can map it without this code base.
+ *
+ * The memory starts with a SharedStateHeader, followed by num_slots slots
+ * of slot_size bytes each. A slot holds one frame: a SharedFrame, then a
+ * SharedBody for each body, then the positions of each body as x, y, z
+ * floats. The layout of a slot never changes, only the contents.
+ *
+ * Frames are numbered from 1, frame f is written into slot f % num_slots.
+ * The slot's sequence is 2f - 1 while it is being written and 2f once it
+ * is complete. A reader of frame f checks the sequence is 2f before and
+ * after copying, if it changed the writer came around again and the copy
+ * is thrown away. The writer never waits for readers.
+ */
+
+// "MSHS", written last so a half made header is never used
+const uint32_t SHARED_STATE_MAGIC = 0x5348534d;
+const uint32_t SHARED_STATE_VERSION = 1;
+
+struct SharedStateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t num_bodies;
+    uint64_t slot_size; // Bytes per slot
+    uint64_t first_slot; // Offset of slot 0 from the start of the memory
+    uint64_t latest; // Newest complete frame, 0 before the first
+};
+
+struct SharedFrame
+{
+    uint64_t sequence; // See above
+    uint64_t frame;
+    double time; // get_time() of the simulation when it was published
+    uint32_t num_bodies;
+    uint32_t padding;
+};
+
+struct SharedBody
+{
+    uint64_t positions; // Offset of the positions from the start of the slot
+    uint32_t capacity; // Room for this many particles
+    uint32_t num_particles; // Particles in this frame
+    float com[3]; // Center of mass
+    float rotation[9]; // Rotation from the rest shape, row major
+};
+
+#endif
@@ -0,0 +1,660 @@
+#include "smallbody.hpp"
+#include "shapematch.hpp"
+
+#include <cmath>
+#include <cassert>
+#include <new>
+
+// Bodies whose Aqq determinant is below this fraction of the cube of its
+// average eigenvalue are treated as flat
+static const real FLAT_BODY_RATIO = 1e-3;
+
+// Iterations per step when updating the rotations
+static const int ROTATION_ITERATIONS = 4;
+
+// Slots filled into one ForceBlock
+static const size_t SLOTS_PER_BLOCK = ForceBlock::SIZE / SmallBodyBatch::LANES;
+
+/* Orders bodies by particle count, largest first, so bodies of about the
+ * same size end up in the same group.
+ */
+struct LargerBody
+{
+    const std::vector<size_t>& counts;
+
+    LargerBody(const std::vector<size_t>& c) : counts(c) { }
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return counts[a] > counts[b];
+    }
+};
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+SmallBodyBatch::SmallBodyBatch() :
+    m_alpha(0.4),
+    m_beta(0),
+    m_alpha_reference_dt(0),
+    m_packed(true),
+    m_groups(NULL),
+    m_num_groups(0),
+    m_slots(NULL)
+{
+    assert(ForceBlock::SIZE % LANES == 0);
+}
+
+//=============================================================================
+// AddBody
+//=============================================================================
+
+size_t SmallBodyBatch::AddBody(const dlib::vec3* positions, size_t count)
+{
+    assert(count > 0);
+
+    Body body;
+    body.first = m_initial_pos.size();
+    body.count = count;
+    body.group = NO_GROUP;
+    body.lane = 0;
+
+    fmath::vec3 com(0, 0, 0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        m_initial_pos.push_back(fmath::load(positions[i]));
+        com += m_initial_pos.back();
+    }
+    com *= 1.0 / count;
+    body.initial_com = com;
+
+    fmath::mat3 Aqq = fmath::mat3::zero();
+    for (size_t i = 0; i < count; ++i)
+    {
+        const fmath::vec3 q = m_initial_pos[body.first + i] - com;
+        Aqq.add_outer(q, q);
+    }
+
+    // Flat bodies have no linear fit, only a rotation
+    const real average = (Aqq(0,0) + Aqq(1,1) + Aqq(2,2)) / 3;
+    body.solid = average > 0 &&
+        fmath::det(Aqq) > FLAT_BODY_RATIO * average * average * average;
+    body.aqq = body.solid ? fmath::inv(Aqq) : fmath::mat3::zero();
+
+    m_bodies.push_back(body);
+    m_packed = false;
+    return m_bodies.size() - 1;
+}
+
+//=============================================================================
+// pack
+//=============================================================================
+
+void SmallBodyBatch::pack()
+{
+    // Save the state of the bodies that were already packed, new bodies
+    // start at rest
+    std::vector<fmath::vec3> pos(m_initial_pos);
+    std::vector<fmath::vec3> vel(m_initial_pos.size(), fmath::vec3(0, 0, 0));
+    std::vector<real> rot(4 * m_bodies.size(), 0);
+    std::vector<size_t> counts(m_bodies.size());
+    for (size_t b = 0; b < m_bodies.size(); ++b)
+    {
+        const Body& body = m_bodies[b];
+        counts[b] = body.count;
+        rot[4*b] = 1;
+        if (body.group == NO_GROUP)
+        {
+            continue;
+        }
+
+        const Group& group = m_groups[body.group];
+        const int l = body.lane;
+        for (int k = 0; k < 4; ++k)
+        {
+            rot[4*b + k] = group.rot[k][l];
+        }
+        for (size_t i = 0; i < body.count; ++i)
+        {
+            const Slot& slot = m_slots[group.first_slot + i];
+            pos[body.first + i] = fmath::vec3(slot.x[l], slot.y[l], slot.z[l]);
+            vel[body.first + i] = fmath::vec3(slot.vx[l], slot.vy[l], slot.vz[l]);
+        }
+    }
+
+    std::vector<size_t> order(m_bodies.size());
+    for (size_t b = 0; b < order.size(); ++b)
+    {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), LargerBody(counts));
+
+    // The first body of each group is its largest
+    m_num_groups = (order.size() + LANES - 1) / LANES;
+    size_t num_slots = 0;
+    for (size_t g = 0; g < m_num_groups; ++g)
+    {
+        num_slots += counts[order[g * LANES]];
+    }
+
+    if (!m_arena.Create(Arena::Size<Group>(m_num_groups) + Arena::Size<Slot>(num_slots)))
+    {
+        throw std::bad_alloc();
+    }
+    m_groups = m_arena.Allocate<Group>(m_num_groups);
+    m_slots = m_arena.Allocate<Slot>(num_slots);
+
+    // Allocate() zeroes everything, so empty lanes and unused slots have
+    // no mass and no rest shape
+    size_t next_slot = 0;
+    for (size_t g = 0; g < m_num_groups; ++g)
+    {
+        Group& group = m_groups[g];
+        group.first_slot = next_slot;
+        group.num_slots = counts[order[g * LANES]];
+        next_slot += group.num_slots;
+
+        for (int l = 0; l < LANES; ++l)
+        {
+            group.rot[0][l] = 1;
+
+            const size_t index = g * LANES + l;
+            if (index >= order.size())
+            {
+                continue;
+            }
+
+            const size_t b = order[index];
+            Body& body = m_bodies[b];
+            body.group = g;
+            body.lane = l;
+
+            group.inv_mass[l] = 1.0 / body.count;
+            group.beta_mask[l] = body.solid ? 1 : 0;
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    group.aqq[3*r + c][l] = body.aqq(r, c);
+                }
+            }
+            for (int k = 0; k < 4; ++k)
+            {
+                group.rot[k][l] = rot[4*b + k];
+            }
+
+            fmath::vec3 com(0, 0, 0);
+            for (size_t i = 0; i < body.count; ++i)
+            {
+                Slot& slot = m_slots[group.first_slot + i];
+                const fmath::vec3& p = pos[body.first + i];
+                const fmath::vec3& v = vel[body.first + i];
+                const fmath::vec3 q = m_initial_pos[body.first + i] - body.initial_com;
+                slot.x[l] = p(0); slot.y[l] = p(1); slot.z[l] = p(2);
+                slot.vx[l] = v(0); slot.vy[l] = v(1); slot.vz[l] = v(2);
+                slot.qx[l] = q(0); slot.qy[l] = q(1); slot.qz[l] = q(2);
+                slot.w[l] = 1;
+                com += p;
+            }
+            com *= group.inv_mass[l];
+            for (int k = 0; k < 3; ++k)
+            {
+                group.com[k][l] = com(k);
+            }
+        }
+    }
+
+    m_packed = true;
+}
+
+//=============================================================================
+// Update
+//=============================================================================
+
+/* Update the rotation of every lane towards the rotational part of its
+ * Apq, the same iteration as shapematch::extract_rotation(). Instead of
+ * Rodrigues' formula each iteration applies the quaternion (1, omega/2),
+ * a rotation around omega by 2*atan(|omega|/2). That is about |omega|
+ * for the small corrections of a warm started iteration, and needs no
+ * trigonometry or branches. The quaternions are only normalized at the
+ * end, the matrices in between divide by their squared length instead.
+ */
+static void update_rotations(const real apq[9][SmallBodyBatch::LANES],
+                             real rot[4][SmallBodyBatch::LANES])
+{
+    const int LANES = SmallBodyBatch::LANES;
+    for (int iteration = 0; iteration < ROTATION_ITERATIONS; ++iteration)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            const real w = rot[0][l], x = rot[1][l], y = rot[2][l], z = rot[3][l];
+            const real s = 2 / (w*w + x*x + y*y + z*z);
+
+            // Columns of the rotation matrix
+            const real r0x = 1 - s*(y*y + z*z), r0y = s*(x*y + w*z), r0z = s*(x*z - w*y);
+            const real r1x = s*(x*y - w*z), r1y = 1 - s*(x*x + z*z), r1z = s*(y*z + w*x);
+            const real r2x = s*(x*z + w*y), r2y = s*(y*z - w*x), r2z = 1 - s*(x*x + y*y);
+
+            // omega = sum r_i x a_i / |sum r_i . a_i| over the columns
+            const real a0x = apq[0][l], a0y = apq[3][l], a0z = apq[6][l];
+            const real a1x = apq[1][l], a1y = apq[4][l], a1z = apq[7][l];
+            const real a2x = apq[2][l], a2y = apq[5][l], a2z = apq[8][l];
+            real ox = (r0y*a0z - r0z*a0y) + (r1y*a1z - r1z*a1y) + (r2y*a2z - r2z*a2y);
+            real oy = (r0z*a0x - r0x*a0z) + (r1z*a1x - r1x*a1z) + (r2z*a2x - r2x*a2z);
+            real oz = (r0x*a0y - r0y*a0x) + (r1x*a1y - r1y*a1x) + (r2x*a2y - r2y*a2x);
+            const real dot = (r0x*a0x + r0y*a0y + r0z*a0z) +
+                             (r1x*a1x + r1y*a1y + r1z*a1z) +
+                             (r2x*a2x + r2y*a2y + r2z*a2z);
+            const real scale = 0.5 / (std::fabs(dot) + 1e-9);
+            ox *= scale;
+            oy *= scale;
+            oz *= scale;
+
+            // (1, omega/2) * q
+            rot[0][l] = w - ox*x - oy*y - oz*z;
+            rot[1][l] = x + ox*w + oy*z - oz*y;
+            rot[2][l] = y + oy*w + oz*x - ox*z;
+            rot[3][l] = z + oz*w + ox*y - oy*x;
+        }
+    }
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        const real inv_length = 1 / std::sqrt(rot[0][l]*rot[0][l] + rot[1][l]*rot[1][l] +
+                                              rot[2][l]*rot[2][l] + rot[3][l]*rot[3][l]);
+        for (int k = 0; k < 4; ++k)
+        {
+            rot[k][l] *= inv_length;
+        }
+    }
+}
+
+void SmallBodyBatch::Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields)
+{
+    if (!m_packed)
+    {
+        pack();
+    }
+
+    const real alpha_term = shapematch::scaled_alpha(m_alpha, dt, m_alpha_reference_dt);
+    const fmath::vec3 f = fmath::load(force);
+    for (size_t g = 0; g < m_num_groups; ++g)
+    {
+        update_group(m_groups[g], dt, alpha_term, f, fields);
+    }
+}
+
+void SmallBodyBatch::update_group(Group& group, real dt, real alpha_term,
+                                  const fmath::vec3& force, const ForceFieldSet* fields)
+{
+    Slot* const slots = m_slots + group.first_slot;
+    const size_t num_slots = group.num_slots;
+    const real half_dt = 0.5 * dt;
+
+    // The uniform force for every lane, used when there are no fields
+    real uniform[3][LANES];
+    for (int l = 0; l < LANES; ++l)
+    {
+        uniform[0][l] = force(0);
+        uniform[1][l] = force(1);
+        uniform[2][l] = force(2);
+    }
+
+    // Do a partial integration, the forces of unused slots are masked out
+    // so they stay where they are
+    const bool have_fields = fields != NULL && !fields->IsEmpty();
+    ForceBlock block;
+    for (size_t start = 0; start < num_slots; start += SLOTS_PER_BLOCK)
+    {
+        const size_t end = std::min(num_slots, start + SLOTS_PER_BLOCK);
+        if (have_fields)
+        {
+            block.count = (end - start) * LANES;
+            for (size_t s = start; s < end; ++s)
+            {
+                const Slot& slot = slots[s];
+                const size_t offset = (s - start) * LANES;
+                for (int l = 0; l < LANES; ++l)
+                {
+                    block.x[offset + l] = slot.x[l];
+                    block.y[offset + l] = slot.y[l];
+                    block.z[offset + l] = slot.z[l];
+                    block.fx[offset + l] = force(0);
+                    block.fy[offset + l] = force(1);
+                    block.fz[offset + l] = force(2);
+                }
+            }
+            fields->Evaluate(block);
+        }
+
+        for (size_t s = start; s < end; ++s)
+        {
+            Slot& slot = slots[s];
+            const size_t offset = (s - start) * LANES;
+            const real* fx = have_fields ? block.fx + offset : uniform[0];
+            const real* fy = have_fields ? block.fy + offset : uniform[1];
+            const real* fz = have_fields ? block.fz + offset : uniform[2];
+            for (int l = 0; l < LANES; ++l)
+            {
+                const real w_dt = slot.w[l] * dt;
+                const real vx = slot.vx[l] + fx[l] * w_dt;
+                const real vy = slot.vy[l] + fy[l] * w_dt;
+                const real vz = slot.vz[l] + fz[l] * w_dt;
+                slot.ox[l] = slot.x[l];
+                slot.oy[l] = slot.y[l];
+                slot.oz[l] = slot.z[l];
+                slot.x[l] += (slot.vx[l] + vx) * half_dt;
+                slot.y[l] += (slot.vy[l] + vy) * half_dt;
+                slot.z[l] += (slot.vz[l] + vz) * half_dt;
+                slot.vx[l] = vx;
+                slot.vy[l] = vy;
+                slot.vz[l] = vz;
+            }
+        }
+    }
+
+    // Centers of mass
+    real cx[LANES], cy[LANES], cz[LANES];
+    for (int l = 0; l < LANES; ++l)
+    {
+        cx[l] = cy[l] = cz[l] = 0;
+    }
+    for (size_t s = 0; s < num_slots; ++s)
+    {
+        const Slot& slot = slots[s];
+        for (int l = 0; l < LANES; ++l)
+        {
+            cx[l] += slot.w[l] * slot.x[l];
+            cy[l] += slot.w[l] * slot.y[l];
+            cz[l] += slot.w[l] * slot.z[l];
+        }
+    }
+    for (int l = 0; l < LANES; ++l)
+    {
+        cx[l] *= group.inv_mass[l];
+        cy[l] *= group.inv_mass[l];
+        cz[l] *= group.inv_mass[l];
+        group.com[0][l] = cx[l];
+        group.com[1][l] = cy[l];
+        group.com[2][l] = cz[l];
+    }
+
+    // Apq, the rest positions of unused slots are zero so they add nothing
+    real apq[9][LANES];
+    for (int k = 0; k < 9; ++k)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            apq[k][l] = 0;
+        }
+    }
+    for (size_t s = 0; s < num_slots; ++s)
+    {
+        const Slot& slot = slots[s];
+        for (int l = 0; l < LANES; ++l)
+        {
+            const real px = slot.x[l] - cx[l];
+            const real py = slot.y[l] - cy[l];
+            const real pz = slot.z[l] - cz[l];
+            apq[0][l] += px * slot.qx[l];
+            apq[1][l] += px * slot.qy[l];
+            apq[2][l] += px * slot.qz[l];
+            apq[3][l] += py * slot.qx[l];
+            apq[4][l] += py * slot.qy[l];
+            apq[5][l] += py * slot.qz[l];
+            apq[6][l] += pz * slot.qx[l];
+            apq[7][l] += pz * slot.qy[l];
+            apq[8][l] += pz * slot.qz[l];
+        }
+    }
+
+    update_rotations(apq, group.rot);
+
+    // goal = beta*A + (1 - beta)*R, with A = Apq * Aqq^-1 scaled to keep
+    // the volume. Flat bodies have no A and only rotate.
+    real goal[9][LANES];
+    if (m_beta > 0)
+    {
+        real det_A[LANES];
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                for (int l = 0; l < LANES; ++l)
+                {
+                    goal[3*r + c][l] = apq[3*r][l] * group.aqq[c][l] +
+                                       apq[3*r + 1][l] * group.aqq[3 + c][l] +
+                                       apq[3*r + 2][l] * group.aqq[6 + c][l];
+                }
+            }
+        }
+        for (int l = 0; l < LANES; ++l)
+        {
+            det_A[l] = goal[0][l] * (goal[4][l]*goal[8][l] - goal[5][l]*goal[7][l]) -
+                       goal[1][l] * (goal[3][l]*goal[8][l] - goal[5][l]*goal[6][l]) +
+                       goal[2][l] * (goal[3][l]*goal[7][l] - goal[4][l]*goal[6][l]);
+        }
+
+        // Only the cube roots are done a lane at a time
+        real a_scale[LANES];
+        for (int l = 0; l < LANES; ++l)
+        {
+            a_scale[l] = m_beta * group.beta_mask[l] / shapematch::root(det_A[l], 3.0);
+        }
+        for (int k = 0; k < 9; ++k)
+        {
+            for (int l = 0; l < LANES; ++l)
+            {
+                goal[k][l] *= a_scale[l];
+            }
+        }
+    }
+    else
+    {
+        for (int k = 0; k < 9; ++k)
+        {
+            for (int l = 0; l < LANES; ++l)
+            {
+                goal[k][l] = 0;
+            }
+        }
+    }
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        const real w = group.rot[0][l], x = group.rot[1][l];
+        const real y = group.rot[2][l], z = group.rot[3][l];
+        const real r_scale = 1 - m_beta * group.beta_mask[l];
+        goal[0][l] += r_scale * (1 - 2*(y*y + z*z));
+        goal[1][l] += r_scale * 2*(x*y - w*z);
+        goal[2][l] += r_scale * 2*(x*z + w*y);
+        goal[3][l] += r_scale * 2*(x*y + w*z);
+        goal[4][l] += r_scale * (1 - 2*(x*x + z*z));
+        goal[5][l] += r_scale * 2*(y*z - w*x);
+        goal[6][l] += r_scale * 2*(x*z - w*y);
+        goal[7][l] += r_scale * 2*(y*z + w*x);
+        goal[8][l] += r_scale * (1 - 2*(x*x + y*y));
+    }
+
+    // Finish the integration, unused slots don't move
+    const real velocity_term = alpha_term / dt;
+    for (size_t s = 0; s < num_slots; ++s)
+    {
+        Slot& slot = slots[s];
+        for (int l = 0; l < LANES; ++l)
+        {
+            const real qx = slot.qx[l], qy = slot.qy[l], qz = slot.qz[l];
+            const real gx = goal[0][l]*qx + goal[1][l]*qy + goal[2][l]*qz + cx[l];
+            const real gy = goal[3][l]*qx + goal[4][l]*qy + goal[5][l]*qz + cy[l];
+            const real gz = goal[6][l]*qx + goal[7][l]*qy + goal[8][l]*qz + cz[l];
+            const real scale = slot.w[l] * velocity_term;
+            slot.vx[l] += (gx - slot.x[l]) * scale;
+            slot.vy[l] += (gy - slot.y[l]) * scale;
+            slot.vz[l] += (gz - slot.z[l]) * scale;
+            slot.x[l] = slot.ox[l] + slot.vx[l] * dt;
+            slot.y[l] = slot.oy[l] + slot.vy[l] * dt;
+            slot.z[l] = slot.oz[l] + slot.vz[l] * dt;
+        }
+    }
+}
+
+//=============================================================================
+// Contain
+//=============================================================================
+
+void SmallBodyBatch::Contain(const dlib::vec3& lower, const dlib::vec3& upper)
+{
+    if (!m_packed)
+    {
+        pack();
+    }
+
+    const real lx = lower(0), ly = lower(1), lz = lower(2);
+    const real ux = upper(0), uy = upper(1), uz = upper(2);
+    const size_t num_slots = m_num_groups > 0 ?
+        m_groups[m_num_groups - 1].first_slot + m_groups[m_num_groups - 1].num_slots : 0;
+    for (size_t s = 0; s < num_slots; ++s)
+    {
+        Slot& slot = m_slots[s];
+        for (int l = 0; l < LANES; ++l)
+        {
+            const real x = std::min(std::max(slot.x[l], lx), ux);
+            const real y = std::min(std::max(slot.y[l], ly), uy);
+            const real z = std::min(std::max(slot.z[l], lz), uz);
+            const real keep = (x == slot.x[l]) & (y == slot.y[l]) & (z == slot.z[l]);
+            slot.x[l] = x;
+            slot.y[l] = y;
+            slot.z[l] = z;
+            slot.vx[l] *= keep;
+            slot.vy[l] *= keep;
+            slot.vz[l] *= keep;
+        }
+    }
+}
+
+//=============================================================================
+// Reset
+//=============================================================================
+
+void SmallBodyBatch::Reset()
+{
+    // Bodies that were never packed are still at rest
+    for (size_t b = 0; b < m_bodies.size(); ++b)
+    {
+        if (m_bodies[b].group != NO_GROUP)
+        {
+            reset_body(m_bodies[b]);
+        }
+    }
+}
+
+void SmallBodyBatch::reset_body(const Body& body)
+{
+    Group& group = m_groups[body.group];
+    const int l = body.lane;
+    for (size_t i = 0; i < body.count; ++i)
+    {
+        Slot& slot = m_slots[group.first_slot + i];
+        const fmath::vec3& p = m_initial_pos[body.first + i];
+        slot.x[l] = p(0); slot.y[l] = p(1); slot.z[l] = p(2);
+        slot.vx[l] = slot.vy[l] = slot.vz[l] = 0;
+    }
+
+    group.rot[0][l] = 1;
+    group.rot[1][l] = group.rot[2][l] = group.rot[3][l] = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        group.com[k][l] = body.initial_com(k);
+    }
+}
+
+//=============================================================================
+// AddVelocity
+//=============================================================================
+
+void SmallBodyBatch::AddVelocity(size_t body_index, const dlib::vec3& velocity)
+{
+    if (!m_packed)
+    {
+        pack();
+    }
+
+    const Body& body = m_bodies[body_index];
+    const Group& group = m_groups[body.group];
+    const int l = body.lane;
+    for (size_t i = 0; i < body.count; ++i)
+    {
+        Slot& slot = m_slots[group.first_slot + i];
+        slot.vx[l] += velocity(0);
+        slot.vy[l] += velocity(1);
+        slot.vz[l] += velocity(2);
+    }
+}
+
+//=============================================================================
+// Accessors
+//=============================================================================
+
+void SmallBodyBatch::GetPositions(size_t body_index, dlib::vec3* out) const
+{
+    const Body& body = m_bodies[body_index];
+    if (body.group == NO_GROUP)
+    {
+        for (size_t i = 0; i < body.count; ++i)
+        {
+            fmath::store(out[i], m_initial_pos[body.first + i]);
+        }
+        return;
+    }
+
+    const Group& group = m_groups[body.group];
+    const int l = body.lane;
+    for (size_t i = 0; i < body.count; ++i)
+    {
+        const Slot& slot = m_slots[group.first_slot + i];
+        fmath::store(out[i], fmath::vec3(slot.x[l], slot.y[l], slot.z[l]));
+    }
+}
+
+dlib::vec3 SmallBodyBatch::GetCOM(size_t body_index) const
+{
+    const Body& body = m_bodies[body_index];
+    dlib::vec3 com;
+    if (body.group == NO_GROUP)
+    {
+        fmath::store(com, body.initial_com);
+    }
+    else
+    {
+        const Group& group = m_groups[body.group];
+        fmath::store(com, fmath::vec3(group.com[0][body.lane],
+                               group.com[1][body.lane],
+                               group.com[2][body.lane]));
+    }
+    return com;
+}
+
+fmath::mat3 SmallBodyBatch::GetRotation(size_t body_index) const
+{
+    const Body& body = m_bodies[body_index];
+    if (body.group == NO_GROUP)
+    {
+        return fmath::mat3::identity();
+    }
+
+    const Group& group = m_groups[body.group];
+    const int l = body.lane;
+    const real w = group.rot[0][l], x = group.rot[1][l];
+    const real y = group.rot[2][l], z = group.rot[3][l];
+
+    fmath::mat3 R;
+    R(0, 0) = 1 - 2*(y*y + z*z); R(0, 1) = 2*(x*y - w*z); R(0, 2) = 2*(x*z + w*y);
+    R(1, 0) = 2*(x*y + w*z); R(1, 1) = 1 - 2*(x*x + z*z); R(1, 2) = 2*(y*z - w*x);
+    R(2, 0) = 2*(x*z - w*y); R(2, 1) = 2*(y*z + w*x); R(2, 2) = 1 - 2*(x*x + y*y);
+    return R;
+}
+
+//=============================================================================
+//
+//=============================================================================
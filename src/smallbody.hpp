@@ -0,0 +1,205 @@
+#ifndef __SMALL_BODY_HPP__
+#define __SMALL_BODY_HPP__
+
+#include "defs.hpp"
+#include "arena.hpp"
+#include "fmath.hpp"
+#include "forcefield.hpp"
+
+#include <vector>
+#include <algorithm>
+
+/* Shape matching for large numbers of tiny bodies, like debris and
+ * pebbles with a few dozen particles each.
+ *
+ * For bodies that small a PSystem step is mostly fixed cost: the matrix
+ * inverses and decompositions, and the Mesh bookkeeping. Here the bodies
+ * are packed LANES at a time into groups, and every particle slot of a
+ * group holds one particle of each of its bodies, in separate x, y and z
+ * arrays (AoSoA across bodies). The whole step, including the rotation
+ * extraction, is written as loops over the lanes without branches, so the
+ * compiler can run LANES bodies per instruction.
+ *
+ * Bodies are grouped with others of about the same particle count, the
+ * unused slots of the smaller bodies are masked out. Deformations are
+ * linear only, quadratic ones don't pay off for a few dozen particles.
+ *
+ *   SmallBodyBatch debris;
+ *   for (...)
+ *       debris.AddBody(positions, count);
+ *   debris.Update(dt, gravity);
+ *   debris.Contain(lower, upper);
+ *   debris.GetPositions(body, out);
+ */
+class SmallBodyBatch
+{
+public:
+    enum { LANES = 8 };
+
+    SmallBodyBatch();
+
+    /* Add a body, its particles start at rest in their rest shape.
+     *
+     * Params:
+     *   positions - Rest positions of the particles, copied
+     *   count - Number of particles, at least 1
+     *
+     * Returns:
+     *   The index of the body, used by the other methods.
+     */
+    size_t AddBody(const dlib::vec3* positions, size_t count);
+
+    /* Performs the integration step for every body.
+     *
+     * Params:
+     *   dt - timestep in seconds
+     *   force - Any forces accumulated, like gravity
+     *   fields - Spatially varying forces added to force, optional
+     */
+    void Update(real dt, const dlib::vec3& force, const ForceFieldSet* fields = NULL);
+
+    /* Keep every particle inside the box between lower and upper. Particles
+     * outside of it are moved back to the closest wall and stopped, the
+     * same as check_for_collisions() does for a PSystem.
+     */
+    void Contain(const dlib::vec3& lower, const dlib::vec3& upper);
+
+    /* Reset every body to its rest shape at its initial position.
+     */
+    void Reset();
+
+    /* Add a velocity to every particle of a body, to throw it.
+     */
+    void AddVelocity(size_t body, const dlib::vec3& velocity);
+
+    size_t GetNumBodies() const
+    {
+        return m_bodies.size();
+    }
+
+    size_t GetNumParticles(size_t body) const
+    {
+        return m_bodies[body].count;
+    }
+
+    /* Copy the current particle positions of a body into out, which must
+     * hold GetNumParticles(body) elements.
+     */
+    void GetPositions(size_t body, dlib::vec3* out) const;
+
+    /* The center of mass of a body.
+     */
+    dlib::vec3 GetCOM(size_t body) const;
+
+    /* The rotation of a body from its rest shape. Together with GetCOM()
+     * it places a rigid copy of the body's mesh, for drawing instanced
+     * debris without reading back the particles.
+     */
+    fmath::mat3 GetRotation(size_t body) const;
+
+    real GetAlpha() const
+    {
+        return m_alpha;
+    }
+
+    /* Same as PSystem::SetAlpha(), for every body.
+     */
+    void SetAlpha(real alpha)
+    {
+        m_alpha = std::min<real>(std::max<real>(alpha, 0), 1);
+    }
+
+    real GetBeta() const
+    {
+        return m_beta;
+    }
+
+    /* Same as PSystem::SetBeta(), for every body.
+     */
+    void SetBeta(real beta)
+    {
+        m_beta = std::min<real>(std::max<real>(beta, 0), 1);
+    }
+
+    /* Same as PSystem::SetAlphaReferenceDt().
+     */
+    void SetAlphaReferenceDt(real reference_dt)
+    {
+        m_alpha_reference_dt = reference_dt;
+    }
+
+private:
+    // Not copyable
+    SmallBodyBatch(const SmallBodyBatch&);
+    SmallBodyBatch& operator=(const SmallBodyBatch&);
+
+    /* One particle of each body in a group. Slots past the end of a body
+     * have a weight and rest position of zero.
+     */
+    struct Slot
+    {
+        real x[LANES], y[LANES], z[LANES];
+        real vx[LANES], vy[LANES], vz[LANES];
+        real ox[LANES], oy[LANES], oz[LANES]; // Position before the step
+        real qx[LANES], qy[LANES], qz[LANES]; // Rest position relative to the rest COM
+        real w[LANES]; // 1 for particles, 0 for unused slots
+    };
+
+    /* LANES bodies stepped together. Lanes without a body have no
+     * particles.
+     */
+    struct Group
+    {
+        size_t first_slot; // Index of the group's first slot
+        size_t num_slots; // Particles of the largest body in the group
+        real inv_mass[LANES]; // 1 / particles, 0 for empty lanes
+        real beta_mask[LANES]; // 1 if the body has a linear fit, 0 if flat
+        real aqq[9][LANES]; // Inverse of Aqq, row major
+        real rot[4][LANES]; // Rotation as a quaternion w, x, y, z
+        real com[3][LANES]; // Center of mass after the last step
+    };
+
+    /* Where a body lives and what it looks like at rest.
+     */
+    struct Body
+    {
+        size_t first; // Index of its first particle in m_initial_pos
+        size_t count; // Number of particles
+        size_t group; // Its group, NO_GROUP until packed
+        int lane; // Its lane in the group
+        fmath::vec3 initial_com;
+        fmath::mat3 aqq; // Inverse of Aqq, if solid
+        bool solid; // False if the body is flat or a line
+    };
+
+    static const size_t NO_GROUP = static_cast<size_t>(-1);
+
+    /* Sort the bodies into groups and lay out the slots, keeping the
+     * state of bodies that were already packed. Called by Update() when
+     * bodies were added.
+     */
+    void pack();
+
+    /* Step the bodies of one group.
+     */
+    void update_group(Group& group, real dt, real alpha_term,
+                      const fmath::vec3& force, const ForceFieldSet* fields);
+
+    /* Put a body back into its rest shape at its initial position.
+     */
+    void reset_body(const Body& body);
+
+private:
+    real m_alpha; // See SetAlpha()
+    real m_beta; // See SetBeta()
+    real m_alpha_reference_dt; // Time step alpha is tuned for, 0 if unused
+    std::vector<Body> m_bodies;
+    std::vector<fmath::vec3> m_initial_pos; // Rest positions of all bodies
+    bool m_packed; // False if bodies were added since the last pack()
+    Arena m_arena; // Holds the groups and slots
+    Group* m_groups;
+    size_t m_num_groups;
+    Slot* m_slots;
+};
+
+#endif
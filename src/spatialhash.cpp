@@ -0,0 +1,292 @@
+#include "spatialhash.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+SpatialHash::SpatialHash() :
+    m_positions(NULL),
+    m_count(0),
+    m_radius(0),
+    m_cell_size(1),
+    m_mask(0),
+    m_bucket_start(),
+    m_entries()
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        m_min[i] = 0;
+        m_max[i] = 0;
+    }
+}
+
+//=============================================================================
+// bucket
+//=============================================================================
+
+size_t SpatialHash::bucket(int x, int y, int z) const
+{
+    // Large primes, the usual spatial hashing function
+    const unsigned int h = (static_cast<unsigned int>(x) * 73856093u) ^
+                           (static_cast<unsigned int>(y) * 19349663u) ^
+                           (static_cast<unsigned int>(z) * 83492791u);
+    return h & m_mask;
+}
+
+//=============================================================================
+// cell
+//=============================================================================
+
+int SpatialHash::cell(real v, int axis) const
+{
+    return static_cast<int>(std::floor((v - m_min[axis]) / m_cell_size));
+}
+
+//=============================================================================
+// Build
+//=============================================================================
+
+void SpatialHash::Build(const dlib::vec3* positions, size_t count, real radius)
+{
+    assert(radius > 0);
+
+    m_positions = positions;
+    m_count = count;
+    m_radius = radius;
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Bounding box of all the spheres
+    for (int a = 0; a < 3; ++a)
+    {
+        m_min[a] = positions[0](a);
+        m_max[a] = positions[0](a);
+    }
+
+    for (size_t i = 1; i < count; ++i)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            if (positions[i](a) < m_min[a]) m_min[a] = positions[i](a);
+            if (positions[i](a) > m_max[a]) m_max[a] = positions[i](a);
+        }
+    }
+
+    for (int a = 0; a < 3; ++a)
+    {
+        m_min[a] -= radius;
+        m_max[a] += radius;
+    }
+
+    // A sphere can then overlap at most 8 cells
+    m_cell_size = 2*radius;
+
+    // Roughly one bucket per particle
+    size_t num_buckets = 64;
+    while (num_buckets < count)
+    {
+        num_buckets <<= 1;
+    }
+    m_mask = num_buckets - 1;
+
+    // Counting sort of the particles into their buckets. First count how
+    // many entries each bucket gets.
+    m_bucket_start.assign(num_buckets + 1, 0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const dlib::vec3& p(positions[i]);
+        const int x0 = cell(p(0) - radius, 0), x1 = cell(p(0) + radius, 0);
+        const int y0 = cell(p(1) - radius, 1), y1 = cell(p(1) + radius, 1);
+        const int z0 = cell(p(2) - radius, 2), z1 = cell(p(2) + radius, 2);
+        for (int x = x0; x <= x1; ++x)
+            for (int y = y0; y <= y1; ++y)
+                for (int z = z0; z <= z1; ++z)
+                    ++m_bucket_start[bucket(x, y, z)];
+    }
+
+    // Turn the counts into the end offset of every bucket
+    for (size_t b = 1; b < num_buckets; ++b)
+    {
+        m_bucket_start[b] += m_bucket_start[b - 1];
+    }
+    m_bucket_start[num_buckets] = m_bucket_start[num_buckets - 1];
+
+    // Fill the buckets back to front, afterwards each offset has been moved
+    // to the start of its bucket.
+    m_entries.resize(m_bucket_start[num_buckets]);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const dlib::vec3& p(positions[i]);
+        const int x0 = cell(p(0) - radius, 0), x1 = cell(p(0) + radius, 0);
+        const int y0 = cell(p(1) - radius, 1), y1 = cell(p(1) + radius, 1);
+        const int z0 = cell(p(2) - radius, 2), z1 = cell(p(2) + radius, 2);
+        for (int x = x0; x <= x1; ++x)
+            for (int y = y0; y <= y1; ++y)
+                for (int z = z0; z <= z1; ++z)
+                    m_entries[--m_bucket_start[bucket(x, y, z)]] = i;
+    }
+}
+
+//=============================================================================
+// clip
+//=============================================================================
+
+bool SpatialHash::clip(const dlib::vec3& origin, const dlib::vec3& dir, real max_t,
+                       real margin, real& t_start, real& t_end) const
+{
+    t_start = 0;
+    t_end = max_t;
+    for (int a = 0; a < 3; ++a)
+    {
+        const real low = m_min[a] - margin;
+        const real high = m_max[a] + margin;
+        if (dir(a) == 0)
+        {
+            if (origin(a) < low || origin(a) > high)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        real t0 = (low - origin(a)) / dir(a);
+        real t1 = (high - origin(a)) / dir(a);
+        if (t0 > t1) std::swap(t0, t1);
+        if (t0 > t_start) t_start = t0;
+        if (t1 < t_end) t_end = t1;
+    }
+
+    return t_start <= t_end;
+}
+
+//=============================================================================
+// MayHit
+//=============================================================================
+
+bool SpatialHash::MayHit(const dlib::vec3& origin, const dlib::vec3& dir, real max_t,
+                         real margin) const
+{
+    if (m_count == 0)
+    {
+        return true;
+    }
+
+    real t_start, t_end;
+    return clip(origin, dir, max_t, margin, t_start, t_end);
+}
+
+//=============================================================================
+// Raycast
+//=============================================================================
+
+bool SpatialHash::Raycast(const dlib::vec3& origin, const dlib::vec3& dir,
+                          real max_t, real& t, size_t& index) const
+{
+    if (m_count == 0)
+    {
+        return false;
+    }
+
+    const real inf = std::numeric_limits<real>::max();
+
+    // Clip the ray against the bounding box of all the spheres
+    real t_start, t_end;
+    if (!clip(origin, dir, max_t, 0, t_start, t_end))
+    {
+        return false;
+    }
+
+    // Setup the grid walk (Amanatides & Woo) from where the ray enters
+    int c[3], num_cells[3], step[3];
+    real t_next[3], t_delta[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        num_cells[a] = cell(m_max[a], a) + 1;
+        c[a] = cell(origin(a) + dir(a)*t_start, a);
+        if (c[a] < 0) c[a] = 0;
+        if (c[a] >= num_cells[a]) c[a] = num_cells[a] - 1;
+
+        if (dir(a) > 0)
+        {
+            step[a] = 1;
+            t_next[a] = (m_min[a] + (c[a] + 1)*m_cell_size - origin(a)) / dir(a);
+            t_delta[a] = m_cell_size / dir(a);
+        }
+        else if (dir(a) < 0)
+        {
+            step[a] = -1;
+            t_next[a] = (m_min[a] + c[a]*m_cell_size - origin(a)) / dir(a);
+            t_delta[a] = -m_cell_size / dir(a);
+        }
+        else
+        {
+            step[a] = 0;
+            t_next[a] = inf;
+            t_delta[a] = inf;
+        }
+    }
+
+    const real radius_sq = m_radius*m_radius;
+    bool hit = false;
+    real best_t = inf;
+    size_t best_index = 0;
+    for (;;)
+    {
+        const size_t b = bucket(c[0], c[1], c[2]);
+        for (unsigned int e = m_bucket_start[b]; e < m_bucket_start[b + 1]; ++e)
+        {
+            const size_t i = m_entries[e];
+            const dlib::vec3 o_to_c = m_positions[i] - origin;
+            const real t_p = dlib::dot(o_to_c, dir);
+            if (t_p <= 0 || t_p > max_t || t_p >= best_t)
+            {
+                continue;
+            }
+
+            if (dlib::dot(o_to_c, o_to_c) - t_p*t_p <= radius_sq)
+            {
+                hit = true;
+                best_t = t_p;
+                best_index = i;
+            }
+        }
+
+        // Step to the next cell along the ray
+        int axis = 0;
+        if (t_next[1] < t_next[axis]) axis = 1;
+        if (t_next[2] < t_next[axis]) axis = 2;
+
+        // The closest point of any sphere not seen yet lies in a cell further
+        // along the ray, so nothing left can beat the current hit.
+        if ((hit && best_t <= t_next[axis]) || t_next[axis] > t_end)
+        {
+            break;
+        }
+
+        c[axis] += step[axis];
+        if (c[axis] < 0 || c[axis] >= num_cells[axis])
+        {
+            break;
+        }
+        t_next[axis] += t_delta[axis];
+    }
+
+    if (hit)
+    {
+        t = best_t;
+        index = best_index;
+    }
+
+    return hit;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,107 @@
+#ifndef __SPATIAL_HASH_HPP__
+#define __SPATIAL_HASH_HPP__
+
+#include "defs.hpp"
+
+#include <vector>
+
+/* A hashed uniform grid over a set of equally sized spheres, one sphere
+ * centered on each particle. It is used to answer ray queries (picking)
+ * without testing every particle in the system.
+ *
+ * Every sphere is inserted into each grid cell its bounding box overlaps,
+ * the cells are then hashed into a fixed number of buckets. A ray query
+ * walks the grid cells along the ray in order and stops as soon as the
+ * closest hit found so far can not be beaten by any cell further along.
+ *
+ * The basic format for use is:
+ *
+ *   SpatialHash grid;
+ *   grid.Build(positions, num_particles, 0.2);
+ *   ...
+ *   if (grid.Raycast(origin, dir, max_t, t, index)) { ... }
+ *
+ * The positions array is not copied and must stay valid, and unchanged,
+ * until the next call to Build().
+ */
+class SpatialHash
+{
+public:
+    /* Creates an empty grid, Raycast() will never hit anything until
+     * Build() is called.
+     */
+    SpatialHash();
+
+    /* Rebuild the grid for the given particles. The internal storage is
+     * reused between builds, so rebuilding every frame does not allocate
+     * once the particle count has settled.
+     *
+     * Params:
+     *   positions - The center of each sphere
+     *   count - The number of entries in positions
+     *   radius - The radius of every sphere
+     */
+    void Build(const dlib::vec3* positions, size_t count, real radius);
+
+    /* Find the closest sphere hit by a ray. The hit distance t is measured
+     * the same way the old linear picking did, it is the distance along the
+     * ray to the point closest to the sphere's center.
+     *
+     * Params:
+     *   origin - Start of the ray
+     *   dir - Direction of the ray, must be normalized
+     *   max_t - Hits further than this along the ray are ignored
+     *   t - Set to the distance along the ray of the closest hit
+     *   index - Set to the index of the particle that was hit
+     *
+     * Returns:
+     *   True if a sphere was hit, t and index are only modified on a hit.
+     */
+    bool Raycast(const dlib::vec3& origin, const dlib::vec3& dir, real max_t,
+                 real& t, size_t& index) const;
+
+    /* Test a ray against the box around the spheres of the last Build(),
+     * grown by margin on every side. Used to skip rebuilding the grid of
+     * particles that can't have moved into the ray.
+     *
+     * Params:
+     *   margin - How far any particle may have moved since the build
+     *
+     * Returns:
+     *   False if the ray misses the box. Always true before the first
+     *   Build(), nothing is known then.
+     */
+    bool MayHit(const dlib::vec3& origin, const dlib::vec3& dir, real max_t,
+                real margin) const;
+
+private:
+    /* Clip a ray against the bounding box grown by margin.
+     *
+     * Returns:
+     *   False if it misses, otherwise t_start and t_end are where it is
+     *   inside the box.
+     */
+    bool clip(const dlib::vec3& origin, const dlib::vec3& dir, real max_t,
+              real margin, real& t_start, real& t_end) const;
+
+    /* Hash an integer cell coordinate into a bucket index.
+     */
+    size_t bucket(int x, int y, int z) const;
+
+    /* Convert a world space coordinate into a cell coordinate.
+     */
+    int cell(real v, int axis) const;
+
+private:
+    const dlib::vec3* m_positions; // Sphere centers (not owned)
+    size_t m_count; // Number of spheres
+    real m_radius; // Radius of every sphere
+    real m_cell_size; // Width of one grid cell
+    real m_min[3]; // Bounding box of all the spheres
+    real m_max[3];
+    size_t m_mask; // Number of buckets - 1, always a power of two
+    std::vector<unsigned int> m_bucket_start; // Offset of each bucket in m_entries
+    std::vector<unsigned int> m_entries; // Particle indices sorted by bucket
+};
+
+#endif
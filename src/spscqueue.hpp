@@ -0,0 +1,75 @@
+#ifndef __SPSC_QUEUE_HPP__
+#define __SPSC_QUEUE_HPP__
+
+#include "atomic.hpp"
+
+#include <cstddef>
+
+/* Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread. Neither side ever blocks, Push() fails when the queue is full and
+ * Pop() fails when it is empty.
+ *
+ * T must be cheap to copy, it is stored by value in a fixed ring of
+ * CAPACITY slots. CAPACITY must be a power of two.
+ */
+template <typename T, size_t CAPACITY>
+class SpscQueue
+{
+public:
+    SpscQueue() :
+        m_head(0),
+        m_tail(0)
+    {
+        // Compile time check that CAPACITY is a power of two
+        typedef char capacity_must_be_power_of_two[(CAPACITY & (CAPACITY - 1)) == 0 ? 1 : -1];
+        (void)sizeof(capacity_must_be_power_of_two);
+    }
+
+    /* Add an item to the queue. Only call from the producer thread.
+     *
+     * Returns:
+     *   True if the item was queued, false if the queue was full.
+     */
+    bool Push(const T& item)
+    {
+        const size_t tail = m_tail;
+        if (tail - atomic::load(&m_head) == CAPACITY)
+        {
+            return false;
+        }
+
+        m_items[tail & (CAPACITY - 1)] = item;
+        atomic::store(&m_tail, tail + 1);
+        return true;
+    }
+
+    /* Remove the oldest item from the queue. Only call from the consumer
+     * thread.
+     *
+     * Returns:
+     *   True if an item was written to out, false if the queue was empty.
+     */
+    bool Pop(T& out)
+    {
+        const size_t head = m_head;
+        if (head == atomic::load(&m_tail))
+        {
+            return false;
+        }
+
+        out = m_items[head & (CAPACITY - 1)];
+        atomic::store(&m_head, head + 1);
+        return true;
+    }
+
+private:
+    // The indices only ever increase, wrapping is handled by the mask. They
+    // are kept on separate cache lines since each is written by one thread.
+    size_t m_head; // Next slot to read, written by the consumer
+    char m_pad0[CACHE_LINE_SIZE - sizeof(size_t)];
+    size_t m_tail; // Next slot to write, written by the producer
+    char m_pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+    T m_items[CAPACITY];
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "statepublisher.hpp"
+#include "atomic.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using std::cerr;
+using std::endl;
+
+/* Round up to a multiple of the cache line size, so the slots and
+ * position arrays don't share lines.
+ */
+static uint64_t align_up(uint64_t size)
+{
+    return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+StatePublisher::StatePublisher() :
+    m_memory(NULL),
+    m_size(0),
+    m_header(NULL),
+    m_frame(0),
+    m_slot(NULL)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+StatePublisher::~StatePublisher()
+{
+    Close();
+}
+
+//=============================================================================
+// Open
+//=============================================================================
+
+bool StatePublisher::Open(const char* name, const std::vector<size_t>& capacities,
+                          unsigned int num_slots)
+{
+    assert(num_slots >= 2);
+
+    Close();
+
+    // Lay out one slot, every slot is the same
+    const size_t num_bodies = capacities.size();
+    uint64_t slot_size = align_up(sizeof(SharedFrame) + num_bodies*sizeof(SharedBody));
+    std::vector<uint64_t> offsets(num_bodies);
+    for (size_t i = 0; i < num_bodies; ++i)
+    {
+        offsets[i] = slot_size;
+        slot_size += align_up(capacities[i] * 3*sizeof(float));
+    }
+    const uint64_t first_slot = align_up(sizeof(SharedStateHeader));
+    const size_t size = first_slot + num_slots*slot_size;
+
+    // Readers still holding an old one keep it, new ones get this one
+    shm_unlink(name);
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        cerr << "Failed to create shared memory " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        cerr << "Failed to map shared memory " << name << ": " << strerror(errno) << endl;
+        shm_unlink(name);
+        return false;
+    }
+
+    m_name = name;
+    m_memory = static_cast<char*>(memory);
+    m_size = size;
+    m_frame = 0;
+    m_slot = NULL;
+
+    // The new memory is zeroed, only the parts that never change are
+    // filled in
+    m_header = reinterpret_cast<SharedStateHeader*>(m_memory);
+    m_header->version = SHARED_STATE_VERSION;
+    m_header->num_slots = num_slots;
+    m_header->num_bodies = num_bodies;
+    m_header->slot_size = slot_size;
+    m_header->first_slot = first_slot;
+    m_header->latest = 0;
+    for (unsigned int s = 0; s < num_slots; ++s)
+    {
+        char* slot = m_memory + first_slot + s*slot_size;
+        reinterpret_cast<SharedFrame*>(slot)->num_bodies = num_bodies;
+
+        SharedBody* bodies = reinterpret_cast<SharedBody*>(slot + sizeof(SharedFrame));
+        for (size_t i = 0; i < num_bodies; ++i)
+        {
+            bodies[i].positions = offsets[i];
+            bodies[i].capacity = capacities[i];
+        }
+    }
+    atomic::store(&m_header->magic, SHARED_STATE_MAGIC);
+    return true;
+}
+
+//=============================================================================
+// Close
+//=============================================================================
+
+void StatePublisher::Close()
+{
+    if (m_memory == NULL)
+    {
+        return;
+    }
+
+    munmap(m_memory, m_size);
+    shm_unlink(m_name.c_str());
+    m_memory = NULL;
+    m_header = NULL;
+    m_slot = NULL;
+}
+
+//=============================================================================
+// BeginFrame
+//=============================================================================
+
+void StatePublisher::BeginFrame(double time)
+{
+    assert(IsOpen());
+
+    ++m_frame;
+    m_slot = get_slot(m_frame);
+    SharedFrame* frame = reinterpret_cast<SharedFrame*>(m_slot);
+
+    // Readers of the frame that was in this slot notice from here on
+    atomic::store(&frame->sequence, 2*m_frame - 1);
+    atomic::fence();
+
+    frame->frame = m_frame;
+    frame->time = time;
+}
+
+//=============================================================================
+// WriteBody
+//=============================================================================
+
+void StatePublisher::WriteBody(size_t body, const dlib::vec3* positions, size_t num_particles,
+                               const dlib::vec3& com, const fmath::mat3& rotation)
+{
+    assert(m_slot != NULL);
+    assert(body < m_header->num_bodies);
+
+    SharedBody& shared = reinterpret_cast<SharedBody*>(m_slot + sizeof(SharedFrame))[body];
+    assert(num_particles <= shared.capacity);
+
+    shared.num_particles = num_particles;
+    for (int i = 0; i < 3; ++i)
+    {
+        shared.com[i] = com(i);
+        for (int j = 0; j < 3; ++j)
+        {
+            shared.rotation[i*3 + j] = rotation(i, j);
+        }
+    }
+
+    float* out = reinterpret_cast<float*>(m_slot + shared.positions);
+    for (size_t i = 0; i < num_particles; ++i)
+    {
+        out[3*i + 0] = positions[i](0);
+        out[3*i + 1] = positions[i](1);
+        out[3*i + 2] = positions[i](2);
+    }
+}
+
+//=============================================================================
+// EndFrame
+//=============================================================================
+
+void StatePublisher::EndFrame()
+{
+    assert(m_slot != NULL);
+
+    SharedFrame* frame = reinterpret_cast<SharedFrame*>(m_slot);
+    atomic::fence();
+    atomic::store(&frame->sequence, 2*m_frame);
+    atomic::store(&m_header->latest, m_frame);
+    m_slot = NULL;
+}
+
+//=============================================================================
+// get_slot
+//=============================================================================
+
+char* StatePublisher::get_slot(uint64_t frame) const
+{
+    return m_memory + m_header->first_slot + (frame % m_header->num_slots)*m_header->slot_size;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,99 @@
+#ifndef __STATE_PUBLISHER_HPP__
+#define __STATE_PUBLISHER_HPP__
+
+#include "defs.hpp"
+#include "fmath.hpp"
+#include "sharedstate.hpp"
+
+#include <string>
+#include <vector>
+
+/* Publishes the particle positions, center of mass and rotation of every
+ * body in POSIX shared memory, for other processes to watch the
+ * simulation without linking into it. See sharedstate.hpp for the layout
+ * and StateReader for reading it.
+ *
+ *   publisher.Open("/meshless", capacities);
+ *   ...
+ *   publisher.BeginFrame(get_time());
+ *   for each body
+ *       publisher.WriteBody(i, positions, count, com, rotation);
+ *   publisher.EndFrame();
+ *
+ * Frames go into a ring of slots, readers check a sequence number instead
+ * of locking, so publishing never waits on them.
+ */
+class StatePublisher
+{
+public:
+    StatePublisher();
+
+    /* Closes the shared memory.
+     */
+    ~StatePublisher();
+
+    /* Create the shared memory, replacing any left over with the same
+     * name.
+     *
+     * Params:
+     *   name - A shm_open() name, like "/meshless"
+     *   capacities - The most particles each body will have
+     *   num_slots - Frames kept, readers fail if the writer goes around
+     *               them all while they copy
+     *
+     * Returns:
+     *   False if the memory couldn't be created.
+     */
+    bool Open(const char* name, const std::vector<size_t>& capacities,
+              unsigned int num_slots = 4);
+
+    /* Unmap and remove the shared memory. Readers that have it mapped keep
+     * it until they close it.
+     */
+    void Close();
+
+    bool IsOpen() const
+    {
+        return m_memory != NULL;
+    }
+
+    /* Start writing the next frame.
+     *
+     * Params:
+     *   time - get_time() of the state, for readers to measure latency
+     */
+    void BeginFrame(double time);
+
+    /* Write one body of the frame. Different bodies can be written at the
+     * same time from different threads.
+     *
+     * Params:
+     *   num_particles - At most the capacity given to Open()
+     *   rotation - From the rest shape, see PSystem::GetRotation()
+     */
+    void WriteBody(size_t body, const dlib::vec3* positions, size_t num_particles,
+                   const dlib::vec3& com, const fmath::mat3& rotation);
+
+    /* Make the frame visible to readers.
+     */
+    void EndFrame();
+
+private:
+    // Not copyable
+    StatePublisher(const StatePublisher&);
+    StatePublisher& operator=(const StatePublisher&);
+
+    /* The slot frame is written into.
+     */
+    char* get_slot(uint64_t frame) const;
+
+private:
+    std::string m_name; // Name of the shared memory
+    char* m_memory; // The mapping, NULL while closed
+    size_t m_size; // Bytes mapped
+    SharedStateHeader* m_header;
+    uint64_t m_frame; // Frame being written, or the last one
+    char* m_slot; // Slot of m_frame
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include "statereader.hpp"
+#include "atomic.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::cerr;
+using std::endl;
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+StateReader::StateReader() :
+    m_memory(NULL),
+    m_size(0),
+    m_header(NULL)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+StateReader::~StateReader()
+{
+    Close();
+}
+
+//=============================================================================
+// Open
+//=============================================================================
+
+bool StateReader::Open(const char* name)
+{
+    Close();
+
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        cerr << "Failed to open shared memory " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(SharedStateHeader))
+    {
+        memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        cerr << "Failed to map shared memory " << name << endl;
+        return false;
+    }
+
+    m_memory = static_cast<const char*>(memory);
+    m_size = info.st_size;
+    m_header = reinterpret_cast<const SharedStateHeader*>(m_memory);
+
+    // The publisher writes the magic number last
+    const bool valid = atomic::load(&m_header->magic) == SHARED_STATE_MAGIC &&
+                       m_header->version == SHARED_STATE_VERSION &&
+                       m_header->first_slot + m_header->num_slots*m_header->slot_size <= m_size;
+    if (!valid)
+    {
+        cerr << "Shared memory " << name << " isn't published state of this version" << endl;
+        Close();
+        return false;
+    }
+    return true;
+}
+
+//=============================================================================
+// Close
+//=============================================================================
+
+void StateReader::Close()
+{
+    if (m_memory != NULL)
+    {
+        munmap(const_cast<char*>(m_memory), m_size);
+        m_memory = NULL;
+        m_header = NULL;
+    }
+}
+
+//=============================================================================
+// GetNumBodies / GetLatest
+//=============================================================================
+
+size_t StateReader::GetNumBodies() const
+{
+    assert(IsOpen());
+    return m_header->num_bodies;
+}
+
+uint64_t StateReader::GetLatest() const
+{
+    assert(IsOpen());
+    return atomic::load(&m_header->latest);
+}
+
+//=============================================================================
+// Read / ReadBody
+//=============================================================================
+
+bool StateReader::Read(StateFrame& frame, int max_tries)
+{
+    assert(IsOpen());
+
+    frame.bodies.resize(m_header->num_bodies);
+    return read(0, frame.bodies.size(), frame.bodies.empty() ? NULL : &frame.bodies[0],
+                frame.frame, frame.time, max_tries);
+}
+
+bool StateReader::ReadBody(size_t body, StateBody& state, uint64_t& frame, int max_tries)
+{
+    assert(IsOpen());
+    assert(body < m_header->num_bodies);
+
+    double time;
+    return read(body, 1, &state, frame, time, max_tries);
+}
+
+//=============================================================================
+// read
+//=============================================================================
+
+bool StateReader::read(size_t first, size_t count, StateBody* bodies, uint64_t& frame,
+                       double& time, int max_tries)
+{
+    for (int attempt = 0; attempt < max_tries; ++attempt)
+    {
+        const uint64_t latest = atomic::load(&m_header->latest);
+        if (latest == 0)
+        {
+            return false;
+        }
+
+        const char* slot = m_memory + m_header->first_slot +
+                           (latest % m_header->num_slots)*m_header->slot_size;
+        const SharedFrame* shared_frame = reinterpret_cast<const SharedFrame*>(slot);
+
+        // Already being written again
+        const uint64_t sequence = atomic::load(&shared_frame->sequence);
+        if (sequence != 2*latest)
+        {
+            continue;
+        }
+
+        time = shared_frame->time;
+        const SharedBody* shared = reinterpret_cast<const SharedBody*>(slot + sizeof(SharedFrame));
+        for (size_t i = 0; i < count; ++i)
+        {
+            const SharedBody& from = shared[first + i];
+            StateBody& to = bodies[i];
+            memcpy(to.com, from.com, sizeof(to.com));
+            memcpy(to.rotation, from.rotation, sizeof(to.rotation));
+
+            // A torn count is caught below, it only has to stay in bounds
+            const size_t num_particles = std::min(from.num_particles, from.capacity);
+            to.positions.resize(3*num_particles);
+            if (num_particles > 0)
+            {
+                memcpy(&to.positions[0], slot + from.positions, 3*num_particles*sizeof(float));
+            }
+        }
+
+        atomic::fence();
+        if (atomic::load(&shared_frame->sequence) == sequence)
+        {
+            frame = latest;
+            return true;
+        }
+    }
+    return false;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,108 @@
+#ifndef __STATE_READER_HPP__
+#define __STATE_READER_HPP__
+
+#include "sharedstate.hpp"
+
+#include <vector>
+#include <cstddef>
+
+/* One body of a frame read by StateReader.
+ */
+struct StateBody
+{
+    float com[3]; // Center of mass
+    float rotation[9]; // Rotation from the rest shape, row major
+    std::vector<float> positions; // x, y, z of each particle
+};
+
+/* Everything published in one frame.
+ */
+struct StateFrame
+{
+    uint64_t frame; // Counts up from 1, frames can be skipped
+    double time; // When it was published, see StatePublisher::BeginFrame()
+    std::vector<StateBody> bodies;
+};
+
+/* Reads the state a StatePublisher publishes, from another process. Only
+ * needs this file, statereader.cpp, sharedstate.hpp and atomic.hpp, see
+ * the reader target of the makefile.
+ *
+ *   StateReader reader;
+ *   if (reader.Open("/meshless"))
+ *   {
+ *       StateFrame frame;
+ *       while (...)
+ *       {
+ *           if (reader.GetLatest() != last && reader.Read(frame))
+ *               ...
+ *       }
+ *   }
+ *
+ * Reading never blocks the simulation. A copy that the simulation wrote
+ * over while it was being made is thrown away and tried again.
+ */
+class StateReader
+{
+public:
+    StateReader();
+
+    /* Unmaps the shared memory.
+     */
+    ~StateReader();
+
+    /* Map the shared memory of a publisher.
+     *
+     * Returns:
+     *   False if there is none with that name, or it has another layout
+     *   version.
+     */
+    bool Open(const char* name);
+
+    void Close();
+
+    bool IsOpen() const
+    {
+        return m_memory != NULL;
+    }
+
+    size_t GetNumBodies() const;
+
+    /* The newest complete frame, 0 if there is none yet. Cheap enough to
+     * poll.
+     */
+    uint64_t GetLatest() const;
+
+    /* Copy the newest complete frame.
+     *
+     * Params:
+     *   max_tries - Times to start over if the simulation overwrites the
+     *               frame during the copy
+     *
+     * Returns:
+     *   False if nothing was published yet or every try was overwritten.
+     */
+    bool Read(StateFrame& frame, int max_tries = 8);
+
+    /* Copy one body of the newest complete frame, cheaper than Read() if
+     * only one is needed.
+     */
+    bool ReadBody(size_t body, StateBody& state, uint64_t& frame, int max_tries = 8);
+
+private:
+    // Not copyable
+    StateReader(const StateReader&);
+    StateReader& operator=(const StateReader&);
+
+    /* Copy count bodies starting at first from the newest frame.
+     */
+    bool read(size_t first, size_t count, StateBody* bodies, uint64_t& frame,
+              double& time, int max_tries);
+
+private:
+    const char* m_memory; // The mapping, NULL while closed
+    size_t m_size; // Bytes mapped
+    const SharedStateHeader* m_header;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "stepcontroller.hpp"
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+// Only remove a substep if the error estimate for one fewer substep is
+// below this fraction of the tolerance, keeps the count from oscillating.
+static const real DECREASE_THRESHOLD = 0.75;
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+StepController::StepController(int max_substeps) :
+    m_substeps(1),
+    m_max_substeps(max_substeps),
+    m_displacement_tolerance(0.1),
+    m_deviation_tolerance(0.1)
+{
+    assert(max_substeps >= 1);
+}
+
+//=============================================================================
+// SetMaxSubsteps
+//=============================================================================
+
+void StepController::SetMaxSubsteps(int max_substeps)
+{
+    assert(max_substeps >= 1);
+
+    m_max_substeps = max_substeps;
+    m_substeps = std::min(m_substeps, m_max_substeps);
+}
+
+//=============================================================================
+// SetTolerance
+//=============================================================================
+
+void StepController::SetTolerance(real displacement, real deviation)
+{
+    assert(displacement > 0);
+    assert(deviation > 0);
+
+    m_displacement_tolerance = displacement;
+    m_deviation_tolerance = deviation;
+}
+
+//=============================================================================
+// Report
+//=============================================================================
+
+void StepController::Report(real displacement, real deviation)
+{
+    // Both quantities grow roughly linearly with the step size, so using n
+    // substeps instead of the current count scales them by m_substeps / n.
+    const real error = std::max(displacement / m_displacement_tolerance,
+                                deviation / m_deviation_tolerance);
+
+    if (error > 1)
+    {
+        // Too large, jump straight to the count that should be enough
+        const int needed = static_cast<int>(std::ceil(m_substeps * error));
+        m_substeps = std::min(needed, m_max_substeps);
+    }
+    else if (m_substeps > 1 &&
+             error * m_substeps / (m_substeps - 1) < DECREASE_THRESHOLD)
+    {
+        // Calm, back off one substep at a time
+        --m_substeps;
+    }
+}
+
+//=============================================================================
+// Reset
+//=============================================================================
+
+void StepController::Reset()
+{
+    m_substeps = 1;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,76 @@
+#ifndef __STEP_CONTROLLER_HPP__
+#define __STEP_CONTROLLER_HPP__
+
+#include "defs.hpp"
+
+/* Picks how many substeps to split each simulation step into. After every
+ * step the caller reports how far the particles moved and how far they
+ * were from their goal positions, relative to the size of their body. If
+ * either is larger than its tolerance the next steps are split into more
+ * substeps, if both are comfortably smaller the substeps are slowly
+ * removed again. This way calm scenes take one large step and only
+ * violent ones pay for small steps.
+ *
+ *   StepController controller(8);
+ *   ...
+ *   const int substeps = controller.GetSubsteps();
+ *   for (int i = 0; i < substeps; ++i)
+ *   {
+ *       ... step all bodies by dt / substeps ...
+ *   }
+ *   controller.Report(max_displacement, max_deviation);
+ */
+class StepController
+{
+public:
+    /* Params:
+     *   max_substeps - Upper limit for GetSubsteps()
+     */
+    StepController(int max_substeps);
+
+    /* Number of substeps to use for the next step, between 1 and the
+     * maximum.
+     */
+    int GetSubsteps() const
+    {
+        return m_substeps;
+    }
+
+    int GetMaxSubsteps() const
+    {
+        return m_max_substeps;
+    }
+
+    /* Change the upper limit for GetSubsteps(), must be at least 1.
+     */
+    void SetMaxSubsteps(int max_substeps);
+
+    /* Set the largest distance a particle may move in one substep, and the
+     * largest distance a particle may be from its goal, both as a fraction
+     * of the body's rest radius.
+     */
+    void SetTolerance(real displacement, real deviation);
+
+    /* Report the result of the last step, it was taken with GetSubsteps()
+     * substeps.
+     *
+     * Params:
+     *   displacement - Largest distance a particle moved in one substep,
+     *                  divided by the rest radius of its body
+     *   deviation - Largest distance a particle was from its goal in one
+     *               substep, divided by the rest radius of its body
+     */
+    void Report(real displacement, real deviation);
+
+    /* Go back to a single substep.
+     */
+    void Reset();
+
+private:
+    int m_substeps; // Current number of substeps
+    int m_max_substeps; // Upper limit for m_substeps
+    real m_displacement_tolerance; // See SetTolerance()
+    real m_deviation_tolerance;
+};
+
+#endif
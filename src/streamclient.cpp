@@ -0,0 +1,344 @@
+#include "streamclient.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::cerr;
+using std::endl;
+
+/* Seconds on a steady clock, for the time outs.
+ */
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Wait until there is something to read, or the time give_up.
+ */
+static bool wait_readable(int socket, double give_up)
+{
+    for (;;)
+    {
+        const int left_ms = static_cast<int>((give_up - now()) * 1000);
+        if (left_ms < 0)
+        {
+            return false;
+        }
+
+        pollfd wait;
+        wait.fd = socket;
+        wait.events = POLLIN;
+        const int ready = poll(&wait, 1, left_ms);
+        if (ready > 0)
+        {
+            return true;
+        }
+        if (ready < 0 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+/* Read a value from a message, moving offset past it.
+ *
+ * Returns:
+ *   False if the message is too short.
+ */
+template <typename T>
+static bool take(const std::vector<char>& payload, size_t& offset, T& value)
+{
+    if (payload.size() - offset < sizeof(T))
+    {
+        return false;
+    }
+    memcpy(&value, &payload[offset], sizeof(T));
+    offset += sizeof(T);
+    return true;
+}
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+StreamClient::StreamClient() :
+    m_socket(-1),
+    m_have_keyframe(false)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+StreamClient::~StreamClient()
+{
+    Close();
+}
+
+//=============================================================================
+// Connect
+//=============================================================================
+
+bool StreamClient::Connect(const char* address)
+{
+    Close();
+
+    const char* colon = strrchr(address, ':');
+    if (colon == NULL || strchr(address, '/') != NULL)
+    {
+        sockaddr_un path;
+        memset(&path, 0, sizeof(path));
+        path.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(path.sun_path))
+        {
+            cerr << "Socket path too long: " << address << endl;
+            return false;
+        }
+        strcpy(path.sun_path, address);
+
+        m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_socket < 0 ||
+            connect(m_socket, reinterpret_cast<sockaddr*>(&path), sizeof(path)) != 0)
+        {
+            cerr << "Failed to connect to " << address << ": " << strerror(errno) << endl;
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    const std::string host(address, colon);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = NULL;
+    if (getaddrinfo(host.c_str(), colon + 1, &hints, &found) != 0)
+    {
+        cerr << "Failed to look up " << address << endl;
+        return false;
+    }
+
+    for (addrinfo* info = found; info != NULL && m_socket < 0; info = info->ai_next)
+    {
+        m_socket = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (m_socket >= 0 && connect(m_socket, info->ai_addr, info->ai_addrlen) != 0)
+        {
+            close(m_socket);
+            m_socket = -1;
+        }
+    }
+    freeaddrinfo(found);
+
+    if (m_socket < 0)
+    {
+        cerr << "Failed to connect to " << address << endl;
+        return false;
+    }
+    return true;
+}
+
+//=============================================================================
+// Close
+//=============================================================================
+
+void StreamClient::Close()
+{
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+    m_rest.clear();
+    m_have_keyframe = false;
+}
+
+//=============================================================================
+// Receive
+//=============================================================================
+
+bool StreamClient::Receive(StreamState& state, double timeout)
+{
+    if (!IsOpen())
+    {
+        return false;
+    }
+
+    const double give_up = now() + timeout;
+    for (;;)
+    {
+        // Nothing is lost if no message started in time
+        if (!wait_readable(m_socket, give_up))
+        {
+            return false;
+        }
+
+        // Once one has, the rest of it is waited for as long again
+        const double message_give_up = std::max(give_up, now() + timeout);
+        StreamMessage message;
+        bool valid = receive(&message, sizeof(message), message_give_up);
+        if (valid)
+        {
+            m_payload.resize(message.size);
+            valid = message.size == 0 ||
+                    receive(&m_payload[0], message.size, message_give_up);
+        }
+
+        if (valid && message.type == STREAM_KEYFRAME)
+        {
+            valid = read_keyframe();
+            if (valid)
+            {
+                continue;
+            }
+        }
+        else if (valid && message.type == STREAM_FRAME)
+        {
+            valid = m_have_keyframe && read_frame(state);
+            if (valid)
+            {
+                return true;
+            }
+        }
+
+        Close();
+        return false;
+    }
+}
+
+//=============================================================================
+// receive
+//=============================================================================
+
+bool StreamClient::receive(void* data, size_t size, double give_up)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+        if (!wait_readable(m_socket, give_up))
+        {
+            return false;
+        }
+
+        const ssize_t received = recv(m_socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+//=============================================================================
+// read_keyframe
+//=============================================================================
+
+bool StreamClient::read_keyframe()
+{
+    size_t offset = 0;
+    StreamKeyframe header;
+    if (!take(m_payload, offset, header) || header.magic != STREAM_MAGIC ||
+        header.version != STREAM_VERSION)
+    {
+        cerr << "Not a stream of this version" << endl;
+        return false;
+    }
+
+    m_rest.resize(header.num_bodies);
+    for (size_t i = 0; i < m_rest.size(); ++i)
+    {
+        StreamRestBody body;
+        if (!take(m_payload, offset, body) ||
+            (m_payload.size() - offset) / (3*sizeof(float)) < body.num_particles)
+        {
+            return false;
+        }
+
+        m_rest[i].resize(3*body.num_particles);
+        const size_t bytes = m_rest[i].size()*sizeof(float);
+        if (bytes > 0)
+        {
+            memcpy(&m_rest[i][0], &m_payload[offset], bytes);
+        }
+        offset += bytes;
+    }
+
+    m_have_keyframe = true;
+    return true;
+}
+
+//=============================================================================
+// read_frame
+//=============================================================================
+
+bool StreamClient::read_frame(StreamState& state)
+{
+    size_t offset = 0;
+    StreamFrame header;
+    if (!take(m_payload, offset, header) || header.num_bodies != m_rest.size())
+    {
+        return false;
+    }
+    state.frame = header.frame;
+    state.time = header.time;
+    state.bodies.resize(header.num_bodies);
+
+    for (size_t i = 0; i < state.bodies.size(); ++i)
+    {
+        StreamBody body;
+        const std::vector<float>& rest = m_rest[i];
+        if (!take(m_payload, offset, body) || 3*body.num_particles != rest.size() ||
+            (body.bits != 8 && body.bits != 16))
+        {
+            return false;
+        }
+        const size_t size = stream_residual_size(body.num_particles, body.bits);
+        if (m_payload.size() - offset < size)
+        {
+            return false;
+        }
+
+        StreamBodyState& out = state.bodies[i];
+        memcpy(out.com, body.com, sizeof(out.com));
+        memcpy(out.rotation, body.rotation, sizeof(out.rotation));
+
+        // Goal plus residual, see streamprotocol.hpp
+        out.positions.resize(rest.size());
+        const int8_t* bytes = reinterpret_cast<const int8_t*>(&m_payload[offset]);
+        const int16_t* shorts = reinterpret_cast<const int16_t*>(&m_payload[offset]);
+        for (size_t p = 0; p < body.num_particles; ++p)
+        {
+            float goal[3];
+            stream_goal(body, &rest[3*p], goal);
+            for (int j = 0; j < 3; ++j)
+            {
+                const size_t k = 3*p + j;
+                const float steps = body.bits == 8 ? bytes[k] : shorts[k];
+                out.positions[k] = goal[j] + steps * body.quantum;
+            }
+        }
+        offset += size;
+    }
+    return true;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,94 @@
+#ifndef __STREAM_CLIENT_HPP__
+#define __STREAM_CLIENT_HPP__
+
+#include "streamprotocol.hpp"
+
+#include <vector>
+#include <cstddef>
+
+/* One body of a frame received by StreamClient.
+ */
+struct StreamBodyState
+{
+    float com[3]; // Center of mass
+    float rotation[9]; // Rotation from the rest shape, row major
+    std::vector<float> positions; // x, y, z of each particle
+};
+
+/* A decoded frame.
+ */
+struct StreamState
+{
+    uint64_t frame; // Counts up from 1, frames the client was too slow for are missing
+    double time; // When it was sent, see StreamServer::BeginFrame()
+    std::vector<StreamBodyState> bodies;
+};
+
+/* Receives the stream of a StreamServer and turns it back into particle
+ * positions. Only needs this file, streamclient.cpp and
+ * streamprotocol.hpp, see the reader target of the makefile.
+ *
+ *   StreamClient client;
+ *   if (client.Connect("simhost:7000"))
+ *   {
+ *       StreamState state;
+ *       while (client.Receive(state))
+ *           ...
+ *   }
+ */
+class StreamClient
+{
+public:
+    StreamClient();
+
+    /* Closes the connection.
+     */
+    ~StreamClient();
+
+    /* Connect to a server.
+     *
+     * Params:
+     *   address - "host:port" for TCP, otherwise the path of a UNIX socket
+     */
+    bool Connect(const char* address);
+
+    void Close();
+
+    bool IsOpen() const
+    {
+        return m_socket >= 0;
+    }
+
+    /* Wait for the next frame and decode it, taking in any keyframe on the
+     * way.
+     *
+     * Params:
+     *   timeout - Seconds to wait
+     *
+     * Returns:
+     *   False if no frame came in time, the server is gone or it sent
+     *   something that isn't a stream. The connection is closed then
+     *   unless nothing was received at all.
+     */
+    bool Receive(StreamState& state, double timeout = 1);
+
+private:
+    // Not copyable
+    StreamClient(const StreamClient&);
+    StreamClient& operator=(const StreamClient&);
+
+    /* Read exactly size bytes, giving up at the time give_up.
+     */
+    bool receive(void* data, size_t size, double give_up);
+
+    bool read_keyframe();
+    bool read_frame(StreamState& state);
+
+private:
+    int m_socket; // -1 while closed
+    std::vector<char> m_payload; // The message being decoded
+    std::vector<std::vector<float> > m_rest; // Rest positions of each body, from the keyframe
+    bool m_have_keyframe;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __STREAM_PROTOCOL_HPP__
+#define __STREAM_PROTOCOL_HPP__
+
+#include <stdint.h>
+
+/* What StreamServer sends its clients, see StreamClient. Plain data with
+ * fixed sizes in little endian byte order, so other programs can decode it
+ * without this code base.
+ *
+ * Every message is a StreamMessage followed by size bytes. A client first
+ * gets a keyframe, then frames:
+ *
+ *   STREAM_KEYFRAME: StreamKeyframe, then for each body a StreamRestBody
+ *   followed by the body's rest positions, x, y, z floats relative to its
+ *   initial center of mass (PSystem::GetRestPositions()).
+ *
+ *   STREAM_FRAME: StreamFrame, then for each body a StreamBody followed by
+ *   the residuals of its particles, x, y, z signed integers of bits bits,
+ *   padded to 8 bytes.
+ *
+ * Shape matching pulls every particle toward its goal position, which is
+ * the body's goal transform applied to its rest position, see
+ * stream_goal(). A frame only sends the transform and how far each
+ * particle is from its goal, in multiples of quantum. The position is
+ *
+ *   stream_goal(body, rest) + residual * quantum
+ *
+ * Another keyframe is sent when the number of particles of a body changes.
+ * Frames can be skipped when a client can't keep up, each one stands on
+ * its own.
+ */
+
+// "MSST", at the start of every keyframe
+const uint32_t STREAM_MAGIC = 0x5453534d;
+const uint32_t STREAM_VERSION = 1;
+
+enum StreamMessageType
+{
+    STREAM_KEYFRAME = 1,
+    STREAM_FRAME = 2
+};
+
+struct StreamMessage
+{
+    uint32_t type; // StreamMessageType
+    uint32_t size; // Bytes following this header
+};
+
+struct StreamKeyframe
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_bodies;
+    uint32_t padding;
+};
+
+struct StreamRestBody
+{
+    uint32_t num_particles;
+    uint32_t padding;
+};
+
+struct StreamFrame
+{
+    uint64_t frame; // Counts up from 1, skipped frames are missing
+    double time; // get_time() of the simulation when it was sent
+    uint32_t num_bodies;
+    uint32_t padding;
+};
+
+struct StreamBody
+{
+    float com[3]; // Center of mass
+    float rotation[9]; // Rotation from the rest shape, row major
+    float goal[27]; // Goal transform, 3x9 row major, see PSystem::GetSkinTransform()
+    float goal_offset[3];
+    float quantum; // Size of one step of the residuals
+    uint32_t num_particles;
+    uint32_t bits; // 8 or 16
+    uint32_t padding;
+};
+
+/* Bytes of the residuals of a body, with the padding.
+ */
+inline uint32_t stream_residual_size(uint32_t num_particles, uint32_t bits)
+{
+    return (num_particles*3*(bits / 8) + 7) / 8 * 8;
+}
+
+/* The goal position of a particle from its rest position, the same on
+ * both ends of the stream.
+ */
+inline void stream_goal(const StreamBody& body, const float rest[3], float goal[3])
+{
+    const float x = rest[0], y = rest[1], z = rest[2];
+    const float q[9] = { x, y, z, x*x, y*y, z*z, x*y, y*z, z*x };
+    for (int r = 0; r < 3; ++r)
+    {
+        float sum = body.goal_offset[r];
+        for (int c = 0; c < 9; ++c)
+        {
+            sum += body.goal[r*9 + c] * q[c];
+        }
+        goal[r] = sum;
+    }
+}
+
+#endif
@@ -0,0 +1,471 @@
+#include "streamserver.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using std::cerr;
+using std::endl;
+
+/* Turn a socket non-blocking.
+ */
+static bool set_non_blocking(int socket)
+{
+    const int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* True if the address is a port number rather than a path.
+ */
+static bool is_port(const char* address)
+{
+    if (*address == '\0')
+    {
+        return false;
+    }
+    for (const char* c = address; *c != '\0'; ++c)
+    {
+        if (*c < '0' || *c > '9')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Add the bytes of a value to the end of a buffer.
+ */
+template <typename T>
+static void append(std::vector<char>& buffer, const T& value)
+{
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+StreamServer::StreamServer() :
+    m_listener(-1),
+    m_precision(1e-4),
+    m_frame_number(0),
+    m_frame_time(0),
+    m_dropped(0)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+StreamServer::~StreamServer()
+{
+    Close();
+}
+
+//=============================================================================
+// Listen
+//=============================================================================
+
+bool StreamServer::Listen(const char* address)
+{
+    Close();
+
+    const bool tcp = is_port(address);
+    m_listener = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (m_listener < 0)
+    {
+        cerr << "Failed to create a socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    int bound;
+    if (tcp)
+    {
+        const int reuse = 1;
+        setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in any;
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        any.sin_port = htons(atoi(address));
+        bound = bind(m_listener, reinterpret_cast<sockaddr*>(&any), sizeof(any));
+    }
+    else
+    {
+        sockaddr_un path;
+        memset(&path, 0, sizeof(path));
+        path.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(path.sun_path))
+        {
+            cerr << "Socket path too long: " << address << endl;
+            Close();
+            return false;
+        }
+        strcpy(path.sun_path, address);
+
+        // Left behind by an earlier run
+        unlink(address);
+        bound = bind(m_listener, reinterpret_cast<sockaddr*>(&path), sizeof(path));
+        if (bound == 0)
+        {
+            m_path.assign(address, address + strlen(address) + 1);
+        }
+    }
+
+    if (bound != 0 || listen(m_listener, 8) != 0 || !set_non_blocking(m_listener))
+    {
+        cerr << "Failed to listen on " << address << ": " << strerror(errno) << endl;
+        Close();
+        return false;
+    }
+    return true;
+}
+
+//=============================================================================
+// Close
+//=============================================================================
+
+void StreamServer::Close()
+{
+    for (size_t i = 0; i < m_clients.size(); ++i)
+    {
+        close(m_clients[i].socket);
+    }
+    m_clients.clear();
+
+    if (m_listener >= 0)
+    {
+        close(m_listener);
+        m_listener = -1;
+    }
+    if (!m_path.empty())
+    {
+        unlink(&m_path[0]);
+        m_path.clear();
+    }
+}
+
+//=============================================================================
+// SetPrecision
+//=============================================================================
+
+void StreamServer::SetPrecision(real precision)
+{
+    assert(precision > 0);
+    m_precision = precision;
+}
+
+//=============================================================================
+// Poll
+//=============================================================================
+
+void StreamServer::Poll()
+{
+    if (!IsOpen())
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        const int socket = accept(m_listener, NULL, NULL);
+        if (socket < 0)
+        {
+            break;
+        }
+        if (!set_non_blocking(socket))
+        {
+            close(socket);
+            continue;
+        }
+
+        // Positions should go out as soon as they are written, harmless on
+        // UNIX sockets
+        const int no_delay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        Client client;
+        client.socket = socket;
+        client.sent = 0;
+        client.needs_keyframe = true;
+        m_clients.push_back(client);
+    }
+
+    for (size_t i = 0; i < m_clients.size(); )
+    {
+        if (flush(m_clients[i]))
+        {
+            ++i;
+            continue;
+        }
+
+        close(m_clients[i].socket);
+        m_clients[i] = m_clients.back();
+        m_clients.pop_back();
+    }
+}
+
+//=============================================================================
+// BeginFrame
+//=============================================================================
+
+bool StreamServer::BeginFrame(double time, size_t num_bodies)
+{
+    Poll();
+
+    bool any_ready = false;
+    for (size_t i = 0; i < m_clients.size(); ++i)
+    {
+        any_ready |= m_clients[i].pending.empty();
+    }
+    if (!any_ready)
+    {
+        m_dropped += m_clients.size();
+        return false;
+    }
+
+    // The keyframe lists every body
+    if (num_bodies != m_bodies.size())
+    {
+        m_keyframe.clear();
+    }
+
+    ++m_frame_number;
+    m_frame_time = time;
+    m_bodies.resize(num_bodies);
+    return true;
+}
+
+//=============================================================================
+// WriteBody
+//=============================================================================
+
+void StreamServer::WriteBody(size_t body, const PSystem& psys)
+{
+    assert(body < m_bodies.size());
+
+    Encoded& out = m_bodies[body];
+    const size_t num_particles = psys.GetNumParticles();
+    const ParticleArray& positions = psys.GetPositionArray();
+    const fmath::vec3* rest = psys.GetRestPositions();
+
+    // Clients only need the rest shape again if it changed
+    out.rest_changed = out.rest.size() != 3*num_particles;
+    if (out.rest_changed)
+    {
+        out.rest.resize(3*num_particles);
+        for (size_t i = 0; i < num_particles; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                out.rest[3*i + j] = rest[i](j);
+            }
+        }
+    }
+
+    StreamBody header;
+    memset(&header, 0, sizeof(header));
+    const dlib::vec3 com = psys.GetCOM();
+    const fmath::mat3& rotation = psys.GetRotation();
+    const PSystem::SkinTransform& skin = psys.GetSkinTransform();
+    for (int r = 0; r < 3; ++r)
+    {
+        header.com[r] = com(r);
+        header.goal_offset[r] = skin.offset(r);
+        for (int c = 0; c < 3; ++c)
+        {
+            header.rotation[r*3 + c] = rotation(r, c);
+        }
+        for (int c = 0; c < 9; ++c)
+        {
+            header.goal[r*9 + c] = skin.matrix(r, c);
+        }
+    }
+    header.num_particles = num_particles;
+
+    // How far each particle is from its goal, the goals are found the same
+    // way the client will
+    out.residuals.resize(3*num_particles);
+    float max_residual = 0;
+    for (size_t i = 0; i < num_particles; ++i)
+    {
+        float goal[3];
+        stream_goal(header, &out.rest[3*i], goal);
+        for (int j = 0; j < 3; ++j)
+        {
+            const float residual = positions[i](j) - goal[j];
+            out.residuals[3*i + j] = residual;
+            max_residual = std::max(max_residual, std::fabs(residual));
+        }
+    }
+
+    // One byte per coordinate if the body stays close to its goals
+    const float precision = m_precision;
+    header.bits = max_residual <= 127*precision ? 8 : 16;
+    header.quantum = header.bits == 8 ? precision : std::max(precision, max_residual / 32767);
+    const float limit = header.bits == 8 ? 127 : 32767;
+
+    out.data.clear();
+    append(out.data, header);
+    const size_t start = out.data.size();
+    out.data.resize(start + stream_residual_size(num_particles, header.bits), 0);
+    int8_t* bytes = reinterpret_cast<int8_t*>(&out.data[start]);
+    int16_t* shorts = reinterpret_cast<int16_t*>(&out.data[start]);
+    const float scale = 1 / header.quantum;
+    for (size_t i = 0; i < 3*num_particles; ++i)
+    {
+        // NaN ends up at the limit too
+        float steps = std::floor(out.residuals[i] * scale + 0.5f);
+        if (!(steps > -limit)) steps = -limit;
+        if (steps > limit) steps = limit;
+
+        if (header.bits == 8)
+        {
+            bytes[i] = static_cast<int8_t>(steps);
+        }
+        else
+        {
+            shorts[i] = static_cast<int16_t>(steps);
+        }
+    }
+}
+
+//=============================================================================
+// EndFrame
+//=============================================================================
+
+void StreamServer::EndFrame()
+{
+    StreamFrame header;
+    memset(&header, 0, sizeof(header));
+    header.frame = m_frame_number;
+    header.time = m_frame_time;
+    header.num_bodies = m_bodies.size();
+
+    m_frame.clear();
+    append(m_frame, header);
+    bool rest_changed = false;
+    for (size_t i = 0; i < m_bodies.size(); ++i)
+    {
+        m_frame.insert(m_frame.end(), m_bodies[i].data.begin(), m_bodies[i].data.end());
+        rest_changed |= m_bodies[i].rest_changed;
+    }
+
+    // Everybody needs the new rest shape before the next frame they get
+    if (rest_changed || m_keyframe.empty())
+    {
+        build_keyframe();
+        for (size_t i = 0; i < m_clients.size(); ++i)
+        {
+            m_clients[i].needs_keyframe = true;
+        }
+    }
+
+    // Clients still sending an earlier frame skip this one
+    for (size_t i = 0; i < m_clients.size(); ++i)
+    {
+        Client& client = m_clients[i];
+        if (!client.pending.empty())
+        {
+            ++m_dropped;
+            continue;
+        }
+
+        if (client.needs_keyframe)
+        {
+            append_message(client.pending, STREAM_KEYFRAME, m_keyframe);
+            client.needs_keyframe = false;
+        }
+        append_message(client.pending, STREAM_FRAME, m_frame);
+    }
+
+    Poll();
+}
+
+//=============================================================================
+// build_keyframe
+//=============================================================================
+
+void StreamServer::build_keyframe()
+{
+    StreamKeyframe header;
+    memset(&header, 0, sizeof(header));
+    header.magic = STREAM_MAGIC;
+    header.version = STREAM_VERSION;
+    header.num_bodies = m_bodies.size();
+
+    m_keyframe.clear();
+    append(m_keyframe, header);
+    for (size_t i = 0; i < m_bodies.size(); ++i)
+    {
+        const std::vector<float>& rest = m_bodies[i].rest;
+        StreamRestBody body;
+        memset(&body, 0, sizeof(body));
+        body.num_particles = rest.size() / 3;
+        append(m_keyframe, body);
+
+        const char* bytes = reinterpret_cast<const char*>(rest.empty() ? NULL : &rest[0]);
+        m_keyframe.insert(m_keyframe.end(), bytes, bytes + rest.size()*sizeof(float));
+    }
+}
+
+//=============================================================================
+// append_message
+//=============================================================================
+
+void StreamServer::append_message(std::vector<char>& buffer, StreamMessageType type,
+                                  const std::vector<char>& payload)
+{
+    StreamMessage message;
+    message.type = type;
+    message.size = payload.size();
+    append(buffer, message);
+    buffer.insert(buffer.end(), payload.begin(), payload.end());
+}
+
+//=============================================================================
+// flush
+//=============================================================================
+
+bool StreamServer::flush(Client& client)
+{
+    while (client.sent < client.pending.size())
+    {
+        const ssize_t sent = send(client.socket, &client.pending[client.sent],
+                                  client.pending.size() - client.sent,
+                                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        client.sent += sent;
+    }
+
+    client.pending.clear();
+    client.sent = 0;
+    return true;
+}
+
+//=============================================================================
+//
+//=============================================================================
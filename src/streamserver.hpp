@@ -0,0 +1,152 @@
+#ifndef __STREAM_SERVER_HPP__
+#define __STREAM_SERVER_HPP__
+
+#include "defs.hpp"
+#include "psystem.hpp"
+#include "streamprotocol.hpp"
+
+#include <vector>
+
+/* Streams the bodies of a running simulation to clients over TCP or a
+ * UNIX socket, see streamprotocol.hpp for what is sent and StreamClient
+ * for receiving it. Instead of every position, a frame holds each body's
+ * goal transform and the small distance of every particle from its goal,
+ * quantized to one or two bytes per coordinate.
+ *
+ *   server.Listen("7000");
+ *   ...
+ *   server.Poll();
+ *   if (server.BeginFrame(get_time(), bodies.size()))
+ *   {
+ *       for each body
+ *           server.WriteBody(i, *bodies[i]);
+ *       server.EndFrame();
+ *   }
+ *
+ * Nothing ever blocks. A client that is still receiving an earlier frame
+ * skips the new one, and if no client can take a frame it isn't encoded
+ * at all.
+ */
+class StreamServer
+{
+public:
+    StreamServer();
+
+    /* Disconnects every client.
+     */
+    ~StreamServer();
+
+    /* Start taking clients.
+     *
+     * Params:
+     *   address - A port number for TCP on every interface, otherwise the
+     *             path of a UNIX socket
+     *
+     * Returns:
+     *   False if the socket couldn't be created.
+     */
+    bool Listen(const char* address);
+
+    /* Disconnect every client and stop listening.
+     */
+    void Close();
+
+    bool IsOpen() const
+    {
+        return m_listener >= 0;
+    }
+
+    /* The step size of the residuals, the sent positions are off by at
+     * most half of it. The default is 1e-4, larger values fit more bodies
+     * in one byte per coordinate. Residuals that don't fit in two bytes
+     * get larger steps.
+     */
+    void SetPrecision(real precision);
+
+    /* Take new clients and send what is waiting, call often.
+     */
+    void Poll();
+
+    /* Start a frame of num_bodies bodies.
+     *
+     * Returns:
+     *   False if no client can take a frame, the frame is skipped and
+     *   WriteBody() and EndFrame() must not be called.
+     */
+    bool BeginFrame(double time, size_t num_bodies);
+
+    /* Encode one body of the frame. Different bodies can be written at the
+     * same time from different threads.
+     */
+    void WriteBody(size_t body, const PSystem& psys);
+
+    /* Send the frame to every client that can take it.
+     */
+    void EndFrame();
+
+    /* Frames skipped by a client because it was still busy, over all
+     * clients.
+     */
+    unsigned long GetDroppedFrames() const
+    {
+        return m_dropped;
+    }
+
+    size_t GetNumClients() const
+    {
+        return m_clients.size();
+    }
+
+private:
+    struct Client
+    {
+        int socket;
+        std::vector<char> pending; // Messages still to send
+        size_t sent; // Bytes of pending already sent
+        bool needs_keyframe; // Joined or the bodies changed since its last keyframe
+    };
+
+    /* What WriteBody() made of one body.
+     */
+    struct Encoded
+    {
+        std::vector<char> data; // StreamBody and residuals
+        std::vector<float> rest; // Rest positions, for keyframes
+        std::vector<float> residuals; // Before quantizing
+        bool rest_changed; // rest was rebuilt by this frame
+    };
+
+    // Not copyable
+    StreamServer(const StreamServer&);
+    StreamServer& operator=(const StreamServer&);
+
+    /* Send as much of a client's pending messages as the socket takes.
+     *
+     * Returns:
+     *   False if the client is gone.
+     */
+    bool flush(Client& client);
+
+    /* Add a message to the end of a buffer.
+     */
+    static void append_message(std::vector<char>& buffer, StreamMessageType type,
+                               const std::vector<char>& payload);
+
+    /* Build m_keyframe from the rest positions of every body.
+     */
+    void build_keyframe();
+
+private:
+    int m_listener; // -1 while closed
+    std::vector<char> m_path; // UNIX socket file, removed by Close()
+    real m_precision; // See SetPrecision()
+    std::vector<Client> m_clients;
+    std::vector<Encoded> m_bodies;
+    std::vector<char> m_frame; // Payload of the frame being sent
+    std::vector<char> m_keyframe; // Payload of the current keyframe
+    uint64_t m_frame_number; // Last frame started
+    double m_frame_time;
+    unsigned long m_dropped; // See GetDroppedFrames()
+};
+
+#endif
@@ -0,0 +1,410 @@
+#include "taskgraph.hpp"
+
+#include <cassert>
+
+//=============================================================================
+// TaskGraph
+//=============================================================================
+
+TaskGraph::TaskGraph()
+{ }
+
+size_t TaskGraph::Add(Function function, void* data, size_t index, int thread)
+{
+    assert(function != NULL);
+
+    Task task;
+    task.function = function;
+    task.data = data;
+    task.index = index;
+    task.thread = thread;
+    task.first_successor = 0;
+    task.num_successors = 0;
+    task.pending = 0;
+    m_tasks.push_back(task);
+    return m_tasks.size() - 1;
+}
+
+void TaskGraph::AddDependency(size_t before, size_t after)
+{
+    assert(before < after);
+    assert(after < m_tasks.size());
+
+    m_edges.push_back(std::make_pair(before, after));
+}
+
+void TaskGraph::Clear()
+{
+    m_tasks.clear();
+    m_edges.clear();
+    m_successors.clear();
+    m_roots.clear();
+}
+
+void TaskGraph::prepare()
+{
+    for (size_t i = 0; i < m_tasks.size(); ++i)
+    {
+        m_tasks[i].num_successors = 0;
+        m_tasks[i].pending = 0;
+    }
+
+    // Count, then lay the successor lists out one after another
+    for (size_t i = 0; i < m_edges.size(); ++i)
+    {
+        ++m_tasks[m_edges[i].first].num_successors;
+        ++m_tasks[m_edges[i].second].pending;
+    }
+
+    size_t first = 0;
+    for (size_t i = 0; i < m_tasks.size(); ++i)
+    {
+        m_tasks[i].first_successor = first;
+        first += m_tasks[i].num_successors;
+        m_tasks[i].num_successors = 0;
+    }
+
+    m_successors.resize(m_edges.size());
+    for (size_t i = 0; i < m_edges.size(); ++i)
+    {
+        Task& before = m_tasks[m_edges[i].first];
+        m_successors[before.first_successor + before.num_successors++] = m_edges[i].second;
+    }
+    m_roots.clear();
+    for (size_t i = 0; i < m_tasks.size(); ++i)
+    {
+        if (m_tasks[i].pending == 0)
+        {
+            m_roots.push_back(i);
+        }
+    }
+}
+
+//=============================================================================
+// TaskPool::Worker
+//=============================================================================
+
+class TaskPool::Worker : public Thread
+{
+public:
+    Worker(TaskPool& pool, size_t queue, int cpu) :
+        m_pool(pool),
+        m_queue(queue),
+        m_cpu(cpu)
+    { }
+
+protected:
+    void Run()
+    {
+        if (m_cpu >= 0)
+        {
+            pin_thread(m_cpu);
+        }
+        m_pool.work(m_queue);
+    }
+
+private:
+    TaskPool& m_pool;
+    size_t m_queue; // Index of the worker's own queue
+    int m_cpu; // Processor to stay on, -1 for any
+};
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+TaskPool::TaskPool() :
+    m_graph(NULL),
+    m_remaining(0),
+    m_queued(0),
+    m_quit(false)
+{
+    // Run() always has a queue, even without workers
+    m_queues.push_back(new Queue());
+}
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+TaskPool::~TaskPool()
+{
+    assert(m_workers.empty());
+
+    for (size_t i = 0; i < m_queues.size(); ++i)
+    {
+        delete m_queues[i];
+    }
+}
+
+//=============================================================================
+// Start
+//=============================================================================
+
+int TaskPool::Start(int num_workers, bool pin)
+{
+    assert(m_workers.empty());
+
+    // The queues must all exist before any worker looks for one to steal
+    // from. Queues of workers that fail to start are emptied by stealing.
+    for (int i = 0; i < num_workers; ++i)
+    {
+        m_queues.insert(m_queues.begin(), new Queue());
+    }
+
+    m_quit = false;
+    const int num_cpus = get_num_cpus();
+    for (int i = 0; i < num_workers; ++i)
+    {
+        const int cpu = pin ? i % num_cpus : -1;
+        Worker* worker = new Worker(*this, i, cpu);
+        if (!worker->Start())
+        {
+            delete worker;
+            break;
+        }
+        m_workers.push_back(worker);
+        m_nodes.push_back(pin ? get_cpu_node(cpu) : 0);
+    }
+
+    return static_cast<int>(m_workers.size());
+}
+
+//=============================================================================
+// Stop
+//=============================================================================
+
+void TaskPool::Stop()
+{
+    {
+        ScopedLock lock(m_mutex);
+        m_quit = true;
+        m_wake.Broadcast();
+    }
+
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i]->Join();
+        delete m_workers[i];
+    }
+    m_workers.clear();
+    m_nodes.clear();
+
+    // Keep only the queue of Run()
+    for (size_t i = 0; i + 1 < m_queues.size(); ++i)
+    {
+        delete m_queues[i];
+    }
+    m_queues.erase(m_queues.begin(), m_queues.end() - 1);
+}
+
+//=============================================================================
+// GetThreadNode
+//=============================================================================
+
+int TaskPool::GetThreadNode(int thread) const
+{
+    assert(thread >= 0 && thread < GetNumThreads());
+    return thread < static_cast<int>(m_nodes.size()) ? m_nodes[thread] : 0;
+}
+
+//=============================================================================
+// Run
+//=============================================================================
+
+void TaskPool::Run(TaskGraph& graph)
+{
+    if (graph.m_tasks.empty())
+    {
+        return;
+    }
+
+    graph.prepare();
+    m_graph = &graph;
+    atomic::store(&m_remaining, static_cast<int>(graph.m_tasks.size()));
+
+    // Spread the tasks that can start right away over every thread. The
+    // pending counts change as soon as the first one is queued.
+    for (size_t i = 0; i < graph.m_roots.size(); ++i)
+    {
+        push(i % m_queues.size(), graph.m_roots[i]);
+    }
+    notify();
+
+    const size_t own = m_queues.size() - 1;
+    while (atomic::load(&m_remaining) > 0)
+    {
+        if (run_one(own))
+        {
+            continue;
+        }
+
+        // Everything left is running on other threads
+        ScopedLock lock(m_mutex);
+        while (atomic::load(&m_remaining) > 0 && idle(own))
+        {
+            m_wake.Wait(m_mutex);
+        }
+    }
+
+    m_graph = NULL;
+}
+
+//=============================================================================
+// work
+//=============================================================================
+
+void TaskPool::work(size_t queue)
+{
+    for (;;)
+    {
+        if (run_one(queue))
+        {
+            continue;
+        }
+
+        ScopedLock lock(m_mutex);
+        while (!m_quit && idle(queue))
+        {
+            m_wake.Wait(m_mutex);
+        }
+
+        if (m_quit)
+        {
+            return;
+        }
+    }
+}
+
+//=============================================================================
+// run_one
+//=============================================================================
+
+bool TaskPool::run_one(size_t queue)
+{
+    // Our own tasks first, then the oldest of the next queue that has one
+    size_t task = 0;
+    bool found = take(queue, true, task);
+    for (size_t i = 1; i < m_queues.size() && !found; ++i)
+    {
+        found = take((queue + i) % m_queues.size(), false, task);
+    }
+
+    if (found)
+    {
+        execute(queue, task);
+    }
+    return found;
+}
+
+//=============================================================================
+// take
+//=============================================================================
+
+bool TaskPool::take(size_t queue, bool owner, size_t& task)
+{
+    Queue& from = *m_queues[queue];
+    ScopedLock lock(from.mutex);
+    if (owner && !from.bound.empty())
+    {
+        task = from.bound.front();
+        from.bound.pop_front();
+        atomic::fetch_add(&from.num_bound, -1);
+        return true;
+    }
+
+    if (from.tasks.empty())
+    {
+        return false;
+    }
+
+    if (owner)
+    {
+        task = from.tasks.back();
+        from.tasks.pop_back();
+    }
+    else
+    {
+        task = from.tasks.front();
+        from.tasks.pop_front();
+    }
+    atomic::fetch_add(&m_queued, -1);
+    return true;
+}
+
+//=============================================================================
+// idle
+//=============================================================================
+
+bool TaskPool::idle(size_t queue) const
+{
+    return atomic::load(&m_queued) == 0 && atomic::load(&m_queues[queue]->num_bound) == 0;
+}
+
+//=============================================================================
+// execute
+//=============================================================================
+
+void TaskPool::execute(size_t queue, size_t task)
+{
+    TaskGraph& graph = *m_graph;
+    const TaskGraph::Task& current = graph.m_tasks[task];
+    current.function(current.data, current.index);
+
+    bool queued = false;
+    for (size_t i = 0; i < current.num_successors; ++i)
+    {
+        const size_t next = graph.m_successors[current.first_successor + i];
+        if (atomic::fetch_add(&graph.m_tasks[next].pending, -1) == 1)
+        {
+            push(queue, next);
+            queued = true;
+        }
+    }
+
+    // The graph may be gone once the last task is counted
+    const bool last = atomic::fetch_add(&m_remaining, -1) == 1;
+    if (queued || last)
+    {
+        notify();
+    }
+}
+
+//=============================================================================
+// push
+//=============================================================================
+
+void TaskPool::push(size_t queue, size_t task)
+{
+    const int thread = m_graph->m_tasks[task].thread;
+    if (thread != TaskGraph::ANY_THREAD)
+    {
+        // The last thread is the caller of Run(), whose queue comes after
+        // those of any workers that failed to start
+        const size_t owner = thread % GetNumThreads();
+        Queue& to = *m_queues[owner < m_workers.size() ? owner : m_queues.size() - 1];
+        ScopedLock lock(to.mutex);
+        to.bound.push_back(task);
+        atomic::fetch_add(&to.num_bound, 1);
+        return;
+    }
+
+    Queue& to = *m_queues[queue];
+    ScopedLock lock(to.mutex);
+    to.tasks.push_back(task);
+    atomic::fetch_add(&m_queued, 1);
+}
+
+//=============================================================================
+// notify
+//=============================================================================
+
+void TaskPool::notify()
+{
+    ScopedLock lock(m_mutex);
+    m_wake.Broadcast();
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,219 @@
+#ifndef __TASK_GRAPH_HPP__
+#define __TASK_GRAPH_HPP__
+
+#include "thread.hpp"
+#include "atomic.hpp"
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+/* A set of jobs with dependencies between them, run by a TaskPool. A task
+ * starts once every task it depends on has finished, tasks without a path
+ * between them may run at the same time on different threads.
+ *
+ *   TaskGraph graph;
+ *   const size_t prepare = graph.Add(prepare_step, &state);
+ *   for (size_t i = 0; i < bodies.size(); ++i)
+ *       graph.AddDependency(prepare, graph.Add(step_body, &state, i));
+ *   pool.Run(graph);
+ *
+ * Dependencies always point from an earlier task to a later one, so a
+ * graph can't have cycles. Clear() keeps the memory, so a graph can be
+ * rebuilt every frame without allocating.
+ *
+ * A task can be bound to one thread of the pool, for work on memory that
+ * thread touched first. Bound tasks are never stolen.
+ */
+class TaskGraph
+{
+public:
+    /* The work of a task, called with the data and index it was added with.
+     */
+    typedef void (*Function)(void* data, size_t index);
+
+    // Thread for tasks that can run anywhere
+    static const int ANY_THREAD = -1;
+
+    TaskGraph();
+
+    /* Add a task.
+     *
+     * Params:
+     *   thread - Only run on this thread of the pool, see
+     *            TaskPool::GetNumThreads()
+     *
+     * Returns:
+     *   The id of the task, for AddDependency().
+     */
+    size_t Add(Function function, void* data, size_t index = 0,
+               int thread = ANY_THREAD);
+
+    /* Don't start after until before has finished. before must have been
+     * added first.
+     */
+    void AddDependency(size_t before, size_t after);
+
+    /* Remove every task and dependency.
+     */
+    void Clear();
+
+    size_t GetNumTasks() const
+    {
+        return m_tasks.size();
+    }
+
+private:
+    friend class TaskPool;
+
+    struct Task
+    {
+        Function function;
+        void* data;
+        size_t index;
+        int thread; // See Add()
+        size_t first_successor; // Successors are in m_successors from here
+        size_t num_successors;
+        int pending; // Unfinished tasks this one depends on, while running
+    };
+
+    /* Build the successor lists, pending counts and m_roots from m_edges.
+     * Called by TaskPool::Run().
+     */
+    void prepare();
+
+private:
+    std::vector<Task> m_tasks;
+    std::vector<std::pair<size_t, size_t> > m_edges; // before, after
+    std::vector<size_t> m_successors; // Tasks waiting on each task, by task
+    std::vector<size_t> m_roots; // Tasks without dependencies
+};
+
+/* Worker threads that run TaskGraphs. Every thread, including the one
+ * calling Run(), has its own queue of ready tasks. Tasks made ready by a
+ * finished task go onto the queue of the thread that ran it, which takes
+ * the newest one first while it is still in the cache. A thread whose
+ * queue is empty steals the oldest task from another queue.
+ *
+ *   TaskPool pool;
+ *   pool.Start(get_num_cpus() - 1);
+ *   ...
+ *   pool.Run(graph);
+ *   ...
+ *   pool.Stop();
+ *
+ * Only one thread may call Run() at a time.
+ */
+class TaskPool
+{
+public:
+    TaskPool();
+
+    /* Stop() must have been called if the pool was started.
+     */
+    ~TaskPool();
+
+    /* Start the worker threads. With no workers Run() does everything on
+     * the calling thread.
+     *
+     * Params:
+     *   pin - Keep worker i on processor i, so the memory it touches first
+     *         stays on its NUMA node
+     *
+     * Returns:
+     *   The number of workers that could be started.
+     */
+    int Start(int num_workers, bool pin = false);
+
+    /* Wait for the workers to finish and end them.
+     */
+    void Stop();
+
+    /* Run every task of a graph, the calling thread helps. Returns once
+     * they have all finished.
+     */
+    void Run(TaskGraph& graph);
+
+    /* The number of threads that run tasks. Threads 0 to
+     * GetNumThreads() - 2 are the workers, the last one is the caller of
+     * Run().
+     */
+    int GetNumThreads() const
+    {
+        return static_cast<int>(m_workers.size()) + 1;
+    }
+
+    /* The NUMA node of a pinned worker, 0 for other threads or if the
+     * system doesn't say.
+     */
+    int GetThreadNode(int thread) const;
+
+private:
+    class Worker;
+
+    /* The ready tasks of one thread, on their own cache lines.
+     */
+    struct Queue
+    {
+        Queue() : num_bound(0) {}
+
+        Mutex mutex;
+        std::deque<size_t> tasks; // The owner takes from the back, thieves from the front
+        std::deque<size_t> bound; // Tasks only the owner may run, oldest first
+        int num_bound; // Size of bound, read without the mutex
+        char padding[CACHE_LINE_SIZE];
+    };
+
+    // Not copyable
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+
+    /* Run tasks until Stop() is called, on worker thread queue.
+     */
+    void work(size_t queue);
+
+    /* Take a task from the queue, or steal one from another, and run it.
+     *
+     * Returns:
+     *   False if no task was ready.
+     */
+    bool run_one(size_t queue);
+
+    /* Take a task of a queue: for the owner a bound one or the newest,
+     * otherwise the oldest that isn't bound.
+     *
+     * Returns:
+     *   False if there was none.
+     */
+    bool take(size_t queue, bool owner, size_t& task);
+
+    /* True if the thread of a queue has nothing to run. Call with m_mutex
+     * locked.
+     */
+    bool idle(size_t queue) const;
+
+    /* Run a task and queue the tasks it made ready on queue.
+     */
+    void execute(size_t queue, size_t task);
+
+    /* Queue a ready task on queue, or on its own thread's if it is bound.
+     */
+    void push(size_t queue, size_t task);
+
+    /* Wake every thread waiting for tasks or for Run() to finish.
+     */
+    void notify();
+
+private:
+    std::vector<Worker*> m_workers;
+    std::vector<Queue*> m_queues; // One per worker, the last one for Run()
+    std::vector<int> m_nodes; // NUMA node of each worker
+    TaskGraph* m_graph; // The graph being run
+    int m_remaining; // Tasks of m_graph that haven't finished
+    int m_queued; // Tasks that aren't bound waiting in all the queues
+    bool m_quit; // Set by Stop(), guarded by m_mutex
+    Mutex m_mutex; // Guards sleeping on m_wake
+    Condition m_wake; // Signalled when tasks are queued or the graph is done
+};
+
+#endif
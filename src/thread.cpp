@@ -0,0 +1,142 @@
+#include "thread.hpp"
+
+#include <ctime>
+#include <cerrno>
+#include <cstdio>
+#include <cassert>
+#include <sched.h>
+#include <unistd.h>
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+Thread::Thread() :
+    m_thread(),
+    m_running(false)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+Thread::~Thread()
+{
+    // Run() would be called on a destroyed object otherwise
+    assert(!m_running);
+}
+
+//=============================================================================
+// Start
+//=============================================================================
+
+bool Thread::Start()
+{
+    assert(!m_running);
+
+    m_running = pthread_create(&m_thread, NULL, &Thread::entry, this) == 0;
+    return m_running;
+}
+
+//=============================================================================
+// Join
+//=============================================================================
+
+void Thread::Join()
+{
+    if (m_running)
+    {
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+}
+
+//=============================================================================
+// entry
+//=============================================================================
+
+void* Thread::entry(void* self)
+{
+    static_cast<Thread*>(self)->Run();
+    return NULL;
+}
+
+//=============================================================================
+// get_time
+//=============================================================================
+
+double get_time()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//=============================================================================
+// sleep_for
+//=============================================================================
+
+void sleep_for(double seconds)
+{
+    if (seconds <= 0)
+    {
+        return;
+    }
+
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(seconds);
+    ts.tv_nsec = static_cast<long>((seconds - ts.tv_sec) * 1e9);
+
+    // Keep sleeping for the remainder if a signal woke us up
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    { }
+}
+
+//=============================================================================
+// get_num_cpus
+//=============================================================================
+
+int get_num_cpus()
+{
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? static_cast<int>(count) : 1;
+}
+
+//=============================================================================
+// pin_thread
+//=============================================================================
+
+bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+//=============================================================================
+// get_cpu_node
+//=============================================================================
+
+// More nodes than any machine this runs on
+static const int MAX_NODES = 64;
+
+int get_cpu_node(int cpu)
+{
+    // Each node's directory has a link to every processor in it
+    for (int node = 0; node < MAX_NODES; ++node)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+        if (access(path, F_OK) == 0)
+        {
+            return node;
+        }
+    }
+
+    return 0;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,208 @@
+#ifndef __THREAD_HPP__
+#define __THREAD_HPP__
+
+#include <pthread.h>
+
+/* Thin wrapper around a POSIX thread. Derive from this class and implement
+ * Run(), then call Start() to run it on a new thread.
+ *
+ *   class Worker : public Thread
+ *   {
+ *   protected:
+ *       void Run() { ... }
+ *   };
+ *
+ *   Worker w;
+ *   w.Start();
+ *   ...
+ *   w.Join();
+ *
+ * The thread must be joined before the object is destroyed.
+ */
+class Thread
+{
+public:
+    /* Doesn't start the thread, see Start().
+     */
+    Thread();
+
+    /* The thread must not be running anymore.
+     */
+    virtual ~Thread();
+
+    /* Create the thread and call Run() on it.
+     *
+     * Returns:
+     *   True if the thread was created, false otherwise.
+     */
+    bool Start();
+
+    /* Wait for Run() to return. Does nothing if the thread was never
+     * started.
+     */
+    void Join();
+
+    /* Check if the thread has been started and not joined yet.
+     */
+    bool IsRunning() const
+    {
+        return m_running;
+    }
+
+protected:
+    /* The work done on the new thread.
+     */
+    virtual void Run() = 0;
+
+private:
+    /* pthread entry point, calls Run().
+     */
+    static void* entry(void* self);
+
+    // Not copyable
+    Thread(const Thread&);
+    Thread& operator=(const Thread&);
+
+private:
+    pthread_t m_thread; // Handle of the running thread
+    bool m_running; // True between Start() and Join()
+};
+
+/* A POSIX mutex, usually locked through a ScopedLock.
+ */
+class Mutex
+{
+public:
+    Mutex()
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~Mutex()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    void Lock()
+    {
+        pthread_mutex_lock(&m_mutex);
+    }
+
+    void Unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    friend class Condition;
+
+    // Not copyable
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+private:
+    pthread_mutex_t m_mutex;
+};
+
+/* A POSIX condition variable, for sleeping until another thread changes
+ * something guarded by a mutex.
+ *
+ *   ScopedLock lock(mutex);
+ *   while (!ready)
+ *       condition.Wait(mutex);
+ */
+class Condition
+{
+public:
+    Condition()
+    {
+        pthread_cond_init(&m_condition, NULL);
+    }
+
+    ~Condition()
+    {
+        pthread_cond_destroy(&m_condition);
+    }
+
+    /* Unlock the mutex, which must be locked, and sleep until woken. The
+     * mutex is locked again before returning. May wake up spuriously.
+     */
+    void Wait(Mutex& mutex)
+    {
+        pthread_cond_wait(&m_condition, &mutex.m_mutex);
+    }
+
+    /* Wake every waiting thread.
+     */
+    void Broadcast()
+    {
+        pthread_cond_broadcast(&m_condition);
+    }
+
+private:
+    // Not copyable
+    Condition(const Condition&);
+    Condition& operator=(const Condition&);
+
+private:
+    pthread_cond_t m_condition;
+};
+
+/* Holds a mutex locked for as long as it is in scope.
+ *
+ *   {
+ *       ScopedLock lock(mutex);
+ *       ...
+ *   }
+ */
+class ScopedLock
+{
+public:
+    ScopedLock(Mutex& mutex) :
+        m_mutex(mutex)
+    {
+        m_mutex.Lock();
+    }
+
+    ~ScopedLock()
+    {
+        m_mutex.Unlock();
+    }
+
+private:
+    // Not copyable
+    ScopedLock(const ScopedLock&);
+    ScopedLock& operator=(const ScopedLock&);
+
+private:
+    Mutex& m_mutex;
+};
+
+/* Get a monotonic time in seconds, usable from any thread.
+ */
+double get_time();
+
+/* Put the calling thread to sleep.
+ *
+ * Params:
+ *   seconds - How long to sleep, values <= 0 return immediately
+ */
+void sleep_for(double seconds);
+
+/* The number of processors currently online, at least 1.
+ */
+int get_num_cpus();
+
+/* Keep the calling thread on one processor, so the memory it touches
+ * first stays on that processor's NUMA node.
+ *
+ * Returns:
+ *   False if the thread couldn't be pinned.
+ */
+bool pin_thread(int cpu);
+
+/* The NUMA node a processor belongs to, 0 if the system doesn't say.
+ */
+int get_cpu_node(int cpu);
+
+#endif
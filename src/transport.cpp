@@ -0,0 +1,359 @@
+#include "transport.hpp"
+#include "thread.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::cerr;
+using std::endl;
+
+/* Sent before the values of every reduction, so ranks that got out of
+ * step are noticed instead of adding up the wrong values.
+ */
+struct MessageHeader
+{
+    int operation;
+    unsigned int count;
+};
+
+/* Write or read all of size bytes, the socket may take them in pieces.
+ */
+static bool send_all(int socket, const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        const ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int socket, void* data, size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+        const ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+/* Fill in the address of a socket file.
+ *
+ * Returns:
+ *   False if the path is too long for one.
+ */
+static bool make_address(const char* path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        cerr << "Socket path too long: " << path << endl;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    return true;
+}
+
+//=============================================================================
+// Constructor
+//=============================================================================
+
+SocketTransport::SocketTransport() :
+    m_rank(0),
+    m_num_ranks(1),
+    m_listener(-1)
+{ }
+
+//=============================================================================
+// Destructor
+//=============================================================================
+
+SocketTransport::~SocketTransport()
+{
+    Close();
+}
+
+//=============================================================================
+// Connect
+//=============================================================================
+
+bool SocketTransport::Connect(const char* path, int rank, int num_ranks, double timeout)
+{
+    assert(num_ranks >= 1);
+    assert(rank >= 0 && rank < num_ranks);
+
+    Close();
+    m_rank = rank;
+    m_num_ranks = num_ranks;
+    if (num_ranks == 1)
+    {
+        return true;
+    }
+
+    const bool connected = rank == 0 ? accept_ranks(path, timeout) :
+                                       connect_to_root(path, timeout);
+    if (!connected)
+    {
+        Close();
+    }
+    return connected;
+}
+
+//=============================================================================
+// Close
+//=============================================================================
+
+void SocketTransport::Close()
+{
+    for (size_t i = 0; i < m_sockets.size(); ++i)
+    {
+        if (m_sockets[i] >= 0)
+        {
+            close(m_sockets[i]);
+        }
+    }
+    m_sockets.clear();
+
+    if (m_listener >= 0)
+    {
+        close(m_listener);
+        m_listener = -1;
+    }
+    if (!m_path.empty())
+    {
+        unlink(&m_path[0]);
+        m_path.clear();
+    }
+
+    m_rank = 0;
+    m_num_ranks = 1;
+}
+
+//=============================================================================
+// accept_ranks
+//=============================================================================
+
+bool SocketTransport::accept_ranks(const char* path, double timeout)
+{
+    sockaddr_un address;
+    if (!make_address(path, address))
+    {
+        return false;
+    }
+
+    // A socket file left behind by an earlier run would fail the bind
+    unlink(path);
+    m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listener < 0 ||
+        bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        cerr << "Failed to create socket " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    m_path.assign(path, path + strlen(path) + 1);
+
+    if (listen(m_listener, m_num_ranks) != 0)
+    {
+        cerr << "Failed to listen on socket " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // The ranks connect in any order and say which one they are
+    m_sockets.assign(m_num_ranks, -1);
+    const double give_up = get_time() + timeout;
+    for (int connected = 1; connected < m_num_ranks; )
+    {
+        pollfd wait;
+        wait.fd = m_listener;
+        wait.events = POLLIN;
+        const int left_ms = static_cast<int>((give_up - get_time()) * 1000);
+        const int ready = left_ms > 0 ? poll(&wait, 1, left_ms) : 0;
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            cerr << "Timed out waiting for ranks on " << path << endl;
+            return false;
+        }
+
+        const int peer = accept(m_listener, NULL, NULL);
+        if (peer < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << "Failed to accept a rank: " << strerror(errno) << endl;
+            return false;
+        }
+
+        int rank = -1;
+        if (!receive_all(peer, &rank, sizeof(rank)) || rank <= 0 ||
+            rank >= m_num_ranks || m_sockets[rank] >= 0)
+        {
+            cerr << "Rejected a connection with a bad rank on " << path << endl;
+            close(peer);
+            continue;
+        }
+        m_sockets[rank] = peer;
+        ++connected;
+    }
+
+    // Nobody else needs to find it
+    close(m_listener);
+    m_listener = -1;
+    unlink(&m_path[0]);
+    m_path.clear();
+    return true;
+}
+
+//=============================================================================
+// connect_to_root
+//=============================================================================
+
+bool SocketTransport::connect_to_root(const char* path, double timeout)
+{
+    sockaddr_un address;
+    if (!make_address(path, address))
+    {
+        return false;
+    }
+
+    // Rank 0 may not have created the socket yet
+    const double give_up = get_time() + timeout;
+    for (;;)
+    {
+        const int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (peer < 0)
+        {
+            cerr << "Failed to create a socket: " << strerror(errno) << endl;
+            return false;
+        }
+
+        if (connect(peer, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+        {
+            m_sockets.push_back(peer);
+            return send_all(peer, &m_rank, sizeof(m_rank));
+        }
+
+        close(peer);
+        if (get_time() > give_up)
+        {
+            cerr << "Timed out connecting to " << path << endl;
+            return false;
+        }
+        sleep_for(0.01);
+    }
+}
+
+//=============================================================================
+// Sum / Max
+//=============================================================================
+
+bool SocketTransport::Sum(double* values, size_t count)
+{
+    return reduce(SUM, values, count);
+}
+
+bool SocketTransport::Max(double* values, size_t count)
+{
+    return reduce(MAX, values, count);
+}
+
+//=============================================================================
+// reduce
+//=============================================================================
+
+bool SocketTransport::reduce(Operation operation, double* values, size_t count)
+{
+    if (m_num_ranks == 1 || count == 0)
+    {
+        return true;
+    }
+
+    MessageHeader header;
+    header.operation = operation;
+    header.count = count;
+    const size_t bytes = count*sizeof(double);
+
+    if (m_rank != 0)
+    {
+        return send_all(m_sockets[0], &header, sizeof(header)) &&
+               send_all(m_sockets[0], values, bytes) &&
+               receive_all(m_sockets[0], values, bytes);
+    }
+
+    // Always combined in rank order, so the result doesn't depend on
+    // which rank got here first
+    m_received.resize(count);
+    for (int rank = 1; rank < m_num_ranks; ++rank)
+    {
+        MessageHeader theirs;
+        if (!receive_all(m_sockets[rank], &theirs, sizeof(theirs)))
+        {
+            cerr << "Lost the connection to rank " << rank << endl;
+            return false;
+        }
+        if (theirs.operation != header.operation || theirs.count != header.count)
+        {
+            cerr << "Rank " << rank << " is out of step with rank 0" << endl;
+            return false;
+        }
+        if (!receive_all(m_sockets[rank], &m_received[0], bytes))
+        {
+            cerr << "Lost the connection to rank " << rank << endl;
+            return false;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            values[i] = operation == SUM ? values[i] + m_received[i] :
+                                           std::max(values[i], m_received[i]);
+        }
+    }
+
+    for (int rank = 1; rank < m_num_ranks; ++rank)
+    {
+        if (!send_all(m_sockets[rank], values, bytes))
+        {
+            cerr << "Lost the connection to rank " << rank << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//=============================================================================
+//
+//=============================================================================
@@ -0,0 +1,114 @@
+#ifndef __TRANSPORT_HPP__
+#define __TRANSPORT_HPP__
+
+#include "defs.hpp"
+
+#include <vector>
+#include <cstddef>
+
+/* Connects the processes that each simulate a part of one body, see
+ * PSystem::JoinParts(). Shape matching only couples the particles through
+ * a few sums per step, the transport adds them up over every process.
+ *
+ * Every call is collective: all processes must make the same calls with
+ * the same counts in the same order, and each gets the same result back,
+ * bit for bit, whatever order the processes got there in.
+ */
+class Transport
+{
+public:
+    virtual ~Transport() { }
+
+    /* Replace each value with its sum over every process.
+     *
+     * Returns:
+     *   False if the connection failed, the values are undefined then.
+     */
+    virtual bool Sum(double* values, size_t count) = 0;
+
+    /* Replace each value with its largest over every process.
+     */
+    virtual bool Max(double* values, size_t count) = 0;
+
+    /* This process, from 0 up to GetNumRanks() - 1.
+     */
+    virtual int GetRank() const = 0;
+
+    virtual int GetNumRanks() const = 0;
+};
+
+/* A Transport over a UNIX domain socket, for processes on one machine.
+ * Rank 0 listens on the socket and adds up the values of the other ranks
+ * in rank order, then sends the result back to each.
+ *
+ *   SocketTransport transport;
+ *   if (!transport.Connect("/tmp/body.sock", rank, num_ranks)) ...
+ *
+ * A single rank never opens a socket.
+ */
+class SocketTransport : public Transport
+{
+public:
+    SocketTransport();
+
+    /* Closes the connections.
+     */
+    ~SocketTransport();
+
+    /* Connect every rank. Rank 0 creates the socket at path and waits for
+     * the others, which keep trying until it is there.
+     *
+     * Params:
+     *   timeout - Seconds to wait for the other ranks
+     *
+     * Returns:
+     *   False if the ranks couldn't be connected in time.
+     */
+    bool Connect(const char* path, int rank, int num_ranks, double timeout = 30);
+
+    /* Close the connections.
+     */
+    void Close();
+
+    bool Sum(double* values, size_t count);
+    bool Max(double* values, size_t count);
+
+    int GetRank() const
+    {
+        return m_rank;
+    }
+
+    int GetNumRanks() const
+    {
+        return m_num_ranks;
+    }
+
+private:
+    enum Operation
+    {
+        SUM,
+        MAX
+    };
+
+    // Not copyable
+    SocketTransport(const SocketTransport&);
+    SocketTransport& operator=(const SocketTransport&);
+
+    /* Sum() and Max(). The other ranks send their values to rank 0, which
+     * combines them and sends the result back.
+     */
+    bool reduce(Operation operation, double* values, size_t count);
+
+    bool connect_to_root(const char* path, double timeout);
+    bool accept_ranks(const char* path, double timeout);
+
+private:
+    int m_rank;
+    int m_num_ranks;
+    int m_listener; // Rank 0's listening socket, -1 if none
+    std::vector<int> m_sockets; // Rank 0: one per other rank, by rank. Others: the one to rank 0
+    std::vector<char> m_path; // Socket file while rank 0 waits for the others
+    std::vector<double> m_received; // Values of one rank while reducing
+};
+
+#endif
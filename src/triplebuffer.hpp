@@ -0,0 +1,90 @@
+#ifndef __TRIPLE_BUFFER_HPP__
+#define __TRIPLE_BUFFER_HPP__
+
+#include "atomic.hpp"
+
+/* Lock-free triple buffer for handing the latest state from one writer
+ * thread to one reader thread. The writer always has a buffer to fill and
+ * the reader always has a complete buffer to read, neither waits on the
+ * other. Intermediate states are dropped if the writer is faster than the
+ * reader.
+ *
+ * The writer does:
+ *
+ *   T& state = buffer.GetWriteBuffer();
+ *   ... fill state ...
+ *   buffer.Publish();
+ *
+ * and the reader does:
+ *
+ *   if (buffer.Acquire())
+ *   {
+ *       const T& state = buffer.GetReadBuffer();
+ *       ...
+ *   }
+ *
+ * The buffers are reused, so if T holds containers they only allocate until
+ * they have reached their final size.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() :
+        m_write(0),
+        m_shared(1),
+        m_read(2)
+    { }
+
+    /* The buffer the writer fills in. Its contents are whatever was
+     * published two or more times ago, not necessarily the latest state.
+     */
+    T& GetWriteBuffer()
+    {
+        return m_buffers[m_write];
+    }
+
+    /* Hand the write buffer over to the reader and get a new one to write.
+     */
+    void Publish()
+    {
+        m_write = atomic::exchange(&m_shared, m_write | FRESH_BIT) & INDEX_MASK;
+    }
+
+    /* Grab the most recently published buffer if there is one the reader
+     * hasn't seen.
+     *
+     * Returns:
+     *   True if GetReadBuffer() now refers to a newer state.
+     */
+    bool Acquire()
+    {
+        if ((atomic::load(&m_shared) & FRESH_BIT) == 0)
+        {
+            return false;
+        }
+
+        m_read = atomic::exchange(&m_shared, m_read) & INDEX_MASK;
+        return true;
+    }
+
+    /* The buffer the reader may look at, valid until the next Acquire().
+     */
+    const T& GetReadBuffer() const
+    {
+        return m_buffers[m_read];
+    }
+
+private:
+    // The shared index has a flag telling if it holds a new state
+    enum { INDEX_MASK = 0x3, FRESH_BIT = 0x4 };
+
+    T m_buffers[3];
+    unsigned int m_write; // Index owned by the writer
+    char m_pad0[CACHE_LINE_SIZE - sizeof(unsigned int)];
+    unsigned int m_shared; // Index exchanged between the two
+    char m_pad1[CACHE_LINE_SIZE - sizeof(unsigned int)];
+    unsigned int m_read; // Index owned by the reader
+};
+
+#endif